@@ -0,0 +1,880 @@
+#define G_LOG_DOMAIN "download-benchmark"
+
+#include "download-async.h"
+#include "download-manager.h"
+#include "download-worker-pool.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/*
+ * Throughput benchmark of download_start() against a #SoupServer that runs
+ * on a thread of its own on localhost and serves synthetic payloads.
+ *
+ * Every combination of --sizes and --concurrency is a case: --count
+ * downloads, by default enough for about 1 GiB but at least the concurrency
+ * and at most 256, with at most the concurrency in flight. Each case prints
+ * one JSON object on a line of its own with the throughput in MB/s, the
+ * p50 and p99 completion latency, the CPU time of the process and its peak
+ * RSS during the case. CPU time includes the server thread.
+ *
+ * The server takes its parameters from the query of each request, so a case
+ * is fully described by its command line:
+ *
+ *   /bench?size=N&latency=MS&chunk=N&rate=BYTES_PER_S&chunked=0|1
+ *
+ * It answers Range requests with a single range, so --segments has an
+ * effect, unless the response is chunked.
+ */
+
+#define BENCHMARK_PAYLOAD_SIZE (256 * 1024)
+#define BENCHMARK_DEFAULT_SIZES "1K,64K,1M,16M,256M"
+#define BENCHMARK_DEFAULT_CONCURRENCY "1,4,16"
+#define BENCHMARK_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define BENCHMARK_AUTO_BYTES (G_GUINT64_CONSTANT (1) << 30)
+#define BENCHMARK_MAX_AUTO_COUNT 256
+
+static guchar payload[BENCHMARK_PAYLOAD_SIZE];
+
+static gchar *sizes_option = NULL;
+static gchar *concurrency_option = NULL;
+static gint count_option = 0;
+static gint latency_option = 0;
+static gint chunk_size_option = BENCHMARK_DEFAULT_CHUNK_SIZE;
+static gint64 rate_option = 0;
+static gboolean chunked_option = FALSE;
+static gchar *target_option = NULL;
+static gint segments_option = 1;
+static gint workers_option = 0;
+static gboolean uring_option = FALSE;
+
+static GOptionEntry entries[] = {
+    { "sizes", 's', 0, G_OPTION_ARG_STRING, &sizes_option, "Payload sizes, with K, M or G suffixes (default " BENCHMARK_DEFAULT_SIZES ")", "LIST" },
+    { "concurrency", 'c', 0, G_OPTION_ARG_STRING, &concurrency_option, "Downloads in flight (default " BENCHMARK_DEFAULT_CONCURRENCY ")", "LIST" },
+    { "count", 'n', 0, G_OPTION_ARG_INT, &count_option, "Downloads per case (default: about 1 GiB worth)", "N" },
+    { "latency", 'l', 0, G_OPTION_ARG_INT, &latency_option, "Delay before the server answers, in ms", "MS" },
+    { "chunk-size", 0, 0, G_OPTION_ARG_INT, &chunk_size_option, "Bytes the server writes at a time", "N" },
+    { "rate", 'r', 0, G_OPTION_ARG_INT64, &rate_option, "Bandwidth cap of every response, in bytes per second", "N" },
+    { "chunked", 0, 0, G_OPTION_ARG_NONE, &chunked_option, "Send chunked responses without Content-Length", NULL },
+    { "target", 't', 0, G_OPTION_ARG_STRING, &target_option, "Where downloads go: chunks (default), memory or file", "TARGET" },
+    { "segments", 0, 0, G_OPTION_ARG_INT, &segments_option, "Segments per download", "N" },
+    { "workers", 'w', 0, G_OPTION_ARG_INT, &workers_option, "Run downloads on a pool of N worker threads", "N" },
+    { "uring", 0, 0, G_OPTION_ARG_NONE, &uring_option, "Write files through io_uring when available", NULL },
+    { NULL }
+};
+
+typedef struct _BenchmarkResponse {
+    SoupServer *server;
+    SoupMessage *message;
+
+    guint64 length;
+    guint64 appended;
+    gsize chunk_size;
+
+    // Bytes per second, 0 for no cap, counted from when the body starts
+    guint64 rate;
+    gint64 start_time;
+
+    GSource *source;
+} BenchmarkResponse;
+
+typedef struct _BenchmarkCase {
+    guint64 size;
+    guint concurrency;
+    guint count;
+
+    gchar *uri;
+    gchar *directory;
+    DownloadOptions options;
+    GMainLoop *loop;
+
+    guint n_started;
+    guint n_done;
+    guint n_failed;
+    GArray *latencies;
+} BenchmarkCase;
+
+typedef struct _BenchmarkDownload {
+    BenchmarkCase *bench_case;
+    gchar *path;
+    gint64 start_time;
+} BenchmarkDownload;
+
+/**
+ * benchmark_response_append:
+ * @response: a #BenchmarkResponse
+ *
+ * Appends the next chunk of the payload to the body of @response, and
+ * completes the body after the last one.
+ */
+static void
+benchmark_response_append (BenchmarkResponse *response)
+{
+    gsize length = MIN (response->chunk_size, response->length - response->appended);
+
+    soup_message_body_append (response->message->response_body,
+                              SOUP_MEMORY_STATIC,
+                              payload,
+                              length);
+
+    response->appended += length;
+
+    if (response->appended >= response->length)
+        soup_message_body_complete (response->message->response_body);
+}
+
+/**
+ * benchmark_response_resume_cb:
+ * @user_data: a #BenchmarkResponse
+ *
+ * Appends the next chunk of a response that waited for its latency or its
+ * bandwidth cap and lets the server write it.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+benchmark_response_resume_cb (gpointer user_data)
+{
+    BenchmarkResponse *response = user_data;
+
+    g_source_unref (response->source);
+    response->source = NULL;
+
+    benchmark_response_append (response);
+    soup_server_unpause_message (response->server, response->message);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * benchmark_response_delay:
+ * @response: a #BenchmarkResponse
+ * @delay: how long to wait, in ms
+ *
+ * Holds @response back for @delay ms before its next chunk.
+ */
+static void
+benchmark_response_delay (BenchmarkResponse *response,
+                          guint              delay)
+{
+    soup_server_pause_message (response->server, response->message);
+
+    response->source = g_timeout_source_new (delay);
+    g_source_set_callback (response->source,
+                           benchmark_response_resume_cb,
+                           response,
+                           NULL);
+    g_source_attach (response->source, g_main_context_get_thread_default ());
+}
+
+/**
+ * benchmark_response_wrote_chunk_cb:
+ * @message: the #SoupMessage of @user_data
+ * @user_data: a #BenchmarkResponse
+ *
+ * Appends the next chunk once the previous one was written, late enough to
+ * stay within the bandwidth cap of the response.
+ */
+static void
+benchmark_response_wrote_chunk_cb (SoupMessage *message,
+                                   gpointer     user_data)
+{
+    BenchmarkResponse *response = user_data;
+    gint64 due;
+    gint64 now;
+
+    if (response->appended >= response->length)
+        return;
+
+    if (response->rate > 0)
+    {
+        due = response->start_time + (gint64) (response->appended * G_USEC_PER_SEC / response->rate);
+        now = g_get_monotonic_time ();
+
+        if (due > now)
+        {
+            benchmark_response_delay (response, (due - now + 999) / 1000);
+            return;
+        }
+    }
+
+    benchmark_response_append (response);
+}
+
+/**
+ * benchmark_response_finished_cb:
+ * @message: the #SoupMessage of @user_data
+ * @user_data: a #BenchmarkResponse
+ *
+ * Frees a #BenchmarkResponse once its message is done with, whether it was
+ * sent in full or the client went away.
+ */
+static void
+benchmark_response_finished_cb (SoupMessage *message,
+                                gpointer     user_data)
+{
+    BenchmarkResponse *response = user_data;
+
+    if (response->source)
+    {
+        g_source_destroy (response->source);
+        g_source_unref (response->source);
+    }
+
+    g_signal_handlers_disconnect_by_data (message, response);
+    g_slice_free (BenchmarkResponse, response);
+}
+
+/**
+ * benchmark_query_get:
+ * @query: (nullable): the query of a request
+ * @key: a parameter name
+ * @fallback: the value when @key is missing
+ *
+ * Gets a numeric parameter of a request.
+ *
+ * Returns: the value of @key
+ */
+static guint64
+benchmark_query_get (GHashTable  *query,
+                     const gchar *key,
+                     guint64      fallback)
+{
+    const gchar *value = query ? g_hash_table_lookup (query, key) : NULL;
+
+    return value ? g_ascii_strtoull (value, NULL, 10) : fallback;
+}
+
+/**
+ * benchmark_server_cb:
+ * @server: the #SoupServer
+ * @message: the #SoupMessage of the request
+ * @path: the path of the request
+ * @query: (nullable): the query of the request
+ * @client: the #SoupClientContext of the request
+ * @user_data: %NULL
+ *
+ * Serves a synthetic payload described by @query, streamed chunk by chunk
+ * so that multi-GB payloads take no memory.
+ */
+static void
+benchmark_server_cb (SoupServer        *server,
+                     SoupMessage       *message,
+                     const char        *path,
+                     GHashTable        *query,
+                     SoupClientContext *client,
+                     gpointer           user_data)
+{
+    BenchmarkResponse *response;
+    SoupRange *ranges;
+    guint64 size = benchmark_query_get (query, "size", 0);
+    guint latency = benchmark_query_get (query, "latency", 0);
+    gboolean chunked = benchmark_query_get (query, "chunked", 0) != 0;
+    goffset start = 0;
+    gint n_ranges;
+
+    if (message->method != SOUP_METHOD_GET)
+    {
+        soup_message_set_status (message, SOUP_STATUS_NOT_IMPLEMENTED);
+        return;
+    }
+
+    response = g_slice_new0 (BenchmarkResponse);
+    response->server = server;
+    response->message = message;
+    response->length = size;
+    response->chunk_size = CLAMP (benchmark_query_get (query, "chunk", BENCHMARK_DEFAULT_CHUNK_SIZE), 1, BENCHMARK_PAYLOAD_SIZE);
+    response->rate = benchmark_query_get (query, "rate", 0);
+    response->start_time = g_get_monotonic_time () + latency * 1000;
+
+    soup_message_set_status (message, SOUP_STATUS_OK);
+    soup_message_headers_set_content_type (message->response_headers, "application/octet-stream", NULL);
+
+    if (chunked)
+    {
+        soup_message_headers_set_encoding (message->response_headers, SOUP_ENCODING_CHUNKED);
+    }
+    else
+    {
+        soup_message_headers_append (message->response_headers, "Accept-Ranges", "bytes");
+
+        if (soup_message_headers_get_ranges (message->request_headers, size, &ranges, &n_ranges))
+        {
+            if (n_ranges == 1)
+            {
+                start = ranges[0].start;
+                response->length = ranges[0].end - ranges[0].start + 1;
+
+                soup_message_set_status (message, SOUP_STATUS_PARTIAL_CONTENT);
+                soup_message_headers_set_content_range (message->response_headers,
+                                                        ranges[0].start,
+                                                        ranges[0].end,
+                                                        size);
+            }
+
+            soup_message_headers_free_ranges (message->request_headers, ranges);
+        }
+
+        soup_message_headers_set_content_length (message->response_headers, response->length);
+    }
+
+    soup_message_body_set_accumulate (message->response_body, FALSE);
+
+    g_signal_connect (message, "wrote-chunk", G_CALLBACK (benchmark_response_wrote_chunk_cb), response);
+    g_signal_connect (message, "finished", G_CALLBACK (benchmark_response_finished_cb), response);
+
+    g_debug ("Serving %" G_GUINT64_FORMAT " bytes from %" G_GOFFSET_FORMAT, response->length, start);
+
+    if (response->length == 0)
+        soup_message_body_complete (message->response_body);
+    else if (latency > 0)
+        benchmark_response_delay (response, latency);
+    else
+        benchmark_response_append (response);
+}
+
+/**
+ * benchmark_server_thread:
+ * @user_data: the #GMainContext of the server
+ *
+ * Runs the server until the process exits.
+ *
+ * Returns: %NULL
+ */
+static gpointer
+benchmark_server_thread (gpointer user_data)
+{
+    GMainContext *context = user_data;
+
+    g_main_context_push_thread_default (context);
+
+    while (TRUE)
+        g_main_context_iteration (context, TRUE);
+
+    return NULL;
+}
+
+/**
+ * benchmark_server_start:
+ *
+ * Starts the #SoupServer on a free port of 127.0.0.1, on a thread of its
+ * own so that serving does not compete with the downloads for their
+ * #GMainContext.
+ *
+ * Returns: the port the server listens on
+ */
+static guint
+benchmark_server_start (void)
+{
+    GMainContext *context;
+    SoupServer *server;
+    GSList *uris;
+    GError *error = NULL;
+    guint port;
+
+    context = g_main_context_new ();
+
+    // The server attaches its sources to the thread-default context
+    g_main_context_push_thread_default (context);
+
+    server = soup_server_new (SOUP_SERVER_SERVER_HEADER, "download-benchmark", NULL);
+    soup_server_add_handler (server, "/bench", benchmark_server_cb, NULL, NULL);
+
+    if (!soup_server_listen_local (server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error))
+    {
+        g_printerr ("Could not start the server: %s\n", error->message);
+        exit (EXIT_FAILURE);
+    }
+
+    g_main_context_pop_thread_default (context);
+
+    uris = soup_server_get_uris (server);
+    port = soup_uri_get_port (uris->data);
+    g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+    g_thread_unref (g_thread_new ("benchmark-server", benchmark_server_thread, context));
+
+    return port;
+}
+
+/**
+ * benchmark_parse_size:
+ * @string: a size, optionally followed by K, M or G
+ * @size: (out): return location for the size in bytes
+ *
+ * Parses a size of the --sizes option, suffixes are powers of 1024.
+ *
+ * Returns: %TRUE if @string is a size
+ */
+static gboolean
+benchmark_parse_size (const gchar *string,
+                      guint64     *size)
+{
+    gchar *end = NULL;
+
+    *size = g_ascii_strtoull (string, &end, 10);
+
+    if (end == string)
+        return FALSE;
+
+    switch (g_ascii_toupper (*end))
+    {
+        case 'G':
+            *size *= 1024;
+            /* fall through */
+        case 'M':
+            *size *= 1024;
+            /* fall through */
+        case 'K':
+            *size *= 1024;
+            end++;
+            break;
+
+        default:
+            break;
+    }
+
+    return *end == '\0';
+}
+
+/**
+ * benchmark_parse_list:
+ * @string: a comma separated list of sizes or counts
+ *
+ * Parses the --sizes and --concurrency options.
+ *
+ * Returns: (transfer full) (nullable): an array of #guint64, or %NULL if
+ *          @string is not a list of positive sizes
+ */
+static GArray *
+benchmark_parse_list (const gchar *string)
+{
+    GArray *values;
+    gchar **items;
+    guint i;
+
+    values = g_array_new (FALSE, FALSE, sizeof (guint64));
+    items = g_strsplit (string, ",", -1);
+
+    for (i = 0; items[i]; i++)
+    {
+        guint64 value;
+
+        if (!benchmark_parse_size (g_strstrip (items[i]), &value) || value == 0)
+        {
+            g_array_unref (values);
+            values = NULL;
+            break;
+        }
+
+        g_array_append_val (values, value);
+    }
+
+    g_strfreev (items);
+
+    return values;
+}
+
+/**
+ * benchmark_reset_peak_rss:
+ *
+ * Resets the peak RSS of the process where the kernel allows it, so that
+ * each case reports its own peak rather than the largest so far.
+ */
+static void
+benchmark_reset_peak_rss (void)
+{
+#ifdef __linux__
+    g_file_set_contents ("/proc/self/clear_refs", "5", 1, NULL);
+#endif
+}
+
+/**
+ * benchmark_get_peak_rss:
+ *
+ * Gets the peak RSS of the process since benchmark_reset_peak_rss().
+ *
+ * Returns: the peak RSS in KiB
+ */
+static guint64
+benchmark_get_peak_rss (void)
+{
+    struct rusage usage;
+
+#ifdef __linux__
+    gchar *status = NULL;
+    gchar *line;
+    guint64 peak = 0;
+
+    if (g_file_get_contents ("/proc/self/status", &status, NULL, NULL) &&
+        (line = strstr (status, "VmHWM:")))
+        peak = g_ascii_strtoull (line + strlen ("VmHWM:"), NULL, 10);
+
+    g_free (status);
+
+    if (peak > 0)
+        return peak;
+#endif
+
+    getrusage (RUSAGE_SELF, &usage);
+
+    return usage.ru_maxrss;
+}
+
+/**
+ * benchmark_get_cpu_time:
+ * @user: (out): return location for the user CPU time in µs
+ * @system: (out): return location for the system CPU time in µs
+ *
+ * Gets the CPU time used by the process so far, over all threads.
+ */
+static void
+benchmark_get_cpu_time (gint64 *user,
+                        gint64 *system)
+{
+    struct rusage usage;
+
+    getrusage (RUSAGE_SELF, &usage);
+
+    *user = (gint64) usage.ru_utime.tv_sec * G_USEC_PER_SEC + usage.ru_utime.tv_usec;
+    *system = (gint64) usage.ru_stime.tv_sec * G_USEC_PER_SEC + usage.ru_stime.tv_usec;
+}
+
+/**
+ * benchmark_chunk_cb:
+ * @bytes: a chunk of a download
+ * @offset: where @bytes starts
+ * @user_data: %NULL
+ *
+ * Drops every chunk, the cost of a download is then the network and the
+ * read loop alone.
+ */
+static void
+benchmark_chunk_cb (GBytes   *bytes,
+                    goffset   offset,
+                    gpointer  user_data)
+{
+}
+
+static void
+benchmark_case_start_next (BenchmarkCase *bench_case);
+
+/**
+ * benchmark_download_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #BenchmarkDownload
+ *
+ * Records the completion latency of a download and starts the next one of
+ * its case, or ends the case after the last one.
+ */
+static void
+benchmark_download_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+    BenchmarkDownload *download = user_data;
+    BenchmarkCase *bench_case = download->bench_case;
+    gint64 latency = g_get_monotonic_time () - download->start_time;
+    GError *error = NULL;
+
+    if (!download_finish (result, &error))
+    {
+        if (bench_case->n_failed++ == 0)
+            g_printerr ("Download of %s failed: %s\n", bench_case->uri, error->message);
+
+        g_error_free (error);
+    }
+
+    g_array_append_val (bench_case->latencies, latency);
+
+    if (download->path)
+    {
+        g_unlink (download->path);
+        g_free (download->path);
+    }
+
+    g_slice_free (BenchmarkDownload, download);
+
+    bench_case->n_done++;
+
+    if (bench_case->n_started < bench_case->count)
+        benchmark_case_start_next (bench_case);
+    else if (bench_case->n_done == bench_case->count)
+        g_main_loop_quit (bench_case->loop);
+}
+
+/**
+ * benchmark_case_start_next:
+ * @bench_case: a #BenchmarkCase
+ *
+ * Starts the next download of @bench_case.
+ */
+static void
+benchmark_case_start_next (BenchmarkCase *bench_case)
+{
+    BenchmarkDownload *download;
+
+    download = g_slice_new0 (BenchmarkDownload);
+    download->bench_case = bench_case;
+    download->start_time = g_get_monotonic_time ();
+
+    if (bench_case->directory)
+        download->path = g_strdup_printf ("%s/download-%u", bench_case->directory, bench_case->n_started);
+
+    bench_case->n_started++;
+
+    download_resource_data_unref (download_start (bench_case->uri,
+                                                  download->path,
+                                                  &bench_case->options,
+                                                  NULL,
+                                                  benchmark_download_cb,
+                                                  download));
+}
+
+/**
+ * benchmark_percentile:
+ * @latencies: sorted latencies in µs
+ * @percentile: a percentile between 0 and 100
+ *
+ * Gets a percentile of @latencies with the nearest rank method.
+ *
+ * Returns: the latency in ms
+ */
+static gdouble
+benchmark_percentile (GArray *latencies,
+                      guint   percentile)
+{
+    guint rank;
+
+    if (latencies->len == 0)
+        return 0;
+
+    rank = (latencies->len * percentile + 99) / 100;
+
+    return g_array_index (latencies, gint64, MAX (rank, 1) - 1) / 1000.0;
+}
+
+/**
+ * benchmark_compare_latency:
+ * @a: a #gint64
+ * @b: a #gint64
+ *
+ * Orders latencies from the shortest.
+ *
+ * Returns: a negative value, 0 or a positive value as for strcmp()
+ */
+static gint
+benchmark_compare_latency (gconstpointer a,
+                           gconstpointer b)
+{
+    gint64 first = *(const gint64 *) a;
+    gint64 second = *(const gint64 *) b;
+
+    return first < second ? -1 : first > second;
+}
+
+/**
+ * benchmark_run_case:
+ * @port: the port of the server
+ * @target: where the downloads go
+ * @directory: (nullable): where downloads to files are written
+ * @size: the payload size
+ * @concurrency: the most downloads in flight
+ *
+ * Runs one case of the matrix and prints its results as a JSON line.
+ */
+static void
+benchmark_run_case (guint           port,
+                    DownloadTarget  target,
+                    const gchar    *directory,
+                    guint64         size,
+                    guint           concurrency)
+{
+    BenchmarkCase bench_case = { 0, };
+    DownloadManager *manager = NULL;
+    DownloadWorkerPool *workers = NULL;
+    gint64 user_start, system_start;
+    gint64 user_end, system_end;
+    gint64 start_time;
+    gdouble seconds;
+    guint i;
+
+    bench_case.size = size;
+    bench_case.concurrency = concurrency;
+    bench_case.count = count_option > 0 ? (guint) count_option : CLAMP (BENCHMARK_AUTO_BYTES / size, concurrency, MAX (concurrency, BENCHMARK_MAX_AUTO_COUNT));
+    bench_case.uri = g_strdup_printf ("http://127.0.0.1:%u/bench?size=%" G_GUINT64_FORMAT "&latency=%d&chunk=%d&rate=%" G_GINT64_FORMAT "&chunked=%d",
+                                      port,
+                                      size,
+                                      latency_option,
+                                      chunk_size_option,
+                                      rate_option,
+                                      chunked_option ? 1 : 0);
+    bench_case.directory = target == DOWNLOAD_TARGET_FILE ? g_strdup (directory) : NULL;
+    bench_case.loop = g_main_loop_new (NULL, FALSE);
+    bench_case.latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), bench_case.count);
+
+    download_options_init (&bench_case.options);
+    bench_case.options.target = target;
+    bench_case.options.overwrite = TRUE;
+    bench_case.options.segments = MAX (segments_option, 1);
+    bench_case.options.uring = uring_option;
+
+    if (target == DOWNLOAD_TARGET_CHUNKS)
+        bench_case.options.chunk_handler = benchmark_chunk_cb;
+
+    // Every download goes to the same host, the per host limit would cap
+    // the concurrency otherwise
+    if (workers_option > 0)
+    {
+        workers = download_worker_pool_new (workers_option, concurrency, concurrency);
+        bench_case.options.workers = workers;
+    }
+    else
+    {
+        manager = download_manager_new (concurrency, concurrency);
+        bench_case.options.manager = manager;
+    }
+
+    benchmark_reset_peak_rss ();
+    benchmark_get_cpu_time (&user_start, &system_start);
+    start_time = g_get_monotonic_time ();
+
+    for (i = 0; i < MIN (concurrency, bench_case.count); i++)
+        benchmark_case_start_next (&bench_case);
+
+    g_main_loop_run (bench_case.loop);
+
+    seconds = (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC;
+    benchmark_get_cpu_time (&user_end, &system_end);
+
+    g_array_sort (bench_case.latencies, benchmark_compare_latency);
+
+    g_print ("{\"size\":%" G_GUINT64_FORMAT ",\"concurrency\":%u,\"downloads\":%u,\"failed\":%u,"
+             "\"seconds\":%.3f,\"mb_per_s\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+             "\"cpu_user_s\":%.3f,\"cpu_system_s\":%.3f,\"peak_rss_kb\":%" G_GUINT64_FORMAT ","
+             "\"target\":\"%s\",\"segments\":%d,\"workers\":%d,\"uring\":%s,"
+             "\"latency_ms\":%d,\"chunk_size\":%d,\"rate\":%" G_GINT64_FORMAT ",\"chunked\":%s}\n",
+             size,
+             concurrency,
+             bench_case.count,
+             bench_case.n_failed,
+             seconds,
+             seconds > 0 ? (gdouble) size * (bench_case.count - bench_case.n_failed) / 1e6 / seconds : 0,
+             benchmark_percentile (bench_case.latencies, 50),
+             benchmark_percentile (bench_case.latencies, 99),
+             (user_end - user_start) / (gdouble) G_USEC_PER_SEC,
+             (system_end - system_start) / (gdouble) G_USEC_PER_SEC,
+             benchmark_get_peak_rss (),
+             target_option ? target_option : "chunks",
+             bench_case.options.segments,
+             workers_option,
+             uring_option ? "true" : "false",
+             latency_option,
+             chunk_size_option,
+             rate_option,
+             chunked_option ? "true" : "false");
+
+    if (manager)
+        download_manager_unref (manager);
+
+    if (workers)
+        download_worker_pool_unref (workers);
+
+    g_array_unref (bench_case.latencies);
+    g_main_loop_unref (bench_case.loop);
+    g_free (bench_case.directory);
+    g_free (bench_case.uri);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    GArray *sizes;
+    GArray *concurrency;
+    DownloadTarget target;
+    gchar *directory = NULL;
+    guint port;
+    guint i;
+    guint j;
+
+    context = g_option_context_new ("- benchmark downloads against a local server");
+    g_option_context_add_main_entries (context, entries, NULL);
+
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    g_option_context_free (context);
+
+    sizes = benchmark_parse_list (sizes_option ? sizes_option : BENCHMARK_DEFAULT_SIZES);
+    concurrency = benchmark_parse_list (concurrency_option ? concurrency_option : BENCHMARK_DEFAULT_CONCURRENCY);
+
+    if (!sizes || !concurrency)
+    {
+        g_printerr ("--sizes and --concurrency take comma separated positive numbers\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!target_option || g_strcmp0 (target_option, "chunks") == 0)
+        target = DOWNLOAD_TARGET_CHUNKS;
+    else if (g_strcmp0 (target_option, "memory") == 0)
+        target = DOWNLOAD_TARGET_MEMORY;
+    else if (g_strcmp0 (target_option, "file") == 0)
+        target = DOWNLOAD_TARGET_FILE;
+    else
+    {
+        g_printerr ("Unknown target \"%s\", use chunks, memory or file\n", target_option);
+        return EXIT_FAILURE;
+    }
+
+    if (target == DOWNLOAD_TARGET_FILE)
+    {
+        directory = g_dir_make_tmp ("download-benchmark-XXXXXX", &error);
+
+        if (!directory)
+        {
+            g_printerr ("%s\n", error->message);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Any content will do, as long as it is not all zeros
+    for (i = 0; i < BENCHMARK_PAYLOAD_SIZE; i++)
+        payload[i] = (guchar) (i * 2654435761u >> 24);
+
+    port = benchmark_server_start ();
+
+    for (i = 0; i < sizes->len; i++)
+    {
+        for (j = 0; j < concurrency->len; j++)
+        {
+            benchmark_run_case (port,
+                                target,
+                                directory,
+                                g_array_index (sizes, guint64, i),
+                                (guint) g_array_index (concurrency, guint64, j));
+        }
+    }
+
+    if (directory)
+    {
+        g_rmdir (directory);
+        g_free (directory);
+    }
+
+    g_array_unref (sizes);
+    g_array_unref (concurrency);
+
+    return EXIT_SUCCESS;
+}
@@ -1,28 +1,66 @@
 #define G_LOG_DOMAIN "download-async"
 
 #include "download-async.h"
+#include "download-buffer-pool.h"
+#include "download-file.h"
+#include "download-manager.h"
+#include "download-private.h"
+#include "download-worker-pool.h"
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 #include <libsoup/soup.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 
 /**
  * SECTION:download-async
  * @title: Asynchronous File Download with libsoup
  * @short_description: Asynchronous file download using the libsoup package
  * @include: download-async.h
- * @see_also: #SoupSession, #SoupRequest, #GMainLoop, #GMainContext,
- *            #GCallback, #GCancellable, #GFile, #GInputStream
+ * @see_also: #SoupSession, #SoupRequest, #GTask, #GAsyncResult,
+ *            #GMainContext, #GCancellable, #GFile, #GInputStream
  *
  * Downloads files in parallel by running asynchronous file download with the
- * help of libsoup. Each download runs it's own #GMainLoop but refs the current
- * #GMainContext, if one exists using g_main_context_ref_thread_default(). If no
- * current #GMainContext exists then a new one is created. If you plan on using
- * downloads inside of an application you should run that application first
- * either with a #GMainLoop or using #GApplication so I can hook onto the
- * main context.
+ * help of libsoup. download_start() returns straight away with a
+ * #DownloadResourceData handle and the transfer is driven by the thread-default
+ * #GMainContext of the caller, so a single context can run any number of
+ * downloads side by side. When the transfer ends the #GAsyncReadyCallback is
+ * invoked on that same context and download_finish() returns the result.
+ *
+ * Downloads share the #SoupSession of a #DownloadManager, which also decides
+ * how many of them run at once, see download-manager. A #DownloadWorkerPool
+ * moves them to worker threads instead, see download-worker-pool.
+ *
+ * A download with #DownloadOptions.segments above 1 from a server that takes
+ * byte ranges sizes the file up front and fetches that many ranges in
+ * parallel, each segment writing at its own offset. A segment that finishes
+ * early takes over half of what is left of the slowest one. A segment that
+ * loses its connection to a transient error reconnects, with an exponential
+ * back off, and asks for the bytes it misses with Range and If-Range.
+ *
+ * A download to a file of a uri already downloaded to a file joins that
+ * transfer unless #DownloadOptions.coalesce is %FALSE. It gets the progress
+ * and then the result of the first download, and its file is cloned from
+ * the first one when their paths differ. Cancelling a joined download only
+ * takes it out, cancelling the first one fails them all.
+ *
+ * %DOWNLOAD_TARGET_MEMORY keeps the resource in memory, read in place into
+ * one buffer when its length is known, and %DOWNLOAD_TARGET_CHUNKS hands
+ * each chunk to #DownloadOptions.chunk_handler without copying it. Neither
+ * is ever split.
+ *
+ * If you plan on using downloads inside of an application you should run that
+ * application with a #GMainLoop or using #GApplication, otherwise nothing
+ * drives the transfers.
  **/
 
+// Downloads leading a flight by uri, and the followers of each of them
+G_LOCK_DEFINE_STATIC (download_flights);
+static GHashTable *download_flights = NULL;
+
 /**
  * download_resource_data_free:
  * @user_data: a #DownloadResourceData
@@ -34,249 +72,4695 @@ download_resource_data_free (gpointer user_data)
 {
     DownloadResourceData *data = user_data;
 
-    if (data->loop)
-        g_main_loop_quit (data->loop);
-
     if (data->uri)
         g_free (data->uri);
 
     if (data->path)
         g_free (data->path);
 
+    if (data->tail)
+        download_tail_unref (data->tail);
+
+    if (data->uring)
+        download_uring_release (data->uring);
+
+    if (data->pack)
+        download_pack_unref (data->pack);
+
+    if (data->pack_key)
+        g_free (data->pack_key);
+
+    if (data->memory)
+        g_free (data->memory);
+
+    if (data->memory_array)
+        g_byte_array_unref (data->memory_array);
+
+    if (data->bytes)
+        g_bytes_unref (data->bytes);
+
+    if (data->host)
+        g_free (data->host);
+
+    if (data->manager)
+        download_manager_unref (data->manager);
+
+    if (data->context)
+        g_main_context_unref (data->context);
+
+    if (data->caller_context)
+        g_main_context_unref (data->caller_context);
+
     if (data->cancellable)
     {
-        g_cancellable_cancel (data->cancellable);
+        g_cancellable_disconnect (data->cancellable, data->stop_waits_id);
         g_object_unref (data->cancellable);
     }
 
+    if (data->user_cancellable)
+    {
+        g_cancellable_disconnect (data->user_cancellable, data->user_cancelled_id);
+        g_object_unref (data->user_cancellable);
+    }
+
+    if (data->request)
+        g_object_unref (data->request);
+
+    if (data->probe)
+        g_object_unref (data->probe);
+
+    if (data->session)
+        g_object_unref (data->session);
+
     if (data->file)
         g_object_unref (data->file);
 
     if (data->output)
         g_object_unref (data->output);
 
+    if (data->error)
+        g_error_free (data->error);
+
+    if (data->checksum)
+        download_checksum_free (data->checksum);
+
+    if (data->expected_digest)
+        g_free (data->expected_digest);
+
+    if (data->digest)
+        g_free (data->digest);
+
+    if (data->cache)
+        download_cache_unref (data->cache);
+
+    if (data->cache_entry)
+        download_cache_entry_free (data->cache_entry);
+
+    if (data->part_path)
+        g_free (data->part_path);
+
+    if (data->journal)
+        download_journal_free (data->journal);
+
+    if (data->commit_group)
+        download_commit_group_unref (data->commit_group);
+
+    if (data->etag)
+        g_free (data->etag);
+
+    if (data->last_modified)
+        g_free (data->last_modified);
+
+    if (data->final_uri)
+        g_free (data->final_uri);
+
+    if (data->mirrors)
+    {
+        guint i;
+
+        for (i = 0; i < data->n_mirrors; i++)
+            g_free (data->mirrors[i].uri);
+
+        g_free (data->mirrors);
+    }
+
+    while (!g_queue_is_empty (&data->pending_ranges))
+        g_slice_free (DownloadRange, g_queue_pop_head (&data->pending_ranges));
+
+    // Segments hand their buffers back to the pool
+    if (data->segments)
+        g_ptr_array_unref (data->segments);
+
+    if (data->buffer_pool)
+        download_buffer_pool_unref (data->buffer_pool);
+
+    if (data->rate_limiter)
+        download_rate_limiter_unref (data->rate_limiter);
+
+    if (data->progress_group)
+        download_progress_group_unref (data->progress_group);
+
+    if (data->leader)
+        download_resource_data_unref (data->leader);
+
+    // May stop the worker threads, nothing of the download may run after it
+    if (data->workers)
+        download_worker_pool_unref (data->workers);
+
     g_slice_free (DownloadResourceData, data);
 }
 
 /**
- * download_resource_from_uri_async_read_close_cb:
- * @object: a #GInputStream
- * @result: a #GAsyncResult
- * @user_data: a #DownloadResourceData
+ * download_resource_data_ref:
+ * @data: a #DownloadResourceData
+ *
+ * Increases the reference count of @data.
+ *
+ * Returns: (transfer full): @data
+ */
+DownloadResourceData *
+download_resource_data_ref (DownloadResourceData *data)
+{
+    g_return_val_if_fail (data != NULL, NULL);
+    g_return_val_if_fail (data->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&data->ref_count);
+
+    return data;
+}
+
+/**
+ * download_resource_data_unref:
+ * @data: a #DownloadResourceData
+ *
+ * Decreases the reference count of @data, freeing it when the count drops to
+ * zero. A running download holds its own reference so dropping the handle
+ * returned by download_start() does not stop the transfer.
+ */
+void
+download_resource_data_unref (DownloadResourceData *data)
+{
+    g_return_if_fail (data != NULL);
+    g_return_if_fail (data->ref_count > 0);
+
+    if (g_atomic_int_dec_and_test (&data->ref_count))
+        download_resource_data_free (data);
+}
+
+/**
+ * download_resource_data_set_error:
+ * @data: a #DownloadResourceData
+ * @error: (transfer full): a #GError
  *
- * Closes an open #GInputStream for @object.
+ * Records @error as the reason the download failed. Only the first error is
+ * kept, errors that follow it are usually a consequence of the first one.
  */
 static void
-download_resource_from_uri_async_read_close_cb (GObject      *object,
-                                                GAsyncResult *result,
-                                                gpointer      user_data)
+download_resource_data_set_error (DownloadResourceData *data,
+                                  GError               *error)
 {
-    g_return_if_fail (G_IS_INPUT_STREAM (object));
+    if (data->error == NULL)
+        data->error = error;
+    else
+        g_error_free (error);
+}
 
-    GInputStream *stream = G_INPUT_STREAM (object);
+/**
+ * download_resource_data_sync_group:
+ * @data: a #DownloadResourceData
+ *
+ * Tells the #DownloadProgressGroup of @data what changed in its byte counts
+ * since the last time. They go back when the download starts over, and the
+ * length becomes known or unknown when it changes from or to 0.
+ */
+static void
+download_resource_data_sync_group (DownloadResourceData *data)
+{
+    gint known = 0;
+
+    if (data->downloaded_bytes == data->group_downloaded_bytes &&
+        data->total_bytes == data->group_total_bytes)
+        return;
+
+    if (data->group_total_bytes == 0 && data->total_bytes > 0)
+        known = 1;
+    else if (data->group_total_bytes > 0 && data->total_bytes == 0)
+        known = -1;
+
+    download_progress_group_update (data->progress_group,
+                                    (gssize) (data->downloaded_bytes - data->group_downloaded_bytes),
+                                    (gssize) (data->total_bytes - data->group_total_bytes),
+                                    known);
+
+    data->group_downloaded_bytes = data->downloaded_bytes;
+    data->group_total_bytes = data->total_bytes;
+}
+
+/**
+ * download_resource_data_leave_group:
+ * @data: a #DownloadResourceData
+ *
+ * Counts @data as done in its #DownloadProgressGroup. A failed download
+ * takes back the part of its length it did not receive, so the totals of
+ * the group still add up.
+ */
+static void
+download_resource_data_leave_group (DownloadResourceData *data)
+{
+    if (data->error)
+        data->total_bytes = data->downloaded_bytes;
+
+    download_resource_data_sync_group (data);
+    download_progress_group_remove (data->progress_group,
+                                    data->error != NULL,
+                                    data->group_total_bytes > 0);
+}
+
+static void
+download_resource_data_land_flight (DownloadResourceData *data);
+
+/**
+ * download_resource_data_close_tail:
+ * @data: a #DownloadResourceData being completed
+ *
+ * Ends the streams of the readers of @data. A download that never opened
+ * its file, as a cache hit or one that joined another transfer, gives them
+ * the finished file.
+ */
+static void
+download_resource_data_close_tail (DownloadResourceData *data)
+{
+    gint fd;
+
+    if (!data->error && !download_tail_is_open (data->tail))
+    {
+        fd = open (data->path, O_RDONLY | O_CLOEXEC);
+
+        if (fd >= 0)
+            download_tail_open (data->tail, fd);
+        else
+            g_warning ("Downloader ( %s ): cannot open \"%s\" for readers: %s", data->uri, data->path, g_strerror (errno));
+    }
+
+    download_tail_close (data->tail, data->error);
+}
+
+/**
+ * download_resource_data_complete:
+ * @data: a #DownloadResourceData
+ *
+ * Returns the result of the download to the #GTask and drops the reference
+ * cycle between @data and the task. A file that was downloaded afresh is
+ * recorded in the #DownloadCache of @data. Nothing may touch the streams of
+ * @data after this has been called.
+ */
+static void
+download_resource_data_complete (DownloadResourceData *data)
+{
+    GTask *task = data->task;
+    DownloadCacheEntry entry = { 0, };
+
+    g_return_if_fail (task != NULL);
+
+    data->task = NULL;
+
+    if (data->cache && !data->cache_hit && !data->error)
+    {
+        entry.uri = data->uri;
+        entry.path = data->path;
+        entry.etag = data->etag;
+        entry.last_modified = data->last_modified;
+        entry.checksum = data->checksum ? download_checksum_get_checksum_type (data->checksum) : DOWNLOAD_CHECKSUM_NONE;
+        entry.digest = data->digest;
+
+        download_cache_store (data->cache, &entry);
+    }
+
+    if (data->admitted)
+        download_manager_release (data->manager, data);
+
+    if (data->worker)
+        download_worker_pool_release (data->workers, data->worker);
+
+    data->metrics.end_time = g_get_monotonic_time ();
+    download_metrics_record (&data->metrics, data->error);
+
+    if (data->progress_group)
+        download_resource_data_leave_group (data);
+
+    if (data->leading)
+        download_resource_data_land_flight (data);
+
+    if (data->tail)
+        download_resource_data_close_tail (data);
+
+    if (data->error)
+    {
+        g_debug ("Downloader ( %s ): finished with error: %s", data->uri, data->error->message);
+        g_task_return_error (task, data->error);
+        data->error = NULL;
+    }
+    else if (data->cache_hit)
+    {
+        g_debug ("Downloader ( %s ): finished, \"%s\" was not modified", data->uri, data->path);
+        g_task_return_boolean (task, TRUE);
+    }
+    else
+    {
+        g_debug ("Downloader ( %s ): finished, wrote \"%" G_GUINT64_FORMAT "\" bytes", data->uri, data->downloaded_bytes);
+        g_task_return_boolean (task, TRUE);
+    }
+
+    g_object_unref (task);
+}
+
+/**
+ * download_resource_data_fail:
+ * @data: a #DownloadResourceData
+ * @error: (transfer full): a #GError
+ *
+ * Completes @data with @error, for downloads that fail before their streams
+ * are opened.
+ */
+void
+download_resource_data_fail (DownloadResourceData *data,
+                             GError               *error)
+{
+    download_resource_data_set_error (data, error);
+    download_resource_data_complete (data);
+}
+
+typedef struct _DownloadProgressReport {
+    DownloadResourceData *data;
+    guint64 downloaded_bytes;
+    guint64 total_bytes;
+} DownloadProgressReport;
+
+/**
+ * download_progress_report_free:
+ * @user_data: a #DownloadProgressReport
+ *
+ * Frees a #DownloadProgressReport struct.
+ */
+static void
+download_progress_report_free (gpointer user_data)
+{
+    DownloadProgressReport *report = user_data;
+
+    download_resource_data_unref (report->data);
+    g_slice_free (DownloadProgressReport, report);
+}
+
+/**
+ * download_progress_report_cb:
+ * @user_data: a #DownloadProgressReport
+ *
+ * Calls the progress handler of a download that runs on a worker, on the
+ * context of the caller.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_progress_report_cb (gpointer user_data)
+{
+    DownloadProgressReport *report = user_data;
+    DownloadResourceData *data = report->data;
+
+    data->p_handler (report->downloaded_bytes,
+                     report->total_bytes,
+                     data->p_user_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_resource_data_report:
+ * @data: a #DownloadResourceData with a progress handler
+ * @context: the #GMainContext the caller runs on
+ * @downloaded_bytes: the bytes received so far
+ * @total_bytes: the length of the resource, 0 if unknown
+ *
+ * Calls the progress handler of @data, straight away if @context is the one
+ * of whoever started @data or else from an idle source on that context,
+ * where it comes before the result of the download.
+ */
+static void
+download_resource_data_report (DownloadResourceData *data,
+                               GMainContext         *context,
+                               guint64               downloaded_bytes,
+                               guint64               total_bytes)
+{
+    if (data->caller_context == context)
+    {
+        data->p_handler (downloaded_bytes,
+                         total_bytes,
+                         data->p_user_data);
+    }
+    else
+    {
+        DownloadProgressReport *report = g_slice_new0 (DownloadProgressReport);
+        GSource *source;
+
+        report->data = download_resource_data_ref (data);
+        report->downloaded_bytes = downloaded_bytes;
+        report->total_bytes = total_bytes;
+
+        // Same priority as the GTask result, which is attached after it
+        source = g_idle_source_new ();
+        g_source_set_priority (source, G_PRIORITY_DEFAULT);
+        g_source_set_callback (source,
+                               download_progress_report_cb,
+                               report,
+                               download_progress_report_free);
+        g_source_attach (source, data->caller_context);
+        g_source_unref (source);
+    }
+}
+
+/**
+ * download_resource_data_report_followers:
+ * @data: a #DownloadResourceData leading a flight
+ *
+ * Passes the progress of @data on to the downloads that follow it. The
+ * handlers run without the lock on the flights held, they may start
+ * downloads of their own.
+ */
+static void
+download_resource_data_report_followers (DownloadResourceData *data)
+{
+    GList *followers;
+    GList *l;
+
+    G_LOCK (download_flights);
+    data->flight_downloaded_bytes = data->downloaded_bytes;
+    data->flight_total_bytes = data->total_bytes;
+    followers = g_list_copy_deep (data->followers, (GCopyFunc) download_resource_data_ref, NULL);
+    G_UNLOCK (download_flights);
+
+    for (l = followers; l != NULL; l = l->next)
+    {
+        DownloadResourceData *follower = l->data;
+
+        if (follower->p_handler)
+            download_resource_data_report (follower, data->context, data->downloaded_bytes, data->total_bytes);
+    }
+
+    g_list_free_full (followers, (GDestroyNotify) download_resource_data_unref);
+}
+
+/**
+ * download_resource_data_progress:
+ * @data: a #DownloadResourceData
+ * @force: %TRUE to report even if a report was made less than a second ago
+ *
+ * Calls the progress handler of @data and of the downloads following it, at
+ * most once per second unless @force is set. Downloads running on a worker
+ * send the report to the context of the caller, where it comes before the
+ * result of the download.
+ */
+static void
+download_resource_data_progress (DownloadResourceData *data,
+                                 gboolean              force)
+{
+    gint64 now;
+
+    if (data->progress_group)
+        download_resource_data_sync_group (data);
+
+    if (!data->p_handler && !data->leading)
+        return;
+
+    now = g_get_monotonic_time ();
+
+    if (!force && now - data->last_progress_time <= 1 * G_USEC_PER_SEC)
+        return;
+
+    if (data->p_handler)
+        download_resource_data_report (data, data->context, data->downloaded_bytes, data->total_bytes);
+
+    if (data->leading)
+        download_resource_data_report_followers (data);
+
+    data->last_progress_time = now;
+}
+
+/**
+ * download_resource_data_join_flight:
+ * @data: a #DownloadResourceData to a file that is not started yet
+ *
+ * Makes @data follow the download of the same uri already in flight, if
+ * any, if it decodes the same and if its checksum, should @data want one,
+ * is of the same type.
+ * Otherwise @data leads the flight of its uri, unless another download
+ * that @data cannot follow already does. A follower hears of the progress
+ * made so far right away.
+ *
+ * Returns: %TRUE if @data follows another download and must not start
+ */
+static gboolean
+download_resource_data_join_flight (DownloadResourceData *data)
+{
+    DownloadResourceData *leader;
+    guint64 downloaded_bytes = 0;
+    guint64 total_bytes = 0;
+
+    G_LOCK (download_flights);
+
+    if (!download_flights)
+        download_flights = g_hash_table_new (g_str_hash, g_str_equal);
+
+    leader = g_hash_table_lookup (download_flights, data->uri);
+
+    if (!leader)
+    {
+        g_hash_table_insert (download_flights, data->uri, data);
+        data->leading = TRUE;
+    }
+    else if (leader->decode == data->decode &&
+             (!data->checksum ||
+              (leader->checksum &&
+               download_checksum_get_checksum_type (leader->checksum) == download_checksum_get_checksum_type (data->checksum))))
+    {
+        data->leader = download_resource_data_ref (leader);
+        leader->followers = g_list_append (leader->followers, download_resource_data_ref (data));
+
+        downloaded_bytes = leader->flight_downloaded_bytes;
+        total_bytes = leader->flight_total_bytes;
+    }
+
+    G_UNLOCK (download_flights);
+
+    if (!data->leader)
+        return FALSE;
+
+    g_debug ("Downloader ( %s ): already in flight, waiting for \"%s\"", data->uri, data->leader->path);
+
+    if (data->p_handler)
+        download_resource_data_report (data, NULL, downloaded_bytes, total_bytes);
+
+    return TRUE;
+}
+
+/**
+ * download_resource_data_clone_cb:
+ * @source_object: %NULL
+ * @result: the #GAsyncResult of download_file_clone_async()
+ * @user_data: a #DownloadResourceData following a flight
+ *
+ * Completes a follower once the file of its leader was cloned to its path.
+ */
+static void
+download_resource_data_clone_cb (GObject      *source_object,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
     DownloadResourceData *data = user_data;
     GError *error = NULL;
 
-    if (data->p_handler)
+    if (!download_file_clone_finish (result, &error))
+        download_resource_data_set_error (data, error);
+
+    download_resource_data_complete (data);
+    download_resource_data_unref (data);
+}
+
+/**
+ * download_resource_data_follow:
+ * @data: a #DownloadResourceData following @leader
+ * @leader: a #DownloadResourceData that just completed
+ *
+ * Completes @data with the outcome of @leader: its error, or its file,
+ * cloned to the path of @data when that is another one, see
+ * download_file_clone_async(). A digest @data expects is checked against
+ * the one of @leader before anything is cloned.
+ */
+static void
+download_resource_data_follow (DownloadResourceData *data,
+                               DownloadResourceData *leader)
+{
+    data->total_bytes = leader->flight_total_bytes;
+    data->downloaded_bytes = leader->flight_downloaded_bytes;
+    data->cache_hit = leader->cache_hit;
+    data->digest = g_strdup (leader->digest);
+
+    if (leader->error)
+    {
+        download_resource_data_set_error (data, g_error_copy (leader->error));
+    }
+    else if (data->expected_digest && (!data->digest || g_ascii_strcasecmp (data->digest, data->expected_digest) != 0))
+    {
+        download_resource_data_set_error (data,
+                                          g_error_new (G_IO_ERROR,
+                                                       G_IO_ERROR_INVALID_DATA,
+                                                       "Checksum of \"%s\" does not match, expected %s but got %s",
+                                                       leader->path,
+                                                       data->expected_digest,
+                                                       data->digest ? data->digest : "none"));
+    }
+    else if (g_strcmp0 (data->path, leader->path) != 0)
+    {
+        g_debug ("Downloader ( %s ): cloning \"%s\" to \"%s\"", data->uri, leader->path, data->path);
+
+        download_file_clone_async (leader->path,
+                                   data->path,
+                                   data->overwrite,
+                                   data->cancellable,
+                                   download_resource_data_clone_cb,
+                                   download_resource_data_ref (data));
+
+        return;
+    }
+
+    download_resource_data_complete (data);
+}
+
+/**
+ * download_resource_data_land_flight:
+ * @data: a #DownloadResourceData leading a flight, being completed
+ *
+ * Ends the flight of @data, downloads of its uri started from now on fetch
+ * it again, and completes the downloads that followed it.
+ */
+static void
+download_resource_data_land_flight (DownloadResourceData *data)
+{
+    GList *followers;
+    GList *l;
+
+    G_LOCK (download_flights);
+
+    g_hash_table_remove (download_flights, data->uri);
+
+    data->flight_downloaded_bytes = data->downloaded_bytes;
+    data->flight_total_bytes = data->total_bytes;
+    followers = data->followers;
+    data->followers = NULL;
+    data->leading = FALSE;
+
+    G_UNLOCK (download_flights);
+
+    for (l = followers; l != NULL; l = l->next)
+        download_resource_data_follow (l->data, data);
+
+    g_list_free_full (followers, (GDestroyNotify) download_resource_data_unref);
+}
+
+/**
+ * download_resource_data_leave_cb:
+ * @user_data: a #DownloadResourceData that left its flight
+ *
+ * Completes a follower that was cancelled, on the context of its caller
+ * rather than from within g_cancellable_cancel().
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_resource_data_leave_cb (gpointer user_data)
+{
+    download_resource_data_complete (user_data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_resource_data_leave_flight:
+ * @data: a #DownloadResourceData following a flight, cancelled by its caller
+ *
+ * Takes @data out of the followers of its leader, which goes on for the
+ * others, and completes it with %G_IO_ERROR_CANCELLED. A follower that its
+ * leader is already completing is left to it, the clone stops on the
+ * cancellable of @data.
+ */
+static void
+download_resource_data_leave_flight (DownloadResourceData *data)
+{
+    DownloadResourceData *leader = data->leader;
+    GList *link;
+    GSource *source;
+
+    G_LOCK (download_flights);
+
+    link = g_list_find (leader->followers, data);
+
+    if (link)
+        leader->followers = g_list_delete_link (leader->followers, link);
+
+    G_UNLOCK (download_flights);
+
+    if (!link)
+        return;
+
+    g_debug ("Downloader ( %s ): cancelled while waiting for \"%s\"", data->uri, leader->path);
+
+    download_resource_data_set_error (data,
+                                      g_error_new_literal (G_IO_ERROR,
+                                                           G_IO_ERROR_CANCELLED,
+                                                           "Operation was cancelled"));
+
+    // Takes over the reference the leader held
+    source = g_idle_source_new ();
+    g_source_set_priority (source, G_PRIORITY_DEFAULT);
+    g_source_set_callback (source,
+                           download_resource_data_leave_cb,
+                           data,
+                           (GDestroyNotify) download_resource_data_unref);
+    g_source_attach (source, data->caller_context);
+    g_source_unref (source);
+}
+
+static void
+download_resource_data_finish (DownloadResourceData *data);
+
+static gboolean
+download_resource_data_hash_catch_up (DownloadResourceData *data);
+
+typedef struct _DownloadHashData {
+    GFile *file;
+    const guchar *memory;
+    DownloadChecksum *checksum;
+    goffset offset;
+    goffset end;
+} DownloadHashData;
+
+/**
+ * download_hash_data_free:
+ * @user_data: a #DownloadHashData
+ *
+ * Frees a #DownloadHashData struct, the checksum and memory belong to the
+ * download.
+ */
+static void
+download_hash_data_free (gpointer user_data)
+{
+    DownloadHashData *hash_data = user_data;
+
+    if (hash_data->file)
+        g_object_unref (hash_data->file);
+    g_slice_free (DownloadHashData, hash_data);
+}
+
+/**
+ * download_resource_data_get_written_end:
+ * @data: a #DownloadResourceData
+ * @from: the first byte of the run
+ *
+ * Works out how far the bytes on disk run without a gap from @from,
+ * counting what each segment wrote and, for a resumed download, what the
+ * journal recorded.
+ *
+ * Returns: the first byte past the run
+ */
+static goffset
+download_resource_data_get_written_end (DownloadResourceData *data,
+                                        goffset               from)
+{
+    goffset end = from;
+    gboolean grew = TRUE;
+    guint i;
+
+    while (grew)
+    {
+        grew = FALSE;
+
+        for (i = 0; i < data->segments->len; i++)
+        {
+            DownloadSegment *segment = g_ptr_array_index (data->segments, i);
+
+            if (segment->start <= end && segment->written > end)
+            {
+                end = segment->written;
+                grew = TRUE;
+            }
+        }
+
+        for (i = 0; data->journal && i < data->journal->ranges->len; i++)
+        {
+            DownloadRange *range = &g_array_index (data->journal->ranges, DownloadRange, i);
+
+            if (range->start <= end && range->end > end)
+            {
+                end = range->end;
+                grew = TRUE;
+            }
+        }
+    }
+
+    return end;
+}
+
+/**
+ * download_resource_data_hash_thread:
+ * @task: a #GTask
+ * @source_object: %NULL
+ * @task_data: a #DownloadHashData
+ * @cancellable: a #GCancellable
+ *
+ * Reads back a range of the file that was written before the checksum got
+ * to it and feeds it into the checksum. A download to memory has the range
+ * at hand already.
+ */
+static void
+download_resource_data_hash_thread (GTask        *task,
+                                    gpointer      source_object,
+                                    gpointer      task_data,
+                                    GCancellable *cancellable)
+{
+    DownloadHashData *hash_data = task_data;
+    GFileInputStream *input;
+    GError *error = NULL;
+    goffset offset = hash_data->offset;
+    guchar *buffer;
+
+    if (hash_data->memory)
+    {
+        download_checksum_update (hash_data->checksum,
+                                  hash_data->memory + hash_data->offset,
+                                  hash_data->end - hash_data->offset);
+
+        g_task_return_boolean (task, TRUE);
+        return;
+    }
+
+    input = g_file_read (hash_data->file, cancellable, &error);
+
+    if (input)
+        g_seekable_seek (G_SEEKABLE (input), offset, G_SEEK_SET, cancellable, &error);
+
+    buffer = g_malloc (DOWNLOAD_BUFFER_POOL_MAX_SIZE);
+
+    while (!error && offset < hash_data->end)
+    {
+        gssize nread;
+
+        nread = g_input_stream_read (G_INPUT_STREAM (input),
+                                     buffer,
+                                     MIN (DOWNLOAD_BUFFER_POOL_MAX_SIZE, hash_data->end - offset),
+                                     cancellable,
+                                     &error);
+
+        if (nread == 0)
+        {
+            g_set_error (&error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_PARTIAL_INPUT,
+                         "File ends at byte %" G_GOFFSET_FORMAT " instead of %" G_GOFFSET_FORMAT,
+                         offset,
+                         hash_data->end);
+        }
+
+        if (nread <= 0)
+            break;
+
+        download_checksum_update (hash_data->checksum, buffer, nread);
+        offset += nread;
+    }
+
+    g_free (buffer);
+
+    if (input)
+        g_object_unref (input);
+
+    if (error)
+        g_task_return_error (task, error);
+    else
+        g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * download_resource_data_hash_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadResourceData
+ *
+ * Moves @data->hash_offset past the range that was read back, then carries
+ * on with what was written meanwhile, or finishes the download if it was
+ * waiting for the checksum.
+ */
+static void
+download_resource_data_hash_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+    DownloadHashData *hash_data = g_task_get_task_data (G_TASK (result));
+    GError *error = NULL;
+
+    data->hashing = FALSE;
+
+    if (g_task_propagate_boolean (G_TASK (result), &error))
+    {
+        data->hash_offset = hash_data->end;
+    }
+    else
+    {
+        g_warning ("Downloader ( %s ): failed to read back \"%s\" for its checksum: %s", data->uri, data->path, error->message);
+        download_resource_data_set_error (data, error);
+    }
+
+    if (data->task && data->n_active_segments == 0)
+        download_resource_data_finish (data);
+    else if (!data->error)
+        download_resource_data_hash_catch_up (data);
+
+    download_resource_data_unref (data);
+}
+
+/**
+ * download_resource_data_hash_catch_up:
+ * @data: a #DownloadResourceData with a checksum
+ *
+ * Hashes the bytes from @data->hash_offset on, which a split or resumed
+ * download writes before the checksum gets to them, by reading them back in
+ * a worker thread. Later bytes are hashed as they are written.
+ *
+ * Returns: %TRUE if a read back started
+ */
+static gboolean
+download_resource_data_hash_catch_up (DownloadResourceData *data)
+{
+    DownloadHashData *hash_data;
+    GTask *task;
+    goffset end;
+
+    if (!data->checksum || data->hashing || (!data->file && !data->memory))
+        return FALSE;
+
+    end = download_resource_data_get_written_end (data, data->hash_offset);
+
+    if (end <= data->hash_offset)
+        return FALSE;
+
+    g_debug ("Downloader ( %s ): reading back \"%" G_GOFFSET_FORMAT "\" .. \"%" G_GOFFSET_FORMAT "\" for the checksum",
+             data->uri, data->hash_offset, end);
+
+    hash_data = g_slice_new0 (DownloadHashData);
+    hash_data->file = data->file ? g_object_ref (data->file) : NULL;
+    hash_data->memory = data->memory;
+    hash_data->checksum = data->checksum;
+    hash_data->offset = data->hash_offset;
+    hash_data->end = end;
+
+    data->hashing = TRUE;
+
+    task = g_task_new (NULL, NULL, download_resource_data_hash_cb, download_resource_data_ref (data));
+    g_task_set_task_data (task, hash_data, download_hash_data_free);
+    g_task_run_in_thread (task, download_resource_data_hash_thread);
+    g_object_unref (task);
+
+    return TRUE;
+}
+
+/**
+ * download_resource_data_hash:
+ * @data: a #DownloadResourceData
+ * @chunk: a #DownloadChunk that was just written
+ *
+ * Feeds @chunk into the checksum of @data while it is still in memory if it
+ * is the next part of the file the checksum needs, otherwise reads back what
+ * the checksum can catch up on.
+ */
+static void
+download_resource_data_hash (DownloadResourceData *data,
+                             DownloadChunk        *chunk)
+{
+    if (!data->checksum || data->hashing)
+        return;
+
+    if (chunk->offset == data->hash_offset)
+    {
+        download_checksum_update (data->checksum, (const guchar *) chunk->buffer, chunk->length);
+        data->hash_offset += chunk->length;
+
+        return;
+    }
+
+    download_resource_data_hash_catch_up (data);
+}
+
+/**
+ * download_resource_data_verify:
+ * @data: a #DownloadResourceData whose bytes all went through its checksum
+ *
+ * Sets @data->digest and fails the download with %G_IO_ERROR_INVALID_DATA if
+ * it does not match @data->expected_digest.
+ */
+static void
+download_resource_data_verify (DownloadResourceData *data)
+{
+    data->verified = TRUE;
+    data->digest = download_checksum_get_string (data->checksum);
+
+    g_debug ("Downloader ( %s ): digest is %s", data->uri, data->digest);
+
+    if (data->expected_digest && g_ascii_strcasecmp (data->digest, data->expected_digest) != 0)
+    {
+        download_resource_data_set_error (data,
+                                          g_error_new (G_IO_ERROR,
+                                                       G_IO_ERROR_INVALID_DATA,
+                                                       "Checksum of \"%s\" does not match, expected %s but got %s",
+                                                       data->path ? data->path : data->uri,
+                                                       data->expected_digest,
+                                                       data->digest));
+    }
+}
+
+/**
+ * download_resource_data_discard_thread:
+ * @task: a #GTask
+ * @source_object: %NULL
+ * @task_data: a #DownloadResourceData
+ * @cancellable: a #GCancellable
+ *
+ * Removes the file of a download that failed its checksum, and its journal,
+ * so that neither the file nor a later resume trusts the bad bytes. A
+ * durable download that failed loses its ".part" file the same way.
+ */
+static void
+download_resource_data_discard_thread (GTask        *task,
+                                       gpointer      source_object,
+                                       gpointer      task_data,
+                                       GCancellable *cancellable)
+{
+    DownloadResourceData *data = task_data;
+
+    g_file_delete (data->file, NULL, NULL);
+
+    if (data->journal)
+        g_unlink (data->journal->path);
+
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * download_resource_data_discard_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadResourceData
+ *
+ * Completes a download once its bad file was removed.
+ */
+static void
+download_resource_data_discard_cb (GObject      *object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+
+    download_resource_data_complete (data);
+}
+
+/**
+ * download_resource_data_discard:
+ * @data: a #DownloadResourceData that failed its checksum, or a durable one
+ *        that failed
+ *
+ * Removes the file of @data in a worker thread, then completes it.
+ */
+static void
+download_resource_data_discard (DownloadResourceData *data)
+{
+    GTask *task;
+
+    task = g_task_new (NULL, NULL, download_resource_data_discard_cb, data);
+    g_task_set_task_data (task,
+                          download_resource_data_ref (data),
+                          (GDestroyNotify) download_resource_data_unref);
+    g_task_run_in_thread (task, download_resource_data_discard_thread);
+    g_object_unref (task);
+}
+
+/**
+ * download_resource_data_save_journal_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadResourceData
+ *
+ * Finishes saving the journal of @user_data, and finishes the download if it
+ * was waiting for the save.
+ */
+static void
+download_resource_data_save_journal_cb (GObject      *object,
+                                        GAsyncResult *result,
+                                        gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+    GError *error = NULL;
+
+    data->journal_saving = FALSE;
+
+    if (!download_journal_save_finish (result, &error))
+    {
+        g_warning ("Downloader ( %s ): failed to save journal \"%s\": %s", data->uri, data->journal->path, error->message);
+        g_error_free (error);
+    }
+
+    if (data->task && data->n_active_segments == 0)
+        download_resource_data_finish (data);
+
+    download_resource_data_unref (data);
+}
+
+/**
+ * download_resource_data_save_journal:
+ * @data: a #DownloadResourceData of a resumable download
+ * @force: %TRUE to save even if the journal was saved recently
+ *
+ * Saves the ranges written so far by every segment, at most once per
+ * %DOWNLOAD_JOURNAL_INTERVAL unless @force is set, and one save at a time.
+ * The ranges are taken before the file is flushed, so the journal only
+ * lists bytes that made it to disk.
+ */
+static void
+download_resource_data_save_journal (DownloadResourceData *data,
+                                     gboolean              force)
+{
+    DownloadJournal *snapshot;
+    gint64 now;
+    guint i;
+
+    if (!data->journal || !data->output || data->journal_saving)
+        return;
+
+    now = g_get_monotonic_time ();
+
+    if (!force && now - data->last_journal_time < DOWNLOAD_JOURNAL_INTERVAL)
+        return;
+
+    snapshot = download_journal_copy (data->journal);
+    snapshot->total = data->total_bytes;
+
+    g_free (snapshot->etag);
+    snapshot->etag = g_strdup (data->etag);
+    g_free (snapshot->last_modified);
+    snapshot->last_modified = g_strdup (data->last_modified);
+
+    for (i = 0; i < data->segments->len; i++)
+    {
+        DownloadSegment *segment = g_ptr_array_index (data->segments, i);
+
+        download_journal_add_range (snapshot, segment->start, segment->written);
+    }
+
+    data->journal_saving = TRUE;
+    data->last_journal_time = now;
+
+    download_journal_save_async (snapshot,
+                                 data->part_path,
+                                 NULL,
+                                 download_resource_data_save_journal_cb,
+                                 download_resource_data_ref (data));
+
+    download_journal_free (snapshot);
+}
+
+/**
+ * download_resource_data_publish_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadResourceData
+ *
+ * Completes the download once its file was made durable as asked and moved
+ * in place, and its journal removed.
+ */
+static void
+download_resource_data_publish_cb (GObject      *object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+    GError *error = NULL;
+
+    if (!download_commit_finish (result, &error))
+        download_resource_data_set_error (data, error);
+    else
+        g_debug ("Downloader ( %s ): moved \"%s\" to \"%s\"", data->uri, data->part_path, data->path);
+
+    download_resource_data_complete (data);
+    download_resource_data_unref (data);
+}
+
+/**
+ * download_resource_data_take_bytes:
+ * @data: a #DownloadResourceData of a download to memory
+ *
+ * Turns the memory @data read into into @data->bytes without copying it once
+ * the download succeeded, or frees it once it failed.
+ */
+static void
+download_resource_data_take_bytes (DownloadResourceData *data)
+{
+    if (data->error)
+    {
+        g_clear_pointer (&data->memory, g_free);
+        g_clear_pointer (&data->memory_array, g_byte_array_unref);
+
+        return;
+    }
+
+    if (data->memory)
+    {
+        data->bytes = g_bytes_new_take (data->memory, data->total_bytes);
+        data->memory = NULL;
+    }
+    else if (data->memory_array)
+    {
+        data->bytes = g_byte_array_free_to_bytes (data->memory_array);
+        data->memory_array = NULL;
+    }
+    else
+    {
+        data->bytes = g_bytes_new (NULL, 0);
+    }
+}
+
+/**
+ * download_resource_data_append_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadResourceData
+ *
+ * Completes the download once its bytes were appended to its pack.
+ */
+static void
+download_resource_data_append_cb (GObject      *object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+    GError *error = NULL;
+
+    if (!download_pack_append_finish (result, &error))
+        download_resource_data_set_error (data, error);
+    else
+        g_debug ("Downloader ( %s ): appended to \"%s\" as \"%s\"", data->uri, download_pack_get_path (data->pack), data->pack_key);
+
+    download_resource_data_complete (data);
+    download_resource_data_unref (data);
+}
+
+/**
+ * download_resource_data_finish:
+ * @data: a #DownloadResourceData whose segments all closed
+ *
+ * Completes the download. A download with a checksum first hashes what is
+ * left and checks the digest, a file that does not match is removed. A file
+ * the cache found fresh is left as it is. A download to memory turns what
+ * it read into @data->bytes, which a download to a pack then appends. A
+ * resumable or durable download that succeeded then moves its ".part" file
+ * in place once flushed as @data->durability asks, see download-commit. A
+ * resumable one that failed first saves its journal so the next
+ * download_start() picks up where it stopped, the ".part" file of a durable
+ * one is removed.
+ */
+static void
+download_resource_data_finish (DownloadResourceData *data)
+{
+    // download_resource_data_save_journal_cb() and
+    // download_resource_data_hash_cb() come back here
+    if (data->journal_saving || data->hashing)
+        return;
+
+    if (data->checksum && !data->error && !data->verified)
+    {
+        if (download_resource_data_hash_catch_up (data))
+            return;
+
+        download_resource_data_verify (data);
+
+        if (data->error && data->target == DOWNLOAD_TARGET_FILE)
+        {
+            download_resource_data_discard (data);
+            return;
+        }
+    }
+
+    if (data->cache_hit)
+    {
+        download_resource_data_complete (data);
+        return;
+    }
+
+    if (data->target == DOWNLOAD_TARGET_MEMORY || data->target == DOWNLOAD_TARGET_PACK)
+    {
+        download_resource_data_take_bytes (data);
+
+        if (data->target == DOWNLOAD_TARGET_PACK && !data->error)
+        {
+            download_pack_append_async (data->pack,
+                                        data->pack_key,
+                                        data->bytes,
+                                        NULL,
+                                        download_resource_data_append_cb,
+                                        download_resource_data_ref (data));
+            return;
+        }
+
+        download_resource_data_complete (data);
+
+        return;
+    }
+
+    if (data->part_path && !data->error)
+    {
+        download_commit_async (data->commit_group,
+                               data->durability,
+                               data->synced,
+                               data->part_path,
+                               data->path,
+                               data->journal ? data->journal->path : NULL,
+                               NULL,
+                               download_resource_data_publish_cb,
+                               download_resource_data_ref (data));
+        return;
+    }
+
+    if (data->part_path && data->output && !data->journal)
+    {
+        download_resource_data_discard (data);
+        return;
+    }
+
+    if (data->part_path && data->output && !data->journal_final)
+    {
+        data->journal_final = TRUE;
+        download_resource_data_save_journal (data, TRUE);
+
+        if (data->journal_saving)
+            return;
+    }
+
+    download_resource_data_complete (data);
+}
+
+/**
+ * download_segment_new:
+ * @data: a #DownloadResourceData
+ * @offset: the first byte of the segment
+ * @end: the first byte past the segment, -1 to read until the end of the body
+ *
+ * Creates a #DownloadSegment fetching the bytes @offset .. @end - 1 of @data.
+ * The segment counts as active until download_segment_closed().
+ *
+ * Returns: (transfer full): a new #DownloadSegment
+ */
+static DownloadSegment *
+download_segment_new (DownloadResourceData *data,
+                      goffset               offset,
+                      goffset               end)
+{
+    DownloadSegment *segment;
+
+    segment = g_slice_new0 (DownloadSegment);
+    segment->data = data;
+    segment->index = data->segments->len;
+    segment->start = offset;
+    segment->written = offset;
+    segment->dropped = offset;
+    segment->offset = offset;
+    segment->end = end;
+    segment->read_size = DOWNLOAD_BUFFER_POOL_MIN_SIZE;
+
+    g_ptr_array_add (data->segments, segment);
+
+    data->n_active_segments++;
+
+    return segment;
+}
+
+/**
+ * download_segment_free:
+ * @user_data: a #DownloadSegment
+ *
+ * Frees a #DownloadSegment struct, handing back the buffers of chunks that
+ * were never written.
+ */
+static void
+download_segment_free (gpointer user_data)
+{
+    DownloadSegment *segment = user_data;
+    DownloadBufferPool *pool = segment->data->buffer_pool;
+    DownloadChunk *chunk;
+
+    if (segment->request)
+        g_object_unref (segment->request);
+
+    if (segment->input)
+        g_object_unref (segment->input);
+
+    if (segment->output)
+        g_object_unref (segment->output);
+
+    if (segment->io_stream)
+        g_object_unref (segment->io_stream);
+
+    while ((chunk = g_queue_pop_head (&segment->pending_chunks)))
+    {
+        if (!chunk->borrowed)
+            download_buffer_pool_release (pool, chunk->buffer, chunk->size);
+
+        g_slice_free (DownloadChunk, chunk);
+    }
+
+    g_slice_free (DownloadSegment, segment);
+}
+
+/**
+ * download_segment_closed:
+ * @segment: a #DownloadSegment
+ *
+ * Called once both streams of @segment are closed. The download finishes
+ * when its last segment closes, see download_resource_data_finish().
+ */
+static void
+download_segment_closed (DownloadSegment *segment)
+{
+    DownloadResourceData *data = segment->data;
+
+    g_debug ("Downloader ( %s ): segment %u closed at \"%" G_GOFFSET_FORMAT "\"", data->uri, segment->index, segment->offset);
+
+    if (--data->n_active_segments > 0)
+        return;
+
+    download_resource_data_progress (data, TRUE);
+    download_resource_data_finish (data);
+}
+
+/**
+ * download_resource_from_uri_async_write_close_cb:
+ * @object: a #GOutputStream
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadSegment
+ *
+ * Closes the #GOutputStream for @object and marks the segment closed.
+ */
+static void
+download_resource_from_uri_async_write_close_cb (GObject      *object,
+                                                 GAsyncResult *result,
+                                                 gpointer      user_data)
+{
+    g_return_if_fail (G_IS_OUTPUT_STREAM (object));
+
+    GOutputStream *stream = G_OUTPUT_STREAM (object);
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    if (!g_output_stream_close_finish (stream, result, &error))
+    {
+        g_warning ("Downloader ( %s ): error closing GOutputStream: %s", data->uri, error->message);
+        download_resource_data_set_error (data, error);
+    }
+
+    download_segment_closed (segment);
+}
+
+/**
+ * download_resource_from_uri_async_write_close:
+ * @segment: a #DownloadSegment
+ *
+ * Closes the #GOutputStream of @segment with a #GCallback to
+ * download_resource_from_uri_async_write_close_cb(). The output is closed
+ * even when cancelled so the file handle is released.
+ */
+static void
+download_resource_from_uri_async_write_close (DownloadSegment *segment)
+{
+    if (!segment->output)
+    {
+        download_segment_closed (segment);
+        return;
+    }
+
+    g_output_stream_close_async (segment->output,
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 download_resource_from_uri_async_write_close_cb,
+                                 segment);
+}
+
+/**
+ * download_resource_from_uri_async_read_close_cb:
+ * @object: a #GInputStream
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadSegment
+ *
+ * Closes an open #GInputStream for @object, then closes the #GOutputStream of
+ * the segment.
+ */
+static void
+download_resource_from_uri_async_read_close_cb (GObject      *object,
+                                                GAsyncResult *result,
+                                                gpointer      user_data)
+{
+    g_return_if_fail (G_IS_INPUT_STREAM (object));
+
+    GInputStream *stream = G_INPUT_STREAM (object);
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    if (!g_input_stream_close_finish (stream, result, &error))
+    {
+        g_warning ("Downloader ( %s ): error closing GInputStream: %s", data->uri, error->message);
+        g_error_free (error);
+    }
+
+    g_debug ("Downloader ( %s ): closed GInputStream, read \"%" G_GUINT64_FORMAT "\" bytes", data->uri, data->downloaded_bytes);
+
+    download_resource_from_uri_async_write_close (segment);
+}
+
+/**
+ * download_resource_from_uri_async_read_close:
+ * @segment: a #DownloadSegment
+ *
+ * Starts closing the streams of @segment, the end of every segment whether it
+ * succeeded or not.
+ */
+static void
+download_resource_from_uri_async_read_close (DownloadSegment *segment)
+{
+    if (!segment->input)
+    {
+        download_resource_from_uri_async_write_close (segment);
+        return;
+    }
+
+    g_input_stream_close_async (segment->input,
+                                G_PRIORITY_DEFAULT,
+                                NULL,
+                                download_resource_from_uri_async_read_close_cb,
+                                segment);
+}
+
+/**
+ * download_segment_chunk_new:
+ * @segment: a #DownloadSegment
+ *
+ * Takes a buffer of about @segment->read_size bytes from the
+ * #DownloadBufferPool of the download. A download to memory of known length
+ * reads in place instead, the chunk then points at its next bytes.
+ *
+ * Returns: (nullable): a new #DownloadChunk, or %NULL when the pool is out of
+ *          memory
+ */
+static DownloadChunk *
+download_segment_chunk_new (DownloadSegment *segment)
+{
+    DownloadChunk *chunk;
+    gpointer buffer;
+    gsize size;
+
+    if (segment->data->memory)
+    {
+        chunk = g_slice_new0 (DownloadChunk);
+        chunk->buffer = (gchar *) segment->data->memory + segment->offset;
+        chunk->size = MIN (segment->read_size, segment->end - segment->offset);
+        chunk->borrowed = TRUE;
+
+        segment->n_chunks++;
+
+        return chunk;
+    }
+
+    buffer = download_buffer_pool_acquire (segment->data->buffer_pool, segment->read_size, &size);
+
+    if (!buffer)
+        return NULL;
+
+    chunk = g_slice_new0 (DownloadChunk);
+    chunk->buffer = buffer;
+    chunk->size = size;
+
+    segment->n_chunks++;
+
+    return chunk;
+}
+
+/**
+ * download_segment_chunk_free:
+ * @segment: a #DownloadSegment
+ * @chunk: a #DownloadChunk of @segment
+ *
+ * Hands the buffer of @chunk back to the #DownloadBufferPool, unless it
+ * was borrowed, and frees @chunk.
+ */
+static void
+download_segment_chunk_free (DownloadSegment *segment,
+                             DownloadChunk   *chunk)
+{
+    if (!chunk->borrowed)
+        download_buffer_pool_release (segment->data->buffer_pool, chunk->buffer, chunk->size);
+
+    g_slice_free (DownloadChunk, chunk);
+
+    segment->n_chunks--;
+}
+
+/**
+ * download_segment_adapt_read_size:
+ * @segment: a #DownloadSegment
+ * @chunk: the #DownloadChunk just read
+ *
+ * Grows or shrinks the size of the next reads from what the last one
+ * returned. A read that filled its whole buffer means the connection delivers
+ * more than one buffer per callback so the size doubles, up to
+ * %DOWNLOAD_BUFFER_POOL_MAX_SIZE. Reads that keep coming back less than a
+ * quarter full halve it, down to %DOWNLOAD_BUFFER_POOL_MIN_SIZE.
+ */
+static void
+download_segment_adapt_read_size (DownloadSegment *segment,
+                                  DownloadChunk   *chunk)
+{
+    if (chunk->length == chunk->size)
+    {
+        segment->n_short_reads = 0;
+        segment->read_size = MIN (segment->read_size * 2, DOWNLOAD_BUFFER_POOL_MAX_SIZE);
+    }
+    else if (chunk->length < chunk->size / 4)
+    {
+        if (++segment->n_short_reads >= 4)
+        {
+            segment->n_short_reads = 0;
+            segment->read_size = MAX (segment->read_size / 2, DOWNLOAD_BUFFER_POOL_MIN_SIZE);
+        }
+    }
+    else
+    {
+        segment->n_short_reads = 0;
+    }
+}
+
+static void
+download_segment_send (DownloadSegment *segment);
+
+/**
+ * download_resource_data_next_range:
+ * @data: a #DownloadResourceData
+ *
+ * Starts a segment for the next range a resumed download still misses.
+ *
+ * Returns: %TRUE if a segment was started
+ */
+static gboolean
+download_resource_data_next_range (DownloadResourceData *data)
+{
+    DownloadSegment *segment;
+    DownloadRange *range;
+
+    range = g_queue_pop_head (&data->pending_ranges);
+
+    if (!range)
+        return FALSE;
+
+    segment = download_segment_new (data, range->start, range->end);
+    g_slice_free (DownloadRange, range);
+
+    g_debug ("Downloader ( %s ): segment %u resumes \"%" G_GOFFSET_FORMAT "\" .. \"%" G_GOFFSET_FORMAT "\"",
+             data->uri, segment->index, segment->offset, segment->end);
+
+    download_segment_send (segment);
+
+    return TRUE;
+}
+
+/**
+ * download_resource_data_steal:
+ * @data: a #DownloadResourceData
+ *
+ * Called when a segment of a split download finished early. The segment
+ * with the most bytes left gives up the second half of them to a new
+ * segment, as long as both halves stay above @data->min_segment_size.
+ */
+static void
+download_resource_data_steal (DownloadResourceData *data)
+{
+    DownloadSegment *victim = NULL;
+    DownloadSegment *segment;
+    goffset remaining = 0;
+    goffset middle;
+    guint i;
+
+    for (i = 0; i < data->segments->len; i++)
+    {
+        segment = g_ptr_array_index (data->segments, i);
+
+        if (segment->closing || segment->eof || segment->end < 0)
+            continue;
+
+        if (segment->end - segment->offset > remaining)
+        {
+            victim = segment;
+            remaining = segment->end - segment->offset;
+        }
+    }
+
+    if (!victim || remaining < 2 * data->min_segment_size)
+        return;
+
+    middle = victim->offset + remaining / 2;
+
+    if (middle - middle % DOWNLOAD_SEGMENT_ALIGNMENT > victim->offset)
+        middle -= middle % DOWNLOAD_SEGMENT_ALIGNMENT;
+
+    segment = download_segment_new (data, middle, victim->end);
+    victim->end = middle;
+
+    g_debug ("Downloader ( %s ): segment %u takes over \"%" G_GOFFSET_FORMAT "\" .. \"%" G_GOFFSET_FORMAT "\" from segment %u",
+             data->uri, segment->index, segment->offset, segment->end, victim->index);
+
+    download_segment_send (segment);
+}
+
+static void
+download_resource_from_uri_async_check_done (DownloadSegment *segment);
+
+/**
+ * download_segment_drop_cache_cb:
+ * @object: a #GOutputStream
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadSegment
+ *
+ * Finishes dropping written bytes of @user_data from the page cache. Where
+ * that is not possible the download stops trying and carries on through the
+ * cache.
+ */
+static void
+download_segment_drop_cache_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    segment->dropping = FALSE;
+
+    if (!download_file_drop_cache_finish (result, &error))
+    {
+        g_warning ("Downloader ( %s ): not bypassing the page cache: %s", data->uri, error->message);
+        g_error_free (error);
+
+        data->bypass_cache = FALSE;
+    }
+
+    download_resource_from_uri_async_check_done (segment);
+}
+
+/**
+ * download_segment_drop_cache:
+ * @segment: a #DownloadSegment
+ * @all: %TRUE to drop every written byte, at the end of @segment
+ *
+ * Drops the bytes @segment wrote from the page cache once
+ * %DOWNLOAD_DROP_CACHE_SIZE of them piled up, when the download bypasses the
+ * cache. Writes go on while a range is flushed and dropped.
+ */
+static void
+download_segment_drop_cache (DownloadSegment *segment,
+                             gboolean         all)
+{
+    DownloadResourceData *data = segment->data;
+    goffset length = segment->written - segment->dropped;
+
+    if (!data->bypass_cache || segment->dropping || length <= 0)
+        return;
+
+    if (!all && length < DOWNLOAD_DROP_CACHE_SIZE)
+        return;
+
+    segment->dropping = TRUE;
+
+    download_file_drop_cache_async (segment->output,
+                                    segment->dropped,
+                                    length,
+                                    NULL,
+                                    download_segment_drop_cache_cb,
+                                    segment);
+
+    segment->dropped = segment->written;
+}
+
+/**
+ * download_resource_from_uri_async_check_done:
+ * @segment: a #DownloadSegment
+ *
+ * Closes the streams of @segment once its bytes were read and every chunk
+ * written, or once a failure happened and the read and write in flight came
+ * back. A segment that bypasses the page cache drops what it wrote last
+ * first. A segment of a split download that finished starts on a range a
+ * resumed download still misses or takes over work from the slowest one
+ * first, one that failed stops the others.
+ */
+static void
+download_resource_from_uri_async_check_done (DownloadSegment *segment)
+{
+    DownloadResourceData *data = segment->data;
+
+    if (segment->closing || segment->reading || segment->writing || segment->connecting || segment->dropping)
+        return;
+
+    if (!data->error && !(segment->eof && g_queue_is_empty (&segment->pending_chunks)))
+        return;
+
+    if (!data->error && data->bypass_cache && segment->written > segment->dropped)
+    {
+        download_segment_drop_cache (segment, TRUE);
+        return;
+    }
+
+    if (segment->wait_source)
+    {
+        g_source_destroy (segment->wait_source);
+        g_source_unref (segment->wait_source);
+        segment->wait_source = NULL;
+    }
+
+    segment->closing = TRUE;
+
+    if (data->segmented)
+    {
+        if (data->error)
+            g_cancellable_cancel (data->cancellable);
+        else if (!download_resource_data_next_range (data))
+            download_resource_data_steal (data);
+    }
+
+    download_resource_from_uri_async_read_close (segment);
+}
+
+static void
+download_resource_from_uri_async_read_cb (GObject      *object,
+                                          GAsyncResult *result,
+                                          gpointer      user_data);
+
+static void
+download_resource_from_uri_async_write_cb (GObject      *object,
+                                           GAsyncResult *result,
+                                           gpointer      user_data);
+
+static void
+download_resource_from_uri_async_read (DownloadSegment *segment);
+
+static void
+download_resource_from_uri_async_write (DownloadSegment *segment);
+
+/**
+ * download_resource_from_uri_async_wait_cb:
+ * @user_data: a #DownloadSegment
+ *
+ * Called when the #GInputStream of @user_data became readable or the
+ * #DownloadBufferPool released memory, whichever @user_data was waiting for.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_resource_from_uri_async_wait_cb (gpointer user_data)
+{
+    DownloadSegment *segment = user_data;
+
+    g_source_unref (segment->wait_source);
+    segment->wait_source = NULL;
+
+    download_resource_from_uri_async_read (segment);
+    download_resource_from_uri_async_check_done (segment);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_resource_from_uri_async_wait:
+ * @segment: a #DownloadSegment
+ * @source: (transfer full): a #GSource to wait on
+ *
+ * Attaches @source to the #GMainContext of the download and reads again once
+ * it dispatches, through download_resource_from_uri_async_wait_cb(). While
+ * waiting @segment holds no buffer.
+ */
+static void
+download_resource_from_uri_async_wait (DownloadSegment *segment,
+                                       GSource         *source)
+{
+    g_source_set_callback (source,
+                           download_resource_from_uri_async_wait_cb,
+                           segment,
+                           NULL);
+    g_source_attach (source, segment->data->context);
+
+    segment->wait_source = source;
+}
+
+/**
+ * download_error_is_transient:
+ * @error: a #GError
+ *
+ * Checks whether @error is the kind of network failure that may go away by
+ * trying again: a dropped or refused connection, a timeout, a temporary
+ * resolver failure or a server error status.
+ *
+ * Returns: %TRUE if @error is worth a retry
+ */
+static gboolean
+download_error_is_transient (const GError *error)
+{
+    if (error->domain == SOUP_HTTP_ERROR)
+        return SOUP_STATUS_IS_TRANSPORT_ERROR (error->code) ||
+               SOUP_STATUS_IS_SERVER_ERROR (error->code) ||
+               error->code == SOUP_STATUS_REQUEST_TIMEOUT;
+
+    if (g_error_matches (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_TEMPORARY_FAILURE))
+        return TRUE;
+
+    if (error->domain != G_IO_ERROR)
+        return FALSE;
+
+    switch (error->code)
+    {
+        case G_IO_ERROR_PARTIAL_INPUT:
+        case G_IO_ERROR_TIMED_OUT:
+        case G_IO_ERROR_CONNECTION_CLOSED:
+        case G_IO_ERROR_BROKEN_PIPE:
+        case G_IO_ERROR_CONNECTION_REFUSED:
+        case G_IO_ERROR_HOST_UNREACHABLE:
+        case G_IO_ERROR_NETWORK_UNREACHABLE:
+        case G_IO_ERROR_NOT_CONNECTED:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * download_segment_can_retry:
+ * @segment: a #DownloadSegment
+ * @error: the #GError @segment failed with
+ *
+ * Checks whether @segment may reconnect after @error instead of failing the
+ * download. Bytes already read can only be skipped with a Range request, so
+ * a segment past its first byte needs a server that takes them.
+ *
+ * Returns: %TRUE if @segment should reconnect
+ */
+static gboolean
+download_segment_can_retry (DownloadSegment *segment,
+                            const GError    *error)
+{
+    DownloadResourceData *data = segment->data;
+
+    if (data->error || segment->n_retries >= data->max_retries)
+        return FALSE;
+
+    if (g_cancellable_is_cancelled (data->cancellable))
+        return FALSE;
+
+    // A decoder cannot pick up halfway through the body
+    if (segment->offset > 0 && (!data->accepts_ranges || data->decoding))
+        return FALSE;
+
+    return download_error_is_transient (error);
+}
+
+/**
+ * download_segment_reconnect_cb:
+ * @user_data: a #DownloadSegment
+ *
+ * Sends the request of @user_data again once its back off delay is over,
+ * unless the download was stopped in the meantime.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_segment_reconnect_cb (gpointer user_data)
+{
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    g_source_unref (segment->wait_source);
+    segment->wait_source = NULL;
+
+    if (g_cancellable_set_error_if_cancelled (data->cancellable, &error))
+        download_resource_data_set_error (data, error);
+
+    if (data->error)
+    {
+        download_resource_from_uri_async_check_done (segment);
+        return G_SOURCE_REMOVE;
+    }
+
+    download_segment_send (segment);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_segment_reconnect:
+ * @segment: a #DownloadSegment
+ * @error: (transfer full): the #GError @segment failed with
+ *
+ * Drops the connection of @segment and sends a new request for the bytes it
+ * has not read yet after a delay that doubles with every attempt, from
+ * %DOWNLOAD_RETRY_MIN_DELAY up to %DOWNLOAD_RETRY_MAX_DELAY. Chunks already
+ * read keep being written meanwhile.
+ */
+static void
+download_segment_reconnect (DownloadSegment *segment,
+                            GError          *error)
+{
+    DownloadResourceData *data = segment->data;
+    GSource *source;
+    GSource *cancellable_source;
+    guint delay;
+
+    delay = MIN ((guint64) DOWNLOAD_RETRY_MIN_DELAY << MIN (segment->n_retries, 16), DOWNLOAD_RETRY_MAX_DELAY);
+    segment->n_retries++;
+    data->metrics.n_retries++;
+
+    g_warning ("Downloader ( %s ): segment %u failed at \"%" G_GOFFSET_FORMAT "\", retry %u of %u in %u ms: %s",
+               data->uri,
+               segment->index,
+               segment->offset,
+               segment->n_retries,
+               data->max_retries,
+               delay,
+               error->message);
+
+    g_error_free (error);
+
+    if (segment->input)
+    {
+        g_input_stream_close_async (segment->input, G_PRIORITY_DEFAULT, NULL, NULL, NULL);
+        g_clear_object (&segment->input);
+    }
+
+    g_clear_object (&segment->request);
+
+    source = g_timeout_source_new (delay);
+    cancellable_source = g_cancellable_source_new (data->cancellable);
+    g_source_set_dummy_callback (cancellable_source);
+    g_source_add_child_source (source, cancellable_source);
+    g_source_unref (cancellable_source);
+
+    g_source_set_callback (source,
+                           download_segment_reconnect_cb,
+                           segment,
+                           NULL);
+    g_source_attach (source, data->context);
+
+    segment->wait_source = source;
+}
+
+/**
+ * download_resource_data_stop_waits_cb:
+ * @user_data: a #DownloadResourceData
+ *
+ * Destroys the sources the segments of a cancelled download wait on, for a
+ * reconnect, the rate limiter, buffers or a readable stream, and lets each
+ * of them fail with the cancellation instead.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_resource_data_stop_waits_cb (gpointer user_data)
+{
+    DownloadResourceData *data = user_data;
+    GError *error = NULL;
+    guint i;
+
+    for (i = 0; i < data->segments->len; i++)
+    {
+        DownloadSegment *segment = g_ptr_array_index (data->segments, i);
+
+        if (!segment->wait_source)
+            continue;
+
+        g_source_destroy (segment->wait_source);
+        g_source_unref (segment->wait_source);
+        segment->wait_source = NULL;
+
+        if (g_cancellable_set_error_if_cancelled (data->cancellable, &error))
+            download_resource_data_set_error (data, error);
+
+        download_resource_from_uri_async_check_done (segment);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_resource_data_stop_waits:
+ * @cancellable: the internal #GCancellable of @user_data
+ * @user_data: a #DownloadResourceData
+ *
+ * Called, from any thread, when a download is cancelled, by the caller or
+ * by a failed segment. Its waiting segments are stopped from its own
+ * #GMainContext.
+ */
+static void
+download_resource_data_stop_waits (GCancellable *cancellable,
+                                   gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+
+    g_main_context_invoke_full (data->context,
+                                G_PRIORITY_DEFAULT,
+                                download_resource_data_stop_waits_cb,
+                                download_resource_data_ref (data),
+                                (GDestroyNotify) download_resource_data_unref);
+}
+
+/**
+ * download_segment_find_mirror:
+ * @segment: a #DownloadSegment
+ *
+ * Finds the mirror @segment could move to, see download_mirrors_pick().
+ * A segment that decodes can only move before its first byte.
+ *
+ * Returns: the index of the mirror, or -1 if @segment has to stay
+ */
+static gint
+download_segment_find_mirror (DownloadSegment *segment)
+{
+    DownloadResourceData *data = segment->data;
+
+    if (!data->mirrors || data->error || g_cancellable_is_cancelled (data->cancellable))
+        return -1;
+
+    if (segment->offset > 0 && data->decoding)
+        return -1;
+
+    return download_mirrors_pick (data->mirrors, data->n_mirrors, segment->mirror);
+}
+
+/**
+ * download_segment_switch_mirror:
+ * @segment: a #DownloadSegment
+ * @mirror: the index of the mirror to move to
+ * @reason: why @segment moves, for the log
+ *
+ * Drops the connection of @segment and asks @mirror for the bytes it has
+ * not read yet straight away, like download_segment_reconnect() without
+ * the delay. Chunks already read keep being written meanwhile. Segments
+ * started or reconnecting from now on go to @mirror too.
+ */
+static void
+download_segment_switch_mirror (DownloadSegment *segment,
+                                gint             mirror,
+                                const gchar     *reason)
+{
+    DownloadResourceData *data = segment->data;
+
+    g_warning ("Downloader ( %s ): segment %u moving at \"%" G_GOFFSET_FORMAT "\" from %s to %s: %s",
+               data->uri,
+               segment->index,
+               segment->offset,
+               data->mirrors[segment->mirror].uri,
+               data->mirrors[mirror].uri,
+               reason);
+
+    data->mirror = mirror;
+    g_clear_pointer (&data->final_uri, g_free);
+
+    segment->window_start = 0;
+
+    if (segment->input)
+    {
+        g_input_stream_close_async (segment->input, G_PRIORITY_DEFAULT, NULL, NULL, NULL);
+        g_clear_object (&segment->input);
+    }
+
+    g_clear_object (&segment->request);
+
+    download_segment_send (segment);
+}
+
+/**
+ * download_segment_check_rate:
+ * @segment: a #DownloadSegment of a download with mirrors
+ * @nread: the bytes @segment just received
+ *
+ * Measures what @segment receives over %DOWNLOAD_MIRROR_CHECK_INTERVAL
+ * into the rate of its mirror, and moves it to another mirror when that
+ * rate is below @data->min_rate. A window in which the segment waited for
+ * the disk, or for a #DownloadRateLimiter with a rate set, says nothing of
+ * the mirror and is not held against it.
+ */
+static void
+download_segment_check_rate (DownloadSegment *segment,
+                             gssize           nread)
+{
+    DownloadResourceData *data = segment->data;
+    DownloadMirror *mirror = &data->mirrors[segment->mirror];
+    gint64 now = g_get_monotonic_time ();
+    gint64 elapsed;
+    gboolean blocked;
+    gint next;
+
+    mirror->n_bytes += nread;
+
+    if (segment->window_start == 0)
+    {
+        segment->window_start = now;
+        segment->window_bytes = 0;
+        segment->window_blocked_time = data->metrics.write_blocked_time;
+
+        return;
+    }
+
+    segment->window_bytes += nread;
+    elapsed = now - segment->window_start;
+
+    if (elapsed < DOWNLOAD_MIRROR_CHECK_INTERVAL)
+        return;
+
+    mirror->rate = segment->window_bytes * (gdouble) G_USEC_PER_SEC / elapsed;
+
+    blocked = data->metrics.write_blocked_time != segment->window_blocked_time ||
+              download_rate_limiter_get_rate (data->rate_limiter) > 0;
+
+    segment->window_start = now;
+    segment->window_bytes = 0;
+    segment->window_blocked_time = data->metrics.write_blocked_time;
+
+    if (blocked || segment->eof || mirror->rate >= data->min_rate)
+        return;
+
+    next = download_segment_find_mirror (segment);
+
+    if (next < 0)
+        return;
+
+    mirror->slow = TRUE;
+
+    download_segment_switch_mirror (segment, next, "too slow");
+}
+
+/**
+ * download_segment_leave_mirror:
+ * @segment: a #DownloadSegment
+ * @error: (transfer full): the #GError @segment failed with
+ *
+ * Moves @segment to another mirror when the one it reads from failed,
+ * rather than wait to reconnect to it.
+ *
+ * Returns: %TRUE if @segment moved, %FALSE if @error is left to the caller
+ */
+static gboolean
+download_segment_leave_mirror (DownloadSegment *segment,
+                               GError          *error)
+{
+    gint next;
+
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return FALSE;
+
+    next = download_segment_find_mirror (segment);
+
+    if (next < 0)
+        return FALSE;
+
+    segment->data->mirrors[segment->mirror].failed = TRUE;
+
+    download_segment_switch_mirror (segment, next, error->message);
+    g_error_free (error);
+
+    return TRUE;
+}
+
+/**
+ * download_resource_from_uri_async_read_done:
+ * @segment: a #DownloadSegment
+ * @chunk: (transfer full): the #DownloadChunk read into
+ * @nread: the number of bytes read, 0 at the end of the stream, -1 on error
+ * @error: (transfer full) (nullable): the read error
+ *
+ * Queues @chunk to be written into the #GOutputStream of @segment and reads
+ * again right away if the ring has room so the network and the disk are kept
+ * busy at the same time. Bytes past the end of @segment, which was shortened
+ * by download_resource_data_steal(), are dropped. A connection lost to a
+ * transient error is picked up again by download_segment_reconnect().
+ */
+static void
+download_resource_from_uri_async_read_done (DownloadSegment *segment,
+                                            DownloadChunk   *chunk,
+                                            gssize           nread,
+                                            GError          *error)
+{
+    DownloadResourceData *data = segment->data;
+
+    data->metrics.n_reads++;
+
+    if (nread > 0)
+    {
+        download_rate_limiter_consume (data->rate_limiter, data->priority, nread);
+
+        data->metrics.bytes_read += nread;
+
+        if (data->metrics.first_byte_time == 0)
+            data->metrics.first_byte_time = g_get_monotonic_time ();
+    }
+
+    if (!error && nread == 0 && segment->end >= 0 && segment->offset < segment->end)
+    {
+        error = g_error_new (G_IO_ERROR,
+                             G_IO_ERROR_PARTIAL_INPUT,
+                             "Connection closed at byte %" G_GOFFSET_FORMAT " of segment ending at %" G_GOFFSET_FORMAT,
+                             segment->offset,
+                             segment->end);
+    }
+
+    if (error && data->mirrors && download_segment_leave_mirror (segment, error))
+    {
+        download_segment_chunk_free (segment, chunk);
+        download_resource_from_uri_async_write (segment);
+
+        return;
+    }
+
+    if (error && download_segment_can_retry (segment, error))
+    {
+        download_segment_chunk_free (segment, chunk);
+        download_segment_reconnect (segment, error);
+        download_resource_from_uri_async_write (segment);
+
+        return;
+    }
+
+    if (error)
+    {
+        g_warning ("Downloader ( %s ): stream read finished failed: %s",
+                   data->uri,
+                   error->message);
+
+        download_resource_data_set_error (data, error);
+    }
+
+    if (nread > 0 && segment->end >= 0)
+        nread = MIN (nread, segment->end - segment->offset);
+
+    if (nread <= 0)
+    {
+        segment->eof = TRUE;
+        download_segment_chunk_free (segment, chunk);
+    }
+    else
+    {
+        chunk->offset = segment->offset;
+        chunk->length = nread;
+        segment->offset += nread;
+
+        download_segment_adapt_read_size (segment, chunk);
+
+        g_queue_push_tail (&segment->pending_chunks, chunk);
+
+        if (segment->end >= 0 && segment->offset >= segment->end)
+            segment->eof = TRUE;
+
+        // A segment that moves is connecting, reads wait for the response
+        if (data->mirrors)
+            download_segment_check_rate (segment, nread);
+    }
+
+    download_resource_from_uri_async_write (segment);
+    download_resource_from_uri_async_read (segment);
+}
+
+/**
+ * download_resource_from_uri_async_read_next:
+ * @segment: a #DownloadSegment
+ *
+ * Reads the next chunk of the #GInputStream of @segment. Nothing is read
+ * while %DOWNLOAD_RING_SIZE chunks are waiting to be written, the next write
+ * to finish calls this again.
+ *
+ * Streams that can be polled, like the ones of libsoup, are read without
+ * blocking once they are readable so that a buffer is only taken from the
+ * #DownloadBufferPool when there are bytes to put in it. Reads are no
+ * larger than the #DownloadRateLimiter allows, and wait for it when it
+ * allows nothing. Other streams fall
+ * back to g_input_stream_read_async() with a #GCallback to
+ * download_resource_from_uri_async_read_cb().
+ */
+static void
+download_resource_from_uri_async_read_next (DownloadSegment *segment)
+{
+    DownloadResourceData *data = segment->data;
+    GPollableInputStream *pollable;
+    DownloadChunk *chunk;
+    GError *error = NULL;
+    gsize allowed;
+    gssize nread;
+
+    if (segment->reading || segment->connecting || segment->eof || segment->wait_source || data->error)
+        return;
+
+    if (segment->n_chunks >= DOWNLOAD_RING_SIZE)
+    {
+        if (segment->blocked_since == 0)
+            segment->blocked_since = g_get_monotonic_time ();
+
+        return;
+    }
+
+    if (g_cancellable_set_error_if_cancelled (data->cancellable, &error))
+    {
+        download_resource_data_set_error (data, error);
+        return;
+    }
+
+    pollable = segment->pollable ? G_POLLABLE_INPUT_STREAM (segment->input) : NULL;
+
+    if (pollable && !g_pollable_input_stream_is_readable (pollable))
+    {
+        download_resource_from_uri_async_wait (segment,
+                                               g_pollable_input_stream_create_source (pollable, data->cancellable));
+        return;
+    }
+
+    allowed = download_rate_limiter_acquire (data->rate_limiter, data->priority, segment->read_size);
+
+    if (allowed == 0)
+    {
+        download_resource_from_uri_async_wait (segment,
+                                               download_rate_limiter_create_source (data->rate_limiter, data->priority, data->cancellable));
+        return;
+    }
+
+    chunk = download_segment_chunk_new (segment);
+
+    if (!chunk)
+    {
+        download_resource_from_uri_async_wait (segment,
+                                               download_buffer_pool_create_source (data->buffer_pool, data->cancellable));
+        return;
+    }
+
+    if (!pollable)
+    {
+        segment->reading = TRUE;
+        segment->read_chunk = chunk;
+
+        g_input_stream_read_async (segment->input,
+                                   chunk->buffer,
+                                   MIN (chunk->size, allowed),
+                                   G_PRIORITY_DEFAULT,
+                                   data->cancellable,
+                                   download_resource_from_uri_async_read_cb,
+                                   segment);
+
+        return;
+    }
+
+    nread = g_pollable_input_stream_read_nonblocking (pollable,
+                                                      chunk->buffer,
+                                                      MIN (chunk->size, allowed),
+                                                      data->cancellable,
+                                                      &error);
+
+    if (nread < 0 && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+    {
+        g_error_free (error);
+        download_segment_chunk_free (segment, chunk);
+
+        download_resource_from_uri_async_wait (segment,
+                                               g_pollable_input_stream_create_source (pollable, data->cancellable));
+        return;
+    }
+
+    download_resource_from_uri_async_read_done (segment, chunk, nread, error);
+}
+
+/**
+ * download_resource_from_uri_async_read:
+ * @segment: a #DownloadSegment
+ *
+ * Reads chunks of @segment with download_resource_from_uri_async_read_next()
+ * for as long as the stream stays readable and there is room for them. A
+ * chunk that goes to memory or to the chunk handler is done with before
+ * download_resource_from_uri_async_read_done() asks for the next one, so
+ * that request is looped over here rather than recursed into. After
+ * %DOWNLOAD_READ_BURST chunks in a row the #GMainContext gets to run other
+ * sources before reading goes on.
+ */
+static void
+download_resource_from_uri_async_read (DownloadSegment *segment)
+{
+    guint n_reads = 0;
+
+    if (segment->in_read)
+    {
+        segment->read_again = TRUE;
+        return;
+    }
+
+    segment->in_read = TRUE;
+
+    do
+    {
+        segment->read_again = FALSE;
+
+        if (++n_reads > DOWNLOAD_READ_BURST && !segment->wait_source)
+        {
+            download_resource_from_uri_async_wait (segment, g_idle_source_new ());
+            break;
+        }
+
+        download_resource_from_uri_async_read_next (segment);
+    }
+    while (segment->read_again);
+
+    segment->in_read = FALSE;
+}
+
+/**
+ * download_segment_deliver:
+ * @segment: a #DownloadSegment of a download that does not save to a file
+ * @chunk: (transfer full): a #DownloadChunk read by @segment
+ *
+ * Hands @chunk on without copying it where possible. A download to memory
+ * of known length already read it in place, one of unknown length appends
+ * it to @data->memory_array. With %DOWNLOAD_TARGET_CHUNKS the buffer itself
+ * goes to the chunk handler as a #GBytes, see download_buffer_pool_wrap().
+ */
+static void
+download_segment_deliver (DownloadSegment *segment,
+                          DownloadChunk   *chunk)
+{
+    DownloadResourceData *data = segment->data;
+    GBytes *bytes;
+    gint64 start_time = g_get_monotonic_time ();
+
+    data->downloaded_bytes += chunk->length;
+    segment->written = chunk->offset + chunk->length;
+
+    download_resource_data_hash (data, chunk);
+
+    if (data->memory_array)
+        g_byte_array_append (data->memory_array, (const guint8 *) chunk->buffer, chunk->length);
+
+    if (data->target == DOWNLOAD_TARGET_CHUNKS)
+    {
+        bytes = download_buffer_pool_wrap (data->buffer_pool, chunk->buffer, chunk->size, chunk->length);
+        chunk->borrowed = TRUE;
+
+        data->chunk_handler (bytes, chunk->offset, data->chunk_user_data);
+
+        g_bytes_unref (bytes);
+    }
+
+    data->metrics.n_writes++;
+    data->metrics.bytes_written += chunk->length;
+    data->metrics.write_time += g_get_monotonic_time () - start_time;
+
+    download_segment_chunk_free (segment, chunk);
+    download_resource_data_progress (data, FALSE);
+}
+
+/**
+ * download_segment_is_last_write:
+ * @segment: a #DownloadSegment
+ * @chunk: the #DownloadChunk @segment is about to write
+ *
+ * Tells whether writing @chunk completes the file of a download that
+ * flushes it with %DOWNLOAD_DURABILITY_FSYNC, with every other write of the
+ * file done. That holds for the last chunk of the only segment of a
+ * download of known length, as a segment writes one chunk at a time. The
+ * bytes a resumed download found were flushed before its journal recorded
+ * them.
+ *
+ * Returns: %TRUE if the write of @chunk may be linked to an fdatasync()
+ *          that stands for the one of the commit
+ */
+static gboolean
+download_segment_is_last_write (DownloadSegment *segment,
+                                DownloadChunk   *chunk)
+{
+    DownloadResourceData *data = segment->data;
+    goffset end = segment->end >= 0 ? segment->end : (goffset) data->total_bytes;
+
+    return data->durability == DOWNLOAD_DURABILITY_FSYNC &&
+           data->segments->len == 1 &&
+           !data->decoding &&
+           end > 0 &&
+           chunk->offset + (goffset) chunk->length == end;
+}
+
+/**
+ * download_resource_from_uri_async_write:
+ * @segment: a #DownloadSegment
+ *
+ * Writes the oldest chunk read into the #GOutputStream of @segment with a
+ * #GCallback to download_resource_from_uri_async_write_cb(), or at its
+ * offset in the file through the #DownloadUring of the download, linked to
+ * an fdatasync() when it is the last write of a file flushed once complete.
+ * Only one write runs at a time so chunks land in the file in the order
+ * they were read.
+ * Downloads that do not save to a file take every chunk read right away
+ * through download_segment_deliver().
+ */
+static void
+download_resource_from_uri_async_write (DownloadSegment *segment)
+{
+    DownloadChunk *chunk;
+    gint fd = -1;
+
+    if (segment->writing || segment->data->error)
+        return;
+
+    if (segment->data->target != DOWNLOAD_TARGET_FILE)
+    {
+        while ((chunk = g_queue_pop_head (&segment->pending_chunks)))
+            download_segment_deliver (segment, chunk);
+
+        return;
+    }
+
+    chunk = g_queue_pop_head (&segment->pending_chunks);
+
+    if (!chunk)
+        return;
+
+    segment->writing = TRUE;
+    segment->write_chunk = chunk;
+    segment->write_start_time = g_get_monotonic_time ();
+
+    if (segment->data->uring)
+        fd = download_file_get_fd (segment->output);
+
+    segment->uring_write = fd >= 0;
+    segment->uring_sync = segment->uring_write && download_segment_is_last_write (segment, chunk);
+
+    if (segment->uring_write)
+    {
+        download_uring_write_async (segment->data->uring,
+                                    segment->output,
+                                    fd,
+                                    segment->data->buffer_pool,
+                                    chunk->buffer,
+                                    chunk->size,
+                                    chunk->length,
+                                    chunk->offset,
+                                    segment->uring_sync,
+                                    segment->data->cancellable,
+                                    download_resource_from_uri_async_write_cb,
+                                    segment);
+        return;
+    }
+
+    g_output_stream_write_all_async (segment->output,
+                                     chunk->buffer,
+                                     chunk->length,
+                                     G_PRIORITY_DEFAULT,
+                                     segment->data->cancellable,
+                                     download_resource_from_uri_async_write_cb,
+                                     segment);
+}
+
+/**
+ * download_resource_from_uri_async_write_cb:
+ * @object: a #GOutputStream
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadSegment
+ *
+ * Finishes writing a chunk and hands its buffer back to the
+ * #DownloadBufferPool, which lets a read that was held back go ahead. The
+ * chunk goes through the checksum while still in memory, the journal of a
+ * resumable download is saved every now and then, and written bytes are
+ * dropped from the page cache when the download bypasses it.
+ */
+static void
+download_resource_from_uri_async_write_cb (GObject      *object,
+                                           GAsyncResult *result,
+                                           gpointer      user_data)
+{
+    g_return_if_fail (G_IS_OUTPUT_STREAM (object));
+
+    GOutputStream *stream = G_OUTPUT_STREAM (object);
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+    gsize n_written = 0;
+    gint64 now = g_get_monotonic_time ();
+
+    segment->writing = FALSE;
+
+    data->metrics.n_writes++;
+    data->metrics.write_time += now - segment->write_start_time;
+
+    if (segment->blocked_since)
+    {
+        data->metrics.write_blocked_time += now - segment->blocked_since;
+        segment->blocked_since = 0;
+    }
+
+    if (segment->uring_write ?
+        !download_uring_write_finish (result, &n_written, &error) :
+        !g_output_stream_write_all_finish (stream, result, &n_written, &error))
+    {
+        g_warning ("Downloader ( %s ): stream write failed: %s",
+                   data->uri,
+                   error->message);
+
+        download_resource_data_set_error (data, error);
+    }
+    else if (segment->uring_sync)
+    {
+        data->synced = TRUE;
+    }
+
+    data->downloaded_bytes += n_written;
+    data->metrics.bytes_written += n_written;
+    segment->written = segment->write_chunk->offset + n_written;
+
+    if (!error)
+        download_resource_data_hash (data, segment->write_chunk);
+
+    if (!error && data->tail)
+        download_tail_commit (data->tail, download_resource_data_get_written_end (data, 0));
+
+    download_segment_chunk_free (segment, segment->write_chunk);
+    segment->write_chunk = NULL;
+
+    download_resource_data_progress (data, FALSE);
+    download_resource_data_save_journal (data, FALSE);
+    download_segment_drop_cache (segment, FALSE);
+
+    download_resource_from_uri_async_write (segment);
+    download_resource_from_uri_async_read (segment);
+    download_resource_from_uri_async_check_done (segment);
+}
+
+/**
+ * download_resource_from_uri_async_read_cb:
+ * @object: a #GInputStream
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadSegment
+ *
+ * Finishes reading a chunk from a #GInputStream that cannot be polled and
+ * passes it on to download_resource_from_uri_async_read_done(). When the
+ * segment ends and its last chunk is written
+ * download_resource_from_uri_async_read_close() is called.
+ */
+static void
+download_resource_from_uri_async_read_cb (GObject      *object,
+                                          GAsyncResult *result,
+                                          gpointer      user_data)
+{
+    g_return_if_fail (G_IS_INPUT_STREAM (object));
+
+    GInputStream *stream = G_INPUT_STREAM (object);
+    DownloadSegment *segment = user_data;
+    DownloadChunk *chunk = segment->read_chunk;
+    GError *error = NULL;
+    gssize nread;
+
+    segment->reading = FALSE;
+    segment->read_chunk = NULL;
+
+    nread = g_input_stream_read_finish (stream, result, &error);
+
+    download_resource_from_uri_async_read_done (segment, chunk, nread, error);
+    download_resource_from_uri_async_check_done (segment);
+}
+
+/**
+ * download_segment_start_reading:
+ * @segment: a #DownloadSegment with both streams open
+ *
+ * Starts the read loop of @segment.
+ */
+static void
+download_segment_start_reading (DownloadSegment *segment)
+{
+    segment->pollable = G_IS_POLLABLE_INPUT_STREAM (segment->input) &&
+                        g_pollable_input_stream_can_poll (G_POLLABLE_INPUT_STREAM (segment->input));
+
+    g_debug ("Downloader ( %s ): segment %u starting %s read...",
+             segment->data->uri,
+             segment->index,
+             segment->pollable ? "pollable" : "async");
+
+    download_resource_from_uri_async_read (segment);
+    download_resource_from_uri_async_check_done (segment);
+}
+
+/**
+ * download_resource_data_split:
+ * @data: a #DownloadResourceData whose first segment has its file open
+ *
+ * Sizes the file, if there is one, to the full length of the resource and
+ * splits the body into evenly sized segments. The first segment keeps the
+ * response it already has and stops at the end of its share, the others send
+ * their own #SoupRequest with a Range header.
+ */
+static void
+download_resource_data_split (DownloadResourceData *data)
+{
+    DownloadSegment *first = g_ptr_array_index (data->segments, 0);
+    goffset total = data->total_bytes;
+    goffset share;
+    GError *error = NULL;
+    guint n_segments;
+    guint i;
+
+    if (data->output && !g_seekable_truncate (G_SEEKABLE (data->output), total, data->cancellable, &error))
+    {
+        g_warning ("Downloader ( %s ): failed to size \"%s\", not splitting: %s", data->uri, data->path, error->message);
+        g_error_free (error);
+
+        data->segmented = FALSE;
+        return;
+    }
+
+    n_segments = MIN (data->max_segments, total / data->min_segment_size);
+    share = total / n_segments;
+
+    if (share > DOWNLOAD_SEGMENT_ALIGNMENT)
+        share -= share % DOWNLOAD_SEGMENT_ALIGNMENT;
+
+    g_debug ("Downloader ( %s ): splitting \"%" G_GOFFSET_FORMAT "\" bytes into %u segments", data->uri, total, n_segments);
+
+    first->end = share;
+
+    for (i = 1; i < n_segments; i++)
+    {
+        DownloadSegment *segment;
+
+        segment = download_segment_new (data,
+                                        i * share,
+                                        i == n_segments - 1 ? total : (i + 1) * share);
+
+        download_segment_send (segment);
+    }
+}
+
+/**
+ * download_resource_from_uri_async_preallocate_cb:
+ * @object: a #GOutputStream
+ * @result: a #GAsyncResult
+ * @user_data: the first #DownloadSegment
+ *
+ * Finishes reserving the blocks of @data->file, then splits the download if
+ * the response allowed it and starts reading. A filesystem that cannot
+ * preallocate only costs the layout of the file.
+ */
+static void
+download_resource_from_uri_async_preallocate_cb (GObject      *object,
+                                                 GAsyncResult *result,
+                                                 gpointer      user_data)
+{
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    if (!download_file_preallocate_finish (result, &error))
+    {
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+            download_resource_data_set_error (data, error);
+            download_resource_from_uri_async_check_done (segment);
+
+            return;
+        }
+
+        g_debug ("Downloader ( %s ): not preallocating \"%s\": %s", data->uri, data->path, error->message);
+        g_error_free (error);
+    }
+
+    if (data->segmented)
+        download_resource_data_split (data);
+
+    download_segment_start_reading (segment);
+}
+
+/**
+ * download_resource_data_open_tail:
+ * @data: a #DownloadResourceData whose output was just opened
+ * @named: whether the output writes to the file under its own name, which
+ *         g_file_replace() does not
+ *
+ * Gives the #DownloadTail of @data a read only descriptor on the file being
+ * written, and the bytes a resumed download already has on disk. Readers
+ * wait for the end of the download when none can be opened.
+ */
+static void
+download_resource_data_open_tail (DownloadResourceData *data,
+                                  gboolean              named)
+{
+    const gchar *path = data->part_path ? data->part_path : data->path;
+    gint fd;
+
+    fd = download_file_reopen (data->output);
+
+    if (fd < 0 && named)
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        g_debug ("Downloader ( %s ): readers wait for \"%s\" to be complete: %s", data->uri, path, g_strerror (errno));
+        return;
+    }
+
+    download_tail_open (data->tail, fd);
+    download_tail_commit (data->tail, download_resource_data_get_written_end (data, 0));
+}
+
+/**
+ * download_resource_from_uri_async_replace_cb:
+ * @object: a #GFile
+ * @result: a #GAsyncResult
+ * @user_data: the first #DownloadSegment
+ *
+ * Finishes opening @data->file for writing, preallocates it when its length
+ * is known, splits the download if the response allowed it and starts
+ * reading the #GInputStream of the #SoupRequest. Split and resumable
+ * downloads create the file rather than replace it, as g_file_replace()
+ * writes to a temporary file the other segments could not open.
+ */
+static void
+download_resource_from_uri_async_replace_cb (GObject      *object,
+                                             GAsyncResult *result,
+                                             gpointer      user_data)
+{
+    g_return_if_fail (G_IS_FILE (object));
+
+    GFile *file = G_FILE (object);
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    if (data->segmented || data->part_path)
+        data->output = G_OUTPUT_STREAM (g_file_create_finish (file, result, &error));
+    else
+        data->output = G_OUTPUT_STREAM (g_file_replace_finish (file, result, &error));
+
+    if (error)
+    {
+        g_warning ("Downloader ( %s ): failed to create output stream and file \"%s\": %s",
+                   data->uri,
+                   data->path,
+                   error->message);
+
+        download_resource_data_set_error (data, error);
+        download_resource_from_uri_async_check_done (segment);
+
+        return;
+    }
+
+    segment->output = g_object_ref (data->output);
+    segment->opened = TRUE;
+
+    if (data->tail)
+        download_resource_data_open_tail (data, data->segmented || data->part_path);
+
+    if (data->preallocate && data->total_bytes > 0)
+    {
+        download_file_preallocate_async (data->output,
+                                         data->total_bytes,
+                                         data->cancellable,
+                                         download_resource_from_uri_async_preallocate_cb,
+                                         segment);
+        return;
+    }
+
+    if (data->segmented)
+        download_resource_data_split (data);
+
+    download_segment_start_reading (segment);
+}
+
+/**
+ * download_resource_from_uri_async_delete_cb:
+ * @object: a #GFile
+ * @result: a #GAsyncResult
+ * @user_data: the first #DownloadSegment
+ *
+ * Finishes removing an earlier copy of @data->file for a split or resumable
+ * download and creates the file with a #GCallback to
+ * download_resource_from_uri_async_replace_cb().
+ */
+static void
+download_resource_from_uri_async_delete_cb (GObject      *object,
+                                            GAsyncResult *result,
+                                            gpointer      user_data)
+{
+    g_return_if_fail (G_IS_FILE (object));
+
+    GFile *file = G_FILE (object);
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    if (!g_file_delete_finish (file, result, &error) &&
+        !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+        g_warning ("Downloader ( %s ): failed to remove \"%s\": %s",
+                   data->uri,
+                   data->path,
+                   error->message);
+
+        download_resource_data_set_error (data, error);
+        download_resource_from_uri_async_check_done (segment);
+
+        return;
+    }
+
+    g_clear_error (&error);
+
+    g_file_create_async (file,
+                         G_FILE_CREATE_NONE,
+                         G_PRIORITY_DEFAULT,
+                         data->cancellable,
+                         download_resource_from_uri_async_replace_cb,
+                         segment);
+}
+
+/**
+ * download_resource_from_uri_async_open_cb:
+ * @object: a #GFile
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadSegment
+ *
+ * Finishes opening another handle on @data->file for a segment of a split
+ * or resumed download, moves it to the first byte of the segment and starts
+ * reading.
+ */
+static void
+download_resource_from_uri_async_open_cb (GObject      *object,
+                                          GAsyncResult *result,
+                                          gpointer      user_data)
+{
+    g_return_if_fail (G_IS_FILE (object));
+
+    GFile *file = G_FILE (object);
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    segment->io_stream = G_IO_STREAM (g_file_open_readwrite_finish (file, result, &error));
+
+    if (!error)
+        g_seekable_seek (G_SEEKABLE (segment->io_stream), segment->offset, G_SEEK_SET, NULL, &error);
+
+    if (error)
+    {
+        g_warning ("Downloader ( %s ): failed to open \"%s\" for segment %u: %s",
+                   data->uri,
+                   data->path,
+                   segment->index,
+                   error->message);
+
+        download_resource_data_set_error (data, error);
+        download_resource_from_uri_async_check_done (segment);
+
+        return;
+    }
+
+    segment->output = g_object_ref (g_io_stream_get_output_stream (segment->io_stream));
+    segment->opened = TRUE;
+
+    if (!data->output)
+    {
+        data->output = g_object_ref (segment->output);
+
+        if (data->tail)
+            download_resource_data_open_tail (data, TRUE);
+    }
+
+    download_segment_start_reading (segment);
+}
+
+/**
+ * download_resource_data_can_split:
+ * @data: a #DownloadResourceData
+ * @request: the #SoupRequest of the first segment, with its response
+ *
+ * Checks whether the body of @request can be fetched as several ranges: the
+ * download asks for more than one segment, the server sent the whole body,
+ * announced its length and advertised byte ranges with Accept-Ranges.
+ *
+ * Returns: %TRUE if the download can be split
+ */
+static gboolean
+download_resource_data_can_split (DownloadResourceData *data,
+                                  SoupRequest          *request)
+{
+    SoupMessage *message;
+    gboolean can_split;
+
+    if (data->max_segments < 2 || !data->accepts_ranges || !SOUP_IS_REQUEST_HTTP (request))
+        return FALSE;
+
+    if (data->total_bytes < 2 * (guint64) data->min_segment_size)
+        return FALSE;
+
+    message = soup_request_http_get_message (SOUP_REQUEST_HTTP (request));
+    can_split = message->status_code == SOUP_STATUS_OK;
+    g_object_unref (message);
+
+    return can_split;
+}
+
+/**
+ * download_resource_data_open_memory:
+ * @data: a #DownloadResourceData that does not save to a file
+ * @segment: a #DownloadSegment, with its response
+ * @request: the #SoupRequest of @segment
+ *
+ * Gets @segment ready to read without a file. For the first segment of a
+ * download to memory whose length is known that means one buffer of that
+ * length, which the segments then read into in place and which can be split
+ * like a file. Without a length the bytes collect into a #GByteArray. A
+ * download to the chunk handler needs neither.
+ */
+static void
+download_resource_data_open_memory (DownloadResourceData *data,
+                                    DownloadSegment      *segment,
+                                    SoupRequest          *request)
+{
+    goffset length;
+
+    segment->opened = TRUE;
+
+    if (segment->index > 0)
+    {
+        download_segment_start_reading (segment);
+        return;
+    }
+
+    length = data->decoding ? -1 : soup_request_get_content_length (request);
+
+    data->total_bytes = MAX (length, 0);
+    data->segmented = download_resource_data_can_split (data, request);
+
+    if (data->target != DOWNLOAD_TARGET_CHUNKS && length > 0 && (guint64) length <= G_MAXSIZE)
+    {
+        data->memory = g_try_malloc (length);
+
+        if (!data->memory)
+        {
+            g_warning ("Downloader ( %s ): cannot hold \"%" G_GOFFSET_FORMAT "\" bytes in memory", data->uri, length);
+
+            download_resource_data_set_error (data,
+                                              g_error_new (G_IO_ERROR,
+                                                           G_IO_ERROR_NO_SPACE,
+                                                           "Not enough memory for %" G_GOFFSET_FORMAT " bytes",
+                                                           length));
+            download_resource_from_uri_async_check_done (segment);
+
+            return;
+        }
+
+        segment->end = length;
+    }
+    else if (data->target != DOWNLOAD_TARGET_CHUNKS)
+    {
+        data->memory_array = g_byte_array_new ();
+        data->segmented = FALSE;
+    }
+
+    if (data->segmented)
+        download_resource_data_split (data);
+
+    download_segment_start_reading (segment);
+}
+
+/**
+ * download_resource_data_read_headers:
+ * @data: a #DownloadResourceData
+ * @request: the #SoupRequest of the first segment, with its response
+ *
+ * Remembers the address @request ended up at after redirects, the ETag and
+ * Last-Modified validators of the response and whether the server takes
+ * Range requests, everything later requests for the same resource need to
+ * ask for part of it.
+ */
+static void
+download_resource_data_read_headers (DownloadResourceData *data,
+                                     SoupRequest          *request)
+{
+    SoupMessage *message;
+    const gchar *accept_ranges;
+    const gchar *etag;
+    const gchar *last_modified;
+
+    if (!SOUP_IS_REQUEST_HTTP (request))
+        return;
+
+    message = soup_request_http_get_message (SOUP_REQUEST_HTTP (request));
+
+    g_free (data->final_uri);
+    data->final_uri = soup_uri_to_string (soup_message_get_uri (message), FALSE);
+
+    accept_ranges = soup_message_headers_get_list (message->response_headers, "Accept-Ranges");
+
+    data->accepts_ranges = message->status_code == SOUP_STATUS_PARTIAL_CONTENT ||
+                           (accept_ranges != NULL && soup_header_contains (accept_ranges, "bytes"));
+
+    // Weak validators may not be used with If-Range
+    etag = soup_message_headers_get_one (message->response_headers, "ETag");
+
+    if (etag && !g_str_has_prefix (etag, "W/"))
+    {
+        g_free (data->etag);
+        data->etag = g_strdup (etag);
+    }
+
+    last_modified = soup_message_headers_get_one (message->response_headers, "Last-Modified");
+
+    if (last_modified)
+    {
+        g_free (data->last_modified);
+        data->last_modified = g_strdup (last_modified);
+    }
+
+    data->validator_mirror = data->mirror;
+
+    g_object_unref (message);
+}
+
+/**
+ * download_segment_get_status:
+ * @segment: a #DownloadSegment with a response
+ *
+ * Gets the HTTP status of the response of @segment.
+ *
+ * Returns: the status code, or 0 if @segment does not use HTTP
+ */
+static guint
+download_segment_get_status (DownloadSegment *segment)
+{
+    SoupMessage *message;
+    guint status;
+
+    if (!SOUP_IS_REQUEST_HTTP (segment->request))
+        return 0;
+
+    message = soup_request_http_get_message (SOUP_REQUEST_HTTP (segment->request));
+    status = message->status_code;
+    g_object_unref (message);
+
+    return status;
+}
+
+/**
+ * download_resource_data_restart:
+ * @data: a resumed #DownloadResourceData
+ * @segment: the first #DownloadSegment, answered with the whole body
+ *
+ * Forgets what the journal of @data recorded once If-Range showed that the
+ * resource changed since. @segment then carries on as the first segment of a
+ * fresh download.
+ */
+static void
+download_resource_data_restart (DownloadResourceData *data,
+                                DownloadSegment      *segment)
+{
+    g_debug ("Downloader ( %s ): resource changed since \"%s\" was written, starting over", data->uri, data->part_path);
+
+    download_journal_clear (data->journal);
+
+    g_clear_pointer (&data->etag, g_free);
+    g_clear_pointer (&data->last_modified, g_free);
+
+    while (!g_queue_is_empty (&data->pending_ranges))
+        g_slice_free (DownloadRange, g_queue_pop_head (&data->pending_ranges));
+
+    data->resumed = FALSE;
+    data->segmented = FALSE;
+    data->downloaded_bytes = 0;
+    data->hash_offset = 0;
+
+    if (data->checksum)
+        download_checksum_reset (data->checksum);
+
+    segment->start = 0;
+    segment->written = 0;
+    segment->dropped = 0;
+    segment->offset = 0;
+    segment->end = -1;
+    segment->ranged = FALSE;
+}
+
+/**
+ * download_resource_data_resume:
+ * @data: a resumed #DownloadResourceData
+ *
+ * Starts segments for the ranges still missing once the first one was
+ * answered, up to @data->max_segments at once. The others start as these
+ * finish.
+ */
+static void
+download_resource_data_resume (DownloadResourceData *data)
+{
+    guint i;
+
+    for (i = 1; i < data->max_segments; i++)
+    {
+        if (!download_resource_data_next_range (data))
+            break;
+    }
+}
+
+/**
+ * download_segment_check_range:
+ * @segment: a #DownloadSegment
+ * @error: return location for a #GError
+ *
+ * Checks that the server answered the Range request of @segment with the
+ * bytes it asked for. Server errors are reported in the %SOUP_HTTP_ERROR
+ * domain so that download_segment_can_retry() tries again, a whole body in
+ * answer to If-Range means the resource changed and fails with
+ * %G_IO_ERROR_WRONG_ETAG.
+ *
+ * Returns: %TRUE if the response starts at the first byte of @segment
+ */
+static gboolean
+download_segment_check_range (DownloadSegment  *segment,
+                              GError          **error)
+{
+    SoupMessage *message;
+    goffset start = -1;
+    goffset end = -1;
+    gboolean valid;
+
+    message = soup_request_http_get_message (SOUP_REQUEST_HTTP (segment->request));
+
+    valid = message->status_code == SOUP_STATUS_PARTIAL_CONTENT &&
+            soup_message_headers_get_content_range (message->response_headers, &start, &end, NULL) &&
+            start == segment->offset;
+
+    if (valid)
+    {
+        segment->data->accepts_ranges = TRUE;
+    }
+    else if (SOUP_STATUS_IS_SERVER_ERROR (message->status_code) ||
+             message->status_code == SOUP_STATUS_REQUEST_TIMEOUT)
+    {
+        g_set_error (error,
+                     SOUP_HTTP_ERROR,
+                     message->status_code,
+                     "Server answered range %" G_GOFFSET_FORMAT " .. %" G_GOFFSET_FORMAT " with status %u",
+                     segment->offset,
+                     segment->end - 1,
+                     message->status_code);
+    }
+    else if (message->status_code == SOUP_STATUS_OK &&
+             soup_message_headers_get_one (message->request_headers, "If-Range"))
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_WRONG_ETAG,
+                     "\"%s\" changed on the server during the download",
+                     segment->data->uri);
+    }
+    else
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_NOT_SUPPORTED,
+                     "Server answered range %" G_GOFFSET_FORMAT " .. %" G_GOFFSET_FORMAT " with status %u",
+                     segment->offset,
+                     segment->end - 1,
+                     message->status_code);
+    }
+
+    g_object_unref (message);
+
+    return valid;
+}
+
+/**
+ * download_resource_data_hit_cache:
+ * @data: a #DownloadResourceData
+ * @segment: the first #DownloadSegment, answered with 304 Not Modified
+ *
+ * Completes a download whose file the server confirmed is still fresh. The
+ * file is left alone and its digest, if one was asked for, is the one the
+ * cache recorded.
+ */
+static void
+download_resource_data_hit_cache (DownloadResourceData *data,
+                                  DownloadSegment      *segment)
+{
+    g_debug ("Downloader ( %s ): \"%s\" is still fresh, nothing to download", data->uri, data->path);
+
+    data->cache_hit = TRUE;
+    data->total_bytes = data->cache_entry->size;
+    data->downloaded_bytes = data->cache_entry->size;
+
+    if (data->checksum)
+    {
+        data->digest = g_strdup (data->cache_entry->digest);
+        data->verified = TRUE;
+    }
+
+    download_cache_touch (data->cache, data->uri);
+
+    segment->eof = TRUE;
+    download_resource_from_uri_async_check_done (segment);
+}
+
+/**
+ * download_segment_wrap_decoder:
+ * @segment: a #DownloadSegment
+ * @encoding: a #DownloadEncoding other than identity
+ * @error: return location for a #GError
+ *
+ * Makes @segment read its input through a decoder of @encoding.
+ *
+ * Returns: %TRUE if @encoding is decoded by this build
+ */
+static gboolean
+download_segment_wrap_decoder (DownloadSegment   *segment,
+                               DownloadEncoding   encoding,
+                               GError           **error)
+{
+    GConverter *converter = download_decoder_new (encoding);
+    GInputStream *input;
+
+    if (!converter)
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_NOT_SUPPORTED,
+                     "%s encoded bodies are not supported by this build",
+                     download_encoding_get_name (encoding));
+
+        return FALSE;
+    }
+
+    g_debug ("Downloader ( %s ): decoding %s", segment->data->uri, download_encoding_get_name (encoding));
+
+    input = g_converter_input_stream_new (segment->input, converter);
+    g_object_unref (converter);
+
+    g_object_unref (segment->input);
+    segment->input = input;
+
+    segment->data->decoding = TRUE;
+
+    return TRUE;
+}
+
+/**
+ * download_segment_decode:
+ * @segment: a #DownloadSegment of a download that decodes
+ * @request: the #SoupRequest of @segment, with a response
+ * @error: return location for a #GError
+ *
+ * Wraps the input of @segment in the decoders its response needs: the
+ * Content-Encoding first, then the compression of the resource itself. A
+ * compressed file served with that same compression as Content-Encoding is
+ * only compressed once, whatever the server meant. Encodings this build
+ * does not decode fail the download rather than write compressed bytes.
+ *
+ * Returns: %TRUE if @segment reads decoded bytes
+ */
+static gboolean
+download_segment_decode (DownloadSegment  *segment,
+                         SoupRequest      *request,
+                         GError          **error)
+{
+    DownloadResourceData *data = segment->data;
+    DownloadEncoding content = DOWNLOAD_ENCODING_IDENTITY;
+    DownloadEncoding resource = DOWNLOAD_ENCODING_IDENTITY;
+    SoupMessage *message;
+
+    if ((data->decode & DOWNLOAD_DECODE_CONTENT) && SOUP_IS_REQUEST_HTTP (request))
+    {
+        message = soup_request_http_get_message (SOUP_REQUEST_HTTP (request));
+        content = download_encoding_from_header (soup_message_headers_get_list (message->response_headers, "Content-Encoding"));
+        g_object_unref (message);
+    }
+
+    if (data->decode & DOWNLOAD_DECODE_RESOURCE)
+        resource = download_encoding_from_resource (soup_request_get_uri (request)->path, soup_request_get_content_type (request));
+
+    if (resource == content)
+        resource = DOWNLOAD_ENCODING_IDENTITY;
+
+    if (content != DOWNLOAD_ENCODING_IDENTITY && !download_segment_wrap_decoder (segment, content, error))
+        return FALSE;
+
+    if (resource != DOWNLOAD_ENCODING_IDENTITY && !download_segment_wrap_decoder (segment, resource, error))
+        return FALSE;
+
+    return TRUE;
+}
+
+/**
+ * download_resource_from_uri_async_cb:
+ * @object: a #SoupRequest
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadSegment
+ *
+ * After a successful #SoupRequest async callback a #GInputStream is returned.
+ * For the first segment of a fresh download @data->file is then opened for
+ * writing with g_file_replace_async(), so the filesystem never blocks the
+ * #GMainContext, with a #GCallback to
+ * download_resource_from_uri_async_replace_cb(). The other segments of a
+ * split download, and every segment of a resumed one, open their own handle
+ * on the file with a #GCallback to download_resource_from_uri_async_open_cb().
+ * Downloads that do not save to a file go to
+ * download_resource_data_open_memory() instead. A segment that reconnected
+ * already has its file open and reads on.
+ */
+static void
+download_resource_from_uri_async_cb (GObject      *object,
+                                     GAsyncResult *result,
+                                     gpointer      user_data)
+{
+    g_return_if_fail (SOUP_IS_REQUEST (object));
+
+    SoupRequest *request = SOUP_REQUEST (object);
+    DownloadSegment *segment = user_data;
+    DownloadResourceData *data = segment->data;
+    GError *error = NULL;
+
+    g_debug ("Downloader ( %s ): segment %u starting async fetch...", data->uri, segment->index);
+
+    segment->connecting = FALSE;
+    segment->input = soup_request_send_finish (request, result, &error);
+
+    if (!error && data->metrics.response_time == 0)
+        data->metrics.response_time = g_get_monotonic_time ();
+
+    // Another segment failed while this one was connecting
+    if (data->error)
+    {
+        g_clear_error (&error);
+        download_resource_from_uri_async_check_done (segment);
+
+        return;
+    }
+
+    if (!error && data->cache_entry && segment->index == 0 && !segment->opened &&
+        download_segment_get_status (segment) == SOUP_STATUS_NOT_MODIFIED)
+    {
+        download_resource_data_hit_cache (data, segment);
+        return;
+    }
+
+    if (!error && data->resumed && segment->index == 0 && !segment->output &&
+        download_segment_get_status (segment) == SOUP_STATUS_OK)
+        download_resource_data_restart (data, segment);
+
+    if (!error && segment->ranged)
+        download_segment_check_range (segment, &error);
+
+    if (error && data->mirrors && download_segment_leave_mirror (segment, error))
+        return;
+
+    if (error && download_segment_can_retry (segment, error))
+    {
+        download_segment_reconnect (segment, error);
+        return;
+    }
+
+    if (error)
+    {
+        g_warning ("Downloader ( %s ): failed to start resource: %s",
+                   data->uri,
+                   error->message);
+
+        download_resource_data_set_error (data, error);
+        download_resource_from_uri_async_check_done (segment);
+
+        return;
+    }
+
+    if (data->decode && !download_segment_decode (segment, request, &error))
+    {
+        g_warning ("Downloader ( %s ): %s", data->uri, error->message);
+
+        download_resource_data_set_error (data, error);
+        download_resource_from_uri_async_check_done (segment);
+
+        return;
+    }
+
+    if (segment->opened)
+    {
+        g_debug ("Downloader ( %s ): segment %u reconnected at \"%" G_GOFFSET_FORMAT "\"", data->uri, segment->index, segment->offset);
+
+        download_segment_start_reading (segment);
+        return;
+    }
+
+    if (segment->index == 0)
+        download_resource_data_read_headers (data, request);
+
+    if (data->target != DOWNLOAD_TARGET_FILE)
+    {
+        download_resource_data_open_memory (data, segment, request);
+        return;
+    }
+
+    if (segment->index > 0 || data->resumed)
+    {
+        if (segment->index == 0)
+            download_resource_data_resume (data);
+
+        g_file_open_readwrite_async (data->file,
+                                     G_PRIORITY_DEFAULT,
+                                     data->cancellable,
+                                     download_resource_from_uri_async_open_cb,
+                                     segment);
+        return;
+    }
+
+    data->total_bytes = data->decoding ? 0 : MAX (soup_request_get_content_length (request), 0);
+    data->segmented = download_resource_data_can_split (data, request);
+
+    if (data->segmented || data->part_path)
+    {
+        g_file_delete_async (data->file,
+                             G_PRIORITY_DEFAULT,
+                             data->cancellable,
+                             download_resource_from_uri_async_delete_cb,
+                             segment);
+        return;
+    }
+
+    g_file_replace_async (data->file,
+                          NULL,
+                          FALSE,
+                          G_FILE_CREATE_NONE,
+                          G_PRIORITY_DEFAULT,
+                          data->cancellable,
+                          download_resource_from_uri_async_replace_cb,
+                          segment);
+}
+
+/**
+ * download_segment_network_event_cb:
+ * @message: the #SoupMessage of a segment
+ * @event: the #GSocketClientEvent that happened
+ * @connection: the connection @event concerns
+ * @user_data: a #DownloadResourceData
+ *
+ * Notes when name resolution, the connection and the TLS handshake of a
+ * new connection start and end in the #DownloadMetrics of @user_data. A
+ * request that reuses a kept-alive connection emits none of these.
+ */
+static void
+download_segment_network_event_cb (SoupMessage        *message,
+                                   GSocketClientEvent  event,
+                                   GIOStream          *connection,
+                                   gpointer            user_data)
+{
+    DownloadResourceData *data = user_data;
+    DownloadMetrics *metrics = &data->metrics;
+    gint64 *time = NULL;
+
+    switch (event)
+    {
+        case G_SOCKET_CLIENT_RESOLVING:
+            time = &metrics->resolve_start_time;
+            break;
+
+        case G_SOCKET_CLIENT_RESOLVED:
+            time = &metrics->resolve_end_time;
+            break;
+
+        case G_SOCKET_CLIENT_CONNECTING:
+            time = &metrics->connect_start_time;
+            break;
+
+        case G_SOCKET_CLIENT_CONNECTED:
+            time = &metrics->connect_end_time;
+            break;
+
+        case G_SOCKET_CLIENT_TLS_HANDSHAKING:
+            time = &metrics->tls_start_time;
+            break;
+
+        case G_SOCKET_CLIENT_TLS_HANDSHAKED:
+            time = &metrics->tls_end_time;
+            break;
+
+        case G_SOCKET_CLIENT_COMPLETE:
+            metrics->n_connections++;
+            break;
+
+        default:
+            break;
+    }
+
+    if (time && *time == 0)
+        *time = g_get_monotonic_time ();
+}
+
+/**
+ * download_resource_data_get_source:
+ * @data: a #DownloadResourceData
+ *
+ * Gets the uri new requests of @data go to: where redirects led the first
+ * one, or else the mirror in use.
+ *
+ * Returns: (transfer none): the uri to request
+ */
+static const gchar *
+download_resource_data_get_source (DownloadResourceData *data)
+{
+    if (data->final_uri)
+        return data->final_uri;
+
+    if (data->mirrors)
+        return data->mirrors[data->mirror].uri;
+
+    return data->uri;
+}
+
+/**
+ * download_segment_send:
+ * @segment: a #DownloadSegment
+ *
+ * Sends the #SoupRequest of @segment, creating one if it has none, with a
+ * #GCallback to download_resource_from_uri_async_cb(). A segment that is not
+ * the whole body asks for its bytes with Range and If-Range, and the first
+ * request of a cached download is made conditional. Requests go to the
+ * address the first segment was redirected to.
+ */
+static void
+download_segment_send (DownloadSegment *segment)
+{
+    DownloadResourceData *data = segment->data;
+    SoupMessage *message;
+    GError *error = NULL;
+
+    if (!segment->request)
+        segment->request = soup_session_request (data->session, download_resource_data_get_source (data), &error);
+
+    segment->mirror = data->mirror;
+
+    if (error)
+    {
+        download_resource_data_set_error (data, error);
+        download_resource_from_uri_async_check_done (segment);
+
+        return;
+    }
+
+    segment->ranged = SOUP_IS_REQUEST_HTTP (segment->request) && (segment->offset > 0 || segment->end >= 0);
+    segment->connecting = TRUE;
+
+    if (data->metrics.send_time == 0)
+        data->metrics.send_time = g_get_monotonic_time ();
+
+    if (SOUP_IS_REQUEST_HTTP (segment->request))
+    {
+        message = soup_request_http_get_message (SOUP_REQUEST_HTTP (segment->request));
+
+        g_signal_connect (message,
+                          "network-event",
+                          G_CALLBACK (download_segment_network_event_cb),
+                          data);
+
+        // The encodings are undone by download_segment_decode() instead
+        if (data->decode & DOWNLOAD_DECODE_CONTENT)
+        {
+            soup_message_disable_feature (message, SOUP_TYPE_CONTENT_DECODER);
+            soup_message_headers_replace (message->request_headers,
+                                          "Accept-Encoding",
+                                          download_decoder_get_accept_encoding ());
+        }
+
+        g_object_unref (message);
+    }
+
+    if (segment->ranged)
+    {
+        message = soup_request_http_get_message (SOUP_REQUEST_HTTP (segment->request));
+
+        soup_message_headers_set_range (message->request_headers,
+                                        segment->offset,
+                                        segment->end >= 0 ? segment->end - 1 : -1);
+
+        // The validators of one mirror mean nothing to another
+        if (!data->mirrors || segment->mirror == data->validator_mirror)
+        {
+            if (data->etag)
+                soup_message_headers_replace (message->request_headers, "If-Range", data->etag);
+            else if (data->last_modified)
+                soup_message_headers_replace (message->request_headers, "If-Range", data->last_modified);
+        }
+
+        g_object_unref (message);
+    }
+    else if (data->cache_entry && segment->index == 0 && !segment->opened && SOUP_IS_REQUEST_HTTP (segment->request))
+    {
+        message = soup_request_http_get_message (SOUP_REQUEST_HTTP (segment->request));
+
+        if (data->cache_entry->etag)
+            soup_message_headers_replace (message->request_headers, "If-None-Match", data->cache_entry->etag);
+
+        if (data->cache_entry->last_modified)
+            soup_message_headers_replace (message->request_headers, "If-Modified-Since", data->cache_entry->last_modified);
+
+        g_object_unref (message);
+    }
+
+    soup_request_send_async (segment->request,
+                             data->cancellable,
+                             download_resource_from_uri_async_cb,
+                             segment);
+}
+
+/**
+ * download_resource_data_plan_resume:
+ * @data: a resumed #DownloadResourceData
+ *
+ * Queues the ranges the journal of @data misses, splitting the largest ones
+ * until there is one for each of @data->max_segments as long as the halves
+ * stay above @data->min_segment_size.
+ */
+static void
+download_resource_data_plan_resume (DownloadResourceData *data)
+{
+    GArray *missing;
+    guint i;
+
+    missing = download_journal_get_missing (data->journal);
+
+    while (missing->len < data->max_segments)
+    {
+        DownloadRange *largest = NULL;
+        DownloadRange second;
+        goffset middle;
+        guint index = 0;
+
+        for (i = 0; i < missing->len; i++)
+        {
+            DownloadRange *range = &g_array_index (missing, DownloadRange, i);
+
+            if (range->end < 0 || range->end - range->start < 2 * data->min_segment_size)
+                continue;
+
+            if (!largest || range->end - range->start > largest->end - largest->start)
+            {
+                largest = range;
+                index = i;
+            }
+        }
+
+        if (!largest)
+            break;
+
+        middle = largest->start + (largest->end - largest->start) / 2;
+
+        if (middle - middle % DOWNLOAD_SEGMENT_ALIGNMENT > largest->start)
+            middle -= middle % DOWNLOAD_SEGMENT_ALIGNMENT;
+
+        second.start = middle;
+        second.end = largest->end;
+        largest->end = middle;
+
+        g_array_insert_val (missing, index + 1, second);
+    }
+
+    for (i = 0; i < missing->len; i++)
+    {
+        DownloadRange *range = g_slice_new (DownloadRange);
+
+        *range = g_array_index (missing, DownloadRange, i);
+        g_queue_push_tail (&data->pending_ranges, range);
+    }
+
+    g_array_unref (missing);
+}
+
+/**
+ * download_resource_data_race_cb:
+ * @object: %NULL
+ * @result: the #GAsyncResult of download_mirrors_race_async()
+ * @user_data: a #DownloadResourceData
+ *
+ * Starts a download from the mirror that won the race. When none sent
+ * anything the download goes to its own uri anyway, to fail with the error
+ * of the transfer.
+ */
+static void
+download_resource_data_race_cb (GObject      *object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+    GError *error = NULL;
+    gint best;
+
+    best = download_mirrors_race_finish (result, &error);
+
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+        download_resource_data_fail (data, error);
+        download_resource_data_unref (data);
+
+        return;
+    }
+
+    if (error)
+    {
+        g_warning ("Downloader ( %s ): no mirror won the race: %s", data->uri, error->message);
+        g_error_free (error);
+
+        best = 0;
+    }
+
+    if (best != data->mirror)
+    {
+        SoupRequest *request = soup_session_request (data->session, data->mirrors[best].uri, &error);
+
+        if (error)
+        {
+            download_resource_data_fail (data, error);
+            download_resource_data_unref (data);
+
+            return;
+        }
+
+        g_object_unref (data->request);
+        data->request = request;
+        data->mirror = best;
+    }
+
+    g_debug ("Downloader ( %s ): downloading from %s at %.0f B/s", data->uri, data->mirrors[best].uri, data->mirrors[best].probe_rate);
+
+    download_resource_data_begin (data);
+    download_resource_data_unref (data);
+}
+
+/**
+ * download_resource_data_begin:
+ * @data: a #DownloadResourceData
+ *
+ * Sends the #SoupRequest of @data once its #DownloadManager gave it a slot,
+ * as the first #DownloadSegment, with a #GCallback to
+ * download_resource_from_uri_async_cb(). A resumed download asks for the
+ * first range its journal misses, the others follow once the server showed
+ * the resource did not change. A download with mirrors races them first,
+ * see download-mirrors.
+ */
+void
+download_resource_data_begin (DownloadResourceData *data)
+{
+    DownloadSegment *segment;
+    DownloadRange *range;
+
+    if (data->metrics.admit_time == 0)
+        data->metrics.admit_time = g_get_monotonic_time ();
+
+    if (data->mirrors && !data->raced)
+    {
+        data->raced = TRUE;
+
+        download_mirrors_race_async (data->session,
+                                     data->mirrors,
+                                     data->n_mirrors,
+                                     data->cancellable,
+                                     download_resource_data_race_cb,
+                                     download_resource_data_ref (data));
+        return;
+    }
+
+    g_debug ("Downloader ( %s ): soup request started", data->uri);
+
+    if (data->resumed && !SOUP_IS_REQUEST_HTTP (data->request))
+    {
+        download_journal_clear (data->journal);
+
+        data->resumed = FALSE;
+        data->segmented = FALSE;
+        data->downloaded_bytes = 0;
+    }
+
+    if (data->resumed)
+    {
+        download_resource_data_plan_resume (data);
+
+        range = g_queue_pop_head (&data->pending_ranges);
+
+        if (!range)
+        {
+            g_debug ("Downloader ( %s ): \"%s\" is already complete", data->uri, data->part_path);
+
+            download_resource_data_finish (data);
+            return;
+        }
+
+        segment = download_segment_new (data, range->start, range->end);
+        g_slice_free (DownloadRange, range);
+    }
+    else
+    {
+        segment = download_segment_new (data, 0, -1);
+    }
+
+    segment->request = g_object_ref (data->request);
+
+    download_segment_send (segment);
+}
+
+/**
+ * download_resolve_path:
+ * @uri: a uri to a resource to download
+ * @path: (nullable): a path to save the @uri resource to
+ *
+ * Works out where @uri is saved to. If @path is %NULL then the @uri will be
+ * saved into %G_USER_DIRECTORY_DOWNLOAD (a.k.a ~/Downloads). If @path ends in a
+ * slash (/) then the path is treated as a directory, created if missing. In
+ * both cases the file will be named the basename of @uri.
+ *
+ * Returns: (transfer full): the path of the file to write
+ */
+static gchar *
+download_resolve_path (const gchar *uri,
+                       const gchar *path)
+{
+    gchar *basename;
+    gchar *resolved;
+
+    if (path != NULL && !g_str_has_suffix (path, "/"))
+        return g_strdup (path);
+
+    basename = g_path_get_basename (uri);
+
+    if (path == NULL)
+    {
+        resolved =
+            g_build_filename (g_get_user_special_dir (G_USER_DIRECTORY_DOWNLOAD),
+                              basename,
+                              NULL);
+    }
+    else
+    {
+        if (!g_file_test (path, G_FILE_TEST_IS_DIR))
+        {
+            g_mkdir_with_parents (path, 0700);
+        }
+
+        resolved = g_build_filename (path, basename, NULL);
+    }
+
+    g_free (basename);
+
+    return resolved;
+}
+
+/**
+ * download_resource_data_cancelled_cb:
+ * @cancellable: the #GCancellable given to download_start()
+ * @user_data: a #DownloadResourceData
+ *
+ * Forwards the cancellation of the caller to the internal #GCancellable of
+ * @user_data, and takes it out of the flight it follows.
+ */
+static void
+download_resource_data_cancelled_cb (GCancellable *cancellable,
+                                     gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+
+    g_cancellable_cancel (data->cancellable);
+
+    if (data->leader)
+        download_resource_data_leave_flight (data);
+}
+
+/**
+ * download_resource_data_load_journal:
+ * @data: a #DownloadResourceData of a resumable download
+ *
+ * Reads the journal an earlier attempt left next to @data->part_path. A
+ * journal that is missing, unreadable, written for another uri, without a
+ * validator to check the resource against or whose ".part" file is gone is
+ * replaced by an empty one and the download starts over.
+ */
+static void
+download_resource_data_load_journal (DownloadResourceData *data)
+{
+    DownloadJournal *journal;
+    gchar *journal_path;
+    GError *error = NULL;
+
+    journal_path = g_strconcat (data->part_path, ".journal", NULL);
+    journal = download_journal_load (journal_path, data->uri, &error);
+
+    if (error)
+    {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_debug ("Downloader ( %s ): ignoring journal: %s", data->uri, error->message);
+
+        g_error_free (error);
+    }
+    else if ((!journal->etag && !journal->last_modified) ||
+             !g_file_test (data->part_path, G_FILE_TEST_IS_REGULAR))
+    {
+        g_debug ("Downloader ( %s ): ignoring journal \"%s\", \"%s\" cannot be checked", data->uri, journal_path, data->part_path);
+
+        download_journal_free (journal);
+        journal = NULL;
+    }
+    else if (journal->ranges->len > 0)
+    {
+        data->resumed = TRUE;
+        data->segmented = journal->total > 0;
+        data->accepts_ranges = TRUE;
+        data->etag = g_strdup (journal->etag);
+        data->last_modified = g_strdup (journal->last_modified);
+        data->total_bytes = journal->total;
+        data->downloaded_bytes = download_journal_get_n_bytes (journal);
+
+        g_debug ("Downloader ( %s ): resuming \"%s\" with \"%" G_GUINT64_FORMAT "\" bytes written",
+                 data->uri, data->part_path, data->downloaded_bytes);
+    }
+
+    data->journal = journal ? journal : download_journal_new (journal_path, data->uri);
+
+    g_free (journal_path);
+}
+
+/**
+ * download_resource_data_lookup_cache:
+ * @data: a #DownloadResourceData saving to a file
+ * @cache: the #DownloadCache of @data
+ *
+ * Finds what @cache knows of the file of @data. An entry is of no use when
+ * the download asks for a digest it cannot vouch for, its file is then
+ * fetched again.
+ */
+static void
+download_resource_data_lookup_cache (DownloadResourceData *data,
+                                     DownloadCache        *cache)
+{
+    DownloadCacheEntry *entry;
+
+    data->cache = download_cache_ref (cache);
+
+    entry = download_cache_lookup (cache, data->uri, data->path);
+
+    if (entry && data->checksum &&
+        (entry->checksum != download_checksum_get_checksum_type (data->checksum) || !entry->digest ||
+         (data->expected_digest && g_ascii_strcasecmp (entry->digest, data->expected_digest) != 0)))
+    {
+        g_debug ("Downloader ( %s ): cached digest of \"%s\" does not fit, downloading again", data->uri, data->path);
+
+        download_cache_entry_free (entry);
+        entry = NULL;
+    }
+
+    data->cache_entry = entry;
+}
+
+/**
+ * download_resource_data_probe_cb:
+ * @source_object: the #SoupSession
+ * @result: the #GAsyncResult of the HEAD request
+ * @user_data: a #DownloadResourceData
+ *
+ * Takes the expected size of a download from the Content-Length of its HEAD
+ * request, then queues it in its #DownloadManager. A failed probe only
+ * leaves the size unknown, unless the download was cancelled meanwhile.
+ */
+static void
+download_resource_data_probe_cb (GObject      *source_object,
+                                 GAsyncResult *result,
+                                 gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+    SoupMessage *probe = data->probe;
+    GInputStream *stream;
+    GError *error = NULL;
+
+    data->probe = NULL;
+
+    stream = soup_session_send_finish (SOUP_SESSION (source_object), result, &error);
+
+    if (stream)
+    {
+        if (SOUP_STATUS_IS_SUCCESSFUL (probe->status_code) &&
+            soup_message_headers_get_encoding (probe->response_headers) == SOUP_ENCODING_CONTENT_LENGTH)
+        {
+            data->expected_size = soup_message_headers_get_content_length (probe->response_headers);
+
+            g_debug ("Downloader ( %s ): expecting %" G_GUINT64_FORMAT " bytes", data->uri, data->expected_size);
+        }
+
+        g_input_stream_close (stream, NULL, NULL);
+        g_object_unref (stream);
+    }
+    else
+    {
+        g_debug ("Downloader ( %s ): size probe failed: %s", data->uri, error->message);
+
+        g_clear_error (&error);
+    }
+
+    g_object_unref (probe);
+
+    if (g_cancellable_is_cancelled (data->cancellable))
+    {
+        download_resource_data_fail (data,
+                                     g_error_new_literal (G_IO_ERROR,
+                                                          G_IO_ERROR_CANCELLED,
+                                                          "Operation was cancelled"));
+    }
+    else
+    {
+        download_manager_queue (data->manager, data);
+    }
+
+    download_resource_data_unref (data);
+}
+
+/**
+ * download_resource_data_queue_cb:
+ * @user_data: a #DownloadResourceData
+ *
+ * Creates the request of a download on the context it runs on and queues it
+ * in its #DownloadManager, once a HEAD request told its size when it asks
+ * for one.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_resource_data_queue_cb (gpointer user_data)
+{
+    DownloadResourceData *data = user_data;
+    GError *error = NULL;
+    SoupURI *soup_uri;
+
+    data->session = g_object_ref (download_manager_get_session (data->manager));
+    data->request = soup_session_request (data->session, data->uri, &error);
+
+    if (error)
+    {
+        g_warning ("Downloader ( %s ): failed to prase uri", data->uri);
+
+        download_resource_data_fail (data, error);
+
+        return G_SOURCE_REMOVE;
+    }
+
+    soup_uri = soup_request_get_uri (data->request);
+    data->host = g_strdup_printf ("%s:%u", soup_uri->host ? soup_uri->host : "", soup_uri->port);
+
+    // The probe runs outside the limits of the manager, its connection is
+    // then usually kept alive for the download itself
+    if (data->probe_size && data->expected_size == 0)
+    {
+        data->probe = soup_message_new_from_uri (SOUP_METHOD_HEAD, soup_uri);
+
+        soup_session_send_async (data->session,
+                                 data->probe,
+                                 data->cancellable,
+                                 download_resource_data_probe_cb,
+                                 download_resource_data_ref (data));
+
+        return G_SOURCE_REMOVE;
+    }
+
+    download_manager_queue (data->manager, data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_options_init:
+ * @options: a #DownloadOptions
+ *
+ * Fills @options with the defaults used when download_start() is passed
+ * %NULL options. Always call this before setting fields so that fields added
+ * later get sane values.
+ */
+void
+download_options_init (DownloadOptions *options)
+{
+    g_return_if_fail (options != NULL);
+
+    memset (options, 0, sizeof (DownloadOptions));
+
+    options->target = DOWNLOAD_TARGET_FILE;
+    options->overwrite = FALSE;
+    options->coalesce = TRUE;
+    options->readable = FALSE;
+    options->priority = DOWNLOAD_PRIORITY_NORMAL;
+    options->expected_size = 0;
+    options->probe_size = FALSE;
+    options->deadline = 0;
+    options->segments = 1;
+    options->min_segment_size = DOWNLOAD_DEFAULT_MIN_SEGMENT_SIZE;
+    options->resumable = FALSE;
+    options->durability = DOWNLOAD_DURABILITY_NONE;
+    options->max_retries = DOWNLOAD_DEFAULT_MAX_RETRIES;
+    options->preallocate = TRUE;
+    options->bypass_cache = FALSE;
+    options->uring = FALSE;
+    options->decode = DOWNLOAD_DECODE_NONE;
+    options->checksum = DOWNLOAD_CHECKSUM_NONE;
+    options->expected_digest = NULL;
+}
+
+/**
+ * download_start:
+ * @uri: a uri to a resource to download
+ * @path: (nullable): a path to save the @uri resource to, ignored unless
+ *        @options->target is %DOWNLOAD_TARGET_FILE
+ * @options: (nullable): a #DownloadOptions, or %NULL for the defaults
+ * @cancellable: (nullable): a #GCancellable, used to stop the asynchronous
+ *               resource fetch and resource save
+ * @callback: a #GAsyncReadyCallback to call when the download is finished
+ * @user_data: data to pass to @callback
+ *
+ * Requests a resource from @uri saving it into @path, see
+ * download_resolve_path() for how @path is treated when it is %NULL or a
+ * directory, or wherever @options->target sends it. @uri, @path and
+ * @options are copied, the caller keeps ownership. See #DownloadOptions for
+ * what each option does.
+ *
+ * download_start() never blocks. The transfer runs on the thread-default
+ * #GMainContext of the caller, or on a worker of @options->workers, and
+ * progress reports and @callback come on the context of the caller. Call
+ * download_finish() from @callback to get the result. Errors found before
+ * the transfer starts, like @path existing while @options->overwrite is
+ * %FALSE, are reported through @callback as well.
+ *
+ * Returns: (transfer full): a #DownloadResourceData handle for the download,
+ *          free with download_resource_data_unref()
+ */
+DownloadResourceData *
+download_start (const gchar           *uri,
+                const gchar           *path,
+                const DownloadOptions *options,
+                GCancellable          *cancellable,
+                GAsyncReadyCallback    callback,
+                gpointer               user_data)
+{
+    g_return_val_if_fail (uri != NULL && *uri != '\0', NULL);
+    g_return_val_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable), NULL);
+    g_return_val_if_fail (!options || options->target != DOWNLOAD_TARGET_CHUNKS || options->chunk_handler, NULL);
+    g_return_val_if_fail (!options || options->target != DOWNLOAD_TARGET_PACK || options->pack, NULL);
+
+    DownloadOptions defaults;
+    DownloadResourceData *data;
+
+    if (options == NULL)
+    {
+        download_options_init (&defaults);
+        options = &defaults;
+    }
+
+    data = g_slice_new0 (DownloadResourceData);
+    data->ref_count = 1;
+
+    data->uri = g_strdup (uri);
+    data->target = options->target;
+
+    if (data->target == DOWNLOAD_TARGET_FILE)
     {
-        data->p_handler (data->downloaded_bytes,
-                         data->total_bytes,
-                         data->p_user_data);
+        data->path = download_resolve_path (uri, path);
+        data->overwrite = options->overwrite;
+        data->preallocate = options->preallocate;
+        data->bypass_cache = options->bypass_cache;
+
+        if (options->readable)
+            data->tail = download_tail_new ();
     }
 
-    if (!g_input_stream_close_finish (stream, result, &error))
+    if (data->target == DOWNLOAD_TARGET_PACK)
     {
-        g_warning ("Downloader ( %s ): error closing GInputStream: %s", data->uri, error->message);
+        data->pack = download_pack_ref (options->pack);
+        data->pack_key = g_strdup (path ? path : uri);
     }
 
-    g_debug ("Downloader ( %s ): closed GInputStream, read \"%lu\" bytes", data->uri, data->downloaded_bytes);
+    data->chunk_handler = options->chunk_handler;
+    data->chunk_user_data = options->chunk_user_data;
 
-    if (data->c_handler)
-        data->c_handler (data->c_user_data);
+    data->decode = options->decode;
 
-    download_resource_data_free (data);
-}
+    data->validator_mirror = -1;
 
-/**
- * download_resource_from_uri_async_read_cb:
- * @object: a #GInputStream
- * @result: a #GAsyncResult
- * @user_data: a #DownloadResourceData
- *
- * Reads a #GInputStream from @object and saves the bytes into @user_data->ouput
- * which is a #GOutputStream for @user_data->file. When the steam ends
- * g_input_stream_close_async() is called with a #GCallback to
- * download_resource_from_uri_async_read_close_cb().
- */
-static void
-download_resource_from_uri_async_read_cb (GObject      *object,
-                                          GAsyncResult *result,
-                                          gpointer      user_data)
-{
-    g_return_if_fail (G_IS_INPUT_STREAM (object));
+    if (options->mirrors && options->mirrors[0])
+    {
+        guint n = g_strv_length ((gchar **) options->mirrors);
+        guint i;
 
-    GInputStream *stream = G_INPUT_STREAM (object);
-    DownloadResourceData *data = user_data;
-    GError *error = NULL;
-    gsize nread;
+        data->mirrors = g_new0 (DownloadMirror, n + 1);
+        data->mirrors[data->n_mirrors++].uri = g_strdup (uri);
+
+        for (i = 0; i < n; i++)
+        {
+            if (g_strcmp0 (options->mirrors[i], uri) != 0)
+                data->mirrors[data->n_mirrors++].uri = g_strdup (options->mirrors[i]);
+        }
+
+        data->min_rate = options->min_rate;
+    }
+
+    // A compressed file named after the uri is saved under its decoded name
+    if (data->path && (data->decode & DOWNLOAD_DECODE_RESOURCE) && (!path || g_str_has_suffix (path, "/")))
+    {
+        const gchar *suffix = download_encoding_get_suffix (download_encoding_from_resource (data->path, NULL));
+
+        if (suffix)
+            data->path[strlen (data->path) - strlen (suffix)] = '\0';
+    }
+
+    data->caller_context = g_main_context_ref_thread_default ();
 
-    if (data->downloaded_bytes == 0)
+    if (options->workers)
     {
-        g_debug ("Downloader ( %s ): starting async read...", data->uri);
+        data->workers = download_worker_pool_ref (options->workers);
+        data->worker = download_worker_pool_assign (data->workers);
+        data->manager = download_manager_ref (download_worker_get_manager (data->worker));
+        data->context = g_main_context_ref (download_worker_get_context (data->worker));
     }
     else
     {
-        //g_debug ("Downloader ( %s ): downloaded bytes \"%lu\"", data->uri, data->downloaded_bytes);
+        data->manager = download_manager_ref (options->manager ? options->manager : download_manager_get_default ());
+        data->context = g_main_context_ref (data->caller_context);
     }
 
-    nread = g_input_stream_read_finish (stream, result, &error);
+    if (data->target == DOWNLOAD_TARGET_FILE && options->uring)
+        data->uring = download_uring_get (data->context);
 
-    if (error)
-    {
-        g_warning ("Downloader ( %s ): stream read finished failed: %s",
-                   data->uri,
-                   error->message);
+    data->buffer_pool = download_buffer_pool_ref (options->buffer_pool ? options->buffer_pool : download_buffer_pool_get_default ());
+    data->rate_limiter = download_rate_limiter_ref (options->rate_limiter ? options->rate_limiter : download_rate_limiter_get_default ());
+    data->priority = options->priority;
 
-        g_error_free (error);
+    if (options->progress_group)
+    {
+        data->progress_group = download_progress_group_ref (options->progress_group);
+        download_progress_group_add (data->progress_group);
     }
 
-    if (g_get_monotonic_time () - data->last_progress_time > 1 * G_USEC_PER_SEC)
+    // The chunk handler gets the body in order, and a decoder needs all of
+    // it, so it comes as one stream
+    data->max_segments = data->target == DOWNLOAD_TARGET_CHUNKS || data->decode ? 1 : MAX (options->segments, 1);
+    data->max_retries = options->max_retries;
+    data->min_segment_size = options->min_segment_size > 0 ? options->min_segment_size : DOWNLOAD_DEFAULT_MIN_SEGMENT_SIZE;
+    data->segments = g_ptr_array_new_with_free_func (download_segment_free);
+
+    // Segments stop each other through the internal cancellable, the one of
+    // the caller only forwards to it
+    data->cancellable = g_cancellable_new ();
+    data->stop_waits_id = g_cancellable_connect (data->cancellable,
+                                                 G_CALLBACK (download_resource_data_stop_waits),
+                                                 data,
+                                                 NULL);
+
+    if (cancellable)
     {
-        if (data->p_handler)
-        {
-            data->p_handler (data->downloaded_bytes,
-                             data->total_bytes,
-                             data->p_user_data);
-        }
+        data->user_cancellable = g_object_ref (cancellable);
+        data->user_cancelled_id = g_cancellable_connect (cancellable,
+                                                         G_CALLBACK (download_resource_data_cancelled_cb),
+                                                         data,
+                                                         NULL);
+    }
+
+    data->p_handler = options->p_handler;
+    data->p_user_data = options->p_user_data;
 
-        data->last_progress_time = g_get_monotonic_time ();
+    data->total_bytes = 0;
+    data->downloaded_bytes = 0;
+    data->last_progress_time = g_get_monotonic_time ();
+    data->metrics.start_time = data->last_progress_time;
+
+    data->expected_size = options->expected_size;
+    data->probe_size = options->probe_size;
+
+    if (options->deadline > 0)
+    {
+        data->deadline = data->metrics.start_time + (gint64) options->deadline * 1000;
+        data->metrics.deadline_time = data->deadline;
     }
 
-    if (nread == -1 || nread == 0 || error)
+    data->task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (data->task, download_start);
+    g_task_set_task_data (data->task,
+                          download_resource_data_ref (data),
+                          (GDestroyNotify) download_resource_data_unref);
+
+    g_debug ("Downloader ( %s ): starting...", data->uri);
+
+    if (data->path)
+        g_debug ("Downloader ( %s ): saving to \"%s\"", data->uri, data->path);
+
+    if (data->path && !data->overwrite && g_file_test (data->path, G_FILE_TEST_EXISTS))
     {
-        // TODO: Add data->progress (data->downloaded_bytes)
+        g_debug ("Downloader ( %s ): overwite = FALSE and file exists ( %s ), download cancelled", data->uri, data->path);
 
-        g_input_stream_close_async (stream,
-                                    G_PRIORITY_DEFAULT,
-                                    data->cancellable,
-                                    download_resource_from_uri_async_read_close_cb,
-                                    data);
+        download_resource_data_fail (data,
+                                     g_error_new (G_IO_ERROR,
+                                                  G_IO_ERROR_EXISTS,
+                                                  "File \"%s\" already exists",
+                                                  data->path));
 
-        return;
+        return data;
     }
 
-    if (data->output)
+    if (options->checksum != DOWNLOAD_CHECKSUM_NONE || options->expected_digest)
     {
-        gboolean written;
-        gsize n_written;
+        DownloadChecksumType type = options->checksum != DOWNLOAD_CHECKSUM_NONE ? options->checksum : DOWNLOAD_CHECKSUM_SHA256;
 
-        written = g_output_stream_write_all (G_OUTPUT_STREAM (data->output),
-                                             data->buffer,
-                                             nread,
-                                             &n_written,
-                                             NULL,
-                                             &error);
+        data->checksum = download_checksum_new (type);
+        data->expected_digest = g_strdup (options->expected_digest);
 
-        if (error)
+        if (!data->checksum)
         {
-            g_warning ("Downloader ( %s ): stream write failed: %s",
-                       data->uri,
-                       error->message);
+            g_warning ("Downloader ( %s ): %s checksums are not supported", data->uri, download_checksum_type_get_name (type));
 
-            g_error_free (error);
+            download_resource_data_fail (data,
+                                         g_error_new (G_IO_ERROR,
+                                                      G_IO_ERROR_NOT_SUPPORTED,
+                                                      "%s checksums are not supported by this build",
+                                                      download_checksum_type_get_name (type)));
+
+            return data;
         }
+    }
 
-        data->downloaded_bytes += n_written;
+    if (data->path && options->coalesce &&
+        !g_cancellable_is_cancelled (data->cancellable) &&
+        download_resource_data_join_flight (data))
+    {
+        return data;
+    }
 
-        if (!written)
-        {
-            g_input_stream_close_async (stream,
-                                        G_PRIORITY_DEFAULT,
-                                        data->cancellable,
-                                        download_resource_from_uri_async_read_close_cb,
-                                        data);
-        }
+    if (data->path && options->cache)
+        download_resource_data_lookup_cache (data, options->cache);
+
+    if (data->path && options->resumable && !data->decode)
+    {
+        data->part_path = g_strconcat (data->path, ".part", NULL);
+        download_resource_data_load_journal (data);
+    }
+
+    if (data->path && options->durability != DOWNLOAD_DURABILITY_NONE)
+    {
+        if (!data->part_path)
+            data->part_path = g_strconcat (data->path, ".part", NULL);
+
+        data->durability = options->durability;
+
+        if (options->commit_group)
+            data->commit_group = download_commit_group_ref (options->commit_group);
+    }
+
+    if (data->path)
+        data->file = g_file_new_for_path (data->part_path ? data->part_path : data->path);
+
+    // The session of a worker is only used from its thread
+    if (data->worker)
+    {
+        g_main_context_invoke_full (data->context,
+                                    G_PRIORITY_DEFAULT,
+                                    download_resource_data_queue_cb,
+                                    download_resource_data_ref (data),
+                                    (GDestroyNotify) download_resource_data_unref);
+    }
+    else
+    {
+        download_resource_data_queue_cb (data);
     }
 
-    g_input_stream_read_async (stream,
-                               data->buffer,
-                               sizeof (data->buffer),
-                               G_PRIORITY_DEFAULT,
-                               data->cancellable,
-                               download_resource_from_uri_async_read_cb,
-                               data);
+    return data;
 }
 
 /**
- * download_resource_from_uri_async_cb:
- * @object: a #SoupRequest
- * @result: a #GAsyncResult
- * @user_data: a #DownloadResourceData
+ * download_finish:
+ * @result: the #GAsyncResult passed to the download_start() callback
+ * @error: return location for a #GError, or %NULL
  *
- * After a successful #SoupRequest async callback a #GInputStream is returned.
- * If the #GInputStream is error free then a #GOutputStream is created for the
- * #GFile at user_data->file. Assuming a #GOutputStream is created without
- * errors then g_input_stream_read_async() is called with a #GCallback to
- * download_resource_from_uri_async_read_cb() which reads the #GInputStream of
- * the #SoupRequest.
+ * Finishes a download started with download_start().
+ *
+ * Returns: %TRUE if the resource was saved, %FALSE with @error set otherwise
  */
-static void
-download_resource_from_uri_async_cb (GObject      *object,
-                                     GAsyncResult *result,
-                                     gpointer      user_data)
+gboolean
+download_finish (GAsyncResult  *result,
+                 GError       **error)
 {
-    g_return_if_fail (SOUP_IS_REQUEST (object));
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+    g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == download_start, FALSE);
 
-    SoupRequest *request = SOUP_REQUEST (object);
-    GInputStream *stream = NULL;
-    DownloadResourceData *data = user_data;
-    GError *error = NULL;
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
 
-    g_debug ("Downloader ( %s ): starting async fetch...", data->uri);
+/**
+ * download_result_get_data:
+ * @result: the #GAsyncResult passed to the download_start() callback
+ *
+ * Gets the #DownloadResourceData handle of a download from its result, handy
+ * when the callback did not keep the handle returned by download_start().
+ *
+ * Returns: (transfer none): the #DownloadResourceData of @result
+ */
+DownloadResourceData *
+download_result_get_data (GAsyncResult *result)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
 
-    stream = soup_request_send_finish (request, result, &error);
+    return g_task_get_task_data (G_TASK (result));
+}
 
-    data->total_bytes = soup_request_get_content_length (request);
+/**
+ * download_cancel:
+ * @data: a #DownloadResourceData
+ *
+ * Cancels the download of @data, taking it out of the flight it follows.
+ * The callback given to download_start() is still invoked,
+ * download_finish() then fails with %G_IO_ERROR_CANCELLED.
+ */
+void
+download_cancel (DownloadResourceData *data)
+{
+    g_return_if_fail (data != NULL);
 
-    if (error)
-    {
-        g_warning ("Downloader ( %s ): failed to start resource: %s",
-                   data->uri,
-                   error->message);
+    g_cancellable_cancel (data->cancellable);
 
-        g_error_free (error);
-        download_resource_data_free (data);
+    if (data->leader)
+        download_resource_data_leave_flight (data);
+}
 
-        return;
-    }
+typedef struct _DownloadResourceCallbackData {
+    DownloadResourceDataCallback c_handler;
+    gpointer c_user_data;
+} DownloadResourceCallbackData;
 
-    data->output = G_OUTPUT_STREAM (g_file_replace (data->file,
-                                                    NULL,
-                                                    FALSE,
-                                                    G_FILE_CREATE_NONE,
-                                                    data->cancellable,
-                                                    &error));
+/**
+ * download_resource_from_uri_async_full_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadResourceCallbackData
+ *
+ * Finishes a download started by download_resource_from_uri_async_full() and
+ * calls its final callback.
+ */
+static void
+download_resource_from_uri_async_full_cb (GObject      *object,
+                                          GAsyncResult *result,
+                                          gpointer      user_data)
+{
+    DownloadResourceCallbackData *callback_data = user_data;
+    DownloadResourceData *data = download_result_get_data (result);
+    GError *error = NULL;
 
-    if (error)
+    if (!download_finish (result, &error))
     {
-        g_warning ("Downloader ( %s ): failed to create output stream and file \"%s\": %s",
-                   data->uri,
-                   data->path,
-                   error->message);
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+            g_debug ("Downloader ( %s ): %s", data->uri, error->message);
+        else
+            g_warning ("Downloader ( %s ): download failed: %s", data->uri, error->message);
 
         g_error_free (error);
-        download_resource_data_free (data);
-
-        return;
     }
 
-    g_input_stream_read_async (stream,
-                               data->buffer,
-                               sizeof (data->buffer),
-                               G_PRIORITY_DEFAULT,
-                               data->cancellable,
-                               download_resource_from_uri_async_read_cb,
-                               data);
+    if (callback_data->c_handler)
+        callback_data->c_handler (callback_data->c_user_data);
+
+    g_slice_free (DownloadResourceCallbackData, callback_data);
 }
 
 /**
@@ -298,20 +4782,10 @@ download_resource_from_uri_async_cb (GObject      *object,
  * the file will be named the basename of @uri. Not supplying @path is
  * discouraged.
  *
- * In addition a #GFile is created for @path and set into a new
- * #DownloadResourceData struct as (struct name)->file. Checks are also made if
- * the @path file exists and if it should overwrite based on @overwrite.
- *
- * When initial data is set soup_request_send_async() is called with a
- * #GCallback to download_resource_from_uri_async_cb() which starts the
- * #SoupRequest.
- *
- * Note: download_resource_from_uri_async_full() runs it's own #GMainLoop
- * but refs the current #GMainContext, if on exists using
- * g_main_context_ref_thread_default(). If no current #GMainContext exists then
- * a new one is created. If you plan on using downloads inside of an
- * application you should run that application first either with a #GMainLoop
- * or using #GApplication so I can hook onto the main context.
+ * This is a thin wrapper around download_start(), it returns straight away and
+ * @c_handler is called once the download ends, whether it succeeded or not.
+ * Failures are logged with g_warning(). Use download_start() directly if you
+ * need to know the outcome.
  */
 void
 download_resource_from_uri_async_full (gchar                        *uri,
@@ -323,104 +4797,30 @@ download_resource_from_uri_async_full (gchar                        *uri,
                                        DownloadResourceDataCallback  c_handler,
                                        gpointer                      c_user_data)
 {
-    g_return_if_fail (uri && g_strv_length (&uri) > 0);
+    g_return_if_fail (uri != NULL && *uri != '\0');
     g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
-    GMainLoop *loop = NULL;
-    GMainContext *context = NULL;
+    DownloadResourceCallbackData *callback_data;
     DownloadResourceData *data;
-    SoupSession *session;
-    SoupRequest *request;
-    gchar *internal_uri = NULL;
-    gchar *internal_path = NULL;
-    GError *error = NULL;
-    GFile *file;
-
-    context = g_main_context_ref_thread_default ();
-    loop = g_main_loop_new (context, TRUE);
-
-    internal_uri = g_strdup (uri);
-    internal_path = g_strdup (path);
-
-    g_debug ("Downloader ( %s ): starting...", internal_uri);
-
-    if (path == NULL)
-    {
-        internal_path =
-            g_build_filename (g_get_user_special_dir (G_USER_DIRECTORY_DOWNLOAD),
-                              g_path_get_basename (internal_uri),
-                              NULL);
-    }
-
-    if (g_str_has_suffix (internal_path, "/"))
-    {
-        if (!g_file_test (internal_path, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_DIR))
-        {
-            g_mkdir_with_parents (internal_path, 0700);
-        }
-
-        internal_path =
-            g_build_filename (internal_path,
-                              g_path_get_basename (internal_uri),
-                              NULL);
-    }
-
-    g_debug ("Downloader ( %s ): saving to \"%s\"", internal_uri, internal_path);
-
-    file = g_file_new_for_path (internal_path);
+    DownloadOptions options;
 
-    if (!overwrite && g_file_query_exists (file, cancellable))
-    {
-        g_debug ("Downloader ( %s ): overwite = FALSE and file exists ( %s ), download cancelled", internal_uri, internal_path);
-        return;
-    }
-
-    session = soup_session_new_with_options (SOUP_SESSION_USER_AGENT, "download_async",
-                                             SOUP_SESSION_SSL_USE_SYSTEM_CA_FILE, TRUE,
-                                             SOUP_SESSION_USE_THREAD_CONTEXT, TRUE,
-                                             SOUP_SESSION_TIMEOUT, 60,
-                                             SOUP_SESSION_IDLE_TIMEOUT, 60,
-                                             NULL);
-
-    request = soup_session_request (session, internal_uri, &error);
-
-    if (error)
-    {
-        g_warning ("Downloader ( %s ): failed to prase uri", internal_uri);
-        g_cancellable_cancel (cancellable);
-        g_object_unref (cancellable);
-        g_error_free (error);
-        return;
-    }
-
-    g_debug ("Downloader ( %s ): soup session and request started", internal_uri);
-
-    data = g_slice_new0 (DownloadResourceData);
-    data->loop = loop;
-
-    data->uri = internal_uri;
-    data->path = internal_path;
-    data->overwrite = overwrite;
-
-    data->cancellable = cancellable;
-    data->p_handler = p_handler;
-    data->p_user_data = p_user_data;
-    data->c_handler = c_handler;
-    data->c_user_data = c_user_data;
+    download_options_init (&options);
+    options.overwrite = overwrite;
+    options.p_handler = p_handler;
+    options.p_user_data = p_user_data;
 
-    data->file = file;
-    data->total_bytes = 0;
-    data->downloaded_bytes = 0;
-    data->last_progress_time = g_get_monotonic_time ();
+    callback_data = g_slice_new0 (DownloadResourceCallbackData);
+    callback_data->c_handler = c_handler;
+    callback_data->c_user_data = c_user_data;
 
-    soup_request_send_async (SOUP_REQUEST(request),
-                             cancellable,
-                             download_resource_from_uri_async_cb,
-                             data);
+    data = download_start (uri,
+                           path,
+                           &options,
+                           cancellable,
+                           download_resource_from_uri_async_full_cb,
+                           callback_data);
 
-    g_main_loop_run (loop);
-    g_main_loop_unref (loop);
-    g_main_context_unref (context);
+    download_resource_data_unref (data);
 }
 
 /**
@@ -430,20 +4830,18 @@ download_resource_from_uri_async_full (gchar                        *uri,
  * @overwrite: %TRUE to overwrite @path
  * @cancellable: a #GCancellable, used to stop the asynchronous resource fetch
  *               and resource save
- * @p_handler: the #GCallback for the progress callback.
- * @c_user_data: data to pass to @p_handler callback
+ * @c_handler: the #GCallback for the finial callback
+ * @c_user_data: data to pass to @c_handler callback
  *
  * Requests a resource from @uri saving it into @path, overriding the contents
- * of @path if @overwrite is set to %TRUE. Because download_async() is
- * asynchronous @uri & @path will be freed when the request is finished. Make a
- * copy of @uri and @path when calling, for example with g_strdup().
+ * of @path if @overwrite is set to %TRUE. @uri and @path are copied so the
+ * caller may free them as soon as this returns.
  *
- * Use download_resource_from_uri_async_full() if you want to call a function
- * when the asynchronous download is finished, like emitting a signal with
- * g_signal_emit().
+ * Use download_resource_from_uri_async_full() if you also want progress
+ * updates.
  *
- * See download_resource_from_uri_async_full() for more about technical
- * description of the download process.
+ * See download_start() for more about technical description of the download
+ * process.
  */
 void
 download_resource_from_uri_async_with_callback (gchar                        *uri,
@@ -465,23 +4863,22 @@ download_resource_from_uri_async_with_callback (gchar                        *ur
 
 /**
  * download_resource_from_uri_async:
- * @uri: a uri to a resource to download, do not free
- * @path: a path to save the @uri resource to, do not free
+ * @uri: a uri to a resource to download
+ * @path: a path to save the @uri resource to
  * @overwrite: %TRUE to overwrite @path
  * @cancellable: a #GCancellable, used to stop the asynchronous resource fetch
  *               and resource save
  *
  * Requests a resource from @uri saving it into @path, overriding the contents
- * of @path if @overwrite is set to %TRUE. Because download_async() is
- * asynchronous @uri & @path will be freed when the request is finished. Make a
- * copy of @uri and @path when calling, for example with g_strdup().
+ * of @path if @overwrite is set to %TRUE. @uri and @path are copied so the
+ * caller may free them as soon as this returns.
  *
  * Use download_resource_from_uri_async_full() if you want to call a function
  * when the asynchronous download is finished, like emitting a signal with
  * g_signal_emit().
  *
- * See download_resource_from_uri_async_full() for more about technical
- * description of the download process.
+ * See download_start() for more about technical description of the download
+ * process.
  */
 void
 download_resource_from_uri_async (gchar        *uri,
@@ -498,3 +4895,167 @@ download_resource_from_uri_async (gchar        *uri,
                                            NULL,
                                            NULL);
 }
+
+/**
+ * download_resource_data_get_bytes:
+ * @data: a #DownloadResourceData
+ *
+ * Gets the resource a download to memory read, once it succeeded.
+ *
+ * Returns: (transfer none) (nullable): the resource, or %NULL if @data did
+ *          not download to memory or has not succeeded (yet)
+ */
+GBytes *
+download_resource_data_get_bytes (DownloadResourceData *data)
+{
+    g_return_val_if_fail (data != NULL, NULL);
+
+    return data->bytes;
+}
+
+/**
+ * download_resource_data_get_digest:
+ * @data: a #DownloadResourceData
+ *
+ * Gets the digest of a download that was started with a checksum, once it
+ * finished.
+ *
+ * Returns: (nullable): the digest as lower case hexadecimal, or %NULL if
+ *          there is none (yet)
+ */
+const gchar *
+download_resource_data_get_digest (DownloadResourceData *data)
+{
+    g_return_val_if_fail (data != NULL, NULL);
+
+    return data->digest;
+}
+
+/**
+ * download_resource_data_is_cache_hit:
+ * @data: a #DownloadResourceData
+ *
+ * Checks whether a download succeeded without fetching the body because the
+ * server confirmed the file from its #DownloadCache is still fresh. Call it
+ * from the callback given to download_start().
+ *
+ * Returns: %TRUE if the file was already up to date
+ */
+gboolean
+download_resource_data_is_cache_hit (DownloadResourceData *data)
+{
+    g_return_val_if_fail (data != NULL, FALSE);
+
+    return data->cache_hit;
+}
+
+/**
+ * download_resource_data_set_priority:
+ * @data: a #DownloadResourceData
+ * @priority: a #DownloadPriority
+ *
+ * Moves a download to another priority of its #DownloadRateLimiter, from its
+ * next read on, for instance to hurry a prefetch the user now waits for.
+ */
+void
+download_resource_data_set_priority (DownloadResourceData *data,
+                                     DownloadPriority      priority)
+{
+    g_return_if_fail (data != NULL);
+    g_return_if_fail (priority < DOWNLOAD_N_PRIORITIES);
+
+    data->priority = priority;
+}
+
+/**
+ * download_resource_data_get_metrics:
+ * @data: a #DownloadResourceData
+ *
+ * Gets the timings and counters of @data, see download-metrics. They are
+ * complete once the callback given to download_start() runs, and are also
+ * added to the process wide totals of download_metrics_dump_json() then.
+ *
+ * Returns: (transfer none): the #DownloadMetrics of @data
+ */
+const DownloadMetrics *
+download_resource_data_get_metrics (DownloadResourceData *data)
+{
+    g_return_val_if_fail (data != NULL, NULL);
+
+    return &data->metrics;
+}
+
+/**
+ * download_resource_data_get_mirrors:
+ * @data: a #DownloadResourceData
+ * @n_mirrors: (out): return location for the number of mirrors
+ *
+ * Gets the uri of @data followed by the mirrors given to download_start(),
+ * with the rates the race and the transfer measured for each of them. Only
+ * read them from the callback of the download, while it runs they change
+ * on the context of the transfer.
+ *
+ * Returns: (transfer none) (array length=n_mirrors) (nullable): the
+ *          #DownloadMirror array of @data, %NULL without mirrors
+ */
+const DownloadMirror *
+download_resource_data_get_mirrors (DownloadResourceData *data,
+                                    guint                *n_mirrors)
+{
+    g_return_val_if_fail (data != NULL, NULL);
+    g_return_val_if_fail (n_mirrors != NULL, NULL);
+
+    *n_mirrors = data->n_mirrors;
+
+    return data->mirrors;
+}
+
+/**
+ * download_resource_data_get_mirror:
+ * @data: a #DownloadResourceData
+ *
+ * Gets the mirror @data downloads from, the one the race picked or the
+ * last one a segment moved to.
+ *
+ * Returns: (transfer none): the uri of the mirror, @data->uri without
+ *          mirrors
+ */
+const gchar *
+download_resource_data_get_mirror (DownloadResourceData *data)
+{
+    g_return_val_if_fail (data != NULL, NULL);
+
+    return data->mirrors ? data->mirrors[data->mirror].uri : data->uri;
+}
+
+/**
+ * download_resource_data_open_reader:
+ * @data: a #DownloadResourceData to a file, started with
+ *        #DownloadOptions.readable set
+ * @error: return location for a #GError
+ *
+ * Opens a stream of the file of @data from its first byte, which can be
+ * read while the download runs, see download-reader. It may be used on any
+ * thread and outlive @data.
+ *
+ * Returns: (transfer full) (nullable): a #DownloadReader, or %NULL with
+ *          %G_IO_ERROR_NOT_SUPPORTED when @data keeps no readers
+ */
+GInputStream *
+download_resource_data_open_reader (DownloadResourceData  *data,
+                                    GError               **error)
+{
+    g_return_val_if_fail (data != NULL, NULL);
+
+    if (!data->tail)
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_NOT_SUPPORTED,
+                     "Download of \"%s\" was not started readable to a file",
+                     data->uri);
+        return NULL;
+    }
+
+    return download_reader_new (data->tail);
+}
@@ -1,7 +1,23 @@
+#ifndef DOWNLOAD_ASYNC_H
+#define DOWNLOAD_ASYNC_H
+
 #include <glib.h>
 #include <gio/gio.h>
 #include <libsoup/soup.h>
 
+#include "download-buffer-pool.h"
+#include "download-cache.h"
+#include "download-checksum.h"
+#include "download-commit.h"
+#include "download-decoder.h"
+#include "download-metrics.h"
+#include "download-mirrors.h"
+#include "download-pack.h"
+#include "download-progress.h"
+#include "download-reader.h"
+#include "download-rate-limiter.h"
+#include "download-worker-pool.h"
+
 G_BEGIN_DECLS
 
 typedef void (* DownloadResourceDataProgress) (guint64   downloaded_bytes,
@@ -10,28 +26,172 @@ typedef void (* DownloadResourceDataProgress) (guint64   downloaded_bytes,
 
 typedef void (* DownloadResourceDataCallback) (gpointer user_data);
 
+typedef void (* DownloadResourceDataChunk) (GBytes   *bytes,
+                                            goffset   offset,
+                                            gpointer  user_data);
+
+typedef enum {
+    DOWNLOAD_TARGET_FILE,
+    DOWNLOAD_TARGET_MEMORY,
+    DOWNLOAD_TARGET_CHUNKS,
+    DOWNLOAD_TARGET_PACK
+} DownloadTarget;
 
-typedef struct _DownloadResourceData {
-    GMainLoop *loop;
+typedef struct _DownloadManager DownloadManager;
+typedef struct _DownloadResourceData DownloadResourceData;
 
-    gchar *uri;
-    gchar *path;
+#define DOWNLOAD_DEFAULT_MIN_SEGMENT_SIZE (1024 * 1024)
+#define DOWNLOAD_DEFAULT_MAX_RETRIES      5
+
+typedef struct _DownloadOptions {
+    // Where the bytes go: the file at path, memory for
+    // download_resource_data_get_bytes(), chunk_handler as they arrive or
+    // pack. Only DOWNLOAD_TARGET_FILE uses path, overwrite, resumable,
+    // preallocate, bypass_cache and segments above 1
+    DownloadTarget target;
     gboolean overwrite;
 
-    GCancellable *cancellable;
+    // Join a download of the same uri to a file already running rather
+    // than start another, the file is cloned to path once complete
+    gboolean coalesce;
+
+    // Keep a DownloadTail so readers can stream the file while it is
+    // written, for DOWNLOAD_TARGET_FILE
+    gboolean readable;
+
+    // The manager whose session and slots the download uses, NULL for the
+    // default one, or a worker pool running the transfer on the least busy
+    // of its threads with the manager of that worker
+    DownloadManager *manager;
+    DownloadWorkerPool *workers;
+
+    // Where read buffers come from, NULL for the default pool
+    DownloadBufferPool *buffer_pool;
+
+    // The limiter shaping reads, NULL for the unlimited default one, and
+    // the weight of the download in it
+    DownloadRateLimiter *rate_limiter;
+    DownloadPriority priority;
+
+    // A group reporting the progress of all its downloads at once
+    DownloadProgressGroup *progress_group;
+
+    // What the manager ranks the download by: its size in bytes, 0 when
+    // unknown, whether to ask for it with a HEAD request then, and the ms
+    // after download_start() it should be done in, 0 for no deadline
+    guint64 expected_size;
+    gboolean probe_size;
+    guint deadline;
+
+    // How many ranges to fetch in parallel when the server takes them, and
+    // the smallest one worth a segment of its own
+    guint segments;
+    goffset min_segment_size;
+
+    // Other uris serving the same bytes, NULL terminated, and the bytes per
+    // second below which a segment moves to another of them, 0 for never
+    const gchar * const *mirrors;
+    guint64 min_rate;
+
+    // Write to "path.part" with a journal so a later download_start() only
+    // fetches what is missing, and how many times a segment reconnects
+    // after a transient error
+    gboolean resumable;
+    guint max_retries;
+
+    // Whether the file is flushed before it is moved to its path, and the
+    // group it is flushed with for DOWNLOAD_DURABILITY_GROUP, NULL for the
+    // default one
+    DownloadDurability durability;
+    DownloadCommitGroup *commit_group;
+
+    // Reserve the blocks of the file before the first write when its length
+    // is known, and drop written bytes from the page cache as it goes
+    gboolean preallocate;
+    gboolean bypass_cache;
+
+    // Write through the io_uring of the context when there is one
+    gboolean uring;
+
+    // Decompress the body as it is read, such downloads are not split
+    DownloadDecode decode;
+
+    // The digest to compute, and the one the bytes must match, which alone
+    // means SHA-256. A mismatch fails with G_IO_ERROR_INVALID_DATA
+    DownloadChecksumType checksum;
+    const gchar *expected_digest;
+
+    // Revalidate the file recorded there rather than download it again,
+    // NULL to not use a cache
+    DownloadCache *cache;
+
+    // Where DOWNLOAD_TARGET_PACK appends the download, keyed by path, or
+    // by uri when there is no path
+    DownloadPack *pack;
+
     DownloadResourceDataProgress p_handler;
     gpointer p_user_data;
-    DownloadResourceDataCallback c_handler;
-    gpointer c_user_data;
 
-    GFile *file;
-    gchar buffer[16384]; // 16 * 1024
-    GOutputStream *output;
+    // Gets every chunk of DOWNLOAD_TARGET_CHUNKS in order, wrapping the
+    // read buffer, which returns to buffer_pool once the bytes are dropped
+    DownloadResourceDataChunk chunk_handler;
+    gpointer chunk_user_data;
+} DownloadOptions;
+
+
+void
+download_options_init (DownloadOptions *options);
+
+DownloadResourceData *
+download_resource_data_ref (DownloadResourceData *data);
+
+void
+download_resource_data_unref (DownloadResourceData *data);
+
+DownloadResourceData *
+download_start (const gchar           *uri,
+                const gchar           *path,
+                const DownloadOptions *options,
+                GCancellable          *cancellable,
+                GAsyncReadyCallback    callback,
+                gpointer               user_data);
+
+gboolean
+download_finish (GAsyncResult  *result,
+                 GError       **error);
+
+DownloadResourceData *
+download_result_get_data (GAsyncResult *result);
 
-    guint64 total_bytes;
-    guint64 downloaded_bytes;
-    guint64 last_progress_time;
-} DownloadResourceData;
+GBytes *
+download_resource_data_get_bytes (DownloadResourceData *data);
+
+const gchar *
+download_resource_data_get_digest (DownloadResourceData *data);
+
+gboolean
+download_resource_data_is_cache_hit (DownloadResourceData *data);
+
+const DownloadMetrics *
+download_resource_data_get_metrics (DownloadResourceData *data);
+
+void
+download_resource_data_set_priority (DownloadResourceData *data,
+                                     DownloadPriority      priority);
+
+const DownloadMirror *
+download_resource_data_get_mirrors (DownloadResourceData *data,
+                                    guint                *n_mirrors);
+
+const gchar *
+download_resource_data_get_mirror (DownloadResourceData *data);
+
+GInputStream *
+download_resource_data_open_reader (DownloadResourceData  *data,
+                                    GError               **error);
+
+void
+download_cancel (DownloadResourceData *data);
 
 void
 download_resource_from_uri_async_full (gchar                        *uri,
@@ -59,3 +219,4 @@ download_resource_from_uri_async (gchar        *uri,
 
 G_END_DECLS
 
+#endif /* DOWNLOAD_ASYNC_H */
@@ -0,0 +1,625 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-buffer-pool.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/**
+ * SECTION:download-buffer-pool
+ * @title: Download Buffer Pool
+ * @short_description: Process-wide, memory-budgeted pool of read buffers
+ * @include: download-buffer-pool.h
+ * @see_also: #DownloadResourceData
+ *
+ * Downloads take their read buffers from a #DownloadBufferPool instead of
+ * owning them, and hand them back as soon as the bytes are written. Memory
+ * therefore follows the amount of data actually moving rather than the number
+ * of open downloads.
+ *
+ * Buffers come in power of two sizes from %DOWNLOAD_BUFFER_POOL_MIN_SIZE up to
+ * %DOWNLOAD_BUFFER_POOL_MAX_SIZE. A few released buffers of each size are
+ * kept around for reuse. The pool never hands out more than its memory limit,
+ * when it is reached a smaller buffer is given instead, and once not even the
+ * smallest fits download_buffer_pool_acquire() returns %NULL and the caller
+ * waits on a source from download_buffer_pool_create_source().
+ *
+ * download_buffer_pool_wrap() lends a buffer out as a #GBytes instead, for
+ * downloads whose bytes go to a consumer in memory rather than to a file.
+ **/
+
+#define DOWNLOAD_BUFFER_POOL_N_CLASSES 9 // 16 KiB, 32 KiB, ... 4 MiB
+
+// Shared by every pool, so serials never repeat within the process
+static gsize download_buffer_pool_next_serial = 1;
+
+struct _DownloadBufferPool {
+    gint ref_count;
+    GMutex mutex;
+
+    gsize memory_limit;
+    gsize in_use;
+    gsize cached;
+
+    // Buffer -> serial, the number it was allocated with. A buffer given
+    // back to the allocator drops out, one later allocated at the same
+    // address gets another serial
+    GHashTable *serials;
+
+    // Free buffers per size class, linked through their first pointer
+    gpointer free_buffers[DOWNLOAD_BUFFER_POOL_N_CLASSES];
+
+    // DownloadBufferPoolSource waiting for memory, with a reference each
+    GList *waiters;
+};
+
+typedef struct _DownloadBufferPoolSource {
+    GSource source;
+    DownloadBufferPool *pool;
+} DownloadBufferPoolSource;
+
+/**
+ * download_buffer_pool_class_for_size:
+ * @size: a buffer size in bytes
+ *
+ * Gets the size class fitting @size, sizes out of range are clamped.
+ *
+ * Returns: the index of the size class
+ */
+static guint
+download_buffer_pool_class_for_size (gsize size)
+{
+    gsize class_size = DOWNLOAD_BUFFER_POOL_MIN_SIZE;
+    guint index = 0;
+
+    while (class_size < size && index < DOWNLOAD_BUFFER_POOL_N_CLASSES - 1)
+    {
+        class_size <<= 1;
+        index++;
+    }
+
+    return index;
+}
+
+/**
+ * download_buffer_pool_trim:
+ * @pool: a #DownloadBufferPool, locked
+ * @needed: bytes about to be handed out
+ *
+ * Frees cached buffers, largest first, until @needed more bytes fit within
+ * the memory limit of @pool.
+ */
+static void
+download_buffer_pool_trim (DownloadBufferPool *pool,
+                           gsize               needed)
+{
+    gint index;
+
+    for (index = DOWNLOAD_BUFFER_POOL_N_CLASSES - 1; index >= 0; index--)
+    {
+        gsize class_size = (gsize) DOWNLOAD_BUFFER_POOL_MIN_SIZE << index;
+
+        while (pool->free_buffers[index] &&
+               pool->in_use + pool->cached + needed > pool->memory_limit)
+        {
+            gpointer buffer = pool->free_buffers[index];
+
+            pool->free_buffers[index] = *(gpointer *) buffer;
+            pool->cached -= class_size;
+
+            g_hash_table_remove (pool->serials, buffer);
+            g_free (buffer);
+        }
+    }
+}
+
+/**
+ * download_buffer_pool_new:
+ * @memory_limit: the most bytes handed out at once, 0 for
+ *                %DOWNLOAD_BUFFER_POOL_DEFAULT_LIMIT
+ *
+ * Creates a #DownloadBufferPool. Pools are thread-safe.
+ *
+ * Returns: (transfer full): a new #DownloadBufferPool, free with
+ *          download_buffer_pool_unref()
+ */
+DownloadBufferPool *
+download_buffer_pool_new (gsize memory_limit)
+{
+    DownloadBufferPool *pool;
+
+    pool = g_slice_new0 (DownloadBufferPool);
+    pool->ref_count = 1;
+    g_mutex_init (&pool->mutex);
+
+    pool->serials = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    pool->memory_limit = memory_limit ? memory_limit : DOWNLOAD_BUFFER_POOL_DEFAULT_LIMIT;
+
+    return pool;
+}
+
+/**
+ * download_buffer_pool_get_default:
+ *
+ * Gets the #DownloadBufferPool shared by downloads that do not ask for a
+ * specific one.
+ *
+ * Returns: (transfer none): the default #DownloadBufferPool
+ */
+DownloadBufferPool *
+download_buffer_pool_get_default (void)
+{
+    static gsize initialized = 0;
+    static DownloadBufferPool *pool = NULL;
+
+    if (g_once_init_enter (&initialized))
+    {
+        pool = download_buffer_pool_new (0);
+        g_once_init_leave (&initialized, 1);
+    }
+
+    return pool;
+}
+
+/**
+ * download_buffer_pool_ref:
+ * @pool: a #DownloadBufferPool
+ *
+ * Increases the reference count of @pool.
+ *
+ * Returns: (transfer full): @pool
+ */
+DownloadBufferPool *
+download_buffer_pool_ref (DownloadBufferPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+    g_return_val_if_fail (pool->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&pool->ref_count);
+
+    return pool;
+}
+
+/**
+ * download_buffer_pool_unref:
+ * @pool: a #DownloadBufferPool
+ *
+ * Decreases the reference count of @pool, freeing it and its cached buffers
+ * when the count drops to zero. Every buffer handed out holds no reference,
+ * release them all first.
+ */
+void
+download_buffer_pool_unref (DownloadBufferPool *pool)
+{
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (pool->ref_count > 0);
+
+    if (!g_atomic_int_dec_and_test (&pool->ref_count))
+        return;
+
+    if (pool->in_use > 0)
+        g_warning ("DownloadBufferPool: freed with \"%" G_GSIZE_FORMAT "\" bytes still in use", pool->in_use);
+
+    pool->memory_limit = 0;
+    download_buffer_pool_trim (pool, 0);
+
+    g_hash_table_unref (pool->serials);
+    g_mutex_clear (&pool->mutex);
+    g_slice_free (DownloadBufferPool, pool);
+}
+
+/**
+ * download_buffer_pool_wake:
+ * @pool: a #DownloadBufferPool, unlocked
+ *
+ * Makes every source waiting on @pool ready, they retry their
+ * download_buffer_pool_acquire() when dispatched, and drops the references
+ * the pool held on them. Sources destroyed in the meantime are only dropped.
+ */
+static void
+download_buffer_pool_wake (DownloadBufferPool *pool)
+{
+    GList *waiters;
+    GList *l;
+
+    g_mutex_lock (&pool->mutex);
+
+    waiters = pool->waiters;
+    pool->waiters = NULL;
+
+    g_mutex_unlock (&pool->mutex);
+
+    for (l = waiters; l != NULL; l = l->next)
+    {
+        if (!g_source_is_destroyed (l->data))
+            g_source_set_ready_time (l->data, 0);
+
+        g_source_unref (l->data);
+    }
+
+    g_list_free (waiters);
+}
+
+/**
+ * download_buffer_pool_set_memory_limit:
+ * @pool: a #DownloadBufferPool
+ * @memory_limit: the most bytes handed out at once, 0 for
+ *                %DOWNLOAD_BUFFER_POOL_DEFAULT_LIMIT
+ *
+ * Changes the memory limit of @pool. Lowering it drops cached buffers right
+ * away, buffers in use count against the new limit once released.
+ */
+void
+download_buffer_pool_set_memory_limit (DownloadBufferPool *pool,
+                                       gsize               memory_limit)
+{
+    g_return_if_fail (pool != NULL);
+
+    g_mutex_lock (&pool->mutex);
+
+    pool->memory_limit = memory_limit ? memory_limit : DOWNLOAD_BUFFER_POOL_DEFAULT_LIMIT;
+    download_buffer_pool_trim (pool, 0);
+
+    g_mutex_unlock (&pool->mutex);
+
+    download_buffer_pool_wake (pool);
+}
+
+/**
+ * download_buffer_pool_get_memory_limit:
+ * @pool: a #DownloadBufferPool
+ *
+ * Gets the memory limit of @pool.
+ *
+ * Returns: the memory limit in bytes
+ */
+gsize
+download_buffer_pool_get_memory_limit (DownloadBufferPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    gsize memory_limit;
+
+    g_mutex_lock (&pool->mutex);
+    memory_limit = pool->memory_limit;
+    g_mutex_unlock (&pool->mutex);
+
+    return memory_limit;
+}
+
+/**
+ * download_buffer_pool_get_memory_used:
+ * @pool: a #DownloadBufferPool
+ *
+ * Gets how much memory @pool holds, buffers in use and cached ones.
+ *
+ * Returns: the memory used in bytes
+ */
+gsize
+download_buffer_pool_get_memory_used (DownloadBufferPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    gsize memory_used;
+
+    g_mutex_lock (&pool->mutex);
+    memory_used = pool->in_use + pool->cached;
+    g_mutex_unlock (&pool->mutex);
+
+    return memory_used;
+}
+
+/**
+ * download_buffer_pool_get_serial:
+ * @pool: a #DownloadBufferPool
+ * @buffer: a buffer of @pool
+ *
+ * Gets the number @buffer was allocated with. A buffer at the same address
+ * with the same serial is still the same memory, which lets io_uring keep
+ * it registered while the pool frees and allocates others, see
+ * download-uring.
+ *
+ * Returns: the serial of @buffer, 0 if @pool did not allocate it
+ */
+guint64
+download_buffer_pool_get_serial (DownloadBufferPool *pool,
+                                 gconstpointer       buffer)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    guint64 serial;
+
+    g_mutex_lock (&pool->mutex);
+    serial = GPOINTER_TO_SIZE (g_hash_table_lookup (pool->serials, buffer));
+    g_mutex_unlock (&pool->mutex);
+
+    return serial;
+}
+
+/**
+ * download_buffer_pool_acquire:
+ * @pool: a #DownloadBufferPool
+ * @size: the wanted buffer size in bytes
+ * @out_size: (out): return location for the size of the returned buffer
+ *
+ * Takes a buffer of at least @size bytes from @pool, rounded up to a power of
+ * two and clamped to %DOWNLOAD_BUFFER_POOL_MIN_SIZE ..
+ * %DOWNLOAD_BUFFER_POOL_MAX_SIZE. If the memory limit does not allow it a
+ * smaller buffer is returned instead. The smallest size is always granted
+ * when nothing else is in use, so a limit below it cannot stall downloads.
+ *
+ * Returns: (nullable): a buffer to give back with
+ *          download_buffer_pool_release(), or %NULL if the memory limit is
+ *          reached
+ */
+gpointer
+download_buffer_pool_acquire (DownloadBufferPool *pool,
+                              gsize               size,
+                              gsize              *out_size)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+    g_return_val_if_fail (out_size != NULL, NULL);
+
+    gint index;
+
+    g_mutex_lock (&pool->mutex);
+
+    for (index = download_buffer_pool_class_for_size (size); index >= 0; index--)
+    {
+        gsize class_size = (gsize) DOWNLOAD_BUFFER_POOL_MIN_SIZE << index;
+        gpointer buffer = pool->free_buffers[index];
+
+        if (buffer)
+        {
+            pool->free_buffers[index] = *(gpointer *) buffer;
+            pool->cached -= class_size;
+            pool->in_use += class_size;
+
+            g_mutex_unlock (&pool->mutex);
+
+            *out_size = class_size;
+            return buffer;
+        }
+
+        if (pool->in_use + class_size <= pool->memory_limit || pool->in_use == 0)
+        {
+            download_buffer_pool_trim (pool, class_size);
+            pool->in_use += class_size;
+
+            buffer = g_malloc (class_size);
+            g_hash_table_insert (pool->serials,
+                                 buffer,
+                                 GSIZE_TO_POINTER (g_atomic_pointer_add (&download_buffer_pool_next_serial, 1)));
+
+            g_mutex_unlock (&pool->mutex);
+
+            *out_size = class_size;
+            return buffer;
+        }
+    }
+
+    g_mutex_unlock (&pool->mutex);
+
+    *out_size = 0;
+    return NULL;
+}
+
+/**
+ * download_buffer_pool_release:
+ * @pool: a #DownloadBufferPool
+ * @buffer: a buffer from download_buffer_pool_acquire()
+ * @size: the size download_buffer_pool_acquire() returned for @buffer
+ *
+ * Gives @buffer back to @pool and wakes the sources waiting for memory.
+ */
+void
+download_buffer_pool_release (DownloadBufferPool *pool,
+                              gpointer            buffer,
+                              gsize               size)
+{
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (buffer != NULL);
+
+    guint index = download_buffer_pool_class_for_size (size);
+    gboolean waiters;
+
+    g_mutex_lock (&pool->mutex);
+
+    pool->in_use -= size;
+
+    // Keep a quarter of the limit around for reuse, free the rest
+    if (pool->in_use + pool->cached + size <= pool->memory_limit &&
+        pool->cached + size <= pool->memory_limit / 4)
+    {
+        *(gpointer *) buffer = pool->free_buffers[index];
+        pool->free_buffers[index] = buffer;
+        pool->cached += size;
+    }
+    else
+    {
+        g_hash_table_remove (pool->serials, buffer);
+        g_free (buffer);
+    }
+
+    waiters = pool->waiters != NULL;
+
+    g_mutex_unlock (&pool->mutex);
+
+    if (waiters)
+        download_buffer_pool_wake (pool);
+}
+
+typedef struct _DownloadBufferPoolLoan {
+    DownloadBufferPool *pool;
+    gpointer buffer;
+    gsize size;
+} DownloadBufferPoolLoan;
+
+/**
+ * download_buffer_pool_loan_free:
+ * @user_data: a #DownloadBufferPoolLoan
+ *
+ * Gives the buffer of a #GBytes made by download_buffer_pool_wrap() back to
+ * its pool once the last reference to the #GBytes is dropped, from whichever
+ * thread dropped it.
+ */
+static void
+download_buffer_pool_loan_free (gpointer user_data)
+{
+    DownloadBufferPoolLoan *loan = user_data;
+
+    download_buffer_pool_release (loan->pool, loan->buffer, loan->size);
+    download_buffer_pool_unref (loan->pool);
+
+    g_slice_free (DownloadBufferPoolLoan, loan);
+}
+
+/**
+ * download_buffer_pool_wrap:
+ * @pool: a #DownloadBufferPool
+ * @buffer: (transfer full): a buffer from download_buffer_pool_acquire()
+ * @size: the size download_buffer_pool_acquire() returned for @buffer
+ * @length: the number of bytes of @buffer in use
+ *
+ * Hands @buffer on as a #GBytes without copying it. @buffer goes back to
+ * @pool once the last reference to the #GBytes is dropped, until then it
+ * counts against the memory limit, so consumers that hold on to the bytes
+ * slow the downloads sharing @pool down rather than growing memory.
+ *
+ * Returns: (transfer full): a #GBytes of the first @length bytes of @buffer
+ */
+GBytes *
+download_buffer_pool_wrap (DownloadBufferPool *pool,
+                           gpointer            buffer,
+                           gsize               size,
+                           gsize               length)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+    g_return_val_if_fail (buffer != NULL, NULL);
+    g_return_val_if_fail (length <= size, NULL);
+
+    DownloadBufferPoolLoan *loan;
+
+    loan = g_slice_new0 (DownloadBufferPoolLoan);
+    loan->pool = download_buffer_pool_ref (pool);
+    loan->buffer = buffer;
+    loan->size = size;
+
+    return g_bytes_new_with_free_func (buffer, length, download_buffer_pool_loan_free, loan);
+}
+
+/**
+ * download_buffer_pool_source_dispatch:
+ * @source: a #DownloadBufferPoolSource
+ * @callback: a #GSourceFunc
+ * @user_data: data to pass to @callback
+ *
+ * Calls @callback once memory was released, or when the #GCancellable the
+ * source was created with is cancelled.
+ *
+ * Returns: the value returned by @callback
+ */
+static gboolean
+download_buffer_pool_source_dispatch (GSource     *source,
+                                      GSourceFunc  callback,
+                                      gpointer     user_data)
+{
+    g_source_set_ready_time (source, -1);
+
+    if (!callback)
+        return G_SOURCE_REMOVE;
+
+    return callback (user_data);
+}
+
+/**
+ * download_buffer_pool_source_finalize:
+ * @source: a #DownloadBufferPoolSource
+ *
+ * Drops the reference @source held on its pool, which no longer lists it.
+ */
+static void
+download_buffer_pool_source_finalize (GSource *source)
+{
+    DownloadBufferPoolSource *pool_source = (DownloadBufferPoolSource *) source;
+
+    download_buffer_pool_unref (pool_source->pool);
+}
+
+static GSourceFuncs download_buffer_pool_source_funcs = {
+    NULL,
+    NULL,
+    download_buffer_pool_source_dispatch,
+    download_buffer_pool_source_finalize,
+};
+
+/**
+ * download_buffer_pool_create_source:
+ * @pool: a #DownloadBufferPool
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Creates a #GSource that dispatches once @pool has released memory, or right
+ * away if it already has room for the smallest buffer. The callback should
+ * retry download_buffer_pool_acquire() and create a new source if it fails
+ * again. The source also dispatches when @cancellable is cancelled.
+ *
+ * Returns: (transfer full): a new #GSource
+ */
+GSource *
+download_buffer_pool_create_source (DownloadBufferPool *pool,
+                                    GCancellable       *cancellable)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+
+    DownloadBufferPoolSource *pool_source;
+    GSource *source;
+    GList *destroyed = NULL;
+    GList *l;
+
+    source = g_source_new (&download_buffer_pool_source_funcs, sizeof (DownloadBufferPoolSource));
+    g_source_set_name (source, "DownloadBufferPoolSource");
+
+    pool_source = (DownloadBufferPoolSource *) source;
+    pool_source->pool = download_buffer_pool_ref (pool);
+
+    if (cancellable)
+    {
+        GSource *cancellable_source = g_cancellable_source_new (cancellable);
+
+        g_source_set_dummy_callback (cancellable_source);
+        g_source_add_child_source (source, cancellable_source);
+        g_source_unref (cancellable_source);
+    }
+
+    g_mutex_lock (&pool->mutex);
+
+    // Memory may have been released between the failed acquire and now
+    if (pool->in_use == 0 || pool->in_use + DOWNLOAD_BUFFER_POOL_MIN_SIZE <= pool->memory_limit)
+        g_source_set_ready_time (source, 0);
+
+    // Sources destroyed without being woken would wait in the list until
+    // the next release otherwise
+    for (l = pool->waiters; l != NULL;)
+    {
+        GList *next = l->next;
+
+        if (g_source_is_destroyed (l->data))
+        {
+            pool->waiters = g_list_remove_link (pool->waiters, l);
+            destroyed = g_list_concat (l, destroyed);
+        }
+
+        l = next;
+    }
+
+    // The list keeps its own reference, a source it holds cannot be
+    // finalized before download_buffer_pool_wake() is done with it
+    pool->waiters = g_list_prepend (pool->waiters, g_source_ref (source));
+
+    g_mutex_unlock (&pool->mutex);
+
+    g_list_free_full (destroyed, (GDestroyNotify) g_source_unref);
+
+    return source;
+}
@@ -0,0 +1,63 @@
+#ifndef DOWNLOAD_BUFFER_POOL_H
+#define DOWNLOAD_BUFFER_POOL_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define DOWNLOAD_BUFFER_POOL_MIN_SIZE      (16 * 1024)
+#define DOWNLOAD_BUFFER_POOL_MAX_SIZE      (4 * 1024 * 1024)
+#define DOWNLOAD_BUFFER_POOL_DEFAULT_LIMIT (256 * 1024 * 1024)
+
+typedef struct _DownloadBufferPool DownloadBufferPool;
+
+DownloadBufferPool *
+download_buffer_pool_new (gsize memory_limit);
+
+DownloadBufferPool *
+download_buffer_pool_get_default (void);
+
+DownloadBufferPool *
+download_buffer_pool_ref (DownloadBufferPool *pool);
+
+void
+download_buffer_pool_unref (DownloadBufferPool *pool);
+
+void
+download_buffer_pool_set_memory_limit (DownloadBufferPool *pool,
+                                       gsize               memory_limit);
+
+gsize
+download_buffer_pool_get_memory_limit (DownloadBufferPool *pool);
+
+gsize
+download_buffer_pool_get_memory_used (DownloadBufferPool *pool);
+
+guint64
+download_buffer_pool_get_serial (DownloadBufferPool *pool,
+                                 gconstpointer       buffer);
+
+gpointer
+download_buffer_pool_acquire (DownloadBufferPool *pool,
+                              gsize               size,
+                              gsize              *out_size);
+
+void
+download_buffer_pool_release (DownloadBufferPool *pool,
+                              gpointer            buffer,
+                              gsize               size);
+
+GBytes *
+download_buffer_pool_wrap (DownloadBufferPool *pool,
+                           gpointer            buffer,
+                           gsize               size,
+                           gsize               length);
+
+GSource *
+download_buffer_pool_create_source (DownloadBufferPool *pool,
+                                    GCancellable       *cancellable);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_BUFFER_POOL_H */
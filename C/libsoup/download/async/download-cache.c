@@ -0,0 +1,824 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-cache.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+/**
+ * SECTION:download-cache
+ * @title: Download Cache
+ * @short_description: Revalidates downloaded files instead of fetching them again
+ * @include: download-cache.h
+ * @see_also: #GKeyFile, #DownloadResourceData
+ *
+ * A #DownloadCache remembers, per uri, the file a download saved it to along
+ * with the ETag and Last-Modified validators of the response, the length and
+ * modification time of the file and its digest when one was computed. The
+ * next download of the same uri to the same file sends If-None-Match and
+ * If-Modified-Since, and a 304 Not Modified answer completes it without
+ * transferring the body, download_resource_data_is_cache_hit() then
+ * returns %TRUE.
+ *
+ * The index is a #GKeyFile, one group per uri:
+ *
+ * |[
+ * [0a4d55a8d778e5022fab701977c5d840bbc486d0]
+ * Uri=https://example.com/metadata.json
+ * Path=/home/user/Downloads/metadata.json
+ * ETag="5e8c-59a0b1c2"
+ * LastModified=Tue, 13 Oct 2026 08:00:00 GMT
+ * Size=4096
+ * MTime=1791878400
+ * Checksum=SHA-256
+ * Digest=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08
+ * LastUsed=1791878400
+ * ]|
+ *
+ * The files the index records add up to at most its size budget. Once a
+ * store goes over it the entries used least recently are dropped from the
+ * index, their files are left alone: they belong to whoever downloaded
+ * them, the cache only stops revalidating them. The index is written in a
+ * worker thread.
+ **/
+
+struct _DownloadCache {
+    gint ref_count;
+    GMutex mutex;
+
+    gchar *index_path;
+    guint64 max_size;
+    guint64 size;
+
+    // Uri -> DownloadCacheEntry
+    GHashTable *entries;
+
+    gboolean saving;
+    gboolean dirty;
+};
+
+typedef struct _DownloadCacheSaveData {
+    gchar *path;
+    gchar *contents;
+    gsize length;
+} DownloadCacheSaveData;
+
+/**
+ * download_cache_entry_copy:
+ * @entry: a #DownloadCacheEntry
+ *
+ * Copies @entry.
+ *
+ * Returns: (transfer full): a copy of @entry
+ */
+DownloadCacheEntry *
+download_cache_entry_copy (const DownloadCacheEntry *entry)
+{
+    g_return_val_if_fail (entry != NULL, NULL);
+
+    DownloadCacheEntry *copy;
+
+    copy = g_slice_new0 (DownloadCacheEntry);
+    copy->uri = g_strdup (entry->uri);
+    copy->path = g_strdup (entry->path);
+    copy->etag = g_strdup (entry->etag);
+    copy->last_modified = g_strdup (entry->last_modified);
+    copy->size = entry->size;
+    copy->mtime = entry->mtime;
+    copy->checksum = entry->checksum;
+    copy->digest = g_strdup (entry->digest);
+    copy->last_used = entry->last_used;
+
+    return copy;
+}
+
+/**
+ * download_cache_entry_free:
+ * @entry: a #DownloadCacheEntry
+ *
+ * Frees a #DownloadCacheEntry struct.
+ */
+void
+download_cache_entry_free (DownloadCacheEntry *entry)
+{
+    if (entry == NULL)
+        return;
+
+    g_free (entry->uri);
+    g_free (entry->path);
+    g_free (entry->etag);
+    g_free (entry->last_modified);
+    g_free (entry->digest);
+
+    g_slice_free (DownloadCacheEntry, entry);
+}
+
+/**
+ * download_cache_save_data_free:
+ * @user_data: a #DownloadCacheSaveData
+ *
+ * Frees a #DownloadCacheSaveData struct.
+ */
+static void
+download_cache_save_data_free (gpointer user_data)
+{
+    DownloadCacheSaveData *save_data = user_data;
+
+    g_free (save_data->path);
+    g_free (save_data->contents);
+
+    g_slice_free (DownloadCacheSaveData, save_data);
+}
+
+/**
+ * download_cache_get_group:
+ * @uri: a uri
+ *
+ * Gets the name of the index group of @uri. Uris may hold characters a
+ * #GKeyFile group name cannot, so the group is named after their hash.
+ *
+ * Returns: (transfer full): the group name
+ */
+static gchar *
+download_cache_get_group (const gchar *uri)
+{
+    return g_compute_checksum_for_string (G_CHECKSUM_SHA1, uri, -1);
+}
+
+/**
+ * download_cache_parse_checksum:
+ * @name: (nullable): a name from download_checksum_type_get_name()
+ *
+ * Gets the #DownloadChecksumType called @name.
+ *
+ * Returns: the #DownloadChecksumType, %DOWNLOAD_CHECKSUM_NONE if @name is
+ *          not known
+ */
+static DownloadChecksumType
+download_cache_parse_checksum (const gchar *name)
+{
+    DownloadChecksumType types[] = { DOWNLOAD_CHECKSUM_SHA256, DOWNLOAD_CHECKSUM_BLAKE3 };
+    guint i;
+
+    for (i = 0; name && i < G_N_ELEMENTS (types); i++)
+    {
+        if (g_strcmp0 (name, download_checksum_type_get_name (types[i])) == 0)
+            return types[i];
+    }
+
+    return DOWNLOAD_CHECKSUM_NONE;
+}
+
+/**
+ * download_cache_insert:
+ * @cache: a locked #DownloadCache
+ * @entry: (transfer full): a #DownloadCacheEntry
+ *
+ * Adds @entry to @cache, replacing the entry of the same uri.
+ */
+static void
+download_cache_insert (DownloadCache      *cache,
+                       DownloadCacheEntry *entry)
+{
+    DownloadCacheEntry *old;
+
+    old = g_hash_table_lookup (cache->entries, entry->uri);
+
+    if (old)
+        cache->size -= old->size;
+
+    cache->size += entry->size;
+
+    g_hash_table_replace (cache->entries, entry->uri, entry);
+}
+
+/**
+ * download_cache_load:
+ * @cache: a #DownloadCache
+ *
+ * Reads the index of @cache. A missing index is an empty cache, groups that
+ * cannot be read are skipped.
+ */
+static void
+download_cache_load (DownloadCache *cache)
+{
+    GKeyFile *key_file;
+    GError *error = NULL;
+    gchar **groups;
+    gsize i;
+
+    key_file = g_key_file_new ();
+
+    if (!g_key_file_load_from_file (key_file, cache->index_path, G_KEY_FILE_NONE, &error))
+    {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning ("Failed to read download cache index \"%s\": %s", cache->index_path, error->message);
+
+        g_error_free (error);
+        g_key_file_free (key_file);
+        return;
+    }
+
+    groups = g_key_file_get_groups (key_file, NULL);
+
+    for (i = 0; groups[i]; i++)
+    {
+        DownloadCacheEntry *entry;
+        gchar *checksum;
+
+        entry = g_slice_new0 (DownloadCacheEntry);
+        entry->uri = g_key_file_get_string (key_file, groups[i], "Uri", NULL);
+        entry->path = g_key_file_get_string (key_file, groups[i], "Path", NULL);
+        entry->etag = g_key_file_get_string (key_file, groups[i], "ETag", NULL);
+        entry->last_modified = g_key_file_get_string (key_file, groups[i], "LastModified", NULL);
+        entry->size = g_key_file_get_uint64 (key_file, groups[i], "Size", NULL);
+        entry->mtime = g_key_file_get_int64 (key_file, groups[i], "MTime", NULL);
+        entry->digest = g_key_file_get_string (key_file, groups[i], "Digest", NULL);
+        entry->last_used = g_key_file_get_int64 (key_file, groups[i], "LastUsed", NULL);
+
+        checksum = g_key_file_get_string (key_file, groups[i], "Checksum", NULL);
+        entry->checksum = download_cache_parse_checksum (checksum);
+        g_free (checksum);
+
+        if (!entry->uri || !entry->path || (!entry->etag && !entry->last_modified))
+        {
+            download_cache_entry_free (entry);
+            continue;
+        }
+
+        download_cache_insert (cache, entry);
+    }
+
+    g_strfreev (groups);
+    g_key_file_free (key_file);
+}
+
+/**
+ * download_cache_new:
+ * @index_path: the path of the index file
+ * @max_size: the most bytes the files of the cache add up to, 0 for
+ *            %DOWNLOAD_CACHE_DEFAULT_MAX_SIZE
+ *
+ * Creates a #DownloadCache keeping its index at @index_path, reading the
+ * entries an earlier run left there.
+ *
+ * Returns: (transfer full): a new #DownloadCache, free with
+ *          download_cache_unref()
+ */
+DownloadCache *
+download_cache_new (const gchar *index_path,
+                    guint64      max_size)
+{
+    g_return_val_if_fail (index_path != NULL, NULL);
+
+    DownloadCache *cache;
+
+    cache = g_slice_new0 (DownloadCache);
+    cache->ref_count = 1;
+    g_mutex_init (&cache->mutex);
+
+    cache->index_path = g_strdup (index_path);
+    cache->max_size = max_size ? max_size : DOWNLOAD_CACHE_DEFAULT_MAX_SIZE;
+    cache->entries = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            NULL,
+                                            (GDestroyNotify) download_cache_entry_free);
+
+    download_cache_load (cache);
+
+    return cache;
+}
+
+/**
+ * download_cache_get_for_directory:
+ * @directory: a download directory
+ *
+ * Gets the #DownloadCache of the files downloaded into @directory, whose
+ * index is the %DOWNLOAD_CACHE_INDEX_NAME file in @directory. It is created
+ * on first use with the default size budget and shared from then on.
+ *
+ * Returns: (transfer none): the #DownloadCache of @directory
+ */
+DownloadCache *
+download_cache_get_for_directory (const gchar *directory)
+{
+    g_return_val_if_fail (directory != NULL, NULL);
+
+    G_LOCK_DEFINE_STATIC (caches);
+    static GHashTable *caches = NULL;
+    DownloadCache *cache;
+
+    G_LOCK (caches);
+
+    if (!caches)
+        caches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) download_cache_unref);
+
+    cache = g_hash_table_lookup (caches, directory);
+
+    if (!cache)
+    {
+        gchar *index_path = g_build_filename (directory, DOWNLOAD_CACHE_INDEX_NAME, NULL);
+
+        cache = download_cache_new (index_path, 0);
+        g_hash_table_insert (caches, g_strdup (directory), cache);
+
+        g_free (index_path);
+    }
+
+    G_UNLOCK (caches);
+
+    return cache;
+}
+
+/**
+ * download_cache_ref:
+ * @cache: a #DownloadCache
+ *
+ * Increases the reference count of @cache.
+ *
+ * Returns: (transfer full): @cache
+ */
+DownloadCache *
+download_cache_ref (DownloadCache *cache)
+{
+    g_return_val_if_fail (cache != NULL, NULL);
+    g_return_val_if_fail (cache->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&cache->ref_count);
+
+    return cache;
+}
+
+/**
+ * download_cache_unref:
+ * @cache: a #DownloadCache
+ *
+ * Decreases the reference count of @cache, freeing it when the count drops to
+ * zero. A save in progress holds its own reference.
+ */
+void
+download_cache_unref (DownloadCache *cache)
+{
+    g_return_if_fail (cache != NULL);
+    g_return_if_fail (cache->ref_count > 0);
+
+    if (!g_atomic_int_dec_and_test (&cache->ref_count))
+        return;
+
+    g_hash_table_unref (cache->entries);
+    g_free (cache->index_path);
+    g_mutex_clear (&cache->mutex);
+
+    g_slice_free (DownloadCache, cache);
+}
+
+/**
+ * download_cache_to_data:
+ * @cache: a locked #DownloadCache
+ * @length: (out): return location for the length of the data
+ *
+ * Writes the entries of @cache out in the #GKeyFile format described above.
+ *
+ * Returns: (transfer full): the contents of the index file
+ */
+static gchar *
+download_cache_to_data (DownloadCache *cache,
+                        gsize         *length)
+{
+    GHashTableIter iter;
+    DownloadCacheEntry *entry;
+    GKeyFile *key_file;
+    gchar *contents;
+
+    key_file = g_key_file_new ();
+
+    g_hash_table_iter_init (&iter, cache->entries);
+
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry))
+    {
+        gchar *group = download_cache_get_group (entry->uri);
+
+        g_key_file_set_string (key_file, group, "Uri", entry->uri);
+        g_key_file_set_string (key_file, group, "Path", entry->path);
+
+        if (entry->etag)
+            g_key_file_set_string (key_file, group, "ETag", entry->etag);
+
+        if (entry->last_modified)
+            g_key_file_set_string (key_file, group, "LastModified", entry->last_modified);
+
+        g_key_file_set_uint64 (key_file, group, "Size", entry->size);
+        g_key_file_set_int64 (key_file, group, "MTime", entry->mtime);
+
+        if (entry->digest)
+        {
+            g_key_file_set_string (key_file, group, "Checksum", download_checksum_type_get_name (entry->checksum));
+            g_key_file_set_string (key_file, group, "Digest", entry->digest);
+        }
+
+        g_key_file_set_int64 (key_file, group, "LastUsed", entry->last_used);
+
+        g_free (group);
+    }
+
+    contents = g_key_file_to_data (key_file, length, NULL);
+    g_key_file_free (key_file);
+
+    return contents;
+}
+
+/**
+ * download_cache_file_matches:
+ * @entry: a #DownloadCacheEntry
+ *
+ * Checks that the file of @entry still has the length and modification time
+ * it was recorded with, so that a file replaced or edited since is neither
+ * trusted nor removed.
+ *
+ * Returns: %TRUE if the file is the one @entry describes
+ */
+static gboolean
+download_cache_file_matches (const DownloadCacheEntry *entry)
+{
+    GStatBuf buf;
+
+    if (g_stat (entry->path, &buf) < 0)
+        return FALSE;
+
+    return (guint64) buf.st_size == entry->size && (gint64) buf.st_mtime == entry->mtime;
+}
+
+/**
+ * download_cache_save_thread:
+ * @task: a #GTask
+ * @source_object: %NULL
+ * @task_data: a #DownloadCacheSaveData
+ * @cancellable: a #GCancellable
+ *
+ * Replaces the index file.
+ */
+static void
+download_cache_save_thread (GTask        *task,
+                            gpointer      source_object,
+                            gpointer      task_data,
+                            GCancellable *cancellable)
+{
+    DownloadCacheSaveData *save_data = task_data;
+    GError *error = NULL;
+
+    if (!g_file_set_contents (save_data->path, save_data->contents, save_data->length, &error))
+        g_task_return_error (task, error);
+    else
+        g_task_return_boolean (task, TRUE);
+}
+
+static void
+download_cache_save (DownloadCache *cache);
+
+/**
+ * download_cache_save_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadCache
+ *
+ * Finishes saving the index, and saves it again if it changed meanwhile.
+ */
+static void
+download_cache_save_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+    DownloadCache *cache = user_data;
+    GError *error = NULL;
+    gboolean dirty;
+
+    if (!g_task_propagate_boolean (G_TASK (result), &error))
+    {
+        g_warning ("Failed to save download cache index \"%s\": %s", cache->index_path, error->message);
+        g_error_free (error);
+    }
+
+    g_mutex_lock (&cache->mutex);
+    cache->saving = FALSE;
+    dirty = cache->dirty;
+    g_mutex_unlock (&cache->mutex);
+
+    if (dirty)
+        download_cache_save (cache);
+
+    download_cache_unref (cache);
+}
+
+/**
+ * download_cache_save:
+ * @cache: a #DownloadCache, unlocked
+ *
+ * Writes the index of @cache in a worker thread, one save at a time. Changes
+ * made while a save runs are written by the next one.
+ */
+static void
+download_cache_save (DownloadCache *cache)
+{
+    DownloadCacheSaveData *save_data;
+    GTask *task;
+
+    g_mutex_lock (&cache->mutex);
+
+    if (cache->saving)
+    {
+        cache->dirty = TRUE;
+        g_mutex_unlock (&cache->mutex);
+
+        return;
+    }
+
+    save_data = g_slice_new0 (DownloadCacheSaveData);
+    save_data->path = g_strdup (cache->index_path);
+    save_data->contents = download_cache_to_data (cache, &save_data->length);
+    cache->saving = TRUE;
+    cache->dirty = FALSE;
+
+    g_mutex_unlock (&cache->mutex);
+
+    task = g_task_new (NULL, NULL, download_cache_save_cb, download_cache_ref (cache));
+    g_task_set_task_data (task, save_data, download_cache_save_data_free);
+    g_task_run_in_thread (task, download_cache_save_thread);
+    g_object_unref (task);
+}
+
+/**
+ * download_cache_evict:
+ * @cache: a locked #DownloadCache
+ * @keep: (nullable): the uri of an entry that must stay
+ *
+ * Drops the entries used least recently until the files of @cache fit in
+ * its size budget, @keep aside. Their files stay where they are.
+ *
+ * Returns: %TRUE if an entry was dropped
+ */
+static gboolean
+download_cache_evict (DownloadCache *cache,
+                      const gchar   *keep)
+{
+    gboolean evicted = FALSE;
+
+    while (cache->size > cache->max_size)
+    {
+        GHashTableIter iter;
+        DownloadCacheEntry *entry;
+        DownloadCacheEntry *oldest = NULL;
+
+        g_hash_table_iter_init (&iter, cache->entries);
+
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry))
+        {
+            if (g_strcmp0 (entry->uri, keep) == 0)
+                continue;
+
+            if (!oldest || entry->last_used < oldest->last_used)
+                oldest = entry;
+        }
+
+        if (!oldest)
+            break;
+
+        g_debug ("Evicting \"%s\" from the download cache", oldest->path);
+
+        cache->size -= oldest->size;
+        evicted = TRUE;
+
+        g_hash_table_remove (cache->entries, oldest->uri);
+    }
+
+    return evicted;
+}
+
+/**
+ * download_cache_set_max_size:
+ * @cache: a #DownloadCache
+ * @max_size: the most bytes the files of the cache add up to, 0 for
+ *            %DOWNLOAD_CACHE_DEFAULT_MAX_SIZE
+ *
+ * Changes the size budget of @cache, evicting entries right away if it
+ * shrank below what the cache holds.
+ */
+void
+download_cache_set_max_size (DownloadCache *cache,
+                             guint64        max_size)
+{
+    g_return_if_fail (cache != NULL);
+
+    gboolean evicted;
+
+    g_mutex_lock (&cache->mutex);
+
+    cache->max_size = max_size ? max_size : DOWNLOAD_CACHE_DEFAULT_MAX_SIZE;
+    evicted = download_cache_evict (cache, NULL);
+
+    g_mutex_unlock (&cache->mutex);
+
+    if (evicted)
+        download_cache_save (cache);
+}
+
+/**
+ * download_cache_get_max_size:
+ * @cache: a #DownloadCache
+ *
+ * Gets the size budget of @cache.
+ *
+ * Returns: the most bytes the files of @cache add up to
+ */
+guint64
+download_cache_get_max_size (DownloadCache *cache)
+{
+    g_return_val_if_fail (cache != NULL, 0);
+
+    guint64 max_size;
+
+    g_mutex_lock (&cache->mutex);
+    max_size = cache->max_size;
+    g_mutex_unlock (&cache->mutex);
+
+    return max_size;
+}
+
+/**
+ * download_cache_get_size:
+ * @cache: a #DownloadCache
+ *
+ * Gets how many bytes the files of @cache add up to.
+ *
+ * Returns: the size of the cache in bytes
+ */
+guint64
+download_cache_get_size (DownloadCache *cache)
+{
+    g_return_val_if_fail (cache != NULL, 0);
+
+    guint64 size;
+
+    g_mutex_lock (&cache->mutex);
+    size = cache->size;
+    g_mutex_unlock (&cache->mutex);
+
+    return size;
+}
+
+/**
+ * download_cache_lookup:
+ * @cache: a #DownloadCache
+ * @uri: a uri
+ * @path: the path @uri is about to be downloaded to
+ *
+ * Finds what @cache knows of @uri, provided it was saved to @path and the
+ * file did not change since. An entry whose file changed is dropped.
+ *
+ * Returns: (transfer full) (nullable): a copy of the #DownloadCacheEntry,
+ *          free with download_cache_entry_free(), or %NULL
+ */
+DownloadCacheEntry *
+download_cache_lookup (DownloadCache *cache,
+                       const gchar   *uri,
+                       const gchar   *path)
+{
+    g_return_val_if_fail (cache != NULL, NULL);
+    g_return_val_if_fail (uri != NULL, NULL);
+    g_return_val_if_fail (path != NULL, NULL);
+
+    DownloadCacheEntry *entry;
+
+    g_mutex_lock (&cache->mutex);
+
+    entry = g_hash_table_lookup (cache->entries, uri);
+    entry = entry ? download_cache_entry_copy (entry) : NULL;
+
+    g_mutex_unlock (&cache->mutex);
+
+    if (!entry)
+        return NULL;
+
+    if (g_strcmp0 (entry->path, path) != 0)
+    {
+        download_cache_entry_free (entry);
+        return NULL;
+    }
+
+    if (!download_cache_file_matches (entry))
+    {
+        g_debug ("\"%s\" changed since it was downloaded, dropping it from the download cache", entry->path);
+
+        download_cache_remove (cache, uri);
+        download_cache_entry_free (entry);
+
+        return NULL;
+    }
+
+    return entry;
+}
+
+/**
+ * download_cache_store:
+ * @cache: a #DownloadCache
+ * @entry: the #DownloadCacheEntry of a download that just completed
+ *
+ * Records @entry as the latest download of @entry->uri, then evicts what no
+ * longer fits in the size budget. The length and modification time are read
+ * from the file, the ones in @entry are ignored. A response without ETag or
+ * Last-Modified cannot be revalidated, its uri is dropped from @cache
+ * instead.
+ */
+void
+download_cache_store (DownloadCache            *cache,
+                      const DownloadCacheEntry *entry)
+{
+    g_return_if_fail (cache != NULL);
+    g_return_if_fail (entry != NULL && entry->uri != NULL && entry->path != NULL);
+
+    DownloadCacheEntry *copy;
+    GStatBuf buf;
+
+    if ((!entry->etag && !entry->last_modified) || g_stat (entry->path, &buf) < 0)
+    {
+        download_cache_remove (cache, entry->uri);
+        return;
+    }
+
+    copy = download_cache_entry_copy (entry);
+    copy->size = buf.st_size;
+    copy->mtime = buf.st_mtime;
+    copy->last_used = g_get_real_time () / G_USEC_PER_SEC;
+
+    g_mutex_lock (&cache->mutex);
+
+    download_cache_insert (cache, copy);
+    download_cache_evict (cache, copy->uri);
+
+    g_mutex_unlock (&cache->mutex);
+
+    download_cache_save (cache);
+}
+
+/**
+ * download_cache_touch:
+ * @cache: a #DownloadCache
+ * @uri: a uri
+ *
+ * Marks the entry of @uri as just used, after a download found it still
+ * fresh, so that it is evicted last.
+ */
+void
+download_cache_touch (DownloadCache *cache,
+                      const gchar   *uri)
+{
+    g_return_if_fail (cache != NULL);
+    g_return_if_fail (uri != NULL);
+
+    DownloadCacheEntry *entry;
+
+    g_mutex_lock (&cache->mutex);
+
+    entry = g_hash_table_lookup (cache->entries, uri);
+
+    if (entry)
+        entry->last_used = g_get_real_time () / G_USEC_PER_SEC;
+
+    g_mutex_unlock (&cache->mutex);
+
+    if (entry)
+        download_cache_save (cache);
+}
+
+/**
+ * download_cache_remove:
+ * @cache: a #DownloadCache
+ * @uri: a uri
+ *
+ * Forgets @uri, its file is left alone.
+ */
+void
+download_cache_remove (DownloadCache *cache,
+                       const gchar   *uri)
+{
+    g_return_if_fail (cache != NULL);
+    g_return_if_fail (uri != NULL);
+
+    DownloadCacheEntry *entry;
+    gboolean removed = FALSE;
+
+    g_mutex_lock (&cache->mutex);
+
+    entry = g_hash_table_lookup (cache->entries, uri);
+
+    if (entry)
+    {
+        cache->size -= entry->size;
+        removed = g_hash_table_remove (cache->entries, uri);
+    }
+
+    g_mutex_unlock (&cache->mutex);
+
+    if (removed)
+        download_cache_save (cache);
+}
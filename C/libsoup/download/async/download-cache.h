@@ -0,0 +1,83 @@
+#ifndef DOWNLOAD_CACHE_H
+#define DOWNLOAD_CACHE_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "download-checksum.h"
+
+G_BEGIN_DECLS
+
+#define DOWNLOAD_CACHE_INDEX_NAME       ".download-cache"
+#define DOWNLOAD_CACHE_DEFAULT_MAX_SIZE (G_GUINT64_CONSTANT (4) * 1024 * 1024 * 1024)
+
+typedef struct _DownloadCache DownloadCache;
+
+typedef struct _DownloadCacheEntry {
+    gchar *uri;
+    gchar *path;
+
+    gchar *etag;
+    gchar *last_modified;
+
+    // Length and modification time of the file when it was recorded, a file
+    // that no longer matches them is not trusted
+    guint64 size;
+    gint64 mtime;
+
+    DownloadChecksumType checksum;
+    gchar *digest;
+
+    // Wall clock time of the last download that used the entry, in seconds
+    gint64 last_used;
+} DownloadCacheEntry;
+
+DownloadCache *
+download_cache_new (const gchar *index_path,
+                    guint64      max_size);
+
+DownloadCache *
+download_cache_get_for_directory (const gchar *directory);
+
+DownloadCache *
+download_cache_ref (DownloadCache *cache);
+
+void
+download_cache_unref (DownloadCache *cache);
+
+void
+download_cache_set_max_size (DownloadCache *cache,
+                             guint64        max_size);
+
+guint64
+download_cache_get_max_size (DownloadCache *cache);
+
+guint64
+download_cache_get_size (DownloadCache *cache);
+
+DownloadCacheEntry *
+download_cache_lookup (DownloadCache *cache,
+                       const gchar   *uri,
+                       const gchar   *path);
+
+void
+download_cache_store (DownloadCache            *cache,
+                      const DownloadCacheEntry *entry);
+
+void
+download_cache_touch (DownloadCache *cache,
+                      const gchar   *uri);
+
+void
+download_cache_remove (DownloadCache *cache,
+                       const gchar   *uri);
+
+DownloadCacheEntry *
+download_cache_entry_copy (const DownloadCacheEntry *entry);
+
+void
+download_cache_entry_free (DownloadCacheEntry *entry);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_CACHE_H */
@@ -0,0 +1,337 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-checksum.h"
+
+#include <glib.h>
+
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+#endif
+
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+/**
+ * SECTION:download-checksum
+ * @title: Download Checksum
+ * @short_description: Streaming digests of downloaded bytes
+ * @include: download-checksum.h
+ * @see_also: #GChecksum
+ *
+ * A #DownloadChecksum hashes the bytes of a download as they are written, so
+ * verifying a file needs no second read of it.
+ *
+ * SHA-256 goes through libcrypto when the build found it, which picks the
+ * SHA extensions or AVX2 code of the CPU at runtime, and falls back to
+ * #GChecksum otherwise. BLAKE3 needs libblake3, which has SIMD code for
+ * SSE4.1, AVX2, AVX-512 and NEON. Use download_checksum_type_is_supported()
+ * to find out what this build offers.
+ **/
+
+struct _DownloadChecksum {
+    DownloadChecksumType type;
+
+#ifdef HAVE_LIBCRYPTO
+    EVP_MD_CTX *md_context;
+#else
+    GChecksum *g_checksum;
+#endif
+
+#ifdef HAVE_BLAKE3
+    blake3_hasher blake3;
+#endif
+};
+
+#if defined (HAVE_LIBCRYPTO) || defined (HAVE_BLAKE3)
+/**
+ * download_checksum_to_hex:
+ * @digest: a raw digest
+ * @length: the number of bytes in @digest
+ *
+ * Formats @digest the way g_checksum_get_string() does.
+ *
+ * Returns: (transfer full): @digest as lower case hexadecimal
+ */
+static gchar *
+download_checksum_to_hex (const guchar *digest,
+                          gsize         length)
+{
+    static const gchar hex[] = "0123456789abcdef";
+    gchar *string;
+    gsize i;
+
+    string = g_malloc (length * 2 + 1);
+
+    for (i = 0; i < length; i++)
+    {
+        string[2 * i] = hex[digest[i] >> 4];
+        string[2 * i + 1] = hex[digest[i] & 0xf];
+    }
+
+    string[length * 2] = '\0';
+
+    return string;
+}
+#endif
+
+/**
+ * download_checksum_type_is_supported:
+ * @type: a #DownloadChecksumType
+ *
+ * Checks whether this build can compute @type.
+ *
+ * Returns: %TRUE if download_checksum_new() accepts @type
+ */
+gboolean
+download_checksum_type_is_supported (DownloadChecksumType type)
+{
+    switch (type)
+    {
+        case DOWNLOAD_CHECKSUM_SHA256:
+            return TRUE;
+
+        case DOWNLOAD_CHECKSUM_BLAKE3:
+#ifdef HAVE_BLAKE3
+            return TRUE;
+#else
+            return FALSE;
+#endif
+
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * download_checksum_type_get_name:
+ * @type: a #DownloadChecksumType
+ *
+ * Gets the name of @type, for messages.
+ *
+ * Returns: the name of @type
+ */
+const gchar *
+download_checksum_type_get_name (DownloadChecksumType type)
+{
+    switch (type)
+    {
+        case DOWNLOAD_CHECKSUM_SHA256:
+            return "SHA-256";
+
+        case DOWNLOAD_CHECKSUM_BLAKE3:
+            return "BLAKE3";
+
+        default:
+            return "none";
+    }
+}
+
+/**
+ * download_checksum_new:
+ * @type: a #DownloadChecksumType
+ *
+ * Creates a #DownloadChecksum computing @type.
+ *
+ * Returns: (transfer full) (nullable): a new #DownloadChecksum, or %NULL if
+ *          @type is not supported by this build
+ */
+DownloadChecksum *
+download_checksum_new (DownloadChecksumType type)
+{
+    DownloadChecksum *checksum;
+
+    if (!download_checksum_type_is_supported (type))
+        return NULL;
+
+    checksum = g_slice_new0 (DownloadChecksum);
+    checksum->type = type;
+
+    if (type == DOWNLOAD_CHECKSUM_SHA256)
+    {
+#ifdef HAVE_LIBCRYPTO
+        checksum->md_context = EVP_MD_CTX_new ();
+#else
+        checksum->g_checksum = g_checksum_new (G_CHECKSUM_SHA256);
+#endif
+    }
+
+    download_checksum_reset (checksum);
+
+    return checksum;
+}
+
+/**
+ * download_checksum_get_checksum_type:
+ * @checksum: a #DownloadChecksum
+ *
+ * Gets the #DownloadChecksumType @checksum computes.
+ *
+ * Returns: the #DownloadChecksumType of @checksum
+ */
+DownloadChecksumType
+download_checksum_get_checksum_type (DownloadChecksum *checksum)
+{
+    g_return_val_if_fail (checksum != NULL, DOWNLOAD_CHECKSUM_NONE);
+
+    return checksum->type;
+}
+
+/**
+ * download_checksum_free:
+ * @checksum: a #DownloadChecksum
+ *
+ * Frees a #DownloadChecksum struct.
+ */
+void
+download_checksum_free (DownloadChecksum *checksum)
+{
+    if (checksum == NULL)
+        return;
+
+#ifdef HAVE_LIBCRYPTO
+    if (checksum->md_context)
+        EVP_MD_CTX_free (checksum->md_context);
+#else
+    if (checksum->g_checksum)
+        g_checksum_free (checksum->g_checksum);
+#endif
+
+    g_slice_free (DownloadChecksum, checksum);
+}
+
+/**
+ * download_checksum_reset:
+ * @checksum: a #DownloadChecksum
+ *
+ * Forgets every byte hashed so far, for a download that starts over.
+ */
+void
+download_checksum_reset (DownloadChecksum *checksum)
+{
+    g_return_if_fail (checksum != NULL);
+
+    switch (checksum->type)
+    {
+        case DOWNLOAD_CHECKSUM_SHA256:
+#ifdef HAVE_LIBCRYPTO
+            EVP_DigestInit_ex (checksum->md_context, EVP_sha256 (), NULL);
+#else
+            g_checksum_reset (checksum->g_checksum);
+#endif
+            break;
+
+        case DOWNLOAD_CHECKSUM_BLAKE3:
+#ifdef HAVE_BLAKE3
+            blake3_hasher_init (&checksum->blake3);
+#endif
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * download_checksum_update:
+ * @checksum: a #DownloadChecksum
+ * @data: the bytes to hash
+ * @length: the number of bytes in @data
+ *
+ * Feeds the next @length bytes of the download into @checksum.
+ */
+void
+download_checksum_update (DownloadChecksum *checksum,
+                          const guchar     *data,
+                          gsize             length)
+{
+    g_return_if_fail (checksum != NULL);
+
+    switch (checksum->type)
+    {
+        case DOWNLOAD_CHECKSUM_SHA256:
+#ifdef HAVE_LIBCRYPTO
+            EVP_DigestUpdate (checksum->md_context, data, length);
+#else
+            // GChecksum takes a gssize length
+            while (length > 0)
+            {
+                gsize n = MIN (length, G_MAXSSIZE);
+
+                g_checksum_update (checksum->g_checksum, data, n);
+
+                data += n;
+                length -= n;
+            }
+#endif
+            break;
+
+        case DOWNLOAD_CHECKSUM_BLAKE3:
+#ifdef HAVE_BLAKE3
+            blake3_hasher_update (&checksum->blake3, data, length);
+#endif
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * download_checksum_get_string:
+ * @checksum: a #DownloadChecksum
+ *
+ * Gets the digest of the bytes hashed so far as a lower case hexadecimal
+ * string. @checksum can be updated further afterwards.
+ *
+ * Returns: (transfer full): the digest
+ */
+gchar *
+download_checksum_get_string (DownloadChecksum *checksum)
+{
+    g_return_val_if_fail (checksum != NULL, NULL);
+
+#ifdef HAVE_LIBCRYPTO
+    EVP_MD_CTX *copy;
+    guchar digest[EVP_MAX_MD_SIZE];
+    guint length = 0;
+#else
+    GChecksum *copy;
+    gchar *string;
+#endif
+#ifdef HAVE_BLAKE3
+    guchar blake3_digest[BLAKE3_OUT_LEN];
+#endif
+
+    switch (checksum->type)
+    {
+        case DOWNLOAD_CHECKSUM_SHA256:
+#ifdef HAVE_LIBCRYPTO
+            copy = EVP_MD_CTX_new ();
+            EVP_MD_CTX_copy_ex (copy, checksum->md_context);
+            EVP_DigestFinal_ex (copy, digest, &length);
+            EVP_MD_CTX_free (copy);
+
+            return download_checksum_to_hex (digest, length);
+#else
+            // A GChecksum cannot be updated once its string was read
+            copy = g_checksum_copy (checksum->g_checksum);
+            string = g_strdup (g_checksum_get_string (copy));
+            g_checksum_free (copy);
+
+            return string;
+#endif
+
+        case DOWNLOAD_CHECKSUM_BLAKE3:
+#ifdef HAVE_BLAKE3
+            blake3_hasher_finalize (&checksum->blake3, blake3_digest, sizeof (blake3_digest));
+
+            return download_checksum_to_hex (blake3_digest, sizeof (blake3_digest));
+#else
+            return NULL;
+#endif
+
+        default:
+            return NULL;
+    }
+}
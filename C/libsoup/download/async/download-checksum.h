@@ -0,0 +1,44 @@
+#ifndef DOWNLOAD_CHECKSUM_H
+#define DOWNLOAD_CHECKSUM_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    DOWNLOAD_CHECKSUM_NONE,
+    DOWNLOAD_CHECKSUM_SHA256,
+    DOWNLOAD_CHECKSUM_BLAKE3
+} DownloadChecksumType;
+
+typedef struct _DownloadChecksum DownloadChecksum;
+
+gboolean
+download_checksum_type_is_supported (DownloadChecksumType type);
+
+const gchar *
+download_checksum_type_get_name (DownloadChecksumType type);
+
+DownloadChecksum *
+download_checksum_new (DownloadChecksumType type);
+
+DownloadChecksumType
+download_checksum_get_checksum_type (DownloadChecksum *checksum);
+
+void
+download_checksum_free (DownloadChecksum *checksum);
+
+void
+download_checksum_reset (DownloadChecksum *checksum);
+
+void
+download_checksum_update (DownloadChecksum *checksum,
+                          const guchar     *data,
+                          gsize             length);
+
+gchar *
+download_checksum_get_string (DownloadChecksum *checksum);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_CHECKSUM_H */
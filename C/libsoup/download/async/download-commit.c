@@ -0,0 +1,546 @@
+#define G_LOG_DOMAIN "download-async"
+
+#define _GNU_SOURCE
+
+#include "download-commit.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * SECTION:download-commit
+ * @title: Download Commit
+ * @short_description: Durable, atomic publishing of downloaded files
+ * @include: download-commit.h
+ * @see_also: #DownloadOptions
+ *
+ * A download to a file with #DownloadOptions.durability set above
+ * %DOWNLOAD_DURABILITY_NONE writes into "@path.part" and is only moved to
+ * @path once its bytes are on disk, so a crash or a reader never finds a
+ * torn file under the final name. With %DOWNLOAD_DURABILITY_FSYNC every
+ * file is flushed on its own with fdatasync(), unless the linked
+ * fdatasync() of its last io_uring write already did, see download-uring.
+ * After the rename, the directory is flushed with fsync() so the new name
+ * is on disk too.
+ *
+ * With %DOWNLOAD_DURABILITY_GROUP completed files wait in a
+ * #DownloadCommitGroup, for up to its max_delay or until it holds
+ * max_files of them. The whole group is then flushed at once by a thread
+ * of the group, which does the waiting as well, so pending files hold none
+ * of the #GTask worker threads the downloads need:
+ *
+ * - The writeback of every file is started with sync_file_range(), so the
+ *   disk sees all of it at once.
+ * - Each file is then waited for with fdatasync(). A group made with
+ *   use_syncfs instead makes one syncfs() call, when all its files are on
+ *   one filesystem.
+ * - All the files are renamed.
+ * - Each directory is flushed once.
+ *
+ * Thousands of small files then share a few disk flushes rather than
+ * paying one or two each. Their downloads complete together once their
+ * group is published.
+ *
+ * %DOWNLOAD_DURABILITY_NONE only does the rename, for the ".part" files of
+ * resumable downloads.
+ **/
+
+typedef struct _DownloadCommitEntry {
+    GTask *task;
+    gchar *temp_path;
+    gchar *path;
+    gchar *remove_path;
+    gboolean sync;
+
+    // The file was flushed as it was written, only its directory is left
+    gboolean synced;
+
+    gint fd;
+    dev_t device;
+    GError *error;
+} DownloadCommitEntry;
+
+struct _DownloadCommitGroup {
+    gint ref_count;
+    GMutex mutex;
+    GCond cond;
+
+    guint max_files;
+    guint max_delay;
+    gboolean use_syncfs;
+
+    // DownloadCommitEntry waiting for the next flush, and whether the
+    // flusher thread is there to flush them
+    GPtrArray *pending;
+    gboolean flushing;
+};
+
+/**
+ * download_commit_entry_free:
+ * @user_data: a #DownloadCommitEntry
+ *
+ * Frees a #DownloadCommitEntry struct.
+ */
+static void
+download_commit_entry_free (gpointer user_data)
+{
+    DownloadCommitEntry *entry = user_data;
+
+    if (entry->fd >= 0)
+        close (entry->fd);
+
+    if (entry->error)
+        g_error_free (entry->error);
+
+    if (entry->task)
+        g_object_unref (entry->task);
+
+    g_free (entry->temp_path);
+    g_free (entry->path);
+    g_free (entry->remove_path);
+
+    g_slice_free (DownloadCommitEntry, entry);
+}
+
+/**
+ * download_commit_entry_fail:
+ * @entry: a #DownloadCommitEntry
+ * @what: what failed
+ * @path: the file it failed on
+ * @saved_errno: the errno it failed with
+ *
+ * Sets the error of @entry unless it already has one.
+ */
+static void
+download_commit_entry_fail (DownloadCommitEntry *entry,
+                            const gchar         *what,
+                            const gchar         *path,
+                            gint                 saved_errno)
+{
+    if (entry->error)
+        return;
+
+    entry->error = g_error_new (G_IO_ERROR,
+                                g_io_error_from_errno (saved_errno),
+                                "Failed to %s \"%s\": %s",
+                                what,
+                                path,
+                                g_strerror (saved_errno));
+}
+
+/**
+ * download_commit_sync_directories:
+ * @entries: the #DownloadCommitEntry of a batch, renamed
+ *
+ * Flushes each directory the batch renamed files in once, so the new names
+ * are on disk.
+ */
+static void
+download_commit_sync_directories (GPtrArray *entries)
+{
+    GHashTable *directories = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    guint i;
+
+    for (i = 0; i < entries->len; i++)
+    {
+        DownloadCommitEntry *entry = g_ptr_array_index (entries, i);
+        gchar *directory;
+        gint fd;
+
+        if (entry->error || !entry->temp_path)
+            continue;
+
+        directory = g_path_get_dirname (entry->path);
+
+        if (g_hash_table_contains (directories, directory))
+        {
+            g_free (directory);
+            continue;
+        }
+
+        fd = open (directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd < 0 || fsync (fd) < 0)
+            g_debug ("Failed to flush directory \"%s\": %s", directory, g_strerror (errno));
+
+        if (fd >= 0)
+            close (fd);
+
+        g_hash_table_add (directories, directory);
+    }
+
+    g_hash_table_unref (directories);
+}
+
+/**
+ * download_commit_batch:
+ * @entries: #DownloadCommitEntry to publish together
+ * @sync: whether to flush the files before their rename
+ * @use_syncfs: whether one syncfs() may stand for the fdatasync() of each
+ *              file
+ *
+ * Flushes the files of @entries when asked to, moves them in place, flushes
+ * their directories and returns the task of each entry. A file that fails
+ * keeps its temporary name and only fails its own task.
+ */
+static void
+download_commit_batch (GPtrArray *entries,
+                       gboolean   sync,
+                       gboolean   use_syncfs)
+{
+    gboolean durable = sync;
+    gboolean one_device = TRUE;
+    guint i;
+
+    for (i = 0; sync && i < entries->len; i++)
+    {
+        DownloadCommitEntry *entry = g_ptr_array_index (entries, i);
+        const gchar *path = entry->temp_path ? entry->temp_path : entry->path;
+        DownloadCommitEntry *first = g_ptr_array_index (entries, 0);
+        struct stat st;
+
+        if (entry->synced)
+        {
+            one_device = FALSE;
+            continue;
+        }
+
+        entry->fd = open (path, O_RDONLY | O_CLOEXEC);
+
+        if (entry->fd < 0 || fstat (entry->fd, &st) < 0)
+        {
+            download_commit_entry_fail (entry, "open", path, errno);
+            one_device = FALSE;
+
+            continue;
+        }
+
+        entry->device = st.st_dev;
+        one_device = one_device && entry->device == first->device;
+
+#ifdef HAVE_SYNC_FILE_RANGE
+        // Start the writeback of every file before waiting on any
+        sync_file_range (entry->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+    }
+
+#ifdef HAVE_SYNCFS
+    if (sync && use_syncfs && one_device && entries->len > 1)
+    {
+        DownloadCommitEntry *first = g_ptr_array_index (entries, 0);
+
+        if (syncfs (first->fd) == 0)
+            sync = FALSE;
+        else
+            g_debug ("syncfs() failed, flushing files one by one: %s", g_strerror (errno));
+    }
+#endif
+
+    for (i = 0; i < entries->len; i++)
+    {
+        DownloadCommitEntry *entry = g_ptr_array_index (entries, i);
+        const gchar *path = entry->temp_path ? entry->temp_path : entry->path;
+
+        if (sync && entry->fd >= 0 && fdatasync (entry->fd) < 0)
+            download_commit_entry_fail (entry, "flush", path, errno);
+
+        if (!entry->error && entry->temp_path && g_rename (entry->temp_path, entry->path) < 0)
+            download_commit_entry_fail (entry, "move into place", entry->temp_path, errno);
+
+        if (!entry->error && entry->remove_path)
+            g_unlink (entry->remove_path);
+    }
+
+    if (durable)
+        download_commit_sync_directories (entries);
+
+    for (i = 0; i < entries->len; i++)
+    {
+        DownloadCommitEntry *entry = g_ptr_array_index (entries, i);
+
+        if (entry->error)
+        {
+            g_task_return_error (entry->task, entry->error);
+            entry->error = NULL;
+        }
+        else
+        {
+            g_task_return_boolean (entry->task, TRUE);
+        }
+    }
+}
+
+/**
+ * download_commit_thread:
+ * @task: a #GTask
+ * @source_object: %NULL
+ * @task_data: a #GPtrArray of one #DownloadCommitEntry
+ * @cancellable: a #GCancellable
+ *
+ * Publishes a file on its own.
+ */
+static void
+download_commit_thread (GTask        *task,
+                        gpointer      source_object,
+                        gpointer      task_data,
+                        GCancellable *cancellable)
+{
+    GPtrArray *entries = task_data;
+    DownloadCommitEntry *entry = g_ptr_array_index (entries, 0);
+
+    download_commit_batch (entries, entry->sync, FALSE);
+}
+
+/**
+ * download_commit_group_thread:
+ * @user_data: a #DownloadCommitGroup, whose reference the thread drops
+ *
+ * Flushes the files of the group in batches, each one collected until it
+ * holds max_files of them or max_delay passed since the first, and ends
+ * once no file waits.
+ *
+ * Returns: %NULL
+ */
+static gpointer
+download_commit_group_thread (gpointer user_data)
+{
+    DownloadCommitGroup *group = user_data;
+    GPtrArray *batch;
+    gint64 deadline;
+
+    g_mutex_lock (&group->mutex);
+
+    while (group->pending->len > 0)
+    {
+        deadline = g_get_monotonic_time () + (gint64) group->max_delay * G_TIME_SPAN_MILLISECOND;
+
+        while (group->pending->len < group->max_files &&
+               g_cond_wait_until (&group->cond, &group->mutex, deadline))
+            ;
+
+        batch = group->pending;
+        group->pending = g_ptr_array_new_with_free_func (download_commit_entry_free);
+
+        g_mutex_unlock (&group->mutex);
+
+        g_debug ("Committing a group of %u files", batch->len);
+
+        download_commit_batch (batch, TRUE, group->use_syncfs);
+        g_ptr_array_unref (batch);
+
+        g_mutex_lock (&group->mutex);
+    }
+
+    group->flushing = FALSE;
+
+    g_mutex_unlock (&group->mutex);
+
+    download_commit_group_unref (group);
+
+    return NULL;
+}
+
+/**
+ * download_commit_group_new:
+ * @max_files: the most files flushed together, 0 for
+ *             %DOWNLOAD_COMMIT_DEFAULT_MAX_FILES
+ * @max_delay: the longest a file waits for others, in ms, 0 for
+ *             %DOWNLOAD_COMMIT_DEFAULT_MAX_DELAY
+ * @use_syncfs: whether to flush a group on one filesystem with a single
+ *              syncfs(), which also flushes what other processes wrote
+ *              there
+ *
+ * Creates a #DownloadCommitGroup for %DOWNLOAD_DURABILITY_GROUP.
+ *
+ * Returns: (transfer full): a new #DownloadCommitGroup, free with
+ *          download_commit_group_unref()
+ */
+DownloadCommitGroup *
+download_commit_group_new (guint    max_files,
+                           guint    max_delay,
+                           gboolean use_syncfs)
+{
+    DownloadCommitGroup *group;
+
+    group = g_slice_new0 (DownloadCommitGroup);
+    group->ref_count = 1;
+    g_mutex_init (&group->mutex);
+    g_cond_init (&group->cond);
+
+    group->max_files = max_files ? max_files : DOWNLOAD_COMMIT_DEFAULT_MAX_FILES;
+    group->max_delay = max_delay ? max_delay : DOWNLOAD_COMMIT_DEFAULT_MAX_DELAY;
+    group->use_syncfs = use_syncfs;
+    group->pending = g_ptr_array_new_with_free_func (download_commit_entry_free);
+
+    return group;
+}
+
+/**
+ * download_commit_group_get_default:
+ *
+ * Gets the #DownloadCommitGroup shared by downloads that do not ask for a
+ * specific one, with the default limits and without syncfs().
+ *
+ * Returns: (transfer none): the default #DownloadCommitGroup
+ */
+DownloadCommitGroup *
+download_commit_group_get_default (void)
+{
+    static gsize initialized = 0;
+    static DownloadCommitGroup *group = NULL;
+
+    if (g_once_init_enter (&initialized))
+    {
+        group = download_commit_group_new (0, 0, FALSE);
+        g_once_init_leave (&initialized, 1);
+    }
+
+    return group;
+}
+
+/**
+ * download_commit_group_ref:
+ * @group: a #DownloadCommitGroup
+ *
+ * Increases the reference count of @group.
+ *
+ * Returns: (transfer full): @group
+ */
+DownloadCommitGroup *
+download_commit_group_ref (DownloadCommitGroup *group)
+{
+    g_return_val_if_fail (group != NULL, NULL);
+    g_return_val_if_fail (group->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&group->ref_count);
+
+    return group;
+}
+
+/**
+ * download_commit_group_unref:
+ * @group: a #DownloadCommitGroup
+ *
+ * Decreases the reference count of @group, freeing it when the count drops
+ * to zero. A flush in progress holds a reference.
+ */
+void
+download_commit_group_unref (DownloadCommitGroup *group)
+{
+    g_return_if_fail (group != NULL);
+    g_return_if_fail (group->ref_count > 0);
+
+    if (!g_atomic_int_dec_and_test (&group->ref_count))
+        return;
+
+    g_ptr_array_unref (group->pending);
+    g_cond_clear (&group->cond);
+    g_mutex_clear (&group->mutex);
+
+    g_slice_free (DownloadCommitGroup, group);
+}
+
+/**
+ * download_commit_async:
+ * @group: (nullable): the #DownloadCommitGroup for
+ *         %DOWNLOAD_DURABILITY_GROUP, %NULL for the default one
+ * @durability: how the file is made durable
+ * @synced: whether the file is on disk already, for
+ *          %DOWNLOAD_DURABILITY_FSYNC, its directory is then the only one
+ *          flushed
+ * @temp_path: (nullable): where the file was written, %NULL when it is
+ *             already at @path
+ * @path: where the file goes
+ * @remove_path: (nullable): a file to remove once @path is published, like
+ *               the journal of a resumable download
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call once the file is published
+ * @user_data: data to pass to @callback
+ *
+ * Makes a complete file durable as @durability asks and moves it from
+ * @temp_path to @path, see download-commit.
+ */
+void
+download_commit_async (DownloadCommitGroup *group,
+                       DownloadDurability   durability,
+                       gboolean             synced,
+                       const gchar         *temp_path,
+                       const gchar         *path,
+                       const gchar         *remove_path,
+                       GCancellable        *cancellable,
+                       GAsyncReadyCallback  callback,
+                       gpointer             user_data)
+{
+    g_return_if_fail (path != NULL);
+
+    DownloadCommitEntry *entry;
+    GPtrArray *entries;
+    GTask *task;
+
+    entry = g_slice_new0 (DownloadCommitEntry);
+    entry->fd = -1;
+    entry->temp_path = g_strdup (temp_path);
+    entry->path = g_strdup (path);
+    entry->remove_path = g_strdup (remove_path);
+    entry->sync = durability != DOWNLOAD_DURABILITY_NONE;
+    entry->synced = synced && durability == DOWNLOAD_DURABILITY_FSYNC;
+    entry->task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (entry->task, download_commit_async);
+
+    if (durability != DOWNLOAD_DURABILITY_GROUP)
+    {
+        entries = g_ptr_array_new_with_free_func (download_commit_entry_free);
+        g_ptr_array_add (entries, entry);
+
+        task = g_task_new (NULL, NULL, NULL, NULL);
+        g_task_set_task_data (task, entries, (GDestroyNotify) g_ptr_array_unref);
+        g_task_run_in_thread (task, download_commit_thread);
+        g_object_unref (task);
+
+        return;
+    }
+
+    if (!group)
+        group = download_commit_group_get_default ();
+
+    g_mutex_lock (&group->mutex);
+
+    g_ptr_array_add (group->pending, entry);
+
+    if (group->pending->len >= group->max_files)
+        g_cond_signal (&group->cond);
+
+    if (!group->flushing)
+    {
+        group->flushing = TRUE;
+
+        g_thread_unref (g_thread_new ("download-commit",
+                                      download_commit_group_thread,
+                                      download_commit_group_ref (group)));
+    }
+
+    g_mutex_unlock (&group->mutex);
+}
+
+/**
+ * download_commit_finish:
+ * @result: the #GAsyncResult passed to the download_commit_async() callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes publishing a file.
+ *
+ * Returns: %TRUE if the file is at its path, and durable when asked to
+ */
+gboolean
+download_commit_finish (GAsyncResult  *result,
+                        GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
@@ -0,0 +1,53 @@
+#ifndef DOWNLOAD_COMMIT_H
+#define DOWNLOAD_COMMIT_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+// A group flushes once it holds this many files, or this many ms after the
+// first one came
+#define DOWNLOAD_COMMIT_DEFAULT_MAX_FILES 256
+#define DOWNLOAD_COMMIT_DEFAULT_MAX_DELAY 50
+
+typedef enum {
+    DOWNLOAD_DURABILITY_NONE,
+    DOWNLOAD_DURABILITY_FSYNC,
+    DOWNLOAD_DURABILITY_GROUP
+} DownloadDurability;
+
+typedef struct _DownloadCommitGroup DownloadCommitGroup;
+
+DownloadCommitGroup *
+download_commit_group_new (guint    max_files,
+                           guint    max_delay,
+                           gboolean use_syncfs);
+
+DownloadCommitGroup *
+download_commit_group_get_default (void);
+
+DownloadCommitGroup *
+download_commit_group_ref (DownloadCommitGroup *group);
+
+void
+download_commit_group_unref (DownloadCommitGroup *group);
+
+void
+download_commit_async (DownloadCommitGroup *group,
+                       DownloadDurability   durability,
+                       gboolean             synced,
+                       const gchar         *temp_path,
+                       const gchar         *path,
+                       const gchar         *remove_path,
+                       GCancellable        *cancellable,
+                       GAsyncReadyCallback  callback,
+                       gpointer             user_data);
+
+gboolean
+download_commit_finish (GAsyncResult  *result,
+                        GError       **error);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_COMMIT_H */
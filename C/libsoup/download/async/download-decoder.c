@@ -0,0 +1,406 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-decoder.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * SECTION:download-decoder
+ * @title: Download Decoder
+ * @short_description: Streaming gzip and zstd decompression of downloads
+ * @include: download-decoder.h
+ * @see_also: #GConverter, #GConverterInputStream, #GZlibDecompressor
+ *
+ * A download started with #DownloadOptions.decode set reads its body through
+ * a #GConverterInputStream, so the bytes are decompressed between the socket
+ * and the output stream and only the decoded file is ever written.
+ *
+ * %DOWNLOAD_DECODE_CONTENT sends `Accept-Encoding` with the encodings this
+ * build decodes, see download_decoder_get_accept_encoding(), and undoes the
+ * `Content-Encoding` of the response. %DOWNLOAD_DECODE_RESOURCE
+ * decompresses resources that are compressed files themselves, named
+ * `.gz` or `.zst` or served as `application/gzip` or `application/zstd`.
+ *
+ * gzip goes through #GZlibDecompressor, zstd through libzstd when the build
+ * found it. Decoding needs the body as one stream, such downloads are never
+ * split into segments nor resumed from a ".part" file.
+ **/
+
+#ifdef HAVE_ZSTD
+#define DOWNLOAD_TYPE_ZSTD_DECOMPRESSOR (download_zstd_decompressor_get_type ())
+G_DECLARE_FINAL_TYPE (DownloadZstdDecompressor, download_zstd_decompressor, DOWNLOAD, ZSTD_DECOMPRESSOR, GObject)
+
+struct _DownloadZstdDecompressor {
+    GObject parent_instance;
+
+    ZSTD_DStream *stream;
+
+    // The last call ended a frame, so the input may end there
+    gboolean frame_done;
+};
+
+static void
+download_zstd_decompressor_iface_init (GConverterIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (DownloadZstdDecompressor, download_zstd_decompressor, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_CONVERTER, download_zstd_decompressor_iface_init))
+
+/**
+ * download_zstd_decompressor_convert:
+ * @converter: a #DownloadZstdDecompressor
+ * @inbuf: the compressed bytes
+ * @inbuf_size: the number of bytes in @inbuf
+ * @outbuf: a buffer for the decompressed bytes
+ * @outbuf_size: the size of @outbuf
+ * @flags: the #GConverterFlags
+ * @bytes_read: (out): return location for the bytes used from @inbuf
+ * @bytes_written: (out): return location for the bytes put in @outbuf
+ * @error: return location for a #GError
+ *
+ * Decompresses as much of @inbuf as fits into @outbuf. Frames may follow
+ * each other, the input may only end after a complete one.
+ *
+ * Returns: a #GConverterResult, %G_CONVERTER_ERROR with @error set
+ */
+static GConverterResult
+download_zstd_decompressor_convert (GConverter       *converter,
+                                    const void       *inbuf,
+                                    gsize             inbuf_size,
+                                    void             *outbuf,
+                                    gsize             outbuf_size,
+                                    GConverterFlags   flags,
+                                    gsize            *bytes_read,
+                                    gsize            *bytes_written,
+                                    GError          **error)
+{
+    DownloadZstdDecompressor *self = DOWNLOAD_ZSTD_DECOMPRESSOR (converter);
+    ZSTD_inBuffer input = { inbuf, inbuf_size, 0 };
+    ZSTD_outBuffer output = { outbuf, outbuf_size, 0 };
+    gsize ret;
+
+    if (inbuf_size == 0 && self->frame_done && (flags & G_CONVERTER_INPUT_AT_END))
+    {
+        *bytes_read = 0;
+        *bytes_written = 0;
+
+        return G_CONVERTER_FINISHED;
+    }
+
+    ret = ZSTD_decompressStream (self->stream, &output, &input);
+
+    if (ZSTD_isError (ret))
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_INVALID_DATA,
+                     "Invalid zstd data: %s",
+                     ZSTD_getErrorName (ret));
+
+        return G_CONVERTER_ERROR;
+    }
+
+    self->frame_done = ret == 0;
+
+    *bytes_read = input.pos;
+    *bytes_written = output.pos;
+
+    if (input.pos == 0 && output.pos == 0)
+    {
+        if (flags & G_CONVERTER_INPUT_AT_END)
+        {
+            g_set_error_literal (error,
+                                 G_IO_ERROR,
+                                 G_IO_ERROR_PARTIAL_INPUT,
+                                 "Truncated zstd data");
+        }
+        else if (output.size == 0 || inbuf_size > 0)
+        {
+            g_set_error_literal (error,
+                                 G_IO_ERROR,
+                                 G_IO_ERROR_NO_SPACE,
+                                 "No space to decompress into");
+        }
+        else
+        {
+            g_set_error_literal (error,
+                                 G_IO_ERROR,
+                                 G_IO_ERROR_PARTIAL_INPUT,
+                                 "Need more zstd data");
+        }
+
+        return G_CONVERTER_ERROR;
+    }
+
+    if (self->frame_done && input.pos == inbuf_size && (flags & G_CONVERTER_INPUT_AT_END))
+        return G_CONVERTER_FINISHED;
+
+    return G_CONVERTER_CONVERTED;
+}
+
+/**
+ * download_zstd_decompressor_reset:
+ * @converter: a #DownloadZstdDecompressor
+ *
+ * Forgets the frame being decompressed, to start on a new stream.
+ */
+static void
+download_zstd_decompressor_reset (GConverter *converter)
+{
+    DownloadZstdDecompressor *self = DOWNLOAD_ZSTD_DECOMPRESSOR (converter);
+
+    ZSTD_DCtx_reset (self->stream, ZSTD_reset_session_only);
+    self->frame_done = FALSE;
+}
+
+/**
+ * download_zstd_decompressor_iface_init:
+ * @iface: the #GConverterIface
+ *
+ * Implements #GConverter with libzstd.
+ */
+static void
+download_zstd_decompressor_iface_init (GConverterIface *iface)
+{
+    iface->convert = download_zstd_decompressor_convert;
+    iface->reset = download_zstd_decompressor_reset;
+}
+
+/**
+ * download_zstd_decompressor_finalize:
+ * @object: a #DownloadZstdDecompressor
+ *
+ * Frees the zstd stream.
+ */
+static void
+download_zstd_decompressor_finalize (GObject *object)
+{
+    DownloadZstdDecompressor *self = DOWNLOAD_ZSTD_DECOMPRESSOR (object);
+
+    ZSTD_freeDStream (self->stream);
+
+    G_OBJECT_CLASS (download_zstd_decompressor_parent_class)->finalize (object);
+}
+
+/**
+ * download_zstd_decompressor_class_init:
+ * @klass: the #DownloadZstdDecompressorClass
+ *
+ * Sets up the class.
+ */
+static void
+download_zstd_decompressor_class_init (DownloadZstdDecompressorClass *klass)
+{
+    G_OBJECT_CLASS (klass)->finalize = download_zstd_decompressor_finalize;
+}
+
+/**
+ * download_zstd_decompressor_init:
+ * @self: a #DownloadZstdDecompressor
+ *
+ * Creates the zstd stream.
+ */
+static void
+download_zstd_decompressor_init (DownloadZstdDecompressor *self)
+{
+    self->stream = ZSTD_createDStream ();
+}
+#endif
+
+/**
+ * download_encoding_is_supported:
+ * @encoding: a #DownloadEncoding
+ *
+ * Checks whether this build decodes @encoding.
+ *
+ * Returns: %TRUE if download_decoder_new() handles @encoding
+ */
+gboolean
+download_encoding_is_supported (DownloadEncoding encoding)
+{
+    switch (encoding)
+    {
+        case DOWNLOAD_ENCODING_IDENTITY:
+        case DOWNLOAD_ENCODING_GZIP:
+            return TRUE;
+
+        case DOWNLOAD_ENCODING_ZSTD:
+#ifdef HAVE_ZSTD
+            return TRUE;
+#else
+            return FALSE;
+#endif
+
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * download_encoding_get_name:
+ * @encoding: a #DownloadEncoding
+ *
+ * Gets the name of @encoding as used in HTTP headers.
+ *
+ * Returns: a static string
+ */
+const gchar *
+download_encoding_get_name (DownloadEncoding encoding)
+{
+    switch (encoding)
+    {
+        case DOWNLOAD_ENCODING_IDENTITY:
+            return "identity";
+
+        case DOWNLOAD_ENCODING_GZIP:
+            return "gzip";
+
+        case DOWNLOAD_ENCODING_ZSTD:
+            return "zstd";
+
+        default:
+            return "unsupported";
+    }
+}
+
+/**
+ * download_encoding_from_header:
+ * @content_encoding: (nullable): the Content-Encoding of a response
+ *
+ * Parses the Content-Encoding of a response. Several encodings applied in
+ * a row, and the ones that are not gzip or zstd, are unsupported.
+ *
+ * Returns: the #DownloadEncoding of the body
+ */
+DownloadEncoding
+download_encoding_from_header (const gchar *content_encoding)
+{
+    DownloadEncoding encoding = DOWNLOAD_ENCODING_UNSUPPORTED;
+    gchar *name;
+
+    if (!content_encoding)
+        return DOWNLOAD_ENCODING_IDENTITY;
+
+    name = g_strstrip (g_ascii_strdown (content_encoding, -1));
+
+    if (*name == '\0' || strcmp (name, "identity") == 0)
+        encoding = DOWNLOAD_ENCODING_IDENTITY;
+    else if (strcmp (name, "gzip") == 0 || strcmp (name, "x-gzip") == 0)
+        encoding = DOWNLOAD_ENCODING_GZIP;
+    else if (strcmp (name, "zstd") == 0)
+        encoding = DOWNLOAD_ENCODING_ZSTD;
+
+    g_free (name);
+
+    return encoding;
+}
+
+/**
+ * download_encoding_from_resource:
+ * @name: (nullable): the path of the uri of a resource, or a file name
+ * @content_type: (nullable): the Content-Type of the resource
+ *
+ * Tells whether a resource is itself a compressed file, from the suffix of
+ * @name or else from @content_type.
+ *
+ * Returns: the #DownloadEncoding of the resource
+ */
+DownloadEncoding
+download_encoding_from_resource (const gchar *name,
+                                 const gchar *content_type)
+{
+    if (name && g_str_has_suffix (name, ".gz"))
+        return DOWNLOAD_ENCODING_GZIP;
+
+    if (name && g_str_has_suffix (name, ".zst"))
+        return DOWNLOAD_ENCODING_ZSTD;
+
+    if (!content_type)
+        return DOWNLOAD_ENCODING_IDENTITY;
+
+    if (g_ascii_strncasecmp (content_type, "application/gzip", 16) == 0 ||
+        g_ascii_strncasecmp (content_type, "application/x-gzip", 18) == 0)
+        return DOWNLOAD_ENCODING_GZIP;
+
+    if (g_ascii_strncasecmp (content_type, "application/zstd", 16) == 0)
+        return DOWNLOAD_ENCODING_ZSTD;
+
+    return DOWNLOAD_ENCODING_IDENTITY;
+}
+
+/**
+ * download_encoding_get_suffix:
+ * @encoding: a #DownloadEncoding
+ *
+ * Gets the file name suffix of files compressed with @encoding.
+ *
+ * Returns: (nullable): a static string, %NULL for identity
+ */
+const gchar *
+download_encoding_get_suffix (DownloadEncoding encoding)
+{
+    switch (encoding)
+    {
+        case DOWNLOAD_ENCODING_GZIP:
+            return ".gz";
+
+        case DOWNLOAD_ENCODING_ZSTD:
+            return ".zst";
+
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * download_decoder_get_accept_encoding:
+ *
+ * Gets the Accept-Encoding sent by downloads with
+ * %DOWNLOAD_DECODE_CONTENT, the encodings this build decodes.
+ *
+ * Returns: a static string
+ */
+const gchar *
+download_decoder_get_accept_encoding (void)
+{
+#ifdef HAVE_ZSTD
+    return "zstd, gzip";
+#else
+    return "gzip";
+#endif
+}
+
+/**
+ * download_decoder_new:
+ * @encoding: a #DownloadEncoding other than identity
+ *
+ * Creates a #GConverter that decompresses @encoding, to wrap the input of
+ * a download in a #GConverterInputStream.
+ *
+ * Returns: (transfer full) (nullable): a new #GConverter, or %NULL if this
+ *          build does not decode @encoding
+ */
+GConverter *
+download_decoder_new (DownloadEncoding encoding)
+{
+    switch (encoding)
+    {
+        case DOWNLOAD_ENCODING_GZIP:
+            return G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+
+        case DOWNLOAD_ENCODING_ZSTD:
+#ifdef HAVE_ZSTD
+            return g_object_new (DOWNLOAD_TYPE_ZSTD_DECOMPRESSOR, NULL);
+#else
+            return NULL;
+#endif
+
+        default:
+            return NULL;
+    }
+}
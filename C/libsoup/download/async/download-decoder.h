@@ -0,0 +1,46 @@
+#ifndef DOWNLOAD_DECODER_H
+#define DOWNLOAD_DECODER_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    DOWNLOAD_DECODE_NONE     = 0,
+    DOWNLOAD_DECODE_CONTENT  = 1 << 0,
+    DOWNLOAD_DECODE_RESOURCE = 1 << 1
+} DownloadDecode;
+
+typedef enum {
+    DOWNLOAD_ENCODING_IDENTITY,
+    DOWNLOAD_ENCODING_GZIP,
+    DOWNLOAD_ENCODING_ZSTD,
+    DOWNLOAD_ENCODING_UNSUPPORTED
+} DownloadEncoding;
+
+gboolean
+download_encoding_is_supported (DownloadEncoding encoding);
+
+const gchar *
+download_encoding_get_name (DownloadEncoding encoding);
+
+DownloadEncoding
+download_encoding_from_header (const gchar *content_encoding);
+
+DownloadEncoding
+download_encoding_from_resource (const gchar *name,
+                                 const gchar *content_type);
+
+const gchar *
+download_encoding_get_suffix (DownloadEncoding encoding);
+
+const gchar *
+download_decoder_get_accept_encoding (void);
+
+GConverter *
+download_decoder_new (DownloadEncoding encoding);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_DECODER_H */
@@ -0,0 +1,607 @@
+#define G_LOG_DOMAIN "download-async"
+
+#define _GNU_SOURCE
+
+#include "download-file.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_GIO_UNIX
+#include <gio/gfiledescriptorbased.h>
+#endif
+
+#ifdef HAVE_FICLONE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+/**
+ * SECTION:download-file
+ * @title: Download File
+ * @short_description: Allocation and page cache control for downloaded files
+ * @include: download-file.h
+ * @see_also: #GOutputStream, #GTask
+ *
+ * Helpers that act on the file descriptor behind the #GOutputStream of a
+ * download. Both run in a worker thread so the #GMainContext never waits on
+ * the disk.
+ *
+ * download_file_preallocate_async() reserves the blocks of a file whose
+ * length is known with fallocate(), so the filesystem lays it out in a few
+ * large extents instead of growing it one write at a time.
+ *
+ * download_file_drop_cache_async() writes a range back to disk and evicts it
+ * from the page cache with posix_fadvise(), so bulk downloads do not push the
+ * working set of other processes out of memory.
+ *
+ * Both need gio-unix to reach the file descriptor and fail with
+ * %G_IO_ERROR_NOT_SUPPORTED where the system call is missing.
+ *
+ * download_file_clone_async() gives a second path to a downloaded file
+ * without copying its bytes where the filesystem allows it: a reflink that
+ * shares the blocks copy-on-write, else a hardlink, and only as a last
+ * resort a copy.
+ *
+ * download_file_reopen() gives a read only descriptor on the file behind
+ * an output stream, for readers following a download as it is written.
+ **/
+
+typedef struct _DownloadFileRange {
+    goffset offset;
+    goffset length;
+} DownloadFileRange;
+
+typedef struct _DownloadFileClone {
+    gchar *source;
+    gchar *destination;
+    gboolean overwrite;
+} DownloadFileClone;
+
+/**
+ * download_file_range_free:
+ * @user_data: a #DownloadFileRange
+ *
+ * Frees a #DownloadFileRange struct.
+ */
+static void
+download_file_range_free (gpointer user_data)
+{
+    g_slice_free (DownloadFileRange, user_data);
+}
+
+/**
+ * download_file_clone_free:
+ * @user_data: a #DownloadFileClone
+ *
+ * Frees a #DownloadFileClone struct.
+ */
+static void
+download_file_clone_free (gpointer user_data)
+{
+    DownloadFileClone *clone = user_data;
+
+    g_free (clone->source);
+    g_free (clone->destination);
+
+    g_slice_free (DownloadFileClone, clone);
+}
+
+/**
+ * download_file_get_fd:
+ * @stream: a #GOutputStream
+ *
+ * Gets the file descriptor @stream writes to.
+ *
+ * Returns: the file descriptor, or -1 if @stream has none
+ */
+gint
+download_file_get_fd (GOutputStream *stream)
+{
+#ifdef HAVE_GIO_UNIX
+    if (G_IS_FILE_DESCRIPTOR_BASED (stream))
+        return g_file_descriptor_based_get_fd (G_FILE_DESCRIPTOR_BASED (stream));
+#endif
+
+    return -1;
+}
+
+/**
+ * download_file_return_errno:
+ * @task: a #GTask
+ * @what: the name of the call that failed
+ * @saved_errno: the errno it failed with
+ *
+ * Returns an error built from @saved_errno on @task.
+ */
+static void
+download_file_return_errno (GTask       *task,
+                            const gchar *what,
+                            gint         saved_errno)
+{
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             g_io_error_from_errno (saved_errno),
+                             "%s failed: %s",
+                             what,
+                             g_strerror (saved_errno));
+}
+
+/**
+ * download_file_preallocate_thread:
+ * @task: a #GTask
+ * @source_object: the #GOutputStream
+ * @task_data: a #DownloadFileRange
+ * @cancellable: a #GCancellable
+ *
+ * Allocates the blocks of the range without changing the size of the file,
+ * which still grows as bytes are written.
+ */
+static void
+download_file_preallocate_thread (GTask        *task,
+                                  gpointer      source_object,
+                                  gpointer      task_data,
+                                  GCancellable *cancellable)
+{
+    gint fd = download_file_get_fd (source_object);
+
+#ifdef HAVE_FALLOCATE
+    DownloadFileRange *range = task_data;
+
+    if (fd >= 0)
+    {
+        if (fallocate (fd, FALLOC_FL_KEEP_SIZE, range->offset, range->length) == 0)
+            g_task_return_boolean (task, TRUE);
+        else
+            download_file_return_errno (task, "fallocate()", errno);
+
+        return;
+    }
+#endif
+
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_NOT_SUPPORTED,
+                             "Preallocation is not supported%s",
+                             fd < 0 ? " for this stream" : "");
+}
+
+/**
+ * download_file_preallocate_async:
+ * @output: the #GOutputStream of a file
+ * @length: the number of bytes to reserve from the start of the file
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the blocks are allocated
+ * @user_data: data to pass to @callback
+ *
+ * Reserves the first @length bytes of the file behind @output with
+ * fallocate(). The size of the file does not change, so a download that
+ * stops halfway leaves a file of the length actually written. Filesystems
+ * that cannot preallocate fail with %G_IO_ERROR_NOT_SUPPORTED, the download
+ * works the same without it.
+ */
+void
+download_file_preallocate_async (GOutputStream       *output,
+                                 goffset              length,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data)
+{
+    g_return_if_fail (G_IS_OUTPUT_STREAM (output));
+    g_return_if_fail (length > 0);
+
+    DownloadFileRange *range;
+    GTask *task;
+
+    range = g_slice_new0 (DownloadFileRange);
+    range->offset = 0;
+    range->length = length;
+
+    task = g_task_new (output, cancellable, callback, user_data);
+    g_task_set_source_tag (task, download_file_preallocate_async);
+    g_task_set_task_data (task, range, download_file_range_free);
+
+    g_task_run_in_thread (task, download_file_preallocate_thread);
+
+    g_object_unref (task);
+}
+
+/**
+ * download_file_preallocate_finish:
+ * @result: the #GAsyncResult passed to the download_file_preallocate_async()
+ *          callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes preallocating a file.
+ *
+ * Returns: %TRUE if the blocks were reserved
+ */
+gboolean
+download_file_preallocate_finish (GAsyncResult  *result,
+                                  GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * download_file_drop_cache_thread:
+ * @task: a #GTask
+ * @source_object: the #GOutputStream
+ * @task_data: a #DownloadFileRange
+ * @cancellable: a #GCancellable
+ *
+ * Writes the dirty pages of the range back and waits for them, pages still
+ * dirty would be kept by posix_fadvise(), then drops them from the page
+ * cache.
+ */
+static void
+download_file_drop_cache_thread (GTask        *task,
+                                 gpointer      source_object,
+                                 gpointer      task_data,
+                                 GCancellable *cancellable)
+{
+#ifdef HAVE_POSIX_FADVISE
+    DownloadFileRange *range = task_data;
+    gint fd = download_file_get_fd (source_object);
+    gint result;
+
+    if (fd >= 0)
+    {
+#ifdef HAVE_SYNC_FILE_RANGE
+        if (sync_file_range (fd,
+                             range->offset,
+                             range->length,
+                             SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+        {
+            download_file_return_errno (task, "sync_file_range()", errno);
+            return;
+        }
+#else
+        if (fdatasync (fd) < 0)
+        {
+            download_file_return_errno (task, "fdatasync()", errno);
+            return;
+        }
+#endif
+
+        // posix_fadvise() returns the error instead of setting errno
+        result = posix_fadvise (fd, range->offset, range->length, POSIX_FADV_DONTNEED);
+
+        if (result != 0)
+            download_file_return_errno (task, "posix_fadvise()", result);
+        else
+            g_task_return_boolean (task, TRUE);
+
+        return;
+    }
+#endif
+
+    g_task_return_new_error (task,
+                             G_IO_ERROR,
+                             G_IO_ERROR_NOT_SUPPORTED,
+                             "Dropping written pages from the cache is not supported");
+}
+
+/**
+ * download_file_drop_cache_async:
+ * @output: the #GOutputStream of a file
+ * @offset: the first byte of the range
+ * @length: the number of bytes in the range
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the range left the cache
+ * @user_data: data to pass to @callback
+ *
+ * Flushes the bytes @offset .. @offset + @length - 1 of the file behind
+ * @output to disk and evicts them from the page cache. @output must stay
+ * open until @callback is invoked.
+ */
+void
+download_file_drop_cache_async (GOutputStream       *output,
+                                goffset              offset,
+                                goffset              length,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+    g_return_if_fail (G_IS_OUTPUT_STREAM (output));
+    g_return_if_fail (offset >= 0 && length > 0);
+
+    DownloadFileRange *range;
+    GTask *task;
+
+    range = g_slice_new0 (DownloadFileRange);
+    range->offset = offset;
+    range->length = length;
+
+    task = g_task_new (output, cancellable, callback, user_data);
+    g_task_set_source_tag (task, download_file_drop_cache_async);
+    g_task_set_task_data (task, range, download_file_range_free);
+
+    g_task_run_in_thread (task, download_file_drop_cache_thread);
+
+    g_object_unref (task);
+}
+
+/**
+ * download_file_drop_cache_finish:
+ * @result: the #GAsyncResult passed to the download_file_drop_cache_async()
+ *          callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes dropping a range of a file from the page cache.
+ *
+ * Returns: %TRUE if the range was written back and dropped
+ */
+gboolean
+download_file_drop_cache_finish (GAsyncResult  *result,
+                                 GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * download_file_reflink:
+ * @clone: a #DownloadFileClone
+ * @temp_path: a path next to @clone->destination to create the copy at
+ *
+ * Creates @temp_path as a copy-on-write clone of @clone->source with the
+ * FICLONE ioctl, which fails on filesystems without shared extents or
+ * across filesystems.
+ *
+ * Returns: %TRUE if @temp_path shares the blocks of the source
+ */
+static gboolean
+download_file_reflink (DownloadFileClone *clone,
+                       const gchar       *temp_path)
+{
+#ifdef HAVE_FICLONE
+    gint source_fd;
+    gint fd;
+    gboolean done;
+
+    source_fd = open (clone->source, O_RDONLY | O_CLOEXEC);
+
+    if (source_fd < 0)
+        return FALSE;
+
+    fd = open (temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+    {
+        close (source_fd);
+        return FALSE;
+    }
+
+    done = ioctl (fd, FICLONE, source_fd) == 0;
+
+    close (fd);
+    close (source_fd);
+
+    if (!done)
+        unlink (temp_path);
+
+    return done;
+#else
+    return FALSE;
+#endif
+}
+
+/**
+ * download_file_clone_thread:
+ * @task: a #GTask
+ * @source_object: %NULL
+ * @task_data: a #DownloadFileClone
+ * @cancellable: a #GCancellable
+ *
+ * Makes the clone at a temporary path then renames it over the destination,
+ * so a destination that is replaced is never seen half written. Without
+ * overwrite the clone is linked to the destination instead, and the
+ * hardlink goes straight to it, which both fail with %G_IO_ERROR_EXISTS if
+ * something is already there.
+ */
+static void
+download_file_clone_thread (GTask        *task,
+                            gpointer      source_object,
+                            gpointer      task_data,
+                            GCancellable *cancellable)
+{
+    DownloadFileClone *clone = task_data;
+    GFile *source;
+    GFile *destination;
+    gchar *temp_path;
+    GError *error = NULL;
+
+    temp_path = g_strdup_printf ("%s.clone-%08x", clone->destination, g_random_int ());
+
+    if (download_file_reflink (clone, temp_path))
+    {
+        // link() fails rather than replace a destination that appeared
+        // meanwhile, the temporary name goes away either way
+        if (!clone->overwrite && link (temp_path, clone->destination) != 0)
+        {
+            gint saved_errno = errno;
+
+            unlink (temp_path);
+            download_file_return_errno (task, "link()", saved_errno);
+        }
+        else if (!clone->overwrite)
+        {
+            unlink (temp_path);
+
+            g_debug ("Reflinked \"%s\" to \"%s\"", clone->source, clone->destination);
+            g_task_return_boolean (task, TRUE);
+        }
+        else if (rename (temp_path, clone->destination) != 0)
+        {
+            gint saved_errno = errno;
+
+            unlink (temp_path);
+            download_file_return_errno (task, "rename()", saved_errno);
+        }
+        else
+        {
+            g_debug ("Reflinked \"%s\" to \"%s\"", clone->source, clone->destination);
+            g_task_return_boolean (task, TRUE);
+        }
+
+        g_free (temp_path);
+        return;
+    }
+
+    if (link (clone->source, clone->overwrite ? temp_path : clone->destination) == 0)
+    {
+        if (clone->overwrite && rename (temp_path, clone->destination) != 0)
+        {
+            gint saved_errno = errno;
+
+            unlink (temp_path);
+            download_file_return_errno (task, "rename()", saved_errno);
+        }
+        else
+        {
+            g_debug ("Hardlinked \"%s\" to \"%s\"", clone->source, clone->destination);
+            g_task_return_boolean (task, TRUE);
+        }
+
+        g_free (temp_path);
+        return;
+    }
+
+    if (errno == EEXIST && !clone->overwrite)
+    {
+        download_file_return_errno (task, "link()", EEXIST);
+        g_free (temp_path);
+        return;
+    }
+
+    g_free (temp_path);
+
+    // Another filesystem, or one without links
+    source = g_file_new_for_path (clone->source);
+    destination = g_file_new_for_path (clone->destination);
+
+    if (g_file_copy (source,
+                     destination,
+                     clone->overwrite ? G_FILE_COPY_OVERWRITE : G_FILE_COPY_NONE,
+                     cancellable,
+                     NULL,
+                     NULL,
+                     &error))
+    {
+        g_debug ("Copied \"%s\" to \"%s\"", clone->source, clone->destination);
+        g_task_return_boolean (task, TRUE);
+    }
+    else
+    {
+        g_task_return_error (task, error);
+    }
+
+    g_object_unref (destination);
+    g_object_unref (source);
+}
+
+/**
+ * download_file_clone_async:
+ * @source: the path of a complete file
+ * @destination: the path to give it as well
+ * @overwrite: %TRUE to replace a file at @destination
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when @destination exists
+ * @user_data: data to pass to @callback
+ *
+ * Makes @destination hold the same bytes as @source, as a reflink where the
+ * filesystem shares blocks, else as a hardlink, else as a copy. A reflink
+ * or a copy is a file of its own, a hardlink is the same file: the
+ * downloads replace their files rather than write into them, so a later
+ * download to one path leaves the other alone, but editing one in place
+ * changes both. Without @overwrite the clone fails with %G_IO_ERROR_EXISTS
+ * when @destination exists.
+ */
+void
+download_file_clone_async (const gchar         *source,
+                           const gchar         *destination,
+                           gboolean             overwrite,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data)
+{
+    g_return_if_fail (source != NULL);
+    g_return_if_fail (destination != NULL);
+
+    DownloadFileClone *clone;
+    GTask *task;
+
+    clone = g_slice_new0 (DownloadFileClone);
+    clone->source = g_strdup (source);
+    clone->destination = g_strdup (destination);
+    clone->overwrite = overwrite;
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (task, download_file_clone_async);
+    g_task_set_task_data (task, clone, download_file_clone_free);
+
+    g_task_run_in_thread (task, download_file_clone_thread);
+
+    g_object_unref (task);
+}
+
+/**
+ * download_file_clone_finish:
+ * @result: the #GAsyncResult passed to the download_file_clone_async()
+ *          callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes cloning a file.
+ *
+ * Returns: %TRUE if the destination holds the bytes of the source
+ */
+gboolean
+download_file_clone_finish (GAsyncResult  *result,
+                            GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * download_file_reopen:
+ * @output: the #GOutputStream of a download
+ *
+ * Opens the file @output writes to once more, read only. It goes through
+ * /proc/self/fd rather than a path, as g_file_replace() writes to a
+ * temporary file that only gets its name once closed.
+ *
+ * Returns: a new file descriptor, or -1 with errno set
+ */
+gint
+download_file_reopen (GOutputStream *output)
+{
+    g_return_val_if_fail (G_IS_OUTPUT_STREAM (output), -1);
+
+    gint fd = download_file_get_fd (output);
+    gchar *proc_path;
+    gint saved_errno;
+
+    if (fd < 0)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    proc_path = g_strdup_printf ("/proc/self/fd/%d", fd);
+    fd = open (proc_path, O_RDONLY | O_CLOEXEC);
+    saved_errno = errno;
+    g_free (proc_path);
+
+    errno = saved_errno;
+
+    return fd;
+}
@@ -0,0 +1,52 @@
+#ifndef DOWNLOAD_FILE_H
+#define DOWNLOAD_FILE_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+void
+download_file_preallocate_async (GOutputStream       *output,
+                                 goffset              length,
+                                 GCancellable        *cancellable,
+                                 GAsyncReadyCallback  callback,
+                                 gpointer             user_data);
+
+gboolean
+download_file_preallocate_finish (GAsyncResult  *result,
+                                  GError       **error);
+
+void
+download_file_drop_cache_async (GOutputStream       *output,
+                                goffset              offset,
+                                goffset              length,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data);
+
+gboolean
+download_file_drop_cache_finish (GAsyncResult  *result,
+                                 GError       **error);
+
+void
+download_file_clone_async (const gchar         *source,
+                           const gchar         *destination,
+                           gboolean             overwrite,
+                           GCancellable        *cancellable,
+                           GAsyncReadyCallback  callback,
+                           gpointer             user_data);
+
+gboolean
+download_file_clone_finish (GAsyncResult  *result,
+                            GError       **error);
+
+gint
+download_file_get_fd (GOutputStream *stream);
+
+gint
+download_file_reopen (GOutputStream *output);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_FILE_H */
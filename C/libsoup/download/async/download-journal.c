@@ -0,0 +1,585 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-journal.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * SECTION:download-journal
+ * @title: Download Journal
+ * @short_description: Records which bytes of a partial download are on disk
+ * @include: download-journal.h
+ * @see_also: #GKeyFile, #GTask
+ *
+ * A resumable download writes into a ".part" file and keeps a small sidecar
+ * journal next to it. The journal is a #GKeyFile holding the uri, the ETag and
+ * Last-Modified validators of the response, the full length and the byte
+ * ranges already written:
+ *
+ * |[
+ * [Download]
+ * Uri=https://example.com/image.iso
+ * ETag="5e8c-59a0b1c2"
+ * LastModified=Tue, 13 Oct 2026 08:00:00 GMT
+ * Total=4294967296
+ * Ranges=0-1048576;2097152-3145728;
+ * ]|
+ *
+ * Ranges are half-open, the end is the first byte past the range.
+ *
+ * download_journal_save_async() flushes the file to disk before it replaces
+ * the journal, so the journal never claims bytes that a crash could lose.
+ **/
+
+#define DOWNLOAD_JOURNAL_GROUP "Download"
+
+typedef struct _DownloadJournalSaveData {
+    gchar *path;
+    gchar *contents;
+    gsize length;
+    gchar *sync_path;
+} DownloadJournalSaveData;
+
+/**
+ * download_journal_new:
+ * @path: the path of the journal file
+ * @uri: the uri of the download
+ *
+ * Creates an empty #DownloadJournal for @uri, nothing is written to @path
+ * until download_journal_save_async() is called.
+ *
+ * Returns: (transfer full): a new #DownloadJournal
+ */
+DownloadJournal *
+download_journal_new (const gchar *path,
+                      const gchar *uri)
+{
+    g_return_val_if_fail (path != NULL, NULL);
+    g_return_val_if_fail (uri != NULL, NULL);
+
+    DownloadJournal *journal;
+
+    journal = g_slice_new0 (DownloadJournal);
+    journal->path = g_strdup (path);
+    journal->uri = g_strdup (uri);
+    journal->ranges = g_array_new (FALSE, FALSE, sizeof (DownloadRange));
+
+    return journal;
+}
+
+/**
+ * download_journal_parse_range:
+ * @text: a range written as "start-end"
+ * @range: return location for the #DownloadRange
+ *
+ * Parses one entry of the Ranges key.
+ *
+ * Returns: %TRUE if @text is a valid, non empty range
+ */
+static gboolean
+download_journal_parse_range (const gchar   *text,
+                              DownloadRange *range)
+{
+    gchar *end;
+
+    range->start = g_ascii_strtoll (text, &end, 10);
+
+    if (end == text || *end != '-')
+        return FALSE;
+
+    text = end + 1;
+    range->end = g_ascii_strtoll (text, &end, 10);
+
+    if (end == text || *end != '\0')
+        return FALSE;
+
+    return range->start >= 0 && range->start < range->end;
+}
+
+/**
+ * download_journal_load:
+ * @path: the path of the journal file
+ * @uri: the uri of the download
+ * @error: return location for a #GError
+ *
+ * Reads the journal at @path. Journals written for another uri, or whose
+ * ranges do not fit in the recorded length, are refused with
+ * %G_IO_ERROR_INVALID_DATA.
+ *
+ * Returns: (transfer full) (nullable): the #DownloadJournal, or %NULL with
+ *          @error set
+ */
+DownloadJournal *
+download_journal_load (const gchar  *path,
+                       const gchar  *uri,
+                       GError      **error)
+{
+    g_return_val_if_fail (path != NULL, NULL);
+    g_return_val_if_fail (uri != NULL, NULL);
+
+    DownloadJournal *journal;
+    GKeyFile *key_file;
+    gchar *journal_uri;
+    gchar **ranges;
+    gsize n_ranges = 0;
+    gsize i;
+
+    key_file = g_key_file_new ();
+
+    if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, error))
+    {
+        g_key_file_free (key_file);
+        return NULL;
+    }
+
+    journal_uri = g_key_file_get_string (key_file, DOWNLOAD_JOURNAL_GROUP, "Uri", NULL);
+
+    if (g_strcmp0 (journal_uri, uri) != 0)
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_INVALID_DATA,
+                     "Journal \"%s\" belongs to another download",
+                     path);
+
+        g_free (journal_uri);
+        g_key_file_free (key_file);
+        return NULL;
+    }
+
+    g_free (journal_uri);
+
+    journal = download_journal_new (path, uri);
+    journal->etag = g_key_file_get_string (key_file, DOWNLOAD_JOURNAL_GROUP, "ETag", NULL);
+    journal->last_modified = g_key_file_get_string (key_file, DOWNLOAD_JOURNAL_GROUP, "LastModified", NULL);
+    journal->total = MAX (g_key_file_get_int64 (key_file, DOWNLOAD_JOURNAL_GROUP, "Total", NULL), 0);
+
+    ranges = g_key_file_get_string_list (key_file, DOWNLOAD_JOURNAL_GROUP, "Ranges", &n_ranges, NULL);
+
+    for (i = 0; i < n_ranges; i++)
+    {
+        DownloadRange range;
+
+        if (!download_journal_parse_range (ranges[i], &range) ||
+            (journal->total > 0 && range.end > journal->total))
+        {
+            g_set_error (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_INVALID_DATA,
+                         "Journal \"%s\" has an invalid range \"%s\"",
+                         path,
+                         ranges[i]);
+
+            g_strfreev (ranges);
+            g_key_file_free (key_file);
+            download_journal_free (journal);
+            return NULL;
+        }
+
+        download_journal_add_range (journal, range.start, range.end);
+    }
+
+    g_strfreev (ranges);
+    g_key_file_free (key_file);
+
+    return journal;
+}
+
+/**
+ * download_journal_copy:
+ * @journal: a #DownloadJournal
+ *
+ * Copies @journal, used to take a snapshot that can be saved while the
+ * download carries on.
+ *
+ * Returns: (transfer full): a copy of @journal
+ */
+DownloadJournal *
+download_journal_copy (DownloadJournal *journal)
+{
+    g_return_val_if_fail (journal != NULL, NULL);
+
+    DownloadJournal *copy;
+
+    copy = download_journal_new (journal->path, journal->uri);
+    copy->etag = g_strdup (journal->etag);
+    copy->last_modified = g_strdup (journal->last_modified);
+    copy->total = journal->total;
+
+    g_array_append_vals (copy->ranges, journal->ranges->data, journal->ranges->len);
+
+    return copy;
+}
+
+/**
+ * download_journal_free:
+ * @journal: a #DownloadJournal
+ *
+ * Frees a #DownloadJournal struct, the journal file is left alone.
+ */
+void
+download_journal_free (DownloadJournal *journal)
+{
+    if (journal == NULL)
+        return;
+
+    g_free (journal->path);
+    g_free (journal->uri);
+    g_free (journal->etag);
+    g_free (journal->last_modified);
+    g_array_unref (journal->ranges);
+
+    g_slice_free (DownloadJournal, journal);
+}
+
+/**
+ * download_journal_add_range:
+ * @journal: a #DownloadJournal
+ * @start: the first byte of the range
+ * @end: the first byte past the range
+ *
+ * Records that the bytes @start .. @end - 1 are in the file, merging the
+ * range with the ones it overlaps or touches. Empty ranges are ignored.
+ */
+void
+download_journal_add_range (DownloadJournal *journal,
+                            goffset          start,
+                            goffset          end)
+{
+    g_return_if_fail (journal != NULL);
+
+    DownloadRange range = { start, end };
+    guint i = 0;
+
+    if (start < 0 || start >= end)
+        return;
+
+    while (i < journal->ranges->len &&
+           g_array_index (journal->ranges, DownloadRange, i).end < range.start)
+        i++;
+
+    while (i < journal->ranges->len &&
+           g_array_index (journal->ranges, DownloadRange, i).start <= range.end)
+    {
+        DownloadRange *other = &g_array_index (journal->ranges, DownloadRange, i);
+
+        range.start = MIN (range.start, other->start);
+        range.end = MAX (range.end, other->end);
+
+        g_array_remove_index (journal->ranges, i);
+    }
+
+    g_array_insert_val (journal->ranges, i, range);
+}
+
+/**
+ * download_journal_clear:
+ * @journal: a #DownloadJournal
+ *
+ * Forgets the validators, length and ranges of @journal, for when the
+ * resource changed since they were recorded.
+ */
+void
+download_journal_clear (DownloadJournal *journal)
+{
+    g_return_if_fail (journal != NULL);
+
+    g_clear_pointer (&journal->etag, g_free);
+    g_clear_pointer (&journal->last_modified, g_free);
+    journal->total = 0;
+
+    g_array_set_size (journal->ranges, 0);
+}
+
+/**
+ * download_journal_get_n_bytes:
+ * @journal: a #DownloadJournal
+ *
+ * Gets how many bytes the ranges of @journal cover.
+ *
+ * Returns: the number of bytes already in the file
+ */
+goffset
+download_journal_get_n_bytes (DownloadJournal *journal)
+{
+    g_return_val_if_fail (journal != NULL, 0);
+
+    goffset n_bytes = 0;
+    guint i;
+
+    for (i = 0; i < journal->ranges->len; i++)
+    {
+        DownloadRange *range = &g_array_index (journal->ranges, DownloadRange, i);
+
+        n_bytes += range->end - range->start;
+    }
+
+    return n_bytes;
+}
+
+/**
+ * download_journal_get_missing:
+ * @journal: a #DownloadJournal
+ *
+ * Works out the ranges still to be fetched. When the length of the resource
+ * is unknown only the bytes after the first range can be asked for, as one
+ * range ending at -1.
+ *
+ * Returns: (transfer full): a #GArray of #DownloadRange, empty if the file is
+ *          complete
+ */
+GArray *
+download_journal_get_missing (DownloadJournal *journal)
+{
+    g_return_val_if_fail (journal != NULL, NULL);
+
+    GArray *missing;
+    DownloadRange range;
+    goffset offset = 0;
+    guint i;
+
+    missing = g_array_new (FALSE, FALSE, sizeof (DownloadRange));
+
+    if (journal->total <= 0)
+    {
+        range.start = 0;
+        range.end = -1;
+
+        if (journal->ranges->len > 0 && g_array_index (journal->ranges, DownloadRange, 0).start == 0)
+            range.start = g_array_index (journal->ranges, DownloadRange, 0).end;
+
+        g_array_append_val (missing, range);
+
+        return missing;
+    }
+
+    for (i = 0; i <= journal->ranges->len; i++)
+    {
+        range.start = offset;
+        range.end = journal->total;
+
+        if (i < journal->ranges->len)
+        {
+            range.end = g_array_index (journal->ranges, DownloadRange, i).start;
+            offset = g_array_index (journal->ranges, DownloadRange, i).end;
+        }
+
+        if (range.start < range.end)
+            g_array_append_val (missing, range);
+    }
+
+    return missing;
+}
+
+/**
+ * download_journal_to_data:
+ * @journal: a #DownloadJournal
+ * @length: (out) (optional): return location for the length of the data
+ *
+ * Writes @journal out in the #GKeyFile format described above.
+ *
+ * Returns: (transfer full): the contents of the journal file
+ */
+gchar *
+download_journal_to_data (DownloadJournal *journal,
+                          gsize           *length)
+{
+    g_return_val_if_fail (journal != NULL, NULL);
+
+    GKeyFile *key_file;
+    GPtrArray *ranges;
+    gchar *contents;
+    guint i;
+
+    key_file = g_key_file_new ();
+
+    g_key_file_set_string (key_file, DOWNLOAD_JOURNAL_GROUP, "Uri", journal->uri);
+
+    if (journal->etag)
+        g_key_file_set_string (key_file, DOWNLOAD_JOURNAL_GROUP, "ETag", journal->etag);
+
+    if (journal->last_modified)
+        g_key_file_set_string (key_file, DOWNLOAD_JOURNAL_GROUP, "LastModified", journal->last_modified);
+
+    g_key_file_set_int64 (key_file, DOWNLOAD_JOURNAL_GROUP, "Total", journal->total);
+
+    ranges = g_ptr_array_new_with_free_func (g_free);
+
+    for (i = 0; i < journal->ranges->len; i++)
+    {
+        DownloadRange *range = &g_array_index (journal->ranges, DownloadRange, i);
+
+        g_ptr_array_add (ranges,
+                         g_strdup_printf ("%" G_GOFFSET_FORMAT "-%" G_GOFFSET_FORMAT, range->start, range->end));
+    }
+
+    g_key_file_set_string_list (key_file,
+                                DOWNLOAD_JOURNAL_GROUP,
+                                "Ranges",
+                                (const gchar * const *) ranges->pdata,
+                                ranges->len);
+
+    contents = g_key_file_to_data (key_file, length, NULL);
+
+    g_ptr_array_unref (ranges);
+    g_key_file_free (key_file);
+
+    return contents;
+}
+
+/**
+ * download_journal_save_data_free:
+ * @user_data: a #DownloadJournalSaveData
+ *
+ * Frees a #DownloadJournalSaveData struct.
+ */
+static void
+download_journal_save_data_free (gpointer user_data)
+{
+    DownloadJournalSaveData *save_data = user_data;
+
+    g_free (save_data->sync_path);
+    g_free (save_data->path);
+    g_free (save_data->contents);
+
+    g_slice_free (DownloadJournalSaveData, save_data);
+}
+
+/**
+ * download_journal_sync:
+ * @path: the path of the file being downloaded
+ * @error: return location for a #GError
+ *
+ * Flushes the data of the file at @path to disk with fsync(), which covers
+ * the writes made through any descriptor of the file, even closed ones.
+ *
+ * Returns: %TRUE if the file was flushed
+ */
+static gboolean
+download_journal_sync (const gchar  *path,
+                       GError      **error)
+{
+    gint saved_errno;
+    gint fd;
+
+    fd = g_open (path, O_RDONLY, 0);
+
+    if (fd >= 0 && fsync (fd) == 0)
+    {
+        close (fd);
+        return TRUE;
+    }
+
+    saved_errno = errno;
+
+    if (fd >= 0)
+        close (fd);
+
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (saved_errno),
+                 "Failed to flush \"%s\": %s",
+                 path,
+                 g_strerror (saved_errno));
+
+    return FALSE;
+}
+
+/**
+ * download_journal_save_thread:
+ * @task: a #GTask
+ * @source_object: %NULL
+ * @task_data: a #DownloadJournalSaveData
+ * @cancellable: a #GCancellable
+ *
+ * Flushes the file being downloaded to disk, then replaces the journal with
+ * g_file_set_contents(), which writes a temporary file and renames it over the
+ * old journal so a crash leaves either the old or the new one.
+ */
+static void
+download_journal_save_thread (GTask        *task,
+                              gpointer      source_object,
+                              gpointer      task_data,
+                              GCancellable *cancellable)
+{
+    DownloadJournalSaveData *save_data = task_data;
+    GError *error = NULL;
+
+    if (save_data->sync_path && !download_journal_sync (save_data->sync_path, &error))
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    if (!g_file_set_contents (save_data->path, save_data->contents, save_data->length, &error))
+    {
+        g_task_return_error (task, error);
+        return;
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * download_journal_save_async:
+ * @journal: a #DownloadJournal
+ * @sync_path: (nullable): the path of the file being downloaded
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call when the journal is saved
+ * @user_data: data to pass to @callback
+ *
+ * Saves @journal in a worker thread so the #GMainContext never waits on the
+ * disk. @journal is serialized before this returns and may be freed or
+ * changed right away. The file at @sync_path is flushed with fsync() before
+ * the journal is written, ranges recorded before the call are then durable.
+ */
+void
+download_journal_save_async (DownloadJournal     *journal,
+                             const gchar         *sync_path,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+    g_return_if_fail (journal != NULL);
+
+    DownloadJournalSaveData *save_data;
+    GTask *task;
+
+    save_data = g_slice_new0 (DownloadJournalSaveData);
+    save_data->path = g_strdup (journal->path);
+    save_data->contents = download_journal_to_data (journal, &save_data->length);
+    save_data->sync_path = g_strdup (sync_path);
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (task, download_journal_save_async);
+    g_task_set_task_data (task, save_data, download_journal_save_data_free);
+
+    g_task_run_in_thread (task, download_journal_save_thread);
+
+    g_object_unref (task);
+}
+
+/**
+ * download_journal_save_finish:
+ * @result: the #GAsyncResult passed to the download_journal_save_async()
+ *          callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes saving a journal.
+ *
+ * Returns: %TRUE if the journal was written
+ */
+gboolean
+download_journal_save_finish (GAsyncResult  *result,
+                              GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
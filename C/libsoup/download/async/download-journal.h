@@ -0,0 +1,72 @@
+#ifndef DOWNLOAD_JOURNAL_H
+#define DOWNLOAD_JOURNAL_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _DownloadRange {
+    goffset start;
+    goffset end;
+} DownloadRange;
+
+typedef struct _DownloadJournal {
+    gchar *path;
+    gchar *uri;
+
+    gchar *etag;
+    gchar *last_modified;
+    goffset total;
+
+    // DownloadRange of bytes already in the file, sorted and merged
+    GArray *ranges;
+} DownloadJournal;
+
+DownloadJournal *
+download_journal_new (const gchar *path,
+                      const gchar *uri);
+
+DownloadJournal *
+download_journal_load (const gchar  *path,
+                       const gchar  *uri,
+                       GError      **error);
+
+DownloadJournal *
+download_journal_copy (DownloadJournal *journal);
+
+void
+download_journal_free (DownloadJournal *journal);
+
+void
+download_journal_add_range (DownloadJournal *journal,
+                            goffset          start,
+                            goffset          end);
+
+void
+download_journal_clear (DownloadJournal *journal);
+
+goffset
+download_journal_get_n_bytes (DownloadJournal *journal);
+
+GArray *
+download_journal_get_missing (DownloadJournal *journal);
+
+gchar *
+download_journal_to_data (DownloadJournal *journal,
+                          gsize           *length);
+
+void
+download_journal_save_async (DownloadJournal     *journal,
+                             const gchar         *sync_path,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data);
+
+gboolean
+download_journal_save_finish (GAsyncResult  *result,
+                              GError       **error);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_JOURNAL_H */
@@ -0,0 +1,807 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-manager.h"
+#include "download-private.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+/**
+ * SECTION:download-manager
+ * @title: Download Manager
+ * @short_description: Pooled #SoupSession with per-host connection limits
+ * @include: download-manager.h
+ * @see_also: #SoupSession, #DownloadResourceData
+ *
+ * A #DownloadManager owns one #SoupSession that every download started
+ * through it shares, so keep-alive connections are reused and DNS, TCP and TLS
+ * handshakes are only paid once per connection instead of once per file.
+ *
+ * The manager also limits how many downloads run at once, both in total and
+ * per host. Downloads beyond those limits wait in a queue and hold no
+ * connection, file or buffer.
+ *
+ * Queued downloads are admitted shortest expected job first. A download is
+ * ranked by when it was queued plus the time its
+ * #DownloadOptions.expected_size takes at the aging rate of the manager, so
+ * a small file queued behind a large one goes first, while a large one
+ * waiting long enough gets ahead of any small one queued later rather than
+ * starve. A download of unknown size is ranked as one of the small size of
+ * the manager, and one with a #DownloadOptions.deadline is ranked no later
+ * than that deadline. On top of that some slots are kept for small
+ * downloads: downloads known to be larger than the small size never take
+ * the last of them. Downloads still running past their deadline are counted
+ * by download_manager_get_n_missed_deadlines() and in their
+ * #DownloadMetrics. See download_manager_set_scheduling() for the knobs.
+ *
+ * download_start() uses download_manager_get_default() unless
+ * #DownloadOptions.manager is set.
+ **/
+
+typedef struct _DownloadManagerHost {
+    gchar *name;
+    guint n_active;
+    GQueue pending;
+    gboolean ready;
+} DownloadManagerHost;
+
+struct _DownloadManager {
+    gint ref_count;
+    GMutex mutex;
+
+    SoupSession *session;
+
+    guint max_connections;
+    guint max_connections_per_host;
+
+    guint n_active;
+    guint n_queued;
+
+    // Downloads larger than small_size may hold all slots but small_slots,
+    // 0 for a quarter of them. Waiting a second is worth aging_rate bytes
+    // of expected size
+    guint64 small_size;
+    guint small_slots;
+    guint64 aging_rate;
+    guint n_active_large;
+    guint n_missed_deadlines;
+
+    // Host name -> DownloadManagerHost, whose pending downloads are sorted
+    // by rank
+    GHashTable *hosts;
+    // Hosts with queued downloads and a free per-host slot
+    GQueue ready;
+};
+
+/**
+ * download_manager_host_free:
+ * @user_data: a #DownloadManagerHost
+ *
+ * Frees a #DownloadManagerHost struct.
+ */
+static void
+download_manager_host_free (gpointer user_data)
+{
+    DownloadManagerHost *host = user_data;
+
+    g_free (host->name);
+    g_slice_free (DownloadManagerHost, host);
+}
+
+/**
+ * download_manager_host_update:
+ * @manager: a #DownloadManager, locked
+ * @host: a #DownloadManagerHost of @manager
+ *
+ * Puts @host in the ready queue of @manager if it has queued downloads and a
+ * free slot, and drops it from @manager when it has nothing left to do.
+ */
+static void
+download_manager_host_update (DownloadManager     *manager,
+                              DownloadManagerHost *host)
+{
+    if (!host->ready &&
+        !g_queue_is_empty (&host->pending) &&
+        host->n_active < manager->max_connections_per_host)
+    {
+        g_queue_push_tail (&manager->ready, host);
+        host->ready = TRUE;
+    }
+
+    if (host->n_active == 0 && g_queue_is_empty (&host->pending))
+    {
+        if (host->ready)
+            g_queue_remove (&manager->ready, host);
+
+        g_hash_table_remove (manager->hosts, host->name);
+    }
+}
+
+/**
+ * download_manager_free:
+ * @manager: a #DownloadManager
+ *
+ * Frees a #DownloadManager struct, aborting whatever the session still has
+ * going on.
+ */
+static void
+download_manager_free (DownloadManager *manager)
+{
+    soup_session_abort (manager->session);
+    g_object_unref (manager->session);
+
+    g_hash_table_unref (manager->hosts);
+    g_queue_clear (&manager->ready);
+    g_mutex_clear (&manager->mutex);
+
+    g_slice_free (DownloadManager, manager);
+}
+
+/**
+ * download_manager_new:
+ * @max_connections: the most downloads running at once, 0 for the default
+ * @max_connections_per_host: the most downloads running at once against a
+ *                            single host, 0 for the default
+ *
+ * Creates a #DownloadManager with its own #SoupSession. The session uses the
+ * thread-default #GMainContext of whoever starts a download, so a manager
+ * should only be used from one thread.
+ *
+ * Returns: (transfer full): a new #DownloadManager, free with
+ *          download_manager_unref()
+ */
+DownloadManager *
+download_manager_new (guint max_connections,
+                      guint max_connections_per_host)
+{
+    DownloadManager *manager;
+
+    if (max_connections == 0)
+        max_connections = DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS;
+
+    if (max_connections_per_host == 0)
+        max_connections_per_host = DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS_PER_HOST;
+
+    manager = g_slice_new0 (DownloadManager);
+    manager->ref_count = 1;
+    g_mutex_init (&manager->mutex);
+
+    manager->max_connections = max_connections;
+    manager->max_connections_per_host = MIN (max_connections_per_host, max_connections);
+
+    manager->small_size = DOWNLOAD_MANAGER_DEFAULT_SMALL_SIZE;
+    manager->small_slots = 0;
+    manager->aging_rate = DOWNLOAD_MANAGER_DEFAULT_AGING_RATE;
+
+    manager->hosts = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            NULL,
+                                            download_manager_host_free);
+    g_queue_init (&manager->ready);
+
+    // libsoup queues on its own limits too, keep them in line with ours so a
+    // download we admit gets a connection straight away
+    manager->session =
+        soup_session_new_with_options (SOUP_SESSION_USER_AGENT, "download_async",
+                                       SOUP_SESSION_SSL_USE_SYSTEM_CA_FILE, TRUE,
+                                       SOUP_SESSION_USE_THREAD_CONTEXT, TRUE,
+                                       SOUP_SESSION_TIMEOUT, 60,
+                                       SOUP_SESSION_IDLE_TIMEOUT, 60,
+                                       SOUP_SESSION_MAX_CONNS, manager->max_connections,
+                                       SOUP_SESSION_MAX_CONNS_PER_HOST, manager->max_connections_per_host,
+                                       NULL);
+
+    return manager;
+}
+
+/**
+ * download_manager_get_default:
+ *
+ * Gets the #DownloadManager used by downloads that do not ask for a specific
+ * one. It is created on first use with the default limits.
+ *
+ * Returns: (transfer none): the default #DownloadManager
+ */
+DownloadManager *
+download_manager_get_default (void)
+{
+    static gsize initialized = 0;
+    static DownloadManager *manager = NULL;
+
+    if (g_once_init_enter (&initialized))
+    {
+        manager = download_manager_new (0, 0);
+        g_once_init_leave (&initialized, 1);
+    }
+
+    return manager;
+}
+
+/**
+ * download_manager_ref:
+ * @manager: a #DownloadManager
+ *
+ * Increases the reference count of @manager.
+ *
+ * Returns: (transfer full): @manager
+ */
+DownloadManager *
+download_manager_ref (DownloadManager *manager)
+{
+    g_return_val_if_fail (manager != NULL, NULL);
+    g_return_val_if_fail (manager->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&manager->ref_count);
+
+    return manager;
+}
+
+/**
+ * download_manager_unref:
+ * @manager: a #DownloadManager
+ *
+ * Decreases the reference count of @manager, freeing it when the count drops
+ * to zero. Every download holds a reference to its manager.
+ */
+void
+download_manager_unref (DownloadManager *manager)
+{
+    g_return_if_fail (manager != NULL);
+    g_return_if_fail (manager->ref_count > 0);
+
+    if (g_atomic_int_dec_and_test (&manager->ref_count))
+        download_manager_free (manager);
+}
+
+/**
+ * download_manager_begin_cb:
+ * @user_data: a #DownloadResourceData
+ *
+ * Starts an admitted download on its own #GMainContext.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_manager_begin_cb (gpointer user_data)
+{
+    DownloadResourceData *data = user_data;
+
+    download_resource_data_begin (data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_manager_is_large:
+ * @manager: a #DownloadManager
+ * @data: a #DownloadResourceData
+ *
+ * Tells whether @data is known to be too large for the slots @manager keeps
+ * for small downloads.
+ *
+ * Returns: %TRUE if @data is larger than the small size of @manager
+ */
+static gboolean
+download_manager_is_large (DownloadManager      *manager,
+                           DownloadResourceData *data)
+{
+    return data->expected_size > manager->small_size;
+}
+
+/**
+ * download_manager_rank:
+ * @manager: a #DownloadManager
+ * @data: a #DownloadResourceData being queued
+ * @now: the monotonic time in µs
+ *
+ * Ranks @data among the queued downloads of @manager, earlier ranks are
+ * admitted first. The rank is @now delayed by how long the expected size of
+ * @data takes at the aging rate of @manager, and no later than the deadline
+ * of @data.
+ *
+ * Returns: the rank of @data, a monotonic time in µs
+ */
+static gint64
+download_manager_rank (DownloadManager      *manager,
+                       DownloadResourceData *data,
+                       gint64                now)
+{
+    guint64 size = data->expected_size > 0 ? data->expected_size : manager->small_size;
+    gdouble delay = (gdouble) size * G_USEC_PER_SEC / manager->aging_rate;
+    gint64 rank;
+
+    // Centuries away is as good as never, and does not overflow
+    rank = now + (gint64) MIN (delay, (gdouble) G_MAXINT64 / 4);
+
+    if (data->deadline > 0)
+        rank = MIN (rank, data->deadline);
+
+    return rank;
+}
+
+/**
+ * download_manager_pick:
+ * @manager: a #DownloadManager, locked
+ * @large: whether @manager has a slot for a large download
+ * @host: (out): return location for the #DownloadManagerHost of the pick
+ *
+ * Finds the queued download of the lowest rank that may take a slot, the
+ * first of each ready host unless large downloads have to wait, then the
+ * first one of that host that is not known to be large.
+ *
+ * Returns: (nullable): the #GList link of the download in the pending queue
+ *          of @host, or %NULL if none may be admitted
+ */
+static GList *
+download_manager_pick (DownloadManager      *manager,
+                       gboolean              large,
+                       DownloadManagerHost **host)
+{
+    GList *best = NULL;
+    GList *h;
+
+    *host = NULL;
+
+    for (h = manager->ready.head; h != NULL; h = h->next)
+    {
+        DownloadManagerHost *candidate = h->data;
+        GList *l;
+
+        for (l = candidate->pending.head; l != NULL; l = l->next)
+        {
+            DownloadResourceData *data = l->data;
+
+            if (large || !download_manager_is_large (manager, data))
+                break;
+        }
+
+        if (l != NULL &&
+            (best == NULL || ((DownloadResourceData *) l->data)->rank < ((DownloadResourceData *) best->data)->rank))
+        {
+            best = l;
+            *host = candidate;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * download_manager_dispatch:
+ * @manager: a #DownloadManager
+ *
+ * Admits queued downloads while @manager has free slots, by rank among the
+ * hosts with a free slot of their own.
+ */
+static void
+download_manager_dispatch (DownloadManager *manager)
+{
+    GList *admitted = NULL;
+    GList *l;
+
+    g_mutex_lock (&manager->mutex);
+
+    while (manager->n_active < manager->max_connections &&
+           !g_queue_is_empty (&manager->ready))
+    {
+        guint small_slots = manager->small_slots > 0 ? manager->small_slots : manager->max_connections / 4;
+        guint large_slots = manager->max_connections - MIN (small_slots, manager->max_connections - 1);
+        DownloadManagerHost *host;
+        DownloadResourceData *data;
+        GList *link;
+
+        link = download_manager_pick (manager, manager->n_active_large < large_slots, &host);
+
+        if (!link)
+            break;
+
+        data = link->data;
+        g_queue_delete_link (&host->pending, link);
+
+        g_queue_remove (&manager->ready, host);
+        host->ready = FALSE;
+        host->n_active++;
+        manager->n_active++;
+        manager->n_queued--;
+
+        data->large = download_manager_is_large (manager, data);
+
+        if (data->large)
+            manager->n_active_large++;
+
+        data->admitted = TRUE;
+        admitted = g_list_prepend (admitted, data);
+
+        download_manager_host_update (manager, host);
+    }
+
+    g_mutex_unlock (&manager->mutex);
+
+    admitted = g_list_reverse (admitted);
+
+    for (l = admitted; l != NULL; l = l->next)
+    {
+        DownloadResourceData *data = l->data;
+
+        g_cancellable_disconnect (data->cancellable, data->cancelled_id);
+        data->cancelled_id = 0;
+
+        // Hands over the reference the queue held
+        g_main_context_invoke_full (data->context,
+                                    G_PRIORITY_DEFAULT,
+                                    download_manager_begin_cb,
+                                    data,
+                                    (GDestroyNotify) download_resource_data_unref);
+    }
+
+    g_list_free (admitted);
+}
+
+/**
+ * download_manager_cancelled_idle:
+ * @user_data: a #DownloadResourceData
+ *
+ * Fails a download that was cancelled while it was still queued, downloads
+ * that were admitted in the meantime fail on their own.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_manager_cancelled_idle (gpointer user_data)
+{
+    DownloadResourceData *data = user_data;
+    DownloadManager *manager = data->manager;
+    DownloadManagerHost *host;
+    gboolean removed = FALSE;
+
+    g_mutex_lock (&manager->mutex);
+
+    host = g_hash_table_lookup (manager->hosts, data->host);
+
+    if (host && g_queue_remove (&host->pending, data))
+    {
+        removed = TRUE;
+        manager->n_queued--;
+
+        if (host->ready && g_queue_is_empty (&host->pending))
+        {
+            g_queue_remove (&manager->ready, host);
+            host->ready = FALSE;
+        }
+
+        download_manager_host_update (manager, host);
+    }
+
+    g_mutex_unlock (&manager->mutex);
+
+    if (!removed)
+        return G_SOURCE_REMOVE;
+
+    g_debug ("Downloader ( %s ): cancelled while queued", data->uri);
+
+    g_cancellable_disconnect (data->cancellable, data->cancelled_id);
+    data->cancelled_id = 0;
+
+    download_resource_data_fail (data,
+                                 g_error_new_literal (G_IO_ERROR,
+                                                      G_IO_ERROR_CANCELLED,
+                                                      "Operation was cancelled"));
+
+    // Drops the reference the queue held
+    download_resource_data_unref (data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_manager_cancelled_cb:
+ * @cancellable: the #GCancellable of @user_data
+ * @user_data: a #DownloadResourceData
+ *
+ * Called, from any thread, when a queued download is cancelled. The download
+ * is taken out of the queue from its own #GMainContext.
+ */
+static void
+download_manager_cancelled_cb (GCancellable *cancellable,
+                               gpointer      user_data)
+{
+    DownloadResourceData *data = user_data;
+    GSource *source;
+
+    source = g_idle_source_new ();
+    g_source_set_callback (source,
+                           download_manager_cancelled_idle,
+                           download_resource_data_ref (data),
+                           (GDestroyNotify) download_resource_data_unref);
+    g_source_attach (source, data->context);
+    g_source_unref (source);
+}
+
+/**
+ * download_manager_queue:
+ * @manager: a #DownloadManager
+ * @data: a #DownloadResourceData, not yet started
+ *
+ * Queues @data by its rank among the other downloads for the same host. It
+ * is started with download_resource_data_begin() once @manager has a free
+ * slot for it, which may be right away.
+ */
+void
+download_manager_queue (DownloadManager      *manager,
+                        DownloadResourceData *data)
+{
+    g_return_if_fail (manager != NULL);
+    g_return_if_fail (data != NULL && data->host != NULL);
+
+    DownloadManagerHost *host;
+    GList *l;
+
+    data->cancelled_id = g_cancellable_connect (data->cancellable,
+                                                G_CALLBACK (download_manager_cancelled_cb),
+                                                data,
+                                                NULL);
+
+    g_mutex_lock (&manager->mutex);
+
+    host = g_hash_table_lookup (manager->hosts, data->host);
+
+    if (!host)
+    {
+        host = g_slice_new0 (DownloadManagerHost);
+        host->name = g_strdup (data->host);
+        g_queue_init (&host->pending);
+
+        g_hash_table_insert (manager->hosts, host->name, host);
+    }
+
+    data->rank = download_manager_rank (manager, data, g_get_monotonic_time ());
+
+    // Ranks mostly grow with time, so the place is usually at the tail, and
+    // equal ranks keep their order
+    for (l = host->pending.tail; l != NULL; l = l->prev)
+    {
+        if (((DownloadResourceData *) l->data)->rank <= data->rank)
+            break;
+    }
+
+    if (l)
+        g_queue_insert_after (&host->pending, l, download_resource_data_ref (data));
+    else
+        g_queue_push_head (&host->pending, download_resource_data_ref (data));
+
+    manager->n_queued++;
+
+    download_manager_host_update (manager, host);
+
+    g_mutex_unlock (&manager->mutex);
+
+    download_manager_dispatch (manager);
+}
+
+/**
+ * download_manager_release:
+ * @manager: a #DownloadManager
+ * @data: a #DownloadResourceData admitted by @manager
+ *
+ * Gives the slot of a finished download back to @manager, starting the next
+ * queued download if there is one, and counts it if it ran past its
+ * deadline.
+ */
+void
+download_manager_release (DownloadManager      *manager,
+                          DownloadResourceData *data)
+{
+    g_return_if_fail (manager != NULL);
+    g_return_if_fail (data != NULL && data->admitted);
+
+    DownloadManagerHost *host;
+    gint64 now = g_get_monotonic_time ();
+    gboolean missed = data->deadline > 0 && now > data->deadline;
+
+    data->admitted = FALSE;
+
+    if (missed)
+        g_debug ("Downloader ( %s ): missed its deadline by %.3f s",
+                 data->uri, (gdouble) (now - data->deadline) / G_USEC_PER_SEC);
+
+    g_mutex_lock (&manager->mutex);
+
+    host = g_hash_table_lookup (manager->hosts, data->host);
+    g_assert (host != NULL);
+
+    host->n_active--;
+    manager->n_active--;
+
+    if (data->large)
+        manager->n_active_large--;
+
+    if (missed)
+        manager->n_missed_deadlines++;
+
+    download_manager_host_update (manager, host);
+
+    g_mutex_unlock (&manager->mutex);
+
+    download_manager_dispatch (manager);
+}
+
+/**
+ * download_manager_set_max_connections:
+ * @manager: a #DownloadManager
+ * @max_connections: the most downloads running at once, 0 for the default
+ * @max_connections_per_host: the most downloads running at once against a
+ *                            single host, 0 for the default
+ *
+ * Changes the limits of @manager. Raising them starts queued downloads right
+ * away, lowering them lets running downloads finish but admits no new ones
+ * until the count drops below the new limits.
+ */
+void
+download_manager_set_max_connections (DownloadManager *manager,
+                                      guint            max_connections,
+                                      guint            max_connections_per_host)
+{
+    g_return_if_fail (manager != NULL);
+
+    GHashTableIter iter;
+    gpointer value;
+
+    if (max_connections == 0)
+        max_connections = DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS;
+
+    if (max_connections_per_host == 0)
+        max_connections_per_host = DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS_PER_HOST;
+
+    g_mutex_lock (&manager->mutex);
+
+    manager->max_connections = max_connections;
+    manager->max_connections_per_host = MIN (max_connections_per_host, max_connections);
+
+    g_hash_table_iter_init (&iter, manager->hosts);
+
+    while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+        DownloadManagerHost *host = value;
+
+        // A lowered limit takes hosts at it out, until a download of theirs
+        // ends and download_manager_host_update() puts them back
+        if (host->ready && host->n_active >= manager->max_connections_per_host)
+        {
+            g_queue_remove (&manager->ready, host);
+            host->ready = FALSE;
+        }
+        else if (!host->ready &&
+                 !g_queue_is_empty (&host->pending) &&
+                 host->n_active < manager->max_connections_per_host)
+        {
+            g_queue_push_tail (&manager->ready, host);
+            host->ready = TRUE;
+        }
+    }
+
+    g_mutex_unlock (&manager->mutex);
+
+    g_object_set (manager->session,
+                  SOUP_SESSION_MAX_CONNS, max_connections,
+                  SOUP_SESSION_MAX_CONNS_PER_HOST, MIN (max_connections_per_host, max_connections),
+                  NULL);
+
+    download_manager_dispatch (manager);
+}
+
+/**
+ * download_manager_set_scheduling:
+ * @manager: a #DownloadManager
+ * @small_size: the largest expected size, in bytes, of a small download, 0
+ *              for the default
+ * @small_slots: how many slots downloads larger than @small_size leave to
+ *               small ones, 0 for a quarter of the slots
+ * @aging_rate: how many bytes of expected size a second of waiting makes
+ *              up for, 0 for the default
+ *
+ * Changes how @manager orders and admits queued downloads, see the section
+ * description. A single slot is never kept for small downloads. Downloads
+ * already queued keep their rank.
+ */
+void
+download_manager_set_scheduling (DownloadManager *manager,
+                                 guint64          small_size,
+                                 guint            small_slots,
+                                 guint64          aging_rate)
+{
+    g_return_if_fail (manager != NULL);
+
+    g_mutex_lock (&manager->mutex);
+
+    manager->small_size = small_size > 0 ? small_size : DOWNLOAD_MANAGER_DEFAULT_SMALL_SIZE;
+    manager->small_slots = small_slots;
+    manager->aging_rate = aging_rate > 0 ? aging_rate : DOWNLOAD_MANAGER_DEFAULT_AGING_RATE;
+
+    g_mutex_unlock (&manager->mutex);
+
+    download_manager_dispatch (manager);
+}
+
+/**
+ * download_manager_get_session:
+ * @manager: a #DownloadManager
+ *
+ * Gets the #SoupSession shared by the downloads of @manager.
+ *
+ * Returns: (transfer none): a #SoupSession
+ */
+SoupSession *
+download_manager_get_session (DownloadManager *manager)
+{
+    g_return_val_if_fail (manager != NULL, NULL);
+
+    return manager->session;
+}
+
+/**
+ * download_manager_get_n_active:
+ * @manager: a #DownloadManager
+ *
+ * Gets how many downloads of @manager hold a connection slot.
+ *
+ * Returns: the number of running downloads
+ */
+guint
+download_manager_get_n_active (DownloadManager *manager)
+{
+    g_return_val_if_fail (manager != NULL, 0);
+
+    guint n_active;
+
+    g_mutex_lock (&manager->mutex);
+    n_active = manager->n_active;
+    g_mutex_unlock (&manager->mutex);
+
+    return n_active;
+}
+
+/**
+ * download_manager_get_n_queued:
+ * @manager: a #DownloadManager
+ *
+ * Gets how many downloads of @manager are waiting for a connection slot.
+ *
+ * Returns: the number of queued downloads
+ */
+guint
+download_manager_get_n_queued (DownloadManager *manager)
+{
+    g_return_val_if_fail (manager != NULL, 0);
+
+    guint n_queued;
+
+    g_mutex_lock (&manager->mutex);
+    n_queued = manager->n_queued;
+    g_mutex_unlock (&manager->mutex);
+
+    return n_queued;
+}
+
+/**
+ * download_manager_get_n_missed_deadlines:
+ * @manager: a #DownloadManager
+ *
+ * Gets how many downloads of @manager completed, or failed, after their
+ * #DownloadOptions.deadline.
+ *
+ * Returns: the number of missed deadlines
+ */
+guint
+download_manager_get_n_missed_deadlines (DownloadManager *manager)
+{
+    g_return_val_if_fail (manager != NULL, 0);
+
+    guint n_missed_deadlines;
+
+    g_mutex_lock (&manager->mutex);
+    n_missed_deadlines = manager->n_missed_deadlines;
+    g_mutex_unlock (&manager->mutex);
+
+    return n_missed_deadlines;
+}
@@ -0,0 +1,58 @@
+#ifndef DOWNLOAD_MANAGER_H
+#define DOWNLOAD_MANAGER_H
+
+#include "download-async.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+#define DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS          32
+#define DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS_PER_HOST 8
+
+// Downloads up to this many bytes may take the slots kept for small ones,
+// and a second of waiting makes up for this many bytes of expected size
+#define DOWNLOAD_MANAGER_DEFAULT_SMALL_SIZE (1024 * 1024)
+#define DOWNLOAD_MANAGER_DEFAULT_AGING_RATE (8 * 1024 * 1024)
+
+DownloadManager *
+download_manager_new (guint max_connections,
+                      guint max_connections_per_host);
+
+DownloadManager *
+download_manager_get_default (void);
+
+DownloadManager *
+download_manager_ref (DownloadManager *manager);
+
+void
+download_manager_unref (DownloadManager *manager);
+
+void
+download_manager_set_max_connections (DownloadManager *manager,
+                                      guint            max_connections,
+                                      guint            max_connections_per_host);
+
+void
+download_manager_set_scheduling (DownloadManager *manager,
+                                 guint64          small_size,
+                                 guint            small_slots,
+                                 guint64          aging_rate);
+
+SoupSession *
+download_manager_get_session (DownloadManager *manager);
+
+guint
+download_manager_get_n_active (DownloadManager *manager);
+
+guint
+download_manager_get_n_queued (DownloadManager *manager);
+
+guint
+download_manager_get_n_missed_deadlines (DownloadManager *manager);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_MANAGER_H */
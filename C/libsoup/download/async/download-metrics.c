@@ -0,0 +1,479 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-metrics.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <string.h>
+
+/**
+ * SECTION:download-metrics
+ * @title: Download Metrics
+ * @short_description: Per download timings and process wide aggregates
+ * @include: download-metrics.h
+ * @see_also: #DownloadResourceData
+ *
+ * Every download fills a #DownloadMetrics as it runs: when it was admitted,
+ * when name resolution, the TCP connection and the TLS handshake started
+ * and ended, when the response headers and the first byte of the body came
+ * in, how many bytes went through how many reads and writes, how long
+ * writes took and held reads back, how often segments reconnected, and
+ * whether it ended after its deadline.
+ * download_resource_data_get_metrics() gives it to the callback of
+ * download_start(), download_metrics_get_phase() turns it into durations.
+ *
+ * Completed downloads are also added to counters shared by the whole
+ * process, with a latency histogram per #DownloadPhase.
+ * download_metrics_dump_json() writes them out for a monitoring scraper:
+ *
+ * |[
+ * {
+ *   "downloads": 12, "succeeded": 11, "failed": 1, "cancelled": 0,
+ *   "deadlines": 4, "missed_deadlines": 1,
+ *   "bytes_read": 104857600, "bytes_written": 104857600,
+ *   "reads": 1630, "writes": 1630,
+ *   "write_time_us": 91234, "write_blocked_time_us": 0,
+ *   "retries": 1, "connections": 3,
+ *   "phases": {
+ *     "ttfb": { "count": 12, "sum_us": 480321,
+ *               "buckets": [ { "le_ms": 1, "count": 0 }, ... ,
+ *                            { "le_ms": null, "count": 0 } ] },
+ *     ...
+ *   }
+ * }
+ * ]|
+ *
+ * Bucket counts are not cumulative, the last bucket holds everything above
+ * 65536 ms.
+ **/
+
+typedef struct _DownloadMetricsHistogram {
+    guint64 count;
+    gint64 sum;
+    guint64 buckets[DOWNLOAD_METRICS_N_BUCKETS];
+} DownloadMetricsHistogram;
+
+typedef struct _DownloadMetricsTotals {
+    guint64 n_downloads;
+    guint64 n_succeeded;
+    guint64 n_failed;
+    guint64 n_cancelled;
+
+    guint64 n_deadlines;
+    guint64 n_missed_deadlines;
+
+    guint64 bytes_read;
+    guint64 bytes_written;
+    guint64 n_reads;
+    guint64 n_writes;
+    gint64 write_time;
+    gint64 write_blocked_time;
+
+    guint64 n_retries;
+    guint64 n_connections;
+
+    DownloadMetricsHistogram phases[DOWNLOAD_N_PHASES];
+} DownloadMetricsTotals;
+
+G_LOCK_DEFINE_STATIC (totals);
+static DownloadMetricsTotals totals;
+
+/**
+ * download_phase_get_name:
+ * @phase: a #DownloadPhase
+ *
+ * Gets the name of @phase, as used in the JSON output.
+ *
+ * Returns: the name of @phase
+ */
+const gchar *
+download_phase_get_name (DownloadPhase phase)
+{
+    switch (phase)
+    {
+        case DOWNLOAD_PHASE_QUEUED:
+            return "queued";
+
+        case DOWNLOAD_PHASE_RESOLVE:
+            return "resolve";
+
+        case DOWNLOAD_PHASE_CONNECT:
+            return "connect";
+
+        case DOWNLOAD_PHASE_TLS:
+            return "tls";
+
+        case DOWNLOAD_PHASE_TTFB:
+            return "ttfb";
+
+        case DOWNLOAD_PHASE_TRANSFER:
+            return "transfer";
+
+        case DOWNLOAD_PHASE_TOTAL:
+            return "total";
+
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * download_metrics_missed_deadline:
+ * @metrics: the #DownloadMetrics of a completed download
+ *
+ * Tells whether a download with a #DownloadOptions.deadline ended after it,
+ * whether it succeeded or not.
+ *
+ * Returns: %TRUE if the download missed its deadline
+ */
+gboolean
+download_metrics_missed_deadline (const DownloadMetrics *metrics)
+{
+    g_return_val_if_fail (metrics != NULL, FALSE);
+
+    return metrics->deadline_time > 0 && metrics->end_time > metrics->deadline_time;
+}
+
+/**
+ * download_metrics_span:
+ * @start: a monotonic time in µs, or 0
+ * @end: a later monotonic time in µs, or 0
+ *
+ * Gets the time between @start and @end.
+ *
+ * Returns: the duration in µs, or -1 if either end is missing
+ */
+static gint64
+download_metrics_span (gint64 start,
+                       gint64 end)
+{
+    if (start == 0 || end == 0 || end < start)
+        return -1;
+
+    return end - start;
+}
+
+/**
+ * download_metrics_get_phase:
+ * @metrics: a #DownloadMetrics
+ * @phase: a #DownloadPhase
+ *
+ * Gets how long @phase took. %DOWNLOAD_PHASE_QUEUED is the wait for a slot
+ * of the #DownloadManager. %DOWNLOAD_PHASE_TTFB runs from when the request
+ * could go out, after the handshakes if there were any, to the response
+ * headers. %DOWNLOAD_PHASE_TRANSFER runs from the response headers to the
+ * end of the download, writes and checksum included.
+ *
+ * Returns: the duration of @phase in µs, or -1 if it did not happen
+ */
+gint64
+download_metrics_get_phase (const DownloadMetrics *metrics,
+                            DownloadPhase          phase)
+{
+    g_return_val_if_fail (metrics != NULL, -1);
+
+    gint64 ready;
+
+    switch (phase)
+    {
+        case DOWNLOAD_PHASE_QUEUED:
+            return download_metrics_span (metrics->start_time, metrics->admit_time);
+
+        case DOWNLOAD_PHASE_RESOLVE:
+            return download_metrics_span (metrics->resolve_start_time, metrics->resolve_end_time);
+
+        case DOWNLOAD_PHASE_CONNECT:
+            return download_metrics_span (metrics->connect_start_time, metrics->connect_end_time);
+
+        case DOWNLOAD_PHASE_TLS:
+            return download_metrics_span (metrics->tls_start_time, metrics->tls_end_time);
+
+        case DOWNLOAD_PHASE_TTFB:
+            ready = MAX (metrics->send_time, MAX (metrics->connect_end_time, metrics->tls_end_time));
+            return download_metrics_span (ready, metrics->response_time);
+
+        case DOWNLOAD_PHASE_TRANSFER:
+            return download_metrics_span (metrics->response_time, metrics->end_time);
+
+        case DOWNLOAD_PHASE_TOTAL:
+            return download_metrics_span (metrics->start_time, metrics->end_time);
+
+        default:
+            return -1;
+    }
+}
+
+/**
+ * download_metrics_append_counters:
+ * @string: a #GString
+ * @bytes_read: bytes read from the network
+ * @bytes_written: bytes written out
+ * @n_reads: number of reads
+ * @n_writes: number of writes
+ * @write_time: µs writes were in flight
+ * @write_blocked_time: µs reads waited on writes
+ * @n_retries: number of reconnects
+ * @n_connections: number of connections opened
+ *
+ * Appends the counters shared by the per download and aggregate JSON
+ * objects to @string.
+ */
+static void
+download_metrics_append_counters (GString *string,
+                                  guint64  bytes_read,
+                                  guint64  bytes_written,
+                                  guint64  n_reads,
+                                  guint64  n_writes,
+                                  gint64   write_time,
+                                  gint64   write_blocked_time,
+                                  guint64  n_retries,
+                                  guint64  n_connections)
+{
+    g_string_append_printf (string,
+                            "\"bytes_read\":%" G_GUINT64_FORMAT ","
+                            "\"bytes_written\":%" G_GUINT64_FORMAT ","
+                            "\"reads\":%" G_GUINT64_FORMAT ","
+                            "\"writes\":%" G_GUINT64_FORMAT ","
+                            "\"write_time_us\":%" G_GINT64_FORMAT ","
+                            "\"write_blocked_time_us\":%" G_GINT64_FORMAT ","
+                            "\"retries\":%" G_GUINT64_FORMAT ","
+                            "\"connections\":%" G_GUINT64_FORMAT,
+                            bytes_read,
+                            bytes_written,
+                            n_reads,
+                            n_writes,
+                            write_time,
+                            write_blocked_time,
+                            n_retries,
+                            n_connections);
+}
+
+/**
+ * download_metrics_to_json:
+ * @metrics: a #DownloadMetrics
+ *
+ * Formats @metrics as a JSON object with the counters, whether the deadline
+ * was missed, null without one, and the duration of every #DownloadPhase in
+ * µs, null for phases that did not happen.
+ *
+ * Returns: (transfer full): a JSON object, free with g_free()
+ */
+gchar *
+download_metrics_to_json (const DownloadMetrics *metrics)
+{
+    g_return_val_if_fail (metrics != NULL, NULL);
+
+    GString *string;
+    guint i;
+
+    string = g_string_new ("{");
+
+    download_metrics_append_counters (string,
+                                      metrics->bytes_read,
+                                      metrics->bytes_written,
+                                      metrics->n_reads,
+                                      metrics->n_writes,
+                                      metrics->write_time,
+                                      metrics->write_blocked_time,
+                                      metrics->n_retries,
+                                      metrics->n_connections);
+
+    if (metrics->deadline_time > 0)
+        g_string_append_printf (string, ",\"deadline_missed\":%s", download_metrics_missed_deadline (metrics) ? "true" : "false");
+    else
+        g_string_append (string, ",\"deadline_missed\":null");
+
+    g_string_append (string, ",\"phases_us\":{");
+
+    for (i = 0; i < DOWNLOAD_N_PHASES; i++)
+    {
+        gint64 duration = download_metrics_get_phase (metrics, i);
+
+        if (i > 0)
+            g_string_append_c (string, ',');
+
+        if (duration < 0)
+            g_string_append_printf (string, "\"%s\":null", download_phase_get_name (i));
+        else
+            g_string_append_printf (string, "\"%s\":%" G_GINT64_FORMAT, download_phase_get_name (i), duration);
+    }
+
+    g_string_append (string, "}}");
+
+    return g_string_free (string, FALSE);
+}
+
+/**
+ * download_metrics_histogram_add:
+ * @histogram: a #DownloadMetricsHistogram
+ * @duration: a duration in µs
+ *
+ * Counts @duration in the bucket of the smallest power of two milliseconds
+ * it fits in.
+ */
+static void
+download_metrics_histogram_add (DownloadMetricsHistogram *histogram,
+                                gint64                    duration)
+{
+    gint64 bound = 1000;
+    guint bucket = 0;
+
+    while (bucket < DOWNLOAD_METRICS_N_BUCKETS - 1 && duration > bound)
+    {
+        bound *= 2;
+        bucket++;
+    }
+
+    histogram->count++;
+    histogram->sum += duration;
+    histogram->buckets[bucket]++;
+}
+
+/**
+ * download_metrics_record:
+ * @metrics: the #DownloadMetrics of a completed download
+ * @error: (nullable): the #GError the download failed with, or %NULL
+ *
+ * Adds a completed download to the process wide counters and histograms.
+ * Called by every download as it completes, from any thread.
+ */
+void
+download_metrics_record (const DownloadMetrics *metrics,
+                         const GError          *error)
+{
+    g_return_if_fail (metrics != NULL);
+
+    guint i;
+
+    G_LOCK (totals);
+
+    totals.n_downloads++;
+
+    if (!error)
+        totals.n_succeeded++;
+    else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        totals.n_cancelled++;
+    else
+        totals.n_failed++;
+
+    if (metrics->deadline_time > 0)
+        totals.n_deadlines++;
+
+    if (download_metrics_missed_deadline (metrics))
+        totals.n_missed_deadlines++;
+
+    totals.bytes_read += metrics->bytes_read;
+    totals.bytes_written += metrics->bytes_written;
+    totals.n_reads += metrics->n_reads;
+    totals.n_writes += metrics->n_writes;
+    totals.write_time += metrics->write_time;
+    totals.write_blocked_time += metrics->write_blocked_time;
+    totals.n_retries += metrics->n_retries;
+    totals.n_connections += metrics->n_connections;
+
+    for (i = 0; i < DOWNLOAD_N_PHASES; i++)
+    {
+        gint64 duration = download_metrics_get_phase (metrics, i);
+
+        if (duration >= 0)
+            download_metrics_histogram_add (&totals.phases[i], duration);
+    }
+
+    G_UNLOCK (totals);
+}
+
+/**
+ * download_metrics_dump_json:
+ *
+ * Formats the process wide counters and the latency histograms as a JSON
+ * object, see the section description for its layout.
+ *
+ * Returns: (transfer full): a JSON object, free with g_free()
+ */
+gchar *
+download_metrics_dump_json (void)
+{
+    DownloadMetricsTotals snapshot;
+    GString *string;
+    guint i;
+    guint j;
+
+    G_LOCK (totals);
+    snapshot = totals;
+    G_UNLOCK (totals);
+
+    string = g_string_new (NULL);
+
+    g_string_append_printf (string,
+                            "{\"downloads\":%" G_GUINT64_FORMAT ","
+                            "\"succeeded\":%" G_GUINT64_FORMAT ","
+                            "\"failed\":%" G_GUINT64_FORMAT ","
+                            "\"cancelled\":%" G_GUINT64_FORMAT ","
+                            "\"deadlines\":%" G_GUINT64_FORMAT ","
+                            "\"missed_deadlines\":%" G_GUINT64_FORMAT ",",
+                            snapshot.n_downloads,
+                            snapshot.n_succeeded,
+                            snapshot.n_failed,
+                            snapshot.n_cancelled,
+                            snapshot.n_deadlines,
+                            snapshot.n_missed_deadlines);
+
+    download_metrics_append_counters (string,
+                                      snapshot.bytes_read,
+                                      snapshot.bytes_written,
+                                      snapshot.n_reads,
+                                      snapshot.n_writes,
+                                      snapshot.write_time,
+                                      snapshot.write_blocked_time,
+                                      snapshot.n_retries,
+                                      snapshot.n_connections);
+
+    g_string_append (string, ",\"phases\":{");
+
+    for (i = 0; i < DOWNLOAD_N_PHASES; i++)
+    {
+        DownloadMetricsHistogram *histogram = &snapshot.phases[i];
+
+        if (i > 0)
+            g_string_append_c (string, ',');
+
+        g_string_append_printf (string,
+                                "\"%s\":{\"count\":%" G_GUINT64_FORMAT ",\"sum_us\":%" G_GINT64_FORMAT ",\"buckets\":[",
+                                download_phase_get_name (i),
+                                histogram->count,
+                                histogram->sum);
+
+        for (j = 0; j < DOWNLOAD_METRICS_N_BUCKETS; j++)
+        {
+            if (j > 0)
+                g_string_append_c (string, ',');
+
+            if (j < DOWNLOAD_METRICS_N_BUCKETS - 1)
+                g_string_append_printf (string, "{\"le_ms\":%u,", 1u << j);
+            else
+                g_string_append (string, "{\"le_ms\":null,");
+
+            g_string_append_printf (string, "\"count\":%" G_GUINT64_FORMAT "}", histogram->buckets[j]);
+        }
+
+        g_string_append (string, "]}");
+    }
+
+    g_string_append (string, "}}");
+
+    return g_string_free (string, FALSE);
+}
+
+/**
+ * download_metrics_reset:
+ *
+ * Sets the process wide counters and histograms back to zero, for scrapers
+ * that want each dump to cover the time since the previous one.
+ */
+void
+download_metrics_reset (void)
+{
+    G_LOCK (totals);
+    memset (&totals, 0, sizeof (DownloadMetricsTotals));
+    G_UNLOCK (totals);
+}
@@ -0,0 +1,83 @@
+#ifndef DOWNLOAD_METRICS_H
+#define DOWNLOAD_METRICS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    DOWNLOAD_PHASE_QUEUED,
+    DOWNLOAD_PHASE_RESOLVE,
+    DOWNLOAD_PHASE_CONNECT,
+    DOWNLOAD_PHASE_TLS,
+    DOWNLOAD_PHASE_TTFB,
+    DOWNLOAD_PHASE_TRANSFER,
+    DOWNLOAD_PHASE_TOTAL
+} DownloadPhase;
+
+#define DOWNLOAD_N_PHASES 7
+
+// Latency histograms count durations up to 1 ms, 2 ms, 4 ms ... 65536 ms,
+// and above
+#define DOWNLOAD_METRICS_N_BUCKETS 18
+
+typedef struct _DownloadMetrics {
+    // Monotonic times in µs, 0 for what did not happen, like the handshakes
+    // of a download that reused a kept-alive connection. Each is taken the
+    // first time it happens for any segment of the download
+    gint64 start_time;
+    gint64 admit_time;
+    gint64 resolve_start_time;
+    gint64 resolve_end_time;
+    gint64 connect_start_time;
+    gint64 connect_end_time;
+    gint64 tls_start_time;
+    gint64 tls_end_time;
+    gint64 send_time;
+    gint64 response_time;
+    gint64 first_byte_time;
+    gint64 end_time;
+
+    // When the download should have ended by, 0 without a deadline
+    gint64 deadline_time;
+
+    guint64 bytes_read;
+    guint64 bytes_written;
+    guint n_reads;
+    guint n_writes;
+
+    // µs writes were in flight, and µs reads were held back because every
+    // chunk of the ring was waiting to be written
+    gint64 write_time;
+    gint64 write_blocked_time;
+
+    guint n_retries;
+    guint n_connections;
+} DownloadMetrics;
+
+gboolean
+download_metrics_missed_deadline (const DownloadMetrics *metrics);
+
+const gchar *
+download_phase_get_name (DownloadPhase phase);
+
+gint64
+download_metrics_get_phase (const DownloadMetrics *metrics,
+                            DownloadPhase          phase);
+
+gchar *
+download_metrics_to_json (const DownloadMetrics *metrics);
+
+void
+download_metrics_record (const DownloadMetrics *metrics,
+                         const GError          *error);
+
+gchar *
+download_metrics_dump_json (void);
+
+void
+download_metrics_reset (void);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_METRICS_H */
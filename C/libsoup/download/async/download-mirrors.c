@@ -0,0 +1,481 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-mirrors.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+/**
+ * SECTION:download-mirrors
+ * @title: Download Mirrors
+ * @short_description: Picking the fastest of several sources of a resource
+ * @include: download-mirrors.h
+ * @see_also: #DownloadOptions, #SoupSession
+ *
+ * A download given #DownloadOptions.mirrors, other uris serving the same
+ * bytes as its own like the ones listed in a metalink, races them before it
+ * starts. download_mirrors_race_async() asks every mirror for its first
+ * %DOWNLOAD_MIRROR_PROBE_SIZE bytes at once. The race ends when one of them
+ * got all of it, or after %DOWNLOAD_MIRROR_PROBE_TIME, and the mirror that
+ * received the most, connection and redirects included, wins.
+ *
+ * While the download runs each segment measures what it receives over
+ * %DOWNLOAD_MIRROR_CHECK_INTERVAL. A segment slower than
+ * #DownloadOptions.min_rate, or whose mirror fails, asks the next mirror by
+ * download_mirrors_pick() for the rest of its bytes, with a Range from the
+ * byte it stopped at. The #DownloadMirror array of a download, see
+ * download_resource_data_get_mirrors(), keeps the rates seen.
+ *
+ * Mirrors cannot be told apart by their validators, so If-Range is only
+ * sent to the mirror they came from. #DownloadOptions.expected_digest is the
+ * way to make sure they all served the same bytes.
+ **/
+
+typedef struct _DownloadMirrorRace {
+    GTask *task;
+    DownloadMirror *mirrors;
+    guint n_mirrors;
+
+    // Stops the probes still running when the race ends, the cancellable of
+    // the caller forwards to it
+    GCancellable *cancellable;
+    gulong cancelled_id;
+    GSource *timeout_source;
+
+    guint n_pending;
+    gint64 start_time;
+    GError *error;
+} DownloadMirrorRace;
+
+typedef struct _DownloadMirrorProbe {
+    DownloadMirrorRace *race;
+    DownloadMirror *mirror;
+
+    SoupRequest *request;
+    GInputStream *input;
+    gchar *buffer;
+    guint64 n_bytes;
+} DownloadMirrorProbe;
+
+// What a probe reads at once, the bytes are thrown away
+#define DOWNLOAD_MIRROR_PROBE_BUFFER_SIZE (64 * 1024)
+
+/**
+ * download_mirror_race_cancelled_cb:
+ * @cancellable: the #GCancellable of the caller
+ * @user_data: a #DownloadMirrorRace
+ *
+ * Stops the probes of a race whose caller gave up.
+ */
+static void
+download_mirror_race_cancelled_cb (GCancellable *cancellable,
+                                   gpointer      user_data)
+{
+    DownloadMirrorRace *race = user_data;
+
+    g_cancellable_cancel (race->cancellable);
+}
+
+/**
+ * download_mirror_race_timeout_cb:
+ * @user_data: a #DownloadMirrorRace
+ *
+ * Ends a race that ran for %DOWNLOAD_MIRROR_PROBE_TIME, the probes are
+ * judged on what they received so far.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_mirror_race_timeout_cb (gpointer user_data)
+{
+    DownloadMirrorRace *race = user_data;
+
+    g_source_unref (race->timeout_source);
+    race->timeout_source = NULL;
+
+    g_cancellable_cancel (race->cancellable);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_mirror_race_free:
+ * @race: a #DownloadMirrorRace
+ *
+ * Frees a #DownloadMirrorRace struct.
+ */
+static void
+download_mirror_race_free (DownloadMirrorRace *race)
+{
+    GCancellable *cancellable = g_task_get_cancellable (race->task);
+
+    if (race->timeout_source)
+    {
+        g_source_destroy (race->timeout_source);
+        g_source_unref (race->timeout_source);
+    }
+
+    if (cancellable)
+        g_cancellable_disconnect (cancellable, race->cancelled_id);
+
+    g_clear_error (&race->error);
+    g_object_unref (race->cancellable);
+    g_object_unref (race->task);
+
+    g_slice_free (DownloadMirrorRace, race);
+}
+
+/**
+ * download_mirror_race_release:
+ * @race: a #DownloadMirrorRace
+ *
+ * Drops one of the probes @race waits for, the last one returns the winner
+ * to the caller and frees @race.
+ */
+static void
+download_mirror_race_release (DownloadMirrorRace *race)
+{
+    guint i;
+    gint best;
+
+    if (--race->n_pending > 0)
+        return;
+
+    for (i = 0; i < race->n_mirrors; i++)
+    {
+        g_debug ("Downloader ( %s ): mirror %s at %.0f B/s",
+                 race->mirrors[i].uri,
+                 race->mirrors[i].failed ? "failed" : "raced",
+                 race->mirrors[i].probe_rate);
+    }
+
+    best = download_mirrors_pick (race->mirrors, race->n_mirrors, -1);
+
+    if (!g_task_return_error_if_cancelled (race->task))
+    {
+        if (best >= 0)
+            g_task_return_int (race->task, best);
+        else if (race->error)
+            g_task_return_error (race->task, g_steal_pointer (&race->error));
+        else
+            g_task_return_new_error (race->task, G_IO_ERROR, G_IO_ERROR_FAILED, "No mirror answered");
+    }
+
+    download_mirror_race_free (race);
+}
+
+/**
+ * download_mirror_race_finish_probe:
+ * @probe: a #DownloadMirrorProbe that stopped
+ * @error: (transfer full) (nullable): why it stopped early
+ *
+ * Records the rate of the mirror of @probe, any bytes received make it a
+ * candidate even if it was cut short. The first probe to receive all it
+ * asked for ends the race, it could only be beaten by one that received
+ * more in the same time.
+ */
+static void
+download_mirror_race_finish_probe (DownloadMirrorProbe *probe,
+                                   GError              *error)
+{
+    DownloadMirrorRace *race = probe->race;
+    DownloadMirror *mirror = probe->mirror;
+    gint64 elapsed = MAX (g_get_monotonic_time () - race->start_time, 1);
+
+    if (probe->n_bytes > 0)
+    {
+        mirror->probe_rate = probe->n_bytes * (gdouble) G_USEC_PER_SEC / elapsed;
+    }
+    else
+    {
+        mirror->failed = TRUE;
+
+        if (error && !race->error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            race->error = g_error_copy (error);
+    }
+
+    if (!error)
+        g_cancellable_cancel (race->cancellable);
+
+    g_clear_error (&error);
+
+    if (probe->input)
+    {
+        g_input_stream_close_async (probe->input, G_PRIORITY_DEFAULT, NULL, NULL, NULL);
+        g_object_unref (probe->input);
+    }
+
+    g_clear_object (&probe->request);
+    g_free (probe->buffer);
+    g_slice_free (DownloadMirrorProbe, probe);
+
+    download_mirror_race_release (race);
+}
+
+/**
+ * download_mirror_probe_read_cb:
+ * @object: the #GInputStream of a probe
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadMirrorProbe
+ *
+ * Counts what a probe received and reads on until it has
+ * %DOWNLOAD_MIRROR_PROBE_SIZE bytes or the body ends.
+ */
+static void
+download_mirror_probe_read_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+    DownloadMirrorProbe *probe = user_data;
+    GError *error = NULL;
+    gssize nread;
+
+    nread = g_input_stream_read_finish (G_INPUT_STREAM (object), result, &error);
+
+    if (nread < 0)
+    {
+        download_mirror_race_finish_probe (probe, error);
+        return;
+    }
+
+    probe->n_bytes += nread;
+
+    if (nread == 0 || probe->n_bytes >= DOWNLOAD_MIRROR_PROBE_SIZE)
+    {
+        download_mirror_race_finish_probe (probe, NULL);
+        return;
+    }
+
+    g_input_stream_read_async (probe->input,
+                               probe->buffer,
+                               DOWNLOAD_MIRROR_PROBE_BUFFER_SIZE,
+                               G_PRIORITY_DEFAULT,
+                               probe->race->cancellable,
+                               download_mirror_probe_read_cb,
+                               probe);
+}
+
+/**
+ * download_mirror_probe_send_cb:
+ * @object: the #SoupRequest of a probe
+ * @result: a #GAsyncResult
+ * @user_data: a #DownloadMirrorProbe
+ *
+ * Starts reading the body of a probe that a mirror answered with success.
+ */
+static void
+download_mirror_probe_send_cb (GObject      *object,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+    DownloadMirrorProbe *probe = user_data;
+    SoupMessage *message;
+    GError *error = NULL;
+    guint status;
+
+    probe->input = soup_request_send_finish (SOUP_REQUEST (object), result, &error);
+
+    if (error)
+    {
+        download_mirror_race_finish_probe (probe, error);
+        return;
+    }
+
+    message = soup_request_http_get_message (SOUP_REQUEST_HTTP (probe->request));
+    status = message->status_code;
+    g_object_unref (message);
+
+    if (!SOUP_STATUS_IS_SUCCESSFUL (status))
+    {
+        download_mirror_race_finish_probe (probe,
+                                           g_error_new (SOUP_HTTP_ERROR,
+                                                        status,
+                                                        "Mirror \"%s\" answered with status %u",
+                                                        probe->mirror->uri,
+                                                        status));
+        return;
+    }
+
+    probe->buffer = g_malloc (DOWNLOAD_MIRROR_PROBE_BUFFER_SIZE);
+
+    g_input_stream_read_async (probe->input,
+                               probe->buffer,
+                               DOWNLOAD_MIRROR_PROBE_BUFFER_SIZE,
+                               G_PRIORITY_DEFAULT,
+                               probe->race->cancellable,
+                               download_mirror_probe_read_cb,
+                               probe);
+}
+
+/**
+ * download_mirrors_race_async:
+ * @session: the #SoupSession to probe with
+ * @mirrors: (array length=n_mirrors): the #DownloadMirror candidates, kept
+ *           alive by the caller until the race returns
+ * @n_mirrors: the number of @mirrors
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call with the winner
+ * @user_data: data to pass to @callback
+ *
+ * Asks every mirror that is neither failed nor slow for the first
+ * %DOWNLOAD_MIRROR_PROBE_SIZE bytes of the resource at the same time,
+ * filling in their #DownloadMirror.probe_rate, or #DownloadMirror.failed
+ * for the ones that sent nothing. Runs on the thread-default
+ * #GMainContext, which must be the one of @session.
+ */
+void
+download_mirrors_race_async (SoupSession         *session,
+                             DownloadMirror      *mirrors,
+                             guint                n_mirrors,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+    g_return_if_fail (SOUP_IS_SESSION (session));
+    g_return_if_fail (mirrors != NULL && n_mirrors > 0);
+
+    DownloadMirrorRace *race;
+    guint i;
+
+    race = g_slice_new0 (DownloadMirrorRace);
+    race->task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (race->task, download_mirrors_race_async);
+    race->mirrors = mirrors;
+    race->n_mirrors = n_mirrors;
+    race->cancellable = g_cancellable_new ();
+    race->start_time = g_get_monotonic_time ();
+
+    // Held by the loop, so a probe failing straight away cannot end the
+    // race before the others are sent
+    race->n_pending = 1;
+
+    if (cancellable)
+    {
+        race->cancelled_id = g_cancellable_connect (cancellable,
+                                                    G_CALLBACK (download_mirror_race_cancelled_cb),
+                                                    race,
+                                                    NULL);
+    }
+
+    race->timeout_source = g_timeout_source_new (DOWNLOAD_MIRROR_PROBE_TIME / 1000);
+    g_source_set_callback (race->timeout_source,
+                           download_mirror_race_timeout_cb,
+                           race,
+                           NULL);
+    g_source_attach (race->timeout_source, g_main_context_get_thread_default ());
+
+    for (i = 0; i < n_mirrors; i++)
+    {
+        DownloadMirrorProbe *probe;
+        SoupMessage *message;
+        GError *error = NULL;
+
+        if (mirrors[i].failed || mirrors[i].slow)
+            continue;
+
+        probe = g_slice_new0 (DownloadMirrorProbe);
+        probe->race = race;
+        probe->mirror = &mirrors[i];
+        probe->request = soup_session_request (session, mirrors[i].uri, &error);
+
+        race->n_pending++;
+
+        if (!error && !SOUP_IS_REQUEST_HTTP (probe->request))
+        {
+            error = g_error_new (G_IO_ERROR,
+                                 G_IO_ERROR_NOT_SUPPORTED,
+                                 "Mirror \"%s\" is not an http uri",
+                                 mirrors[i].uri);
+        }
+
+        if (error)
+        {
+            download_mirror_race_finish_probe (probe, error);
+            continue;
+        }
+
+        message = soup_request_http_get_message (SOUP_REQUEST_HTTP (probe->request));
+        soup_message_headers_set_range (message->request_headers, 0, DOWNLOAD_MIRROR_PROBE_SIZE - 1);
+        g_object_unref (message);
+
+        soup_request_send_async (probe->request,
+                                 race->cancellable,
+                                 download_mirror_probe_send_cb,
+                                 probe);
+    }
+
+    download_mirror_race_release (race);
+}
+
+/**
+ * download_mirrors_race_finish:
+ * @result: the #GAsyncResult passed to the download_mirrors_race_async()
+ *          callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes a race between mirrors.
+ *
+ * Returns: the index of the fastest mirror, or -1 with @error set if none
+ *          of them sent anything
+ */
+gint
+download_mirrors_race_finish (GAsyncResult  *result,
+                              GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), -1);
+
+    GError *task_error = NULL;
+    gssize best;
+
+    best = g_task_propagate_int (G_TASK (result), &task_error);
+
+    if (task_error)
+    {
+        g_propagate_error (error, task_error);
+        return -1;
+    }
+
+    return best;
+}
+
+/**
+ * download_mirrors_pick:
+ * @mirrors: (array length=n_mirrors): the #DownloadMirror candidates
+ * @n_mirrors: the number of @mirrors
+ * @current: the index of the mirror in use, or -1
+ *
+ * Picks the mirror to use instead of @current: the fastest of the ones
+ * neither failed nor left for being slow, by the rate seen while
+ * downloading from them or else by the race. Mirrors not measured yet come
+ * after measured ones, in their order.
+ *
+ * Returns: the index of the mirror, or -1 if there is none left
+ */
+gint
+download_mirrors_pick (const DownloadMirror *mirrors,
+                       guint                 n_mirrors,
+                       gint                  current)
+{
+    gdouble best_rate = -1;
+    gint best = -1;
+    guint i;
+
+    for (i = 0; i < n_mirrors; i++)
+    {
+        gdouble rate;
+
+        if ((gint) i == current || mirrors[i].failed || mirrors[i].slow)
+            continue;
+
+        rate = mirrors[i].rate > 0 ? mirrors[i].rate : mirrors[i].probe_rate;
+
+        if (rate > best_rate)
+        {
+            best_rate = rate;
+            best = i;
+        }
+    }
+
+    return best;
+}
@@ -0,0 +1,51 @@
+#ifndef DOWNLOAD_MIRRORS_H
+#define DOWNLOAD_MIRRORS_H
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <libsoup/soup.h>
+
+G_BEGIN_DECLS
+
+// Bytes each mirror is asked for by the race, and the longest it runs in µs
+#define DOWNLOAD_MIRROR_PROBE_SIZE (256 * 1024)
+#define DOWNLOAD_MIRROR_PROBE_TIME (2 * G_USEC_PER_SEC)
+
+// How long the throughput of a segment is measured over before it is
+// compared to the minimum rate, in µs
+#define DOWNLOAD_MIRROR_CHECK_INTERVAL (5 * G_USEC_PER_SEC)
+
+typedef struct _DownloadMirror {
+    gchar *uri;
+
+    // Bytes per second measured by the race, and over the last check while
+    // downloading from it, 0 until known
+    gdouble probe_rate;
+    gdouble rate;
+    guint64 n_bytes;
+
+    // The mirror failed, or was left for being too slow
+    gboolean failed;
+    gboolean slow;
+} DownloadMirror;
+
+void
+download_mirrors_race_async (SoupSession         *session,
+                             DownloadMirror      *mirrors,
+                             guint                n_mirrors,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data);
+
+gint
+download_mirrors_race_finish (GAsyncResult  *result,
+                              GError       **error);
+
+gint
+download_mirrors_pick (const DownloadMirror *mirrors,
+                       guint                 n_mirrors,
+                       gint                  current);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_MIRRORS_H */
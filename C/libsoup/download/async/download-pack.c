@@ -0,0 +1,849 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-pack.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/**
+ * SECTION:download-pack
+ * @title: Download Pack
+ * @short_description: Many small downloads appended to one file
+ * @include: download-pack.h
+ * @see_also: #DownloadOptions, #GMappedFile
+ *
+ * A download with #DownloadOptions.target set to %DOWNLOAD_TARGET_PACK is
+ * kept in memory and appended to the #DownloadPack of
+ * #DownloadOptions.pack once complete, instead of getting a file of its
+ * own. Fetching tens of thousands of small objects then costs one write
+ * each rather than an inode, an open, a rename and a close.
+ *
+ * The pack file only grows. Each object is written with pwrite() at a
+ * range reserved for it, so appends run in parallel in worker threads,
+ * then recorded in the index "@path.idx": an 8 byte magic followed by one
+ * record per object, a little endian 32 bit key length, 64 bit offset, 64
+ * bit length and 32 bit CRC-32 of the object, then the key. Appending a
+ * key again makes the newest copy the one looked up.
+ *
+ * Neither file is flushed by appends, which cost one write each. Instead
+ * download_pack_open() reads the pack back and checks every record against
+ * the CRC-32 of the bytes it points to. After a crash of the machine the
+ * index may have reached the disk before the bytes of an object, or the
+ * other way around: the index is cut off at the first record whose bytes do
+ * not match, or at a torn last record, and the pack past the last object
+ * still recorded. The objects appended last may then be missing, but no
+ * record ever points at bytes that are not there.
+ *
+ * download_pack_get() reads an object with pread(), or after
+ * download_pack_map() returns a slice of a #GMappedFile of the pack without
+ * copying it.
+ **/
+
+#define DOWNLOAD_PACK_MAGIC "DLPACK02"
+#define DOWNLOAD_PACK_MAGIC_SIZE 8
+#define DOWNLOAD_PACK_RECORD_SIZE (4 + 8 + 8 + 4)
+
+typedef struct _DownloadPackEntry {
+    goffset offset;
+    gsize length;
+} DownloadPackEntry;
+
+typedef struct _DownloadPackAppend {
+    DownloadPack *pack;
+    gchar *key;
+    GBytes *bytes;
+    goffset offset;
+} DownloadPackAppend;
+
+struct _DownloadPack {
+    gint ref_count;
+    GMutex mutex;
+
+    gchar *path;
+    gchar *index_path;
+    gint fd;
+    gint index_fd;
+
+    // End of the pack, past the ranges reserved by appends still writing
+    goffset size;
+
+    // DownloadPackEntry by key
+    GHashTable *objects;
+
+    gboolean mapped;
+    GMappedFile *map;
+    GBytes *map_bytes;
+};
+
+/**
+ * download_pack_set_errno:
+ * @error: return location for a #GError
+ * @what: what failed
+ * @path: the file it failed on
+ * @saved_errno: the errno it failed with
+ *
+ * Sets @error from @saved_errno.
+ */
+static void
+download_pack_set_errno (GError      **error,
+                         const gchar  *what,
+                         const gchar  *path,
+                         gint          saved_errno)
+{
+    g_set_error (error,
+                 G_IO_ERROR,
+                 g_io_error_from_errno (saved_errno),
+                 "Failed to %s \"%s\": %s",
+                 what,
+                 path,
+                 g_strerror (saved_errno));
+}
+
+/**
+ * download_pack_entry_free:
+ * @user_data: a #DownloadPackEntry
+ *
+ * Frees a #DownloadPackEntry struct.
+ */
+static void
+download_pack_entry_free (gpointer user_data)
+{
+    g_slice_free (DownloadPackEntry, user_data);
+}
+
+/**
+ * download_pack_free:
+ * @pack: a #DownloadPack
+ *
+ * Frees a #DownloadPack struct.
+ */
+static void
+download_pack_free (DownloadPack *pack)
+{
+    if (pack->map_bytes)
+        g_bytes_unref (pack->map_bytes);
+
+    if (pack->map)
+        g_mapped_file_unref (pack->map);
+
+    if (pack->objects)
+        g_hash_table_unref (pack->objects);
+
+    if (pack->index_fd >= 0)
+        close (pack->index_fd);
+
+    if (pack->fd >= 0)
+        close (pack->fd);
+
+    g_free (pack->index_path);
+    g_free (pack->path);
+    g_mutex_clear (&pack->mutex);
+
+    g_slice_free (DownloadPack, pack);
+}
+
+/**
+ * download_pack_write_all:
+ * @fd: a file descriptor
+ * @buffer: the bytes to write
+ * @length: the number of bytes in @buffer
+ * @offset: where to write them, or -1 to write() at the current position
+ *
+ * Writes all of @buffer, going on after short writes and interruptions.
+ *
+ * Returns: 0, or the errno the write failed with
+ */
+static gint
+download_pack_write_all (gint          fd,
+                         const guint8 *buffer,
+                         gsize         length,
+                         goffset       offset)
+{
+    gsize done = 0;
+
+    while (done < length)
+    {
+        gssize n;
+
+        if (offset >= 0)
+            n = pwrite (fd, buffer + done, length - done, offset + done);
+        else
+            n = write (fd, buffer + done, length - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0)
+            return errno;
+
+        done += n;
+    }
+
+    return 0;
+}
+
+/**
+ * download_pack_crc32:
+ * @buffer: the bytes of an object
+ * @length: the number of bytes in @buffer
+ *
+ * Computes the CRC-32 an index record keeps of an object, in pieces zlib
+ * takes in one call.
+ *
+ * Returns: the CRC-32 of @buffer
+ */
+static guint32
+download_pack_crc32 (const guint8 *buffer,
+                     gsize         length)
+{
+    uLong crc = crc32 (0L, Z_NULL, 0);
+
+    while (length > 0)
+    {
+        uInt n = (uInt) MIN (length, (gsize) G_MAXUINT32);
+
+        crc = crc32 (crc, buffer, n);
+        buffer += n;
+        length -= n;
+    }
+
+    return (guint32) crc;
+}
+
+/**
+ * download_pack_load_index:
+ * @pack: a #DownloadPack being opened
+ * @error: return location for a #GError
+ *
+ * Reads the records of the index of @pack, writing the magic of a new one,
+ * and checks each of them against the bytes it points to. The index is cut
+ * off at the first record whose bytes are missing or do not match its
+ * CRC-32, or at a torn last record, and the pack past the last object still
+ * recorded, left by appends a crash interrupted.
+ *
+ * Returns: %TRUE if the index was read
+ */
+static gboolean
+download_pack_load_index (DownloadPack  *pack,
+                          GError       **error)
+{
+    gchar *contents;
+    gsize length;
+    gsize position;
+    GMappedFile *map;
+    const guint8 *data;
+    gsize data_length;
+    struct stat st;
+
+    if (!g_file_get_contents (pack->index_path, &contents, &length, error))
+        return FALSE;
+
+    if (length == 0)
+    {
+        gint saved_errno = download_pack_write_all (pack->index_fd, (const guint8 *) DOWNLOAD_PACK_MAGIC, DOWNLOAD_PACK_MAGIC_SIZE, -1);
+
+        g_free (contents);
+
+        if (saved_errno)
+        {
+            download_pack_set_errno (error, "write", pack->index_path, saved_errno);
+            return FALSE;
+        }
+
+        length = DOWNLOAD_PACK_MAGIC_SIZE;
+        contents = NULL;
+    }
+    else if (length < DOWNLOAD_PACK_MAGIC_SIZE || memcmp (contents, DOWNLOAD_PACK_MAGIC, DOWNLOAD_PACK_MAGIC_SIZE) != 0)
+    {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_INVALID_DATA,
+                     "\"%s\" is not a download pack index",
+                     pack->index_path);
+        g_free (contents);
+
+        return FALSE;
+    }
+
+    map = g_mapped_file_new_from_fd (pack->fd, FALSE, error);
+
+    if (!map)
+    {
+        g_free (contents);
+        return FALSE;
+    }
+
+    data = (const guint8 *) g_mapped_file_get_contents (map);
+    data_length = g_mapped_file_get_length (map);
+
+    position = DOWNLOAD_PACK_MAGIC_SIZE;
+
+    while (contents && length - position >= DOWNLOAD_PACK_RECORD_SIZE)
+    {
+        DownloadPackEntry *entry;
+        guint32 key_length;
+        guint64 offset;
+        guint64 object_length;
+        guint32 crc;
+
+        memcpy (&key_length, contents + position, 4);
+        memcpy (&offset, contents + position + 4, 8);
+        memcpy (&object_length, contents + position + 12, 8);
+        memcpy (&crc, contents + position + 20, 4);
+
+        key_length = GUINT32_FROM_LE (key_length);
+        offset = GUINT64_FROM_LE (offset);
+        object_length = GUINT64_FROM_LE (object_length);
+        crc = GUINT32_FROM_LE (crc);
+
+        if (length - position - DOWNLOAD_PACK_RECORD_SIZE < key_length)
+            break;
+
+        if (offset > data_length || object_length > data_length - offset ||
+            download_pack_crc32 (data + offset, object_length) != crc)
+        {
+            g_debug ("Download pack \"%s\" lacks the bytes of \"%.*s\"", pack->path, (gint) key_length, contents + position + DOWNLOAD_PACK_RECORD_SIZE);
+            break;
+        }
+
+        entry = g_slice_new0 (DownloadPackEntry);
+        entry->offset = offset;
+        entry->length = object_length;
+
+        g_hash_table_replace (pack->objects,
+                              g_strndup (contents + position + DOWNLOAD_PACK_RECORD_SIZE, key_length),
+                              entry);
+
+        pack->size = MAX (pack->size, (goffset) (offset + object_length));
+        position += DOWNLOAD_PACK_RECORD_SIZE + key_length;
+    }
+
+    g_mapped_file_unref (map);
+    g_free (contents);
+
+    if (position < length)
+    {
+        g_debug ("Cutting %" G_GSIZE_FORMAT " bytes of records off download pack index \"%s\"", length - position, pack->index_path);
+
+        if (ftruncate (pack->index_fd, position) != 0)
+        {
+            download_pack_set_errno (error, "truncate", pack->index_path, errno);
+            return FALSE;
+        }
+    }
+
+    if (fstat (pack->fd, &st) != 0)
+    {
+        download_pack_set_errno (error, "stat", pack->path, errno);
+        return FALSE;
+    }
+
+    if (st.st_size > pack->size)
+    {
+        g_debug ("Cutting %" G_GOFFSET_FORMAT " unrecorded bytes off download pack \"%s\"", (goffset) st.st_size - pack->size, pack->path);
+
+        if (ftruncate (pack->fd, pack->size) != 0)
+        {
+            download_pack_set_errno (error, "truncate", pack->path, errno);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * download_pack_open:
+ * @path: the path of the pack file, created if missing
+ * @error: return location for a #GError
+ *
+ * Opens the pack at @path and reads its index "@path.idx". A pack is not
+ * meant to be opened twice at once, by this process or another.
+ *
+ * Returns: (transfer full) (nullable): a #DownloadPack, free with
+ *          download_pack_unref(), or %NULL with @error set
+ */
+DownloadPack *
+download_pack_open (const gchar  *path,
+                    GError      **error)
+{
+    g_return_val_if_fail (path != NULL, NULL);
+
+    DownloadPack *pack;
+
+    pack = g_slice_new0 (DownloadPack);
+    pack->ref_count = 1;
+    g_mutex_init (&pack->mutex);
+
+    pack->path = g_strdup (path);
+    pack->index_path = g_strconcat (path, ".idx", NULL);
+    pack->objects = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, download_pack_entry_free);
+
+    pack->fd = g_open (pack->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (pack->fd < 0)
+    {
+        download_pack_set_errno (error, "open", pack->path, errno);
+        pack->index_fd = -1;
+        download_pack_free (pack);
+
+        return NULL;
+    }
+
+    pack->index_fd = g_open (pack->index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if (pack->index_fd < 0)
+    {
+        download_pack_set_errno (error, "open", pack->index_path, errno);
+        download_pack_free (pack);
+
+        return NULL;
+    }
+
+    if (!download_pack_load_index (pack, error))
+    {
+        download_pack_free (pack);
+        return NULL;
+    }
+
+    g_debug ("Opened download pack \"%s\" with %u objects", pack->path, g_hash_table_size (pack->objects));
+
+    return pack;
+}
+
+/**
+ * download_pack_ref:
+ * @pack: a #DownloadPack
+ *
+ * Increases the reference count of @pack.
+ *
+ * Returns: (transfer full): @pack
+ */
+DownloadPack *
+download_pack_ref (DownloadPack *pack)
+{
+    g_return_val_if_fail (pack != NULL, NULL);
+    g_return_val_if_fail (pack->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&pack->ref_count);
+
+    return pack;
+}
+
+/**
+ * download_pack_unref:
+ * @pack: a #DownloadPack
+ *
+ * Decreases the reference count of @pack, closing it when the count drops
+ * to zero. Appends still running hold a reference.
+ */
+void
+download_pack_unref (DownloadPack *pack)
+{
+    g_return_if_fail (pack != NULL);
+    g_return_if_fail (pack->ref_count > 0);
+
+    if (g_atomic_int_dec_and_test (&pack->ref_count))
+        download_pack_free (pack);
+}
+
+/**
+ * download_pack_get_path:
+ * @pack: a #DownloadPack
+ *
+ * Gets the path of the pack file.
+ *
+ * Returns: (transfer none): the path given to download_pack_open()
+ */
+const gchar *
+download_pack_get_path (DownloadPack *pack)
+{
+    g_return_val_if_fail (pack != NULL, NULL);
+
+    return pack->path;
+}
+
+/**
+ * download_pack_get_n_objects:
+ * @pack: a #DownloadPack
+ *
+ * Counts the keys of @pack.
+ *
+ * Returns: the number of objects that can be looked up
+ */
+guint
+download_pack_get_n_objects (DownloadPack *pack)
+{
+    g_return_val_if_fail (pack != NULL, 0);
+
+    guint n_objects;
+
+    g_mutex_lock (&pack->mutex);
+    n_objects = g_hash_table_size (pack->objects);
+    g_mutex_unlock (&pack->mutex);
+
+    return n_objects;
+}
+
+/**
+ * download_pack_lookup:
+ * @pack: a #DownloadPack
+ * @key: the key of an object
+ * @offset: (out) (optional): return location for where the object starts
+ *          in the pack file
+ * @length: (out) (optional): return location for its length
+ *
+ * Looks up where an object lies in the pack file.
+ *
+ * Returns: %TRUE if @pack holds @key
+ */
+gboolean
+download_pack_lookup (DownloadPack *pack,
+                      const gchar  *key,
+                      goffset      *offset,
+                      gsize        *length)
+{
+    g_return_val_if_fail (pack != NULL, FALSE);
+    g_return_val_if_fail (key != NULL, FALSE);
+
+    DownloadPackEntry *entry;
+
+    g_mutex_lock (&pack->mutex);
+
+    entry = g_hash_table_lookup (pack->objects, key);
+
+    if (entry && offset)
+        *offset = entry->offset;
+
+    if (entry && length)
+        *length = entry->length;
+
+    g_mutex_unlock (&pack->mutex);
+
+    return entry != NULL;
+}
+
+/**
+ * download_pack_remap:
+ * @pack: a #DownloadPack, locked
+ * @error: return location for a #GError
+ *
+ * Maps the pack file again, to see what was appended since. Slices of the
+ * previous map keep it alive.
+ *
+ * Returns: %TRUE if the pack is mapped
+ */
+static gboolean
+download_pack_remap (DownloadPack  *pack,
+                     GError       **error)
+{
+    GMappedFile *map;
+
+    map = g_mapped_file_new (pack->path, FALSE, error);
+
+    if (!map)
+        return FALSE;
+
+    if (pack->map_bytes)
+        g_bytes_unref (pack->map_bytes);
+
+    if (pack->map)
+        g_mapped_file_unref (pack->map);
+
+    pack->map = map;
+    pack->map_bytes = g_mapped_file_get_bytes (map);
+
+    return TRUE;
+}
+
+/**
+ * download_pack_map:
+ * @pack: a #DownloadPack
+ * @error: return location for a #GError
+ *
+ * Maps the pack file in memory, download_pack_get() then returns slices of
+ * it rather than copies. Objects appended later are reached by mapping the
+ * file again when they are first asked for.
+ *
+ * Returns: %TRUE if the pack is mapped
+ */
+gboolean
+download_pack_map (DownloadPack  *pack,
+                   GError       **error)
+{
+    g_return_val_if_fail (pack != NULL, FALSE);
+
+    gboolean mapped;
+
+    g_mutex_lock (&pack->mutex);
+
+    mapped = download_pack_remap (pack, error);
+    pack->mapped = mapped;
+
+    g_mutex_unlock (&pack->mutex);
+
+    return mapped;
+}
+
+/**
+ * download_pack_get:
+ * @pack: a #DownloadPack
+ * @key: the key of an object
+ * @error: return location for a #GError
+ *
+ * Reads an object of @pack, without copying it when @pack is mapped, see
+ * download_pack_map(). Fails with %G_IO_ERROR_NOT_FOUND for unknown keys.
+ *
+ * Returns: (transfer full) (nullable): the bytes of the object, or %NULL
+ *          with @error set
+ */
+GBytes *
+download_pack_get (DownloadPack  *pack,
+                   const gchar   *key,
+                   GError       **error)
+{
+    g_return_val_if_fail (pack != NULL, NULL);
+    g_return_val_if_fail (key != NULL, NULL);
+
+    DownloadPackEntry *entry;
+    DownloadPackEntry found;
+    GBytes *bytes = NULL;
+    guint8 *buffer;
+    gsize done = 0;
+
+    g_mutex_lock (&pack->mutex);
+
+    entry = g_hash_table_lookup (pack->objects, key);
+
+    if (!entry)
+    {
+        g_mutex_unlock (&pack->mutex);
+
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_NOT_FOUND,
+                     "No \"%s\" in download pack \"%s\"",
+                     key,
+                     pack->path);
+        return NULL;
+    }
+
+    found = *entry;
+
+    if (pack->mapped)
+    {
+        if (found.offset + found.length <= g_bytes_get_size (pack->map_bytes) ||
+            download_pack_remap (pack, error))
+            bytes = g_bytes_new_from_bytes (pack->map_bytes, found.offset, found.length);
+
+        g_mutex_unlock (&pack->mutex);
+
+        return bytes;
+    }
+
+    g_mutex_unlock (&pack->mutex);
+
+    buffer = g_malloc (MAX (found.length, 1));
+
+    while (done < found.length)
+    {
+        gssize n = pread (pack->fd, buffer + done, found.length - done, found.offset + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+        {
+            if (n == 0)
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT, "Download pack \"%s\" ends inside \"%s\"", pack->path, key);
+            else
+                download_pack_set_errno (error, "read", pack->path, errno);
+
+            g_free (buffer);
+
+            return NULL;
+        }
+
+        done += n;
+    }
+
+    return g_bytes_new_take (buffer, found.length);
+}
+
+/**
+ * download_pack_append_free:
+ * @user_data: a #DownloadPackAppend
+ *
+ * Frees a #DownloadPackAppend struct.
+ */
+static void
+download_pack_append_free (gpointer user_data)
+{
+    DownloadPackAppend *append = user_data;
+
+    download_pack_unref (append->pack);
+    g_free (append->key);
+    g_bytes_unref (append->bytes);
+
+    g_slice_free (DownloadPackAppend, append);
+}
+
+/**
+ * download_pack_append_thread:
+ * @task: a #GTask
+ * @source_object: %NULL
+ * @task_data: a #DownloadPackAppend
+ * @cancellable: a #GCancellable
+ *
+ * Writes the bytes of an object at the range reserved for it, then its
+ * record to the index. The object can be looked up from then on. A failed
+ * write leaves its range as a hole nothing points to.
+ */
+static void
+download_pack_append_thread (GTask        *task,
+                             gpointer      source_object,
+                             gpointer      task_data,
+                             GCancellable *cancellable)
+{
+    DownloadPackAppend *append = task_data;
+    DownloadPack *pack = append->pack;
+    DownloadPackEntry *entry;
+    const guint8 *buffer;
+    gsize length;
+    gsize key_length = strlen (append->key);
+    guint8 *record;
+    guint32 key_length_le = GUINT32_TO_LE ((guint32) key_length);
+    guint64 offset_le = GUINT64_TO_LE ((guint64) append->offset);
+    guint64 length_le;
+    guint32 crc_le;
+    gint saved_errno;
+
+    buffer = g_bytes_get_data (append->bytes, &length);
+    saved_errno = download_pack_write_all (pack->fd, buffer, length, append->offset);
+
+    if (saved_errno)
+    {
+        g_task_return_new_error (task,
+                                 G_IO_ERROR,
+                                 g_io_error_from_errno (saved_errno),
+                                 "Failed to write \"%s\" to download pack \"%s\": %s",
+                                 append->key,
+                                 pack->path,
+                                 g_strerror (saved_errno));
+        return;
+    }
+
+    length_le = GUINT64_TO_LE ((guint64) length);
+    crc_le = GUINT32_TO_LE (download_pack_crc32 (buffer, length));
+
+    record = g_malloc (DOWNLOAD_PACK_RECORD_SIZE + key_length);
+    memcpy (record, &key_length_le, 4);
+    memcpy (record + 4, &offset_le, 8);
+    memcpy (record + 12, &length_le, 8);
+    memcpy (record + 20, &crc_le, 4);
+    memcpy (record + DOWNLOAD_PACK_RECORD_SIZE, append->key, key_length);
+
+    entry = g_slice_new0 (DownloadPackEntry);
+    entry->offset = append->offset;
+    entry->length = length;
+
+    // Records go to the index in the order objects become visible
+    g_mutex_lock (&pack->mutex);
+
+    saved_errno = download_pack_write_all (pack->index_fd, record, DOWNLOAD_PACK_RECORD_SIZE + key_length, -1);
+
+    if (!saved_errno)
+        g_hash_table_replace (pack->objects, g_strdup (append->key), entry);
+
+    g_mutex_unlock (&pack->mutex);
+
+    g_free (record);
+
+    if (saved_errno)
+    {
+        download_pack_entry_free (entry);
+        g_task_return_new_error (task,
+                                 G_IO_ERROR,
+                                 g_io_error_from_errno (saved_errno),
+                                 "Failed to record \"%s\" in download pack index \"%s\": %s",
+                                 append->key,
+                                 pack->index_path,
+                                 g_strerror (saved_errno));
+        return;
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * download_pack_append_async:
+ * @pack: a #DownloadPack
+ * @key: the key to look the object up by
+ * @bytes: the object
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call once the object can be looked
+ *            up
+ * @user_data: data to pass to @callback
+ *
+ * Appends @bytes to @pack in a worker thread. The range of the pack it goes
+ * to is taken right away, so any number of appends write at once.
+ */
+void
+download_pack_append_async (DownloadPack        *pack,
+                            const gchar         *key,
+                            GBytes              *bytes,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+    g_return_if_fail (pack != NULL);
+    g_return_if_fail (key != NULL);
+    g_return_if_fail (bytes != NULL);
+
+    DownloadPackAppend *append;
+    GTask *task;
+
+    append = g_slice_new0 (DownloadPackAppend);
+    append->pack = download_pack_ref (pack);
+    append->key = g_strdup (key);
+    append->bytes = g_bytes_ref (bytes);
+
+    g_mutex_lock (&pack->mutex);
+    append->offset = pack->size;
+    pack->size += g_bytes_get_size (bytes);
+    g_mutex_unlock (&pack->mutex);
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (task, download_pack_append_async);
+    g_task_set_task_data (task, append, download_pack_append_free);
+
+    g_task_run_in_thread (task, download_pack_append_thread);
+
+    g_object_unref (task);
+}
+
+/**
+ * download_pack_append_finish:
+ * @result: the #GAsyncResult passed to the download_pack_append_async()
+ *          callback
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes appending an object to a pack.
+ *
+ * Returns: %TRUE if the object was written and recorded
+ */
+gboolean
+download_pack_append_finish (GAsyncResult  *result,
+                             GError       **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
@@ -0,0 +1,56 @@
+#ifndef DOWNLOAD_PACK_H
+#define DOWNLOAD_PACK_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _DownloadPack DownloadPack;
+
+DownloadPack *
+download_pack_open (const gchar  *path,
+                    GError      **error);
+
+DownloadPack *
+download_pack_ref (DownloadPack *pack);
+
+void
+download_pack_unref (DownloadPack *pack);
+
+const gchar *
+download_pack_get_path (DownloadPack *pack);
+
+guint
+download_pack_get_n_objects (DownloadPack *pack);
+
+gboolean
+download_pack_lookup (DownloadPack *pack,
+                      const gchar  *key,
+                      goffset      *offset,
+                      gsize        *length);
+
+GBytes *
+download_pack_get (DownloadPack  *pack,
+                   const gchar   *key,
+                   GError       **error);
+
+gboolean
+download_pack_map (DownloadPack  *pack,
+                   GError       **error);
+
+void
+download_pack_append_async (DownloadPack        *pack,
+                            const gchar         *key,
+                            GBytes              *bytes,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data);
+
+gboolean
+download_pack_append_finish (GAsyncResult  *result,
+                             GError       **error);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_PACK_H */
@@ -0,0 +1,332 @@
+#ifndef DOWNLOAD_PRIVATE_H
+#define DOWNLOAD_PRIVATE_H
+
+#include "download-async.h"
+#include "download-journal.h"
+#include "download-manager.h"
+#include "download-uring.h"
+
+G_BEGIN_DECLS
+
+/*
+ * Types and functions shared between the download modules, they are not part
+ * of the public API.
+ */
+
+// Most chunks a segment has read and not yet written
+#define DOWNLOAD_RING_SIZE 4
+
+// Most chunks a segment reads in one go from a stream that stays readable
+// before it lets the main context run
+#define DOWNLOAD_READ_BURST 16
+
+// Segment boundaries are kept on multiples of this
+#define DOWNLOAD_SEGMENT_ALIGNMENT (64 * 1024)
+
+// Reconnects wait twice as long each time, within these bounds in ms
+#define DOWNLOAD_RETRY_MIN_DELAY 500
+#define DOWNLOAD_RETRY_MAX_DELAY (30 * 1000)
+
+// Written bytes a segment lets pile up in the page cache before dropping
+// them when the download bypasses the cache
+#define DOWNLOAD_DROP_CACHE_SIZE (8 * 1024 * 1024)
+
+// Shortest time between two journal saves, in µs
+#define DOWNLOAD_JOURNAL_INTERVAL (2 * G_USEC_PER_SEC)
+
+struct _DownloadResourceData {
+    gint ref_count;
+    GTask *task;
+
+    gchar *uri;
+    gchar *path;
+    gboolean overwrite;
+
+    // How far readers of the file may go, NULL unless the download is
+    // readable
+    DownloadTail *tail;
+
+    // Where the bytes go: a file, one buffer returned at the end, the
+    // chunk handler as they arrive, or a buffer appended to pack under
+    // pack_key. A download to memory or a pack of known length reads
+    // straight into memory, others collect into memory_array
+    DownloadTarget target;
+    DownloadPack *pack;
+    gchar *pack_key;
+    DownloadResourceDataChunk chunk_handler;
+    gpointer chunk_user_data;
+    guchar *memory;
+    GByteArray *memory_array;
+    GBytes *bytes;
+
+    DownloadManager *manager;
+    GMainContext *context;
+    gchar *host;
+
+    // The uri and the mirrors it was given, the one requests go to, and
+    // the one the validators in etag and last_modified came from
+    DownloadMirror *mirrors;
+    guint n_mirrors;
+    gint mirror;
+    gint validator_mirror;
+    gboolean raced;
+    guint64 min_rate;
+
+    // The first download of a uri to a file leads a flight, later ones to a
+    // file follow it rather than fetch the uri again and get its file once
+    // it lands. The leader publishes its progress to them in
+    // flight_downloaded_bytes and flight_total_bytes, like followers, under
+    // the lock of the flights
+    DownloadResourceData *leader;
+    GList *followers;
+    gboolean leading;
+    guint64 flight_downloaded_bytes;
+    guint64 flight_total_bytes;
+
+    // A download given to a worker runs on the context and manager of the
+    // worker, caller_context is where its progress is reported
+    DownloadWorkerPool *workers;
+    DownloadWorker *worker;
+    GMainContext *caller_context;
+    gboolean admitted;
+    gulong cancelled_id;
+
+    // How the manager ranks the download while it is queued, the monotonic
+    // time it should end by, 0 for none, and whether it holds a slot left
+    // to large downloads. probe is the HEAD request asking for the size
+    guint64 expected_size;
+    gboolean probe_size;
+    SoupMessage *probe;
+    gint64 deadline;
+    gint64 rank;
+    gboolean large;
+
+    SoupSession *session;
+    SoupRequest *request;
+
+    GCancellable *cancellable;
+    gulong stop_waits_id;
+    GCancellable *user_cancellable;
+    gulong user_cancelled_id;
+    DownloadResourceDataProgress p_handler;
+    gpointer p_user_data;
+
+    GFile *file;
+    GOutputStream *output;
+    GError *error;
+    gboolean preallocate;
+    gboolean bypass_cache;
+    DownloadUring *uring;
+
+    // What may be decompressed on the way in, and whether the body is, in
+    // which case its length is unknown until the end
+    DownloadDecode decode;
+    gboolean decoding;
+
+    // Bytes before hash_offset went through the checksum, the ones after it
+    // that are already on disk are read back once it reaches them
+    DownloadChecksum *checksum;
+    gchar *expected_digest;
+    gchar *digest;
+    goffset hash_offset;
+    gboolean hashing;
+    gboolean verified;
+
+    // What the cache knew of the file before the download, sent back with
+    // If-None-Match and If-Modified-Since, and whether it was still fresh
+    DownloadCache *cache;
+    DownloadCacheEntry *cache_entry;
+    gboolean cache_hit;
+
+    // Resumable and durable downloads write into part_path, which the
+    // journal of a resumable one describes, and move it to path once
+    // complete and as durable as asked
+    gchar *part_path;
+    DownloadDurability durability;
+    DownloadCommitGroup *commit_group;
+    DownloadJournal *journal;
+    gboolean resumed;
+    gboolean journal_saving;
+    gboolean journal_final;
+    guint64 last_journal_time;
+
+    // The last write of the file went through io_uring linked to an
+    // fdatasync(), which succeeded
+    gboolean synced;
+
+    // Validators of the response, sent back with If-Range when a segment
+    // reconnects
+    gchar *etag;
+    gchar *last_modified;
+    gboolean accepts_ranges;
+    guint max_retries;
+
+    DownloadBufferPool *buffer_pool;
+    DownloadRateLimiter *rate_limiter;
+    DownloadPriority priority;
+
+    // DownloadSegment, one unless the body is fetched as several ranges
+    guint max_segments;
+    goffset min_segment_size;
+    gboolean segmented;
+    gchar *final_uri;
+    GPtrArray *segments;
+    guint n_active_segments;
+    GQueue pending_ranges;
+
+    guint64 total_bytes;
+    guint64 downloaded_bytes;
+    guint64 last_progress_time;
+
+    // What the DownloadProgressGroup was last told about this download
+    DownloadProgressGroup *progress_group;
+    guint64 group_downloaded_bytes;
+    guint64 group_total_bytes;
+
+    DownloadMetrics metrics;
+};
+
+typedef struct _DownloadChunk {
+    gchar *buffer;
+    gsize size;
+    gsize length;
+    goffset offset;
+
+    // The pool does not own the buffer: it points into the memory of a
+    // download to memory, or was handed on to the chunk handler
+    gboolean borrowed;
+} DownloadChunk;
+
+typedef struct _DownloadSegment {
+    DownloadResourceData *data;
+    guint index;
+
+    SoupRequest *request;
+    GInputStream *input;
+    GIOStream *io_stream;
+    GOutputStream *output;
+
+    // First byte of the segment, the byte after the last one written, the
+    // next byte read from the input, and the first byte past the segment or
+    // -1 to read until the end of the body
+    goffset start;
+    goffset written;
+    goffset offset;
+    goffset end;
+
+    // The request asked for a Range, the file or memory the segment writes
+    // to is ready, and how many times the segment reconnected after losing
+    // its connection
+    gboolean ranged;
+    gboolean connecting;
+    gboolean opened;
+    guint n_retries;
+
+    // Bytes before this one were dropped from the page cache
+    goffset dropped;
+    gboolean dropping;
+
+    // Chunks borrow their buffer from the pool, at most DOWNLOAD_RING_SIZE of
+    // them are being read into, queued to be written or being written
+    gsize read_size;
+    guint n_short_reads;
+    guint n_chunks;
+    GQueue pending_chunks;
+    DownloadChunk *read_chunk;
+    DownloadChunk *write_chunk;
+    GSource *wait_source;
+    gboolean pollable;
+    gboolean in_read;
+    gboolean read_again;
+    gboolean reading;
+    gboolean writing;
+    gboolean eof;
+    gboolean closing;
+
+    // The running write went through io_uring rather than the output, and
+    // was linked to an fdatasync() of the file
+    gboolean uring_write;
+    gboolean uring_sync;
+
+    // When the running write started, and since when reads wait for a
+    // write because the ring is full, for the #DownloadMetrics
+    gint64 write_start_time;
+    gint64 blocked_since;
+
+    // The mirror the segment reads from, and what it received since
+    // window_start along with the write_blocked_time of the download then
+    gint mirror;
+    gint64 window_start;
+    guint64 window_bytes;
+    gint64 window_blocked_time;
+} DownloadSegment;
+
+void
+download_resource_data_begin (DownloadResourceData *data);
+
+void
+download_resource_data_fail (DownloadResourceData *data,
+                             GError               *error);
+
+void
+download_manager_queue (DownloadManager      *manager,
+                        DownloadResourceData *data);
+
+void
+download_manager_release (DownloadManager      *manager,
+                          DownloadResourceData *data);
+
+DownloadWorker *
+download_worker_pool_assign (DownloadWorkerPool *pool);
+
+void
+download_worker_pool_release (DownloadWorkerPool *pool,
+                              DownloadWorker     *worker);
+
+GMainContext *
+download_worker_get_context (DownloadWorker *worker);
+
+DownloadManager *
+download_worker_get_manager (DownloadWorker *worker);
+
+DownloadTail *
+download_tail_new (void);
+
+DownloadTail *
+download_tail_ref (DownloadTail *tail);
+
+void
+download_tail_unref (DownloadTail *tail);
+
+void
+download_tail_open (DownloadTail *tail,
+                    gint          fd);
+
+gboolean
+download_tail_is_open (DownloadTail *tail);
+
+void
+download_tail_commit (DownloadTail *tail,
+                      goffset       end);
+
+void
+download_tail_close (DownloadTail *tail,
+                     const GError *error);
+
+void
+download_progress_group_add (DownloadProgressGroup *group);
+
+void
+download_progress_group_update (DownloadProgressGroup *group,
+                                gssize                 bytes,
+                                gssize                 total,
+                                gint                   known);
+
+void
+download_progress_group_remove (DownloadProgressGroup *group,
+                                gboolean               failed,
+                                gboolean               known);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_PRIVATE_H */
@@ -0,0 +1,444 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-progress.h"
+#include "download-private.h"
+
+#include <glib.h>
+#include <math.h>
+
+/**
+ * SECTION:download-progress
+ * @title: Download Progress
+ * @short_description: One progress subscription for a group of downloads
+ * @include: download-progress.h
+ * @see_also: #DownloadResourceData, #DownloadOptions
+ *
+ * A #DownloadProgressGroup adds up the progress of every download started
+ * with it as #DownloadOptions.progress_group. Subscribers get a
+ * #DownloadProgress every interval given to download_progress_group_new(),
+ * with the totals, the number of running, completed and failed downloads, a
+ * speed smoothed by an exponentially weighted moving average and the
+ * remaining time at that speed. A last report follows right after the last
+ * running download of the group ends.
+ *
+ * Downloads only add what they received to counters of the group with
+ * atomic operations, the tick folds them in. Thousands of transfers thus
+ * cost the subscribers one call per tick, whatever thread the downloads
+ * run on, see download-worker-pool.
+ *
+ * Subscribers are called on the thread-default #GMainContext of whoever
+ * created the group, subscribe and unsubscribe from that context too. The
+ * group stays alive while it has subscribers.
+ **/
+
+typedef struct _DownloadProgressSubscriber {
+    guint id;
+    DownloadProgressFunc func;
+    gpointer user_data;
+    GDestroyNotify destroy;
+} DownloadProgressSubscriber;
+
+struct _DownloadProgressGroup {
+    gint ref_count;
+    GMutex mutex;
+
+    GMainContext *context;
+    guint interval;
+    GSource *tick_source;
+
+    GList *subscribers;
+    guint last_id;
+
+    // Updated by the downloads with atomic operations, the byte counters
+    // hold what changed since the last tick
+    gsize pending_bytes;
+    gsize pending_total;
+    gint n_active;
+    gint n_unknown;
+    gint n_completed;
+    gint n_failed;
+
+    // Tick state, progress under the mutex for download_progress_group_get()
+    gint64 last_tick;
+    gboolean have_speed;
+    DownloadProgress progress;
+};
+
+/**
+ * download_progress_subscriber_free:
+ * @user_data: a #DownloadProgressSubscriber
+ *
+ * Frees a #DownloadProgressSubscriber struct, calling its destroy notify.
+ */
+static void
+download_progress_subscriber_free (gpointer user_data)
+{
+    DownloadProgressSubscriber *subscriber = user_data;
+
+    if (subscriber->destroy)
+        subscriber->destroy (subscriber->user_data);
+
+    g_slice_free (DownloadProgressSubscriber, subscriber);
+}
+
+/**
+ * download_progress_group_free:
+ * @group: a #DownloadProgressGroup
+ *
+ * Frees a #DownloadProgressGroup struct.
+ */
+static void
+download_progress_group_free (DownloadProgressGroup *group)
+{
+    g_list_free_full (group->subscribers, download_progress_subscriber_free);
+    g_main_context_unref (group->context);
+    g_mutex_clear (&group->mutex);
+
+    g_slice_free (DownloadProgressGroup, group);
+}
+
+/**
+ * download_progress_group_new:
+ * @interval: the time between two reports in ms, 0 for
+ *            %DOWNLOAD_PROGRESS_DEFAULT_INTERVAL
+ *
+ * Creates a #DownloadProgressGroup that reports on the thread-default
+ * #GMainContext of the caller.
+ *
+ * Returns: (transfer full): a new #DownloadProgressGroup, free with
+ *          download_progress_group_unref()
+ */
+DownloadProgressGroup *
+download_progress_group_new (guint interval)
+{
+    DownloadProgressGroup *group;
+
+    group = g_slice_new0 (DownloadProgressGroup);
+    group->ref_count = 1;
+    g_mutex_init (&group->mutex);
+
+    group->context = g_main_context_ref_thread_default ();
+    group->interval = interval > 0 ? interval : DOWNLOAD_PROGRESS_DEFAULT_INTERVAL;
+    group->progress.eta = -1;
+
+    return group;
+}
+
+/**
+ * download_progress_group_ref:
+ * @group: a #DownloadProgressGroup
+ *
+ * Increases the reference count of @group.
+ *
+ * Returns: (transfer full): @group
+ */
+DownloadProgressGroup *
+download_progress_group_ref (DownloadProgressGroup *group)
+{
+    g_return_val_if_fail (group != NULL, NULL);
+    g_return_val_if_fail (group->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&group->ref_count);
+
+    return group;
+}
+
+/**
+ * download_progress_group_unref:
+ * @group: a #DownloadProgressGroup
+ *
+ * Decreases the reference count of @group, freeing it when the count drops
+ * to zero. Every download of the group and the tick, while there are
+ * subscribers, hold a reference to it.
+ */
+void
+download_progress_group_unref (DownloadProgressGroup *group)
+{
+    g_return_if_fail (group != NULL);
+    g_return_if_fail (group->ref_count > 0);
+
+    if (g_atomic_int_dec_and_test (&group->ref_count))
+        download_progress_group_free (group);
+}
+
+/**
+ * download_progress_group_tick:
+ * @group: a #DownloadProgressGroup
+ *
+ * Folds what the downloads of @group added since the last tick into its
+ * totals, updates the speed average and calls the subscribers.
+ */
+static void
+download_progress_group_tick (DownloadProgressGroup *group)
+{
+    DownloadProgress progress;
+    gint64 now = g_get_monotonic_time ();
+    gint64 elapsed = now - group->last_tick;
+    gssize bytes;
+    gssize total;
+    GList *l;
+
+    bytes = (gssize) g_atomic_pointer_and (&group->pending_bytes, 0);
+    total = (gssize) g_atomic_pointer_and (&group->pending_total, 0);
+
+    g_mutex_lock (&group->mutex);
+
+    progress = group->progress;
+
+    progress.downloaded_bytes += bytes;
+    progress.total_bytes += total;
+    progress.n_active = g_atomic_int_get (&group->n_active);
+    progress.n_completed = g_atomic_int_get (&group->n_completed);
+    progress.n_failed = g_atomic_int_get (&group->n_failed);
+
+    // A download that started over takes bytes back, that is no speed
+    if (group->last_tick > 0 && elapsed > 0)
+    {
+        gdouble rate = MAX (bytes, 0) * (gdouble) G_USEC_PER_SEC / elapsed;
+        gdouble alpha = 1.0 - exp (-(gdouble) elapsed / DOWNLOAD_PROGRESS_TIME_CONSTANT);
+
+        progress.speed = group->have_speed ? progress.speed + alpha * (rate - progress.speed) : rate;
+        group->have_speed = TRUE;
+    }
+
+    if (g_atomic_int_get (&group->n_unknown) > 0 || progress.speed <= 0)
+        progress.eta = -1;
+    else if (progress.total_bytes <= progress.downloaded_bytes)
+        progress.eta = 0;
+    else
+        progress.eta = (progress.total_bytes - progress.downloaded_bytes) / progress.speed;
+
+    group->progress = progress;
+    group->last_tick = now;
+
+    g_mutex_unlock (&group->mutex);
+
+    for (l = group->subscribers; l != NULL; )
+    {
+        DownloadProgressSubscriber *subscriber = l->data;
+
+        // The subscriber may unsubscribe itself
+        l = l->next;
+
+        subscriber->func (&progress, subscriber->user_data);
+    }
+}
+
+/**
+ * download_progress_group_tick_cb:
+ * @user_data: a #DownloadProgressGroup
+ *
+ * Reports the progress of a group every interval.
+ *
+ * Returns: %G_SOURCE_CONTINUE
+ */
+static gboolean
+download_progress_group_tick_cb (gpointer user_data)
+{
+    download_progress_group_tick (user_data);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * download_progress_group_final_cb:
+ * @user_data: a #DownloadProgressGroup
+ *
+ * Reports the progress of a group whose last running download ended,
+ * without waiting for the next tick.
+ *
+ * Returns: %G_SOURCE_REMOVE
+ */
+static gboolean
+download_progress_group_final_cb (gpointer user_data)
+{
+    DownloadProgressGroup *group = user_data;
+
+    if (group->subscribers)
+        download_progress_group_tick (group);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * download_progress_group_subscribe:
+ * @group: a #DownloadProgressGroup
+ * @func: the #DownloadProgressFunc to call every interval
+ * @user_data: data to pass to @func
+ * @destroy: (nullable): a #GDestroyNotify for @user_data
+ *
+ * Calls @func with the progress of @group every interval until
+ * download_progress_group_unsubscribe(). Call this on the context @group
+ * reports on.
+ *
+ * Returns: an id for download_progress_group_unsubscribe()
+ */
+guint
+download_progress_group_subscribe (DownloadProgressGroup *group,
+                                   DownloadProgressFunc   func,
+                                   gpointer               user_data,
+                                   GDestroyNotify         destroy)
+{
+    g_return_val_if_fail (group != NULL, 0);
+    g_return_val_if_fail (func != NULL, 0);
+
+    DownloadProgressSubscriber *subscriber;
+
+    subscriber = g_slice_new0 (DownloadProgressSubscriber);
+    subscriber->id = ++group->last_id;
+    subscriber->func = func;
+    subscriber->user_data = user_data;
+    subscriber->destroy = destroy;
+
+    group->subscribers = g_list_append (group->subscribers, subscriber);
+
+    if (!group->tick_source)
+    {
+        group->tick_source = g_timeout_source_new (group->interval);
+        g_source_set_callback (group->tick_source,
+                               download_progress_group_tick_cb,
+                               download_progress_group_ref (group),
+                               (GDestroyNotify) download_progress_group_unref);
+        g_source_attach (group->tick_source, group->context);
+    }
+
+    return subscriber->id;
+}
+
+/**
+ * download_progress_group_unsubscribe:
+ * @group: a #DownloadProgressGroup
+ * @id: an id returned by download_progress_group_subscribe()
+ *
+ * Stops calling a subscriber of @group and frees its data. Call this on the
+ * context @group reports on, a subscriber may unsubscribe itself.
+ */
+void
+download_progress_group_unsubscribe (DownloadProgressGroup *group,
+                                     guint                  id)
+{
+    g_return_if_fail (group != NULL);
+
+    GList *l;
+
+    for (l = group->subscribers; l != NULL; l = l->next)
+    {
+        DownloadProgressSubscriber *subscriber = l->data;
+
+        if (subscriber->id != id)
+            continue;
+
+        group->subscribers = g_list_delete_link (group->subscribers, l);
+        download_progress_subscriber_free (subscriber);
+        break;
+    }
+
+    if (!group->subscribers && group->tick_source)
+    {
+        GSource *source = group->tick_source;
+
+        group->tick_source = NULL;
+
+        // May drop the last reference to the group
+        g_source_destroy (source);
+        g_source_unref (source);
+    }
+}
+
+/**
+ * download_progress_group_get:
+ * @group: a #DownloadProgressGroup
+ * @progress: (out): return location for the #DownloadProgress
+ *
+ * Gets the progress of @group as of its last tick, from any thread.
+ */
+void
+download_progress_group_get (DownloadProgressGroup *group,
+                             DownloadProgress      *progress)
+{
+    g_return_if_fail (group != NULL);
+    g_return_if_fail (progress != NULL);
+
+    g_mutex_lock (&group->mutex);
+    *progress = group->progress;
+    g_mutex_unlock (&group->mutex);
+}
+
+/**
+ * download_progress_group_add:
+ * @group: a #DownloadProgressGroup
+ *
+ * Counts a download that starts as running, with no known length yet.
+ */
+void
+download_progress_group_add (DownloadProgressGroup *group)
+{
+    g_return_if_fail (group != NULL);
+
+    g_atomic_int_inc (&group->n_active);
+    g_atomic_int_inc (&group->n_unknown);
+}
+
+/**
+ * download_progress_group_update:
+ * @group: a #DownloadProgressGroup
+ * @bytes: the bytes a download received since its last update, negative
+ *         when it started over
+ * @total: how much the length of the download changed since its last
+ *         update
+ * @known: 1 when the download just learned its length, -1 when it lost
+ *         it, 0 otherwise
+ *
+ * Adds what a download did to the counters of @group. This is the only
+ * cost of the group on the path of every chunk, a few atomic additions.
+ */
+void
+download_progress_group_update (DownloadProgressGroup *group,
+                                gssize                 bytes,
+                                gssize                 total,
+                                gint                   known)
+{
+    if (bytes != 0)
+        g_atomic_pointer_add (&group->pending_bytes, bytes);
+
+    if (total != 0)
+        g_atomic_pointer_add (&group->pending_total, total);
+
+    if (known != 0)
+        g_atomic_int_add (&group->n_unknown, -known);
+}
+
+/**
+ * download_progress_group_remove:
+ * @group: a #DownloadProgressGroup
+ * @failed: %TRUE if the download failed
+ * @known: %TRUE if the length of the download was known
+ *
+ * Counts a download of @group as done, from any thread. The subscribers
+ * hear about it right away when it was the last one running.
+ */
+void
+download_progress_group_remove (DownloadProgressGroup *group,
+                                gboolean               failed,
+                                gboolean               known)
+{
+    g_return_if_fail (group != NULL);
+
+    if (!known)
+        g_atomic_int_add (&group->n_unknown, -1);
+
+    g_atomic_int_inc (failed ? &group->n_failed : &group->n_completed);
+
+    if (g_atomic_int_dec_and_test (&group->n_active))
+    {
+        GSource *source = g_idle_source_new ();
+
+        g_source_set_priority (source, G_PRIORITY_DEFAULT);
+        g_source_set_callback (source,
+                               download_progress_group_final_cb,
+                               download_progress_group_ref (group),
+                               (GDestroyNotify) download_progress_group_unref);
+        g_source_attach (source, group->context);
+        g_source_unref (source);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef DOWNLOAD_PROGRESS_H
+#define DOWNLOAD_PROGRESS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define DOWNLOAD_PROGRESS_DEFAULT_INTERVAL 500
+
+// Time constant of the speed average, in µs: a change of rate shows for
+// about two thirds after this long
+#define DOWNLOAD_PROGRESS_TIME_CONSTANT (3 * G_USEC_PER_SEC)
+
+typedef struct _DownloadProgressGroup DownloadProgressGroup;
+
+typedef struct _DownloadProgress {
+    // Bytes received by every download of the group, and the length of the
+    // ones that announced it
+    guint64 downloaded_bytes;
+    guint64 total_bytes;
+
+    guint n_active;
+    guint n_completed;
+    guint n_failed;
+
+    // Bytes per second averaged over about DOWNLOAD_PROGRESS_TIME_CONSTANT,
+    // and seconds left at that speed, -1 while a running download has no
+    // known length or nothing was received yet
+    gdouble speed;
+    gdouble eta;
+} DownloadProgress;
+
+typedef void (* DownloadProgressFunc) (const DownloadProgress *progress,
+                                       gpointer                user_data);
+
+DownloadProgressGroup *
+download_progress_group_new (guint interval);
+
+DownloadProgressGroup *
+download_progress_group_ref (DownloadProgressGroup *group);
+
+void
+download_progress_group_unref (DownloadProgressGroup *group);
+
+guint
+download_progress_group_subscribe (DownloadProgressGroup *group,
+                                   DownloadProgressFunc   func,
+                                   gpointer               user_data,
+                                   GDestroyNotify         destroy);
+
+void
+download_progress_group_unsubscribe (DownloadProgressGroup *group,
+                                     guint                  id);
+
+void
+download_progress_group_get (DownloadProgressGroup *group,
+                             DownloadProgress      *progress);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_PROGRESS_H */
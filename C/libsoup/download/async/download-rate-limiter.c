@@ -0,0 +1,478 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-rate-limiter.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/**
+ * SECTION:download-rate-limiter
+ * @title: Download Rate Limiter
+ * @short_description: Token bucket shared by downloads, with weighted priorities
+ * @include: download-rate-limiter.h
+ * @see_also: #DownloadResourceData, #DownloadBufferPool
+ *
+ * A #DownloadRateLimiter caps how many bytes per second all the downloads
+ * sharing it read together. Before every read a download asks the limiter
+ * how much it may read with download_rate_limiter_acquire(), and reports
+ * what it read with download_rate_limiter_consume(). When it may read
+ * nothing it waits on a source from download_rate_limiter_create_source().
+ *
+ * Every #DownloadPriority has its own bucket. The rate is shared between the
+ * priorities that read recently in proportion to their weight, 1, 4 and 16
+ * by default, so urgent downloads take most of it from background ones while
+ * they run and background ones get it all back once they are done. A
+ * priority with a weight of 0 only reads when no priority with a weight
+ * competes with it. Each bucket saves up at most a quarter of a second of
+ * its share, so a quiet priority cannot burst past the rate later.
+ *
+ * The rate and the weights can be changed at any time, running downloads
+ * follow within %DOWNLOAD_RATE_LIMITER_MAX_DELAY. A rate of 0 means no
+ * limit, which is what download_rate_limiter_get_default() starts with.
+ **/
+
+// Longest a priority may save up its share of the rate for, in µs
+#define DOWNLOAD_RATE_LIMITER_BURST (G_USEC_PER_SEC / 4)
+
+// How long a priority competes for the rate after it last asked, in µs
+#define DOWNLOAD_RATE_LIMITER_ACTIVE_TIME (G_USEC_PER_SEC / 2)
+
+// Smallest read granted, so slow rates do not turn into tiny reads
+#define DOWNLOAD_RATE_LIMITER_MIN_GRANT (4 * 1024)
+
+// Longest a download waits before asking again, in ms
+#define DOWNLOAD_RATE_LIMITER_MAX_DELAY 250
+
+typedef struct _DownloadRateLimiterBucket {
+    guint weight;
+    gdouble tokens;
+    gint64 last_request;
+} DownloadRateLimiterBucket;
+
+struct _DownloadRateLimiter {
+    gint ref_count;
+    GMutex mutex;
+
+    // Bytes per second, 0 for no limit
+    guint64 rate;
+    gint64 last_refill;
+
+    DownloadRateLimiterBucket buckets[DOWNLOAD_N_PRIORITIES];
+};
+
+/**
+ * download_rate_limiter_new:
+ * @rate: the most bytes per second read by all downloads together, 0 for no
+ *        limit
+ *
+ * Creates a #DownloadRateLimiter with the default weights.
+ *
+ * Returns: (transfer full): a new #DownloadRateLimiter, free with
+ *          download_rate_limiter_unref()
+ */
+DownloadRateLimiter *
+download_rate_limiter_new (guint64 rate)
+{
+    DownloadRateLimiter *limiter;
+
+    limiter = g_slice_new0 (DownloadRateLimiter);
+    limiter->ref_count = 1;
+    g_mutex_init (&limiter->mutex);
+
+    limiter->rate = rate;
+    limiter->last_refill = g_get_monotonic_time ();
+
+    limiter->buckets[DOWNLOAD_PRIORITY_BACKGROUND].weight = DOWNLOAD_RATE_LIMITER_DEFAULT_WEIGHT_BACKGROUND;
+    limiter->buckets[DOWNLOAD_PRIORITY_NORMAL].weight = DOWNLOAD_RATE_LIMITER_DEFAULT_WEIGHT_NORMAL;
+    limiter->buckets[DOWNLOAD_PRIORITY_URGENT].weight = DOWNLOAD_RATE_LIMITER_DEFAULT_WEIGHT_URGENT;
+
+    return limiter;
+}
+
+/**
+ * download_rate_limiter_get_default:
+ *
+ * Gets the #DownloadRateLimiter used by downloads that do not ask for a
+ * specific one. It is created on first use without a limit, call
+ * download_rate_limiter_set_rate() on it to cap every such download.
+ *
+ * Returns: (transfer none): the default #DownloadRateLimiter
+ */
+DownloadRateLimiter *
+download_rate_limiter_get_default (void)
+{
+    static gsize initialized = 0;
+    static DownloadRateLimiter *limiter = NULL;
+
+    if (g_once_init_enter (&initialized))
+    {
+        limiter = download_rate_limiter_new (0);
+        g_once_init_leave (&initialized, 1);
+    }
+
+    return limiter;
+}
+
+/**
+ * download_rate_limiter_ref:
+ * @limiter: a #DownloadRateLimiter
+ *
+ * Increases the reference count of @limiter.
+ *
+ * Returns: (transfer full): @limiter
+ */
+DownloadRateLimiter *
+download_rate_limiter_ref (DownloadRateLimiter *limiter)
+{
+    g_return_val_if_fail (limiter != NULL, NULL);
+    g_return_val_if_fail (limiter->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&limiter->ref_count);
+
+    return limiter;
+}
+
+/**
+ * download_rate_limiter_unref:
+ * @limiter: a #DownloadRateLimiter
+ *
+ * Decreases the reference count of @limiter, freeing it when the count drops
+ * to zero. Every download holds a reference to its limiter.
+ */
+void
+download_rate_limiter_unref (DownloadRateLimiter *limiter)
+{
+    g_return_if_fail (limiter != NULL);
+    g_return_if_fail (limiter->ref_count > 0);
+
+    if (!g_atomic_int_dec_and_test (&limiter->ref_count))
+        return;
+
+    g_mutex_clear (&limiter->mutex);
+    g_slice_free (DownloadRateLimiter, limiter);
+}
+
+/**
+ * download_rate_limiter_get_shares:
+ * @limiter: a locked #DownloadRateLimiter
+ * @now: the monotonic time
+ * @shares: (out caller-allocates): return location for the part of the rate
+ *          of each #DownloadPriority
+ *
+ * Splits the rate between the priorities that asked for it within
+ * %DOWNLOAD_RATE_LIMITER_ACTIVE_TIME, by weight. Priorities of weight 0 share
+ * it evenly when they are the only ones competing. When none competes the
+ * rate is split by weight between all of them.
+ */
+static void
+download_rate_limiter_get_shares (DownloadRateLimiter *limiter,
+                                  gint64               now,
+                                  gdouble             *shares)
+{
+    gboolean active[DOWNLOAD_N_PRIORITIES];
+    guint total_weight = 0;
+    guint n_active = 0;
+    guint i;
+
+    for (i = 0; i < DOWNLOAD_N_PRIORITIES; i++)
+    {
+        DownloadRateLimiterBucket *bucket = &limiter->buckets[i];
+
+        active[i] = bucket->last_request > 0 && now - bucket->last_request < DOWNLOAD_RATE_LIMITER_ACTIVE_TIME;
+
+        if (active[i])
+        {
+            total_weight += bucket->weight;
+            n_active++;
+        }
+    }
+
+    if (n_active == 0)
+    {
+        for (i = 0; i < DOWNLOAD_N_PRIORITIES; i++)
+        {
+            active[i] = TRUE;
+            total_weight += limiter->buckets[i].weight;
+        }
+
+        n_active = DOWNLOAD_N_PRIORITIES;
+    }
+
+    for (i = 0; i < DOWNLOAD_N_PRIORITIES; i++)
+    {
+        if (!active[i])
+            shares[i] = 0;
+        else if (total_weight > 0)
+            shares[i] = (gdouble) limiter->buckets[i].weight / total_weight;
+        else
+            shares[i] = 1.0 / n_active;
+    }
+}
+
+/**
+ * download_rate_limiter_refill:
+ * @limiter: a locked #DownloadRateLimiter
+ * @now: the monotonic time
+ *
+ * Adds the tokens earned since the last refill to the buckets, according to
+ * their share, up to %DOWNLOAD_RATE_LIMITER_BURST worth of it.
+ */
+static void
+download_rate_limiter_refill (DownloadRateLimiter *limiter,
+                              gint64               now)
+{
+    gdouble shares[DOWNLOAD_N_PRIORITIES];
+    gdouble earned;
+    guint i;
+
+    earned = (gdouble) limiter->rate * (now - limiter->last_refill) / G_USEC_PER_SEC;
+    limiter->last_refill = now;
+
+    if (limiter->rate == 0 || earned <= 0)
+        return;
+
+    download_rate_limiter_get_shares (limiter, now, shares);
+
+    for (i = 0; i < DOWNLOAD_N_PRIORITIES; i++)
+    {
+        DownloadRateLimiterBucket *bucket = &limiter->buckets[i];
+        gdouble burst = (gdouble) limiter->rate * shares[i] * DOWNLOAD_RATE_LIMITER_BURST / G_USEC_PER_SEC;
+
+        if (shares[i] > 0)
+            bucket->tokens = MIN (bucket->tokens + earned * shares[i], burst);
+    }
+}
+
+/**
+ * download_rate_limiter_set_rate:
+ * @limiter: a #DownloadRateLimiter
+ * @rate: the most bytes per second read by all downloads together, 0 for no
+ *        limit
+ *
+ * Changes the rate of @limiter. Downloads waiting for tokens pick it up the
+ * next time they ask.
+ */
+void
+download_rate_limiter_set_rate (DownloadRateLimiter *limiter,
+                                guint64              rate)
+{
+    g_return_if_fail (limiter != NULL);
+
+    guint i;
+
+    g_mutex_lock (&limiter->mutex);
+
+    download_rate_limiter_refill (limiter, g_get_monotonic_time ());
+
+    // Debts run up under another rate would stall the new one
+    for (i = 0; i < DOWNLOAD_N_PRIORITIES; i++)
+        limiter->buckets[i].tokens = MAX (limiter->buckets[i].tokens, 0);
+
+    limiter->rate = rate;
+
+    g_mutex_unlock (&limiter->mutex);
+}
+
+/**
+ * download_rate_limiter_get_rate:
+ * @limiter: a #DownloadRateLimiter
+ *
+ * Gets the rate of @limiter.
+ *
+ * Returns: the most bytes per second read through @limiter, 0 for no limit
+ */
+guint64
+download_rate_limiter_get_rate (DownloadRateLimiter *limiter)
+{
+    g_return_val_if_fail (limiter != NULL, 0);
+
+    guint64 rate;
+
+    g_mutex_lock (&limiter->mutex);
+    rate = limiter->rate;
+    g_mutex_unlock (&limiter->mutex);
+
+    return rate;
+}
+
+/**
+ * download_rate_limiter_set_weight:
+ * @limiter: a #DownloadRateLimiter
+ * @priority: a #DownloadPriority
+ * @weight: the weight of @priority, 0 to only read when no other priority
+ *          with a weight does
+ *
+ * Changes how much of the rate @priority gets while others compete with it.
+ */
+void
+download_rate_limiter_set_weight (DownloadRateLimiter *limiter,
+                                  DownloadPriority     priority,
+                                  guint                weight)
+{
+    g_return_if_fail (limiter != NULL);
+    g_return_if_fail (priority < DOWNLOAD_N_PRIORITIES);
+
+    g_mutex_lock (&limiter->mutex);
+
+    download_rate_limiter_refill (limiter, g_get_monotonic_time ());
+    limiter->buckets[priority].weight = weight;
+
+    g_mutex_unlock (&limiter->mutex);
+}
+
+/**
+ * download_rate_limiter_get_weight:
+ * @limiter: a #DownloadRateLimiter
+ * @priority: a #DownloadPriority
+ *
+ * Gets the weight of @priority.
+ *
+ * Returns: the weight of @priority
+ */
+guint
+download_rate_limiter_get_weight (DownloadRateLimiter *limiter,
+                                  DownloadPriority     priority)
+{
+    g_return_val_if_fail (limiter != NULL, 0);
+    g_return_val_if_fail (priority < DOWNLOAD_N_PRIORITIES, 0);
+
+    guint weight;
+
+    g_mutex_lock (&limiter->mutex);
+    weight = limiter->buckets[priority].weight;
+    g_mutex_unlock (&limiter->mutex);
+
+    return weight;
+}
+
+/**
+ * download_rate_limiter_acquire:
+ * @limiter: a #DownloadRateLimiter
+ * @priority: the #DownloadPriority of the download
+ * @size: the number of bytes the download would like to read
+ *
+ * Works out how much a download of @priority may read now: at most @size and
+ * the tokens in its bucket, but never less than a few KiB so slow rates
+ * still read in reasonable chunks. Asking counts @priority as competing for
+ * the rate. Report what was actually read with
+ * download_rate_limiter_consume().
+ *
+ * Returns: the number of bytes to read at most, 0 to wait on a source from
+ *          download_rate_limiter_create_source() first
+ */
+gsize
+download_rate_limiter_acquire (DownloadRateLimiter *limiter,
+                               DownloadPriority     priority,
+                               gsize                size)
+{
+    g_return_val_if_fail (limiter != NULL, 0);
+    g_return_val_if_fail (priority < DOWNLOAD_N_PRIORITIES, 0);
+
+    DownloadRateLimiterBucket *bucket = &limiter->buckets[priority];
+    gint64 now = g_get_monotonic_time ();
+    gsize allowed = 0;
+
+    g_mutex_lock (&limiter->mutex);
+
+    bucket->last_request = now;
+
+    if (limiter->rate == 0)
+    {
+        allowed = size;
+    }
+    else
+    {
+        download_rate_limiter_refill (limiter, now);
+
+        if (bucket->tokens > 0)
+            allowed = MIN (size, MAX ((gsize) bucket->tokens, DOWNLOAD_RATE_LIMITER_MIN_GRANT));
+    }
+
+    g_mutex_unlock (&limiter->mutex);
+
+    return allowed;
+}
+
+/**
+ * download_rate_limiter_consume:
+ * @limiter: a #DownloadRateLimiter
+ * @priority: the #DownloadPriority of the download
+ * @size: the number of bytes read
+ *
+ * Takes @size bytes out of the bucket of @priority. A read granted more than
+ * the bucket held leaves it in debt, which the next refills pay back.
+ */
+void
+download_rate_limiter_consume (DownloadRateLimiter *limiter,
+                               DownloadPriority     priority,
+                               gsize                size)
+{
+    g_return_if_fail (limiter != NULL);
+    g_return_if_fail (priority < DOWNLOAD_N_PRIORITIES);
+
+    g_mutex_lock (&limiter->mutex);
+
+    if (limiter->rate > 0)
+        limiter->buckets[priority].tokens -= size;
+
+    g_mutex_unlock (&limiter->mutex);
+}
+
+/**
+ * download_rate_limiter_create_source:
+ * @limiter: a #DownloadRateLimiter
+ * @priority: the #DownloadPriority of the download
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Creates a source that dispatches once the bucket of @priority should hold
+ * tokens again at its current share of the rate, or after
+ * %DOWNLOAD_RATE_LIMITER_MAX_DELAY at the latest so that changes to the rate
+ * and to the other priorities are picked up. It also dispatches when
+ * @cancellable is cancelled. Ask download_rate_limiter_acquire() again when
+ * it does.
+ *
+ * Returns: (transfer full): a new #GSource
+ */
+GSource *
+download_rate_limiter_create_source (DownloadRateLimiter *limiter,
+                                     DownloadPriority     priority,
+                                     GCancellable        *cancellable)
+{
+    g_return_val_if_fail (limiter != NULL, NULL);
+    g_return_val_if_fail (priority < DOWNLOAD_N_PRIORITIES, NULL);
+
+    gdouble shares[DOWNLOAD_N_PRIORITIES];
+    gint64 now = g_get_monotonic_time ();
+    gdouble rate;
+    gdouble missing;
+    guint delay = DOWNLOAD_RATE_LIMITER_MAX_DELAY;
+    GSource *source;
+
+    g_mutex_lock (&limiter->mutex);
+
+    download_rate_limiter_refill (limiter, now);
+    download_rate_limiter_get_shares (limiter, now, shares);
+
+    rate = limiter->rate * shares[priority];
+    missing = 1 - limiter->buckets[priority].tokens;
+
+    if (limiter->rate == 0 || missing <= 0)
+        delay = 0;
+    else if (rate > 0)
+        delay = CLAMP (missing * 1000 / rate + 1, 1, DOWNLOAD_RATE_LIMITER_MAX_DELAY);
+
+    g_mutex_unlock (&limiter->mutex);
+
+    source = g_timeout_source_new (delay);
+
+    if (cancellable)
+    {
+        GSource *cancellable_source = g_cancellable_source_new (cancellable);
+
+        g_source_set_dummy_callback (cancellable_source);
+        g_source_add_child_source (source, cancellable_source);
+        g_source_unref (cancellable_source);
+    }
+
+    return source;
+}
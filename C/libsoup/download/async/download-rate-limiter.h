@@ -0,0 +1,68 @@
+#ifndef DOWNLOAD_RATE_LIMITER_H
+#define DOWNLOAD_RATE_LIMITER_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+    DOWNLOAD_PRIORITY_BACKGROUND,
+    DOWNLOAD_PRIORITY_NORMAL,
+    DOWNLOAD_PRIORITY_URGENT
+} DownloadPriority;
+
+#define DOWNLOAD_N_PRIORITIES 3
+
+#define DOWNLOAD_RATE_LIMITER_DEFAULT_WEIGHT_BACKGROUND 1
+#define DOWNLOAD_RATE_LIMITER_DEFAULT_WEIGHT_NORMAL     4
+#define DOWNLOAD_RATE_LIMITER_DEFAULT_WEIGHT_URGENT     16
+
+typedef struct _DownloadRateLimiter DownloadRateLimiter;
+
+DownloadRateLimiter *
+download_rate_limiter_new (guint64 rate);
+
+DownloadRateLimiter *
+download_rate_limiter_get_default (void);
+
+DownloadRateLimiter *
+download_rate_limiter_ref (DownloadRateLimiter *limiter);
+
+void
+download_rate_limiter_unref (DownloadRateLimiter *limiter);
+
+void
+download_rate_limiter_set_rate (DownloadRateLimiter *limiter,
+                                guint64              rate);
+
+guint64
+download_rate_limiter_get_rate (DownloadRateLimiter *limiter);
+
+void
+download_rate_limiter_set_weight (DownloadRateLimiter *limiter,
+                                  DownloadPriority     priority,
+                                  guint                weight);
+
+guint
+download_rate_limiter_get_weight (DownloadRateLimiter *limiter,
+                                  DownloadPriority     priority);
+
+gsize
+download_rate_limiter_acquire (DownloadRateLimiter *limiter,
+                               DownloadPriority     priority,
+                               gsize                size);
+
+void
+download_rate_limiter_consume (DownloadRateLimiter *limiter,
+                               DownloadPriority     priority,
+                               gsize                size);
+
+GSource *
+download_rate_limiter_create_source (DownloadRateLimiter *limiter,
+                                     DownloadPriority     priority,
+                                     GCancellable        *cancellable);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_RATE_LIMITER_H */
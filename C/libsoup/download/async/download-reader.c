@@ -0,0 +1,704 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-reader.h"
+#include "download-private.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * SECTION:download-reader
+ * @title: Download Reader
+ * @short_description: Streams of a file still being downloaded
+ * @include: download-reader.h
+ * @see_also: #DownloadOptions, #GInputStream
+ *
+ * A download to a file started with #DownloadOptions.readable set keeps a
+ * #DownloadTail: a read only descriptor on the file being written and how
+ * far the bytes on disk run without a gap from the first one, moved on as
+ * each write completes. download_resource_data_open_reader() returns a
+ * #DownloadReader on it, a #GInputStream that reads the file from its
+ * start with pread(), waits at that mark for the next write and only
+ * reaches the end of the stream once the download succeeded. A failed or
+ * cancelled download fails the reads that follow with its error.
+ *
+ * Any number of readers share the tail, each at its own position. The
+ * bytes are read back from the page cache where the download wrote them,
+ * not copied for each reader. The stream is a #GPollableInputStream, its
+ * sources are woken by the tail as writes complete, so
+ * g_input_stream_read_async() waits on the #GMainContext of the caller
+ * rather than hold a #GTask worker thread the download may need.
+ **/
+
+struct _DownloadTail {
+    gint ref_count;
+    GMutex mutex;
+    GCond cond;
+
+    gint fd;
+    goffset committed;
+    gboolean done;
+    GError *error;
+
+    // DownloadReaderSource of readers waiting for the mark to move, each
+    // holding a reference, made ready on the next commit or close
+    GSList *sources;
+};
+
+struct _DownloadReader {
+    GInputStream parent_instance;
+
+    DownloadTail *tail;
+    goffset position;
+};
+
+typedef struct _DownloadReaderSource {
+    GSource source;
+    DownloadReader *reader;
+} DownloadReaderSource;
+
+static void
+download_reader_pollable_iface_init (GPollableInputStreamInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (DownloadReader, download_reader, G_TYPE_INPUT_STREAM,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_POLLABLE_INPUT_STREAM,
+                                                download_reader_pollable_iface_init))
+
+/**
+ * download_tail_new:
+ *
+ * Creates a #DownloadTail with nothing to read yet.
+ *
+ * Returns: (transfer full): a #DownloadTail, free with download_tail_unref()
+ */
+DownloadTail *
+download_tail_new (void)
+{
+    DownloadTail *tail;
+
+    tail = g_slice_new0 (DownloadTail);
+    tail->ref_count = 1;
+    tail->fd = -1;
+    g_mutex_init (&tail->mutex);
+    g_cond_init (&tail->cond);
+
+    return tail;
+}
+
+/**
+ * download_tail_ref:
+ * @tail: a #DownloadTail
+ *
+ * Increases the reference count of @tail.
+ *
+ * Returns: (transfer full): @tail
+ */
+DownloadTail *
+download_tail_ref (DownloadTail *tail)
+{
+    g_return_val_if_fail (tail != NULL, NULL);
+    g_return_val_if_fail (tail->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&tail->ref_count);
+
+    return tail;
+}
+
+/**
+ * download_tail_unref:
+ * @tail: a #DownloadTail
+ *
+ * Decreases the reference count of @tail, closing its descriptor when the
+ * count drops to zero.
+ */
+void
+download_tail_unref (DownloadTail *tail)
+{
+    g_return_if_fail (tail != NULL);
+    g_return_if_fail (tail->ref_count > 0);
+
+    if (!g_atomic_int_dec_and_test (&tail->ref_count))
+        return;
+
+    if (tail->fd >= 0)
+        close (tail->fd);
+
+    if (tail->error)
+        g_error_free (tail->error);
+
+    g_slist_free_full (tail->sources, (GDestroyNotify) g_source_unref);
+
+    g_cond_clear (&tail->cond);
+    g_mutex_clear (&tail->mutex);
+
+    g_slice_free (DownloadTail, tail);
+}
+
+/**
+ * download_tail_open:
+ * @tail: a #DownloadTail
+ * @fd: (transfer full): a read only descriptor on the file of the download
+ *
+ * Gives @tail the descriptor readers pread() from. Only the first call
+ * counts, later descriptors are closed.
+ */
+void
+download_tail_open (DownloadTail *tail,
+                    gint          fd)
+{
+    g_return_if_fail (tail != NULL);
+    g_return_if_fail (fd >= 0);
+
+    g_mutex_lock (&tail->mutex);
+
+    if (tail->fd < 0)
+    {
+        tail->fd = fd;
+        fd = -1;
+    }
+
+    g_mutex_unlock (&tail->mutex);
+
+    if (fd >= 0)
+        close (fd);
+}
+
+/**
+ * download_tail_is_open:
+ * @tail: a #DownloadTail
+ *
+ * Checks whether @tail has a descriptor to read from.
+ *
+ * Returns: %TRUE once download_tail_open() was called
+ */
+gboolean
+download_tail_is_open (DownloadTail *tail)
+{
+    g_return_val_if_fail (tail != NULL, FALSE);
+
+    gboolean opened;
+
+    g_mutex_lock (&tail->mutex);
+    opened = tail->fd >= 0;
+    g_mutex_unlock (&tail->mutex);
+
+    return opened;
+}
+
+/**
+ * download_tail_wake:
+ * @tail: a locked #DownloadTail
+ *
+ * Makes the sources of the readers waiting on @tail ready, from whatever
+ * thread, and forgets them.
+ */
+static void
+download_tail_wake (DownloadTail *tail)
+{
+    GSList *l;
+
+    for (l = tail->sources; l != NULL; l = l->next)
+    {
+        g_source_set_ready_time (l->data, 0);
+        g_source_unref (l->data);
+    }
+
+    g_slist_free (tail->sources);
+    tail->sources = NULL;
+}
+
+/**
+ * download_tail_commit:
+ * @tail: a #DownloadTail
+ * @end: the first byte past the ones on disk without a gap from the start
+ *
+ * Lets readers read up to @end and wakes the ones waiting. The mark never
+ * moves back.
+ */
+void
+download_tail_commit (DownloadTail *tail,
+                      goffset       end)
+{
+    g_return_if_fail (tail != NULL);
+
+    g_mutex_lock (&tail->mutex);
+
+    if (tail->fd >= 0 && end > tail->committed)
+    {
+        tail->committed = end;
+        g_cond_broadcast (&tail->cond);
+        download_tail_wake (tail);
+    }
+
+    g_mutex_unlock (&tail->mutex);
+}
+
+/**
+ * download_tail_close:
+ * @tail: a #DownloadTail
+ * @error: (nullable): the error the download failed with
+ *
+ * Ends the stream of every reader of @tail: at the end of the file once
+ * the download succeeded, with @error otherwise.
+ */
+void
+download_tail_close (DownloadTail *tail,
+                     const GError *error)
+{
+    g_return_if_fail (tail != NULL);
+
+    struct stat st;
+
+    g_mutex_lock (&tail->mutex);
+
+    if (error && !tail->error)
+        tail->error = g_error_copy (error);
+
+    if (!error && tail->fd >= 0 && fstat (tail->fd, &st) == 0)
+        tail->committed = MAX (tail->committed, (goffset) st.st_size);
+
+    tail->done = TRUE;
+    g_cond_broadcast (&tail->cond);
+    download_tail_wake (tail);
+
+    g_mutex_unlock (&tail->mutex);
+}
+
+/**
+ * download_tail_cancelled_cb:
+ * @cancellable: the #GCancellable of a read
+ * @user_data: a #DownloadTail
+ *
+ * Wakes the reads waiting on @user_data so the cancelled one returns.
+ */
+static void
+download_tail_cancelled_cb (GCancellable *cancellable,
+                            gpointer      user_data)
+{
+    DownloadTail *tail = user_data;
+
+    g_mutex_lock (&tail->mutex);
+    g_cond_broadcast (&tail->cond);
+    g_mutex_unlock (&tail->mutex);
+}
+
+/**
+ * download_reader_pread:
+ * @reader: a #DownloadReader
+ * @fd: the descriptor of its tail
+ * @buffer: a buffer to read into
+ * @count: the size of @buffer
+ * @available: the bytes on disk past the position of @reader
+ * @error: return location for a #GError
+ *
+ * Reads up to @count of the @available bytes at the position of @reader
+ * and moves past them.
+ *
+ * Returns: the number of bytes read, 0 if none are available, or -1 with
+ *          @error set
+ */
+static gssize
+download_reader_pread (DownloadReader  *reader,
+                       gint             fd,
+                       void            *buffer,
+                       gsize            count,
+                       goffset          available,
+                       GError         **error)
+{
+    gssize n;
+
+    if (available <= 0)
+        return 0;
+
+    do
+        n = pread (fd, buffer, MIN ((goffset) count, available), reader->position);
+    while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+    {
+        gint saved_errno = errno;
+
+        g_set_error (error,
+                     G_IO_ERROR,
+                     g_io_error_from_errno (saved_errno),
+                     "Failed to read the download: %s",
+                     g_strerror (saved_errno));
+        return -1;
+    }
+
+    reader->position += n;
+
+    return n;
+}
+
+/**
+ * download_reader_read:
+ * @stream: a #DownloadReader
+ * @buffer: a buffer to read into
+ * @count: the size of @buffer
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Waits until the download wrote past the position of the reader, ended or
+ * @cancellable is cancelled, then reads what it can of the bytes on disk.
+ *
+ * Returns: the number of bytes read, 0 at the end of the stream, or -1
+ *          with @error set
+ */
+static gssize
+download_reader_read (GInputStream  *stream,
+                      void          *buffer,
+                      gsize          count,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+    DownloadReader *reader = DOWNLOAD_READER (stream);
+    DownloadTail *tail = reader->tail;
+    GError *tail_error = NULL;
+    gulong cancelled_id = 0;
+    goffset available;
+    gint fd;
+
+    if (count == 0)
+        return 0;
+
+    // Connected before locking, the handler runs right away when the
+    // cancellable already is
+    if (cancellable)
+        cancelled_id = g_cancellable_connect (cancellable,
+                                              G_CALLBACK (download_tail_cancelled_cb),
+                                              tail,
+                                              NULL);
+
+    g_mutex_lock (&tail->mutex);
+
+    while (!tail->error && !tail->done && tail->committed <= reader->position &&
+           !g_cancellable_is_cancelled (cancellable))
+        g_cond_wait (&tail->cond, &tail->mutex);
+
+    available = tail->committed - reader->position;
+    fd = tail->fd;
+
+    if (tail->error)
+        tail_error = g_error_copy (tail->error);
+
+    g_mutex_unlock (&tail->mutex);
+
+    if (cancellable)
+        g_cancellable_disconnect (cancellable, cancelled_id);
+
+    if (tail_error)
+    {
+        g_propagate_error (error, tail_error);
+        return -1;
+    }
+
+    if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return -1;
+
+    return download_reader_pread (reader, fd, buffer, count, available, error);
+}
+
+/**
+ * download_reader_read_nonblocking:
+ * @stream: a #DownloadReader
+ * @buffer: a buffer to read into
+ * @count: the size of @buffer
+ * @error: return location for a #GError
+ *
+ * Reads what it can of the bytes on disk past the position of the reader,
+ * without waiting for the download to write more.
+ *
+ * Returns: the number of bytes read, 0 at the end of the stream, or -1
+ *          with @error set, to %G_IO_ERROR_WOULD_BLOCK if nothing can be
+ *          read yet
+ */
+static gssize
+download_reader_read_nonblocking (GPollableInputStream  *stream,
+                                  void                  *buffer,
+                                  gsize                  count,
+                                  GError               **error)
+{
+    DownloadReader *reader = DOWNLOAD_READER (stream);
+    DownloadTail *tail = reader->tail;
+    GError *tail_error = NULL;
+    goffset available;
+    gboolean done;
+    gint fd;
+
+    if (count == 0)
+        return 0;
+
+    g_mutex_lock (&tail->mutex);
+
+    available = tail->committed - reader->position;
+    done = tail->done;
+    fd = tail->fd;
+
+    if (tail->error)
+        tail_error = g_error_copy (tail->error);
+
+    g_mutex_unlock (&tail->mutex);
+
+    if (tail_error)
+    {
+        g_propagate_error (error, tail_error);
+        return -1;
+    }
+
+    if (available <= 0 && !done)
+    {
+        g_set_error_literal (error,
+                             G_IO_ERROR,
+                             G_IO_ERROR_WOULD_BLOCK,
+                             "The download wrote nothing more yet");
+        return -1;
+    }
+
+    return download_reader_pread (reader, fd, buffer, count, available, error);
+}
+
+/**
+ * download_reader_is_readable:
+ * @stream: a #DownloadReader
+ *
+ * Checks whether a read would return straight away, with bytes, the end of
+ * the stream or the error of the download.
+ *
+ * Returns: %TRUE if @stream can be read without blocking
+ */
+static gboolean
+download_reader_is_readable (GPollableInputStream *stream)
+{
+    DownloadReader *reader = DOWNLOAD_READER (stream);
+    DownloadTail *tail = reader->tail;
+    gboolean readable;
+
+    g_mutex_lock (&tail->mutex);
+    readable = tail->error || tail->done || tail->committed > reader->position;
+    g_mutex_unlock (&tail->mutex);
+
+    return readable;
+}
+
+/**
+ * download_reader_watch:
+ * @reader: a #DownloadReader
+ * @source: the #DownloadReaderSource of @reader
+ *
+ * Makes @source ready right away if @reader can be read, or else once its
+ * tail moves on.
+ */
+static void
+download_reader_watch (DownloadReader *reader,
+                       GSource        *source)
+{
+    DownloadTail *tail = reader->tail;
+
+    g_mutex_lock (&tail->mutex);
+
+    if (tail->error || tail->done || tail->committed > reader->position)
+        g_source_set_ready_time (source, 0);
+    else
+        tail->sources = g_slist_prepend (tail->sources, g_source_ref (source));
+
+    g_mutex_unlock (&tail->mutex);
+}
+
+/**
+ * download_reader_source_dispatch:
+ * @source: a #DownloadReaderSource
+ * @callback: a #GPollableSourceFunc
+ * @user_data: data for @callback
+ *
+ * Calls @callback once the reader of @source may be readable, or its
+ * cancellable was cancelled, and watches the reader again if @callback
+ * wants to go on.
+ *
+ * Returns: what @callback returned
+ */
+static gboolean
+download_reader_source_dispatch (GSource     *source,
+                                 GSourceFunc  callback,
+                                 gpointer     user_data)
+{
+    DownloadReaderSource *reader_source = (DownloadReaderSource *) source;
+    GPollableSourceFunc func = (GPollableSourceFunc) callback;
+    gboolean again;
+
+    g_source_set_ready_time (source, -1);
+
+    if (!func)
+        return G_SOURCE_REMOVE;
+
+    again = func (G_OBJECT (reader_source->reader), user_data);
+
+    if (again)
+        download_reader_watch (reader_source->reader, source);
+
+    return again;
+}
+
+/**
+ * download_reader_source_finalize:
+ * @source: a #DownloadReaderSource
+ *
+ * Drops the reference of @source to its reader.
+ */
+static void
+download_reader_source_finalize (GSource *source)
+{
+    DownloadReaderSource *reader_source = (DownloadReaderSource *) source;
+
+    g_object_unref (reader_source->reader);
+}
+
+static GSourceFuncs download_reader_source_funcs = {
+    NULL,
+    NULL,
+    download_reader_source_dispatch,
+    download_reader_source_finalize
+};
+
+/**
+ * download_reader_create_source:
+ * @stream: a #DownloadReader
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Creates a source that dispatches once @stream is readable, see
+ * download_reader_is_readable(), or @cancellable is cancelled.
+ *
+ * Returns: (transfer full): a new #GSource
+ */
+static GSource *
+download_reader_create_source (GPollableInputStream *stream,
+                               GCancellable         *cancellable)
+{
+    DownloadReader *reader = DOWNLOAD_READER (stream);
+    DownloadReaderSource *reader_source;
+    GSource *source;
+
+    source = g_source_new (&download_reader_source_funcs, sizeof (DownloadReaderSource));
+    g_source_set_name (source, "DownloadReaderSource");
+
+    reader_source = (DownloadReaderSource *) source;
+    reader_source->reader = g_object_ref (reader);
+
+    if (cancellable)
+    {
+        GSource *cancellable_source = g_cancellable_source_new (cancellable);
+
+        g_source_set_dummy_callback (cancellable_source);
+        g_source_add_child_source (source, cancellable_source);
+        g_source_unref (cancellable_source);
+    }
+
+    download_reader_watch (reader, source);
+
+    return source;
+}
+
+/**
+ * download_reader_pollable_iface_init:
+ * @iface: the #GPollableInputStreamInterface of #DownloadReader
+ *
+ * Sets up the #GPollableInputStream methods of #DownloadReader.
+ */
+static void
+download_reader_pollable_iface_init (GPollableInputStreamInterface *iface)
+{
+    iface->is_readable = download_reader_is_readable;
+    iface->create_source = download_reader_create_source;
+    iface->read_nonblocking = download_reader_read_nonblocking;
+}
+
+/**
+ * download_reader_finalize:
+ * @object: a #DownloadReader
+ *
+ * Drops the reference of the reader to its #DownloadTail.
+ */
+static void
+download_reader_finalize (GObject *object)
+{
+    DownloadReader *reader = DOWNLOAD_READER (object);
+
+    download_tail_unref (reader->tail);
+
+    G_OBJECT_CLASS (download_reader_parent_class)->finalize (object);
+}
+
+/**
+ * download_reader_class_init:
+ * @klass: the #DownloadReaderClass
+ *
+ * Sets up the #GInputStream methods of #DownloadReader.
+ */
+static void
+download_reader_class_init (DownloadReaderClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GInputStreamClass *stream_class = G_INPUT_STREAM_CLASS (klass);
+
+    object_class->finalize = download_reader_finalize;
+    stream_class->read_fn = download_reader_read;
+}
+
+/**
+ * download_reader_init:
+ * @reader: a #DownloadReader
+ *
+ * Does nothing, download_reader_new() gives the reader its tail.
+ */
+static void
+download_reader_init (DownloadReader *reader)
+{
+}
+
+/**
+ * download_reader_new:
+ * @tail: the #DownloadTail of a download
+ *
+ * Creates a stream of the file of a download from its first byte, see
+ * download_resource_data_open_reader().
+ *
+ * Returns: (transfer full): a #DownloadReader
+ */
+GInputStream *
+download_reader_new (DownloadTail *tail)
+{
+    g_return_val_if_fail (tail != NULL, NULL);
+
+    DownloadReader *reader;
+
+    reader = g_object_new (DOWNLOAD_TYPE_READER, NULL);
+    reader->tail = download_tail_ref (tail);
+
+    return G_INPUT_STREAM (reader);
+}
+
+/**
+ * download_reader_get_available:
+ * @reader: a #DownloadReader
+ *
+ * Counts the bytes the reader can read right away.
+ *
+ * Returns: the bytes between the position of @reader and the end of what
+ *          the download wrote so far
+ */
+goffset
+download_reader_get_available (DownloadReader *reader)
+{
+    g_return_val_if_fail (DOWNLOAD_IS_READER (reader), 0);
+
+    goffset available;
+
+    g_mutex_lock (&reader->tail->mutex);
+    available = reader->tail->committed - reader->position;
+    g_mutex_unlock (&reader->tail->mutex);
+
+    return MAX (available, 0);
+}
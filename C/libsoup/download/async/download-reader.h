@@ -0,0 +1,22 @@
+#ifndef DOWNLOAD_READER_H
+#define DOWNLOAD_READER_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define DOWNLOAD_TYPE_READER (download_reader_get_type ())
+G_DECLARE_FINAL_TYPE (DownloadReader, download_reader, DOWNLOAD, READER, GInputStream)
+
+typedef struct _DownloadTail DownloadTail;
+
+GInputStream *
+download_reader_new (DownloadTail *tail);
+
+goffset
+download_reader_get_available (DownloadReader *reader);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_READER_H */
@@ -0,0 +1,681 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-uring.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/**
+ * SECTION:download-uring
+ * @title: Download Uring
+ * @short_description: Batched file writes through io_uring
+ * @include: download-uring.h
+ * @see_also: #DownloadOptions, #DownloadBufferPool
+ *
+ * A download to a file started with #DownloadOptions.uring set writes its
+ * chunks through the #DownloadUring of its #GMainContext rather than
+ * g_output_stream_write_all_async(), which costs a write() and a trip
+ * through a worker thread per chunk. The writes of every download on the
+ * context queue up in one submission ring, and go to the kernel in a
+ * single io_uring_enter() as the context is about to poll. Completions are
+ * reaped when the ring descriptor polls readable.
+ *
+ * The buffers of a #DownloadBufferPool are registered with the ring the
+ * first time they are written, up to %DOWNLOAD_URING_N_BUFFERS of them, so
+ * the kernel does not map their pages again for every write. A
+ * registration holds the serial the pool allocated the buffer with, see
+ * download_buffer_pool_get_serial(), so only a buffer freed and allocated
+ * again at the same address is registered afresh. A write asked to sync
+ * is linked to an fdatasync() of the file that only runs once it
+ * succeeded. Downloads with %DOWNLOAD_DURABILITY_FSYNC ask it of the write
+ * that completes their file, and their commit then skips its own
+ * fdatasync() of the file.
+ *
+ * There is one ring per #GMainContext while downloads use it. Without
+ * liburing at build time, or where io_uring_setup() fails, as in sandboxes
+ * that forbid it or kernels before 5.1, download_uring_get() returns %NULL
+ * and downloads write through GIO. Such a failure is mostly for good, so
+ * after one no context sets up a ring for
+ * %DOWNLOAD_URING_RETRY_INTERVAL seconds, rather than every download
+ * paying for a failing io_uring_setup().
+ **/
+
+#ifdef HAVE_LIBURING
+
+typedef struct _DownloadUringBuffer {
+    gconstpointer address;
+    gsize size;
+
+    // Only compared, the pool may be gone
+    gconstpointer pool;
+    guint64 serial;
+} DownloadUringBuffer;
+
+typedef struct _DownloadUringWrite {
+    gint fd;
+    const guint8 *buffer;
+    gsize length;
+    goffset offset;
+    gint buffer_index;
+    gboolean sync;
+
+    // Bytes written so far, completions still to come for the last
+    // submission, and the errors they brought
+    gsize done;
+    guint n_pending;
+    gint write_errno;
+    gint sync_errno;
+} DownloadUringWrite;
+
+struct _DownloadUring {
+    GSource source;
+
+    GMainContext *context;
+    guint n_users;
+
+    struct io_uring ring;
+    guint n_unsubmitted;
+
+    gboolean registered;
+    DownloadUringBuffer buffers[DOWNLOAD_URING_N_BUFFERS];
+    guint next_buffer;
+};
+
+// DownloadUring by GMainContext, and the monotonic time the last ring
+// failed to set up, 0 if none did
+static GHashTable *download_urings;
+static gint64 download_uring_failed_time;
+G_LOCK_DEFINE_STATIC (download_urings);
+
+static void
+download_uring_submit_write (DownloadUring *uring,
+                             GTask         *task);
+
+/**
+ * download_uring_write_free:
+ * @user_data: a #DownloadUringWrite
+ *
+ * Frees a #DownloadUringWrite struct.
+ */
+static void
+download_uring_write_free (gpointer user_data)
+{
+    g_slice_free (DownloadUringWrite, user_data);
+}
+
+/**
+ * download_uring_complete:
+ * @uring: a #DownloadUring
+ * @task: the #GTask of a write
+ * @res: the result of one of its operations, bytes written or -errno
+ * @is_sync: whether @res is the one of the linked fdatasync()
+ *
+ * Accounts for one completion of a write. Once the last of its submission
+ * came back a short write is submitted again for the rest, and a finished
+ * one returns.
+ */
+static void
+download_uring_complete (DownloadUring *uring,
+                         GTask         *task,
+                         gint           res,
+                         gboolean       is_sync)
+{
+    DownloadUringWrite *write = g_task_get_task_data (task);
+
+    // A short write cancels the linked sync, which the resubmission redoes
+    if (is_sync && res < 0 && res != -ECANCELED)
+        write->sync_errno = -res;
+    else if (!is_sync && res < 0)
+        write->write_errno = -res;
+    else if (!is_sync && res == 0 && write->done < write->length)
+        write->write_errno = ENOSPC;
+    else if (!is_sync)
+        write->done += res;
+
+    if (--write->n_pending > 0)
+        return;
+
+    if (!write->write_errno && !write->sync_errno && write->done < write->length)
+    {
+        download_uring_submit_write (uring, task);
+        return;
+    }
+
+    if (write->write_errno || write->sync_errno)
+    {
+        gint saved_errno = write->write_errno ? write->write_errno : write->sync_errno;
+
+        g_task_return_new_error (task,
+                                 G_IO_ERROR,
+                                 g_io_error_from_errno (saved_errno),
+                                 "Failed to %s: %s",
+                                 write->write_errno ? "write" : "sync the file",
+                                 g_strerror (saved_errno));
+    }
+    else
+    {
+        g_task_return_int (task, write->done);
+    }
+
+    g_object_unref (task);
+}
+
+/**
+ * download_uring_get_sqe:
+ * @uring: a #DownloadUring
+ *
+ * Takes a free submission queue entry, submitting what is queued first
+ * when the ring is full.
+ *
+ * Returns: (transfer none): a #io_uring_sqe
+ */
+static struct io_uring_sqe *
+download_uring_get_sqe (DownloadUring *uring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe (&uring->ring);
+
+    if (!sqe)
+    {
+        io_uring_submit (&uring->ring);
+        uring->n_unsubmitted = 0;
+
+        sqe = io_uring_get_sqe (&uring->ring);
+    }
+
+    uring->n_unsubmitted++;
+
+    return sqe;
+}
+
+/**
+ * download_uring_submit_write:
+ * @uring: a #DownloadUring
+ * @task: the #GTask of a write
+ *
+ * Queues what is left of a write, linked to an fdatasync() when it syncs.
+ * The queue goes to the kernel from download_uring_prepare().
+ */
+static void
+download_uring_submit_write (DownloadUring *uring,
+                             GTask         *task)
+{
+    DownloadUringWrite *write = g_task_get_task_data (task);
+    struct io_uring_sqe *sqe;
+
+    // A link only holds within one submission
+    if (write->sync && io_uring_sq_space_left (&uring->ring) < 2)
+    {
+        io_uring_submit (&uring->ring);
+        uring->n_unsubmitted = 0;
+    }
+
+    sqe = download_uring_get_sqe (uring);
+
+    if (write->buffer_index >= 0)
+        io_uring_prep_write_fixed (sqe,
+                                   write->fd,
+                                   write->buffer + write->done,
+                                   write->length - write->done,
+                                   write->offset + write->done,
+                                   write->buffer_index);
+    else
+        io_uring_prep_write (sqe,
+                             write->fd,
+                             write->buffer + write->done,
+                             write->length - write->done,
+                             write->offset + write->done);
+
+    io_uring_sqe_set_data (sqe, task);
+    write->n_pending = 1;
+
+    if (write->sync)
+    {
+        io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK);
+
+        sqe = download_uring_get_sqe (uring);
+        io_uring_prep_fsync (sqe, write->fd, IORING_FSYNC_DATASYNC);
+
+        // The low bit of the user data tells the sync completion apart
+        io_uring_sqe_set_data (sqe, (gpointer) ((guintptr) task | 1));
+        write->n_pending = 2;
+    }
+}
+
+/**
+ * download_uring_find_buffer:
+ * @uring: a #DownloadUring
+ * @pool: (nullable): the #DownloadBufferPool @buffer comes from
+ * @buffer: a buffer of @pool
+ * @size: the size @buffer was allocated with
+ *
+ * Finds the registered buffer holding @buffer, registering it in the
+ * oldest slot when no registration of the same allocation does.
+ *
+ * Returns: the index of the registered buffer, or -1 to write from
+ *          unregistered memory
+ */
+static gint
+download_uring_find_buffer (DownloadUring      *uring,
+                            DownloadBufferPool *pool,
+                            gconstpointer       buffer,
+                            gsize               size)
+{
+    DownloadUringBuffer *registered;
+    struct iovec iov;
+    guint64 serial;
+    guint i;
+
+    if (!uring->registered || !pool)
+        return -1;
+
+    serial = download_buffer_pool_get_serial (pool, buffer);
+
+    if (serial == 0)
+        return -1;
+
+    for (i = 0; i < DOWNLOAD_URING_N_BUFFERS; i++)
+    {
+        registered = &uring->buffers[i];
+
+        if (registered->address == buffer && registered->size >= size &&
+            registered->pool == pool && registered->serial == serial)
+            return i;
+    }
+
+    i = uring->next_buffer;
+    uring->next_buffer = (uring->next_buffer + 1) % DOWNLOAD_URING_N_BUFFERS;
+
+    iov.iov_base = (gpointer) buffer;
+    iov.iov_len = size;
+
+    // Writes in flight keep the buffer they were submitted with
+    if (io_uring_register_buffers_update_tag (&uring->ring, i, &iov, NULL, 1) != 1)
+    {
+        uring->buffers[i].address = NULL;
+        return -1;
+    }
+
+    registered = &uring->buffers[i];
+    registered->address = buffer;
+    registered->size = size;
+    registered->pool = pool;
+    registered->serial = serial;
+
+    return i;
+}
+
+/**
+ * download_uring_prepare:
+ * @source: a #DownloadUring
+ * @timeout: (out): return location for the poll timeout
+ *
+ * Submits the writes queued since the last iteration of the context in
+ * one system call.
+ *
+ * Returns: %TRUE if completions wait to be reaped
+ */
+static gboolean
+download_uring_prepare (GSource *source,
+                        gint    *timeout)
+{
+    DownloadUring *uring = (DownloadUring *) source;
+
+    *timeout = -1;
+
+    if (uring->n_unsubmitted > 0)
+    {
+        io_uring_submit (&uring->ring);
+        uring->n_unsubmitted = 0;
+    }
+
+    return io_uring_cq_ready (&uring->ring) > 0;
+}
+
+/**
+ * download_uring_check:
+ * @source: a #DownloadUring
+ *
+ * Checks for completions after the poll.
+ *
+ * Returns: %TRUE if completions wait to be reaped
+ */
+static gboolean
+download_uring_check (GSource *source)
+{
+    DownloadUring *uring = (DownloadUring *) source;
+
+    return io_uring_cq_ready (&uring->ring) > 0;
+}
+
+/**
+ * download_uring_dispatch:
+ * @source: a #DownloadUring
+ * @callback: unused
+ * @user_data: unused
+ *
+ * Reaps the completions, the writes they finish return to their callback
+ * right away.
+ *
+ * Returns: %G_SOURCE_CONTINUE
+ */
+static gboolean
+download_uring_dispatch (GSource     *source,
+                         GSourceFunc  callback,
+                         gpointer     user_data)
+{
+    DownloadUring *uring = (DownloadUring *) source;
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe (&uring->ring, &cqe) == 0)
+    {
+        guintptr data = (guintptr) io_uring_cqe_get_data (cqe);
+        gint res = cqe->res;
+
+        io_uring_cqe_seen (&uring->ring, cqe);
+
+        download_uring_complete (uring, G_TASK ((gpointer) (data & ~(guintptr) 1)), res, data & 1);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * download_uring_finalize:
+ * @source: a #DownloadUring
+ *
+ * Tears the ring down once no download uses it, after the context let go
+ * of the source.
+ */
+static void
+download_uring_finalize (GSource *source)
+{
+    DownloadUring *uring = (DownloadUring *) source;
+
+    if (!uring->context)
+        return;
+
+    io_uring_queue_exit (&uring->ring);
+    g_main_context_unref (uring->context);
+}
+
+static GSourceFuncs download_uring_funcs = {
+    download_uring_prepare,
+    download_uring_check,
+    download_uring_dispatch,
+    download_uring_finalize,
+    NULL,
+    NULL
+};
+
+/**
+ * download_uring_new:
+ * @context: a #GMainContext
+ *
+ * Sets up a ring with %DOWNLOAD_URING_ENTRIES entries and sparse buffer
+ * registration, and attaches it to @context.
+ *
+ * Returns: (transfer full) (nullable): a #DownloadUring, or %NULL where
+ *          io_uring is not available
+ */
+static DownloadUring *
+download_uring_new (GMainContext *context)
+{
+    DownloadUring *uring;
+    gint ret;
+
+    uring = (DownloadUring *) g_source_new (&download_uring_funcs, sizeof (DownloadUring));
+
+    ret = io_uring_queue_init (DOWNLOAD_URING_ENTRIES, &uring->ring, 0);
+
+    if (ret < 0)
+    {
+        g_debug ("io_uring is not available, writing through GIO: %s", g_strerror (-ret));
+
+        // Without a context the finalize function knows there is no ring
+        g_source_unref ((GSource *) uring);
+
+        return NULL;
+    }
+
+    // Sparse registration needs Linux 5.19, writes are not registered before
+    uring->registered = io_uring_register_buffers_sparse (&uring->ring, DOWNLOAD_URING_N_BUFFERS) == 0;
+    uring->context = g_main_context_ref (context);
+
+    g_source_set_name ((GSource *) uring, "DownloadUring");
+    g_source_add_unix_fd ((GSource *) uring, uring->ring.ring_fd, G_IO_IN);
+    g_source_attach ((GSource *) uring, context);
+
+    return uring;
+}
+
+/**
+ * download_uring_get:
+ * @context: the #GMainContext downloads run on
+ *
+ * Gets the ring of @context, setting one up for the first user. It is
+ * only written to from @context, and kept until every user called
+ * download_uring_release().
+ *
+ * Returns: (transfer full) (nullable): the #DownloadUring of @context, or
+ *          %NULL when writes have to go through GIO
+ */
+DownloadUring *
+download_uring_get (GMainContext *context)
+{
+    g_return_val_if_fail (context != NULL, NULL);
+
+    DownloadUring *uring = NULL;
+    gint64 now = g_get_monotonic_time ();
+
+    G_LOCK (download_urings);
+
+    if (download_uring_failed_time == 0 ||
+        now - download_uring_failed_time >= DOWNLOAD_URING_RETRY_INTERVAL * G_USEC_PER_SEC)
+    {
+        if (!download_urings)
+            download_urings = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        uring = g_hash_table_lookup (download_urings, context);
+
+        if (!uring)
+            uring = download_uring_new (context);
+
+        if (uring)
+        {
+            g_hash_table_insert (download_urings, context, uring);
+            uring->n_users++;
+        }
+        else
+        {
+            download_uring_failed_time = now;
+        }
+    }
+
+    G_UNLOCK (download_urings);
+
+    return uring;
+}
+
+/**
+ * download_uring_release:
+ * @uring: a #DownloadUring from download_uring_get()
+ *
+ * Drops a use of @uring, destroying it with the last one.
+ */
+void
+download_uring_release (DownloadUring *uring)
+{
+    g_return_if_fail (uring != NULL);
+    g_return_if_fail (uring->n_users > 0);
+
+    G_LOCK (download_urings);
+
+    if (--uring->n_users == 0)
+    {
+        g_hash_table_remove (download_urings, uring->context);
+
+        g_source_destroy ((GSource *) uring);
+        g_source_unref ((GSource *) uring);
+    }
+
+    G_UNLOCK (download_urings);
+}
+
+/**
+ * download_uring_write_async:
+ * @uring: the #DownloadUring of the thread-default #GMainContext
+ * @output: the #GOutputStream @fd belongs to, the source object of the
+ *          result
+ * @fd: the file descriptor to write to
+ * @pool: (nullable): the #DownloadBufferPool @buffer comes from, to write
+ *        from a registered buffer
+ * @buffer: the bytes to write
+ * @size: the size @buffer was allocated with
+ * @length: the number of bytes to write
+ * @offset: where to write them
+ * @sync: whether to fdatasync() the file once written
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback to call once all of @buffer is written
+ * @user_data: data to pass to @callback
+ *
+ * Queues a write of all of @buffer at @offset, which leaves the position of
+ * @output alone. Short writes are submitted again for the rest.
+ */
+void
+download_uring_write_async (DownloadUring       *uring,
+                            GOutputStream       *output,
+                            gint                 fd,
+                            DownloadBufferPool  *pool,
+                            gconstpointer        buffer,
+                            gsize                size,
+                            gsize                length,
+                            goffset              offset,
+                            gboolean             sync,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+    g_return_if_fail (uring != NULL);
+    g_return_if_fail (fd >= 0);
+
+    DownloadUringWrite *write;
+    GTask *task;
+
+    write = g_slice_new0 (DownloadUringWrite);
+    write->fd = fd;
+    write->buffer = buffer;
+    write->length = length;
+    write->offset = offset;
+    write->sync = sync;
+    write->buffer_index = download_uring_find_buffer (uring, pool, buffer, size);
+
+    task = g_task_new (output, cancellable, callback, user_data);
+    g_task_set_source_tag (task, download_uring_write_async);
+    g_task_set_task_data (task, write, download_uring_write_free);
+
+    // The ring holds the task until its last completion
+    download_uring_submit_write (uring, task);
+}
+
+#else
+
+/**
+ * download_uring_get:
+ * @context: the #GMainContext downloads run on
+ *
+ * Gets the ring of @context, which this build has none of.
+ *
+ * Returns: %NULL, writes go through GIO
+ */
+DownloadUring *
+download_uring_get (GMainContext *context)
+{
+    return NULL;
+}
+
+/**
+ * download_uring_release:
+ * @uring: a #DownloadUring
+ *
+ * Never called, download_uring_get() gives no ring.
+ */
+void
+download_uring_release (DownloadUring *uring)
+{
+    g_return_if_reached ();
+}
+
+/**
+ * download_uring_write_async:
+ * @uring: a #DownloadUring
+ * @output: the #GOutputStream @fd belongs to
+ * @fd: the file descriptor to write to
+ * @pool: (nullable): the #DownloadBufferPool @buffer comes from
+ * @buffer: the bytes to write
+ * @size: the size @buffer was allocated with
+ * @length: the number of bytes to write
+ * @offset: where to write them
+ * @sync: whether to fdatasync() the file once written
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: a #GAsyncReadyCallback
+ * @user_data: data to pass to @callback
+ *
+ * Fails with %G_IO_ERROR_NOT_SUPPORTED, the build has no liburing.
+ */
+void
+download_uring_write_async (DownloadUring       *uring,
+                            GOutputStream       *output,
+                            gint                 fd,
+                            DownloadBufferPool  *pool,
+                            gconstpointer        buffer,
+                            gsize                size,
+                            gsize                length,
+                            goffset              offset,
+                            gboolean             sync,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+    g_task_report_new_error (output,
+                             callback,
+                             user_data,
+                             download_uring_write_async,
+                             G_IO_ERROR,
+                             G_IO_ERROR_NOT_SUPPORTED,
+                             "Built without io_uring support");
+}
+
+#endif
+
+/**
+ * download_uring_write_finish:
+ * @result: the #GAsyncResult passed to the download_uring_write_async()
+ *          callback
+ * @bytes_written: (out) (optional): return location for the number of
+ *                 bytes written
+ * @error: return location for a #GError, or %NULL
+ *
+ * Finishes a write through io_uring.
+ *
+ * Returns: %TRUE if all the bytes were written, and synced when asked to
+ */
+gboolean
+download_uring_write_finish (GAsyncResult  *result,
+                             gsize         *bytes_written,
+                             GError       **error)
+{
+    g_return_val_if_fail (G_IS_TASK (result), FALSE);
+
+    gssize n_written = g_task_propagate_int (G_TASK (result), error);
+
+    if (bytes_written)
+        *bytes_written = MAX (n_written, 0);
+
+    return n_written >= 0;
+}
@@ -0,0 +1,47 @@
+#ifndef DOWNLOAD_URING_H
+#define DOWNLOAD_URING_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "download-buffer-pool.h"
+
+G_BEGIN_DECLS
+
+// Submission queue entries of a ring, and buffers it keeps registered
+#define DOWNLOAD_URING_ENTRIES   256
+#define DOWNLOAD_URING_N_BUFFERS 64
+
+// Seconds after a ring failed to set up before another is tried
+#define DOWNLOAD_URING_RETRY_INTERVAL 60
+
+typedef struct _DownloadUring DownloadUring;
+
+DownloadUring *
+download_uring_get (GMainContext *context);
+
+void
+download_uring_release (DownloadUring *uring);
+
+void
+download_uring_write_async (DownloadUring       *uring,
+                            GOutputStream       *output,
+                            gint                 fd,
+                            DownloadBufferPool  *pool,
+                            gconstpointer        buffer,
+                            gsize                size,
+                            gsize                length,
+                            goffset              offset,
+                            gboolean             sync,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data);
+
+gboolean
+download_uring_write_finish (GAsyncResult  *result,
+                             gsize         *bytes_written,
+                             GError       **error);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_URING_H */
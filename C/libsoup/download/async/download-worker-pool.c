@@ -0,0 +1,367 @@
+#define G_LOG_DOMAIN "download-async"
+
+#include "download-worker-pool.h"
+#include "download-manager.h"
+#include "download-private.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/**
+ * SECTION:download-worker-pool
+ * @title: Download Worker Pool
+ * @short_description: Threads that each run downloads on their own context
+ * @include: download-worker-pool.h
+ * @see_also: #DownloadManager, #GMainContext
+ *
+ * Without a #DownloadWorkerPool every download runs on the thread-default
+ * #GMainContext of its caller, so one core does the TLS decryption, the
+ * copies and the writes of all of them. A pool starts a number of worker
+ * threads, each with its own #GMainContext and its own #DownloadManager, and
+ * so its own #SoupSession and connections.
+ *
+ * download_start() hands a download with #DownloadOptions.workers set to the
+ * worker running the fewest downloads, taking turns between workers that
+ * run as many. The download then runs entirely on that worker, while the
+ * progress handler and the #GAsyncReadyCallback are still invoked on the
+ * context of the caller. The chunk handler of a download to
+ * %DOWNLOAD_TARGET_CHUNKS is the exception, it is called on the worker so
+ * that chunks are not held up by the caller.
+ *
+ * The connection limits of the pool are divided between its workers, every
+ * worker admits at least one download at a time and one per host.
+ **/
+
+struct _DownloadWorker {
+    GThread *thread;
+    GMainContext *context;
+    DownloadManager *manager;
+
+    gint quit;
+
+    // Downloads given to the worker that have not completed yet
+    guint n_downloads;
+};
+
+struct _DownloadWorkerPool {
+    gint ref_count;
+    GMutex mutex;
+
+    GPtrArray *workers;
+
+    // Worker to look at first next time, so equally loaded workers take turns
+    guint next;
+};
+
+/**
+ * download_worker_free:
+ * @worker: a #DownloadWorker whose thread ended
+ *
+ * Frees a #DownloadWorker struct, aborting whatever its session still has
+ * going on.
+ */
+static void
+download_worker_free (DownloadWorker *worker)
+{
+    download_manager_unref (worker->manager);
+    g_main_context_unref (worker->context);
+
+    g_slice_free (DownloadWorker, worker);
+}
+
+/**
+ * download_worker_thread:
+ * @user_data: a #DownloadWorker
+ *
+ * Runs the #GMainContext of a worker until the pool asks it to quit, then
+ * frees the worker from its own thread.
+ *
+ * Returns: %NULL
+ */
+static gpointer
+download_worker_thread (gpointer user_data)
+{
+    DownloadWorker *worker = user_data;
+
+    g_main_context_push_thread_default (worker->context);
+
+    while (!g_atomic_int_get (&worker->quit))
+        g_main_context_iteration (worker->context, TRUE);
+
+    g_main_context_pop_thread_default (worker->context);
+
+    download_worker_free (worker);
+
+    return NULL;
+}
+
+/**
+ * download_worker_pool_free:
+ * @pool: a #DownloadWorkerPool
+ *
+ * Stops the workers of @pool and frees it. Every download holds a reference
+ * to its pool, so the workers have nothing left to run. The last reference
+ * may be dropped on a worker, which is then left to end on its own.
+ */
+static void
+download_worker_pool_free (DownloadWorkerPool *pool)
+{
+    guint i;
+
+    for (i = 0; i < pool->workers->len; i++)
+    {
+        DownloadWorker *worker = g_ptr_array_index (pool->workers, i);
+        GThread *thread = worker->thread;
+        GMainContext *context = g_main_context_ref (worker->context);
+
+        // The worker frees itself once it sees quit, possibly before the
+        // wakeup
+        g_atomic_int_set (&worker->quit, TRUE);
+        g_main_context_wakeup (context);
+        g_main_context_unref (context);
+
+        if (thread == g_thread_self ())
+            g_thread_unref (thread);
+        else
+            g_thread_join (thread);
+    }
+
+    g_ptr_array_unref (pool->workers);
+    g_mutex_clear (&pool->mutex);
+
+    g_slice_free (DownloadWorkerPool, pool);
+}
+
+/**
+ * download_worker_pool_new:
+ * @n_workers: the number of worker threads, 0 for one per processor
+ * @max_connections: the most downloads running at once over all workers, 0
+ *                   for the default of #DownloadManager
+ * @max_connections_per_host: the most downloads running at once against a
+ *                            single host over all workers, 0 for the default
+ *                            of #DownloadManager
+ *
+ * Creates a #DownloadWorkerPool and starts its threads.
+ *
+ * Returns: (transfer full): a new #DownloadWorkerPool, free with
+ *          download_worker_pool_unref()
+ */
+DownloadWorkerPool *
+download_worker_pool_new (guint n_workers,
+                          guint max_connections,
+                          guint max_connections_per_host)
+{
+    DownloadWorkerPool *pool;
+    guint i;
+
+    if (n_workers == 0)
+        n_workers = g_get_num_processors ();
+
+    if (max_connections == 0)
+        max_connections = DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS;
+
+    if (max_connections_per_host == 0)
+        max_connections_per_host = DOWNLOAD_MANAGER_DEFAULT_MAX_CONNECTIONS_PER_HOST;
+
+    pool = g_slice_new0 (DownloadWorkerPool);
+    pool->ref_count = 1;
+    g_mutex_init (&pool->mutex);
+
+    pool->workers = g_ptr_array_sized_new (n_workers);
+
+    for (i = 0; i < n_workers; i++)
+    {
+        DownloadWorker *worker;
+        gchar *name;
+
+        worker = g_slice_new0 (DownloadWorker);
+        worker->context = g_main_context_new ();
+        worker->manager = download_manager_new (MAX (max_connections / n_workers, 1),
+                                                MAX (max_connections_per_host / n_workers, 1));
+
+        name = g_strdup_printf ("download-worker-%u", i);
+        worker->thread = g_thread_new (name, download_worker_thread, worker);
+        g_free (name);
+
+        g_ptr_array_add (pool->workers, worker);
+    }
+
+    g_debug ("Downloader: started %u workers", n_workers);
+
+    return pool;
+}
+
+/**
+ * download_worker_pool_ref:
+ * @pool: a #DownloadWorkerPool
+ *
+ * Increases the reference count of @pool.
+ *
+ * Returns: (transfer full): @pool
+ */
+DownloadWorkerPool *
+download_worker_pool_ref (DownloadWorkerPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+    g_return_val_if_fail (pool->ref_count > 0, NULL);
+
+    g_atomic_int_inc (&pool->ref_count);
+
+    return pool;
+}
+
+/**
+ * download_worker_pool_unref:
+ * @pool: a #DownloadWorkerPool
+ *
+ * Decreases the reference count of @pool, stopping its threads and freeing
+ * it when the count drops to zero. Every download holds a reference to its
+ * pool.
+ */
+void
+download_worker_pool_unref (DownloadWorkerPool *pool)
+{
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (pool->ref_count > 0);
+
+    if (g_atomic_int_dec_and_test (&pool->ref_count))
+        download_worker_pool_free (pool);
+}
+
+/**
+ * download_worker_pool_get_n_workers:
+ * @pool: a #DownloadWorkerPool
+ *
+ * Gets how many worker threads @pool runs.
+ *
+ * Returns: the number of workers
+ */
+guint
+download_worker_pool_get_n_workers (DownloadWorkerPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    return pool->workers->len;
+}
+
+/**
+ * download_worker_pool_get_n_downloads:
+ * @pool: a #DownloadWorkerPool
+ *
+ * Gets how many downloads the workers of @pool run or queue together.
+ *
+ * Returns: the number of downloads not completed yet
+ */
+guint
+download_worker_pool_get_n_downloads (DownloadWorkerPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, 0);
+
+    guint n_downloads = 0;
+    guint i;
+
+    g_mutex_lock (&pool->mutex);
+
+    for (i = 0; i < pool->workers->len; i++)
+    {
+        DownloadWorker *worker = g_ptr_array_index (pool->workers, i);
+
+        n_downloads += worker->n_downloads;
+    }
+
+    g_mutex_unlock (&pool->mutex);
+
+    return n_downloads;
+}
+
+/**
+ * download_worker_pool_assign:
+ * @pool: a #DownloadWorkerPool
+ *
+ * Picks the worker of @pool running the fewest downloads for a new one and
+ * counts it there until download_worker_pool_release().
+ *
+ * Returns: (transfer none): a #DownloadWorker of @pool, valid as long as
+ *          @pool is
+ */
+DownloadWorker *
+download_worker_pool_assign (DownloadWorkerPool *pool)
+{
+    g_return_val_if_fail (pool != NULL, NULL);
+
+    DownloadWorker *best = NULL;
+    guint best_index = 0;
+    guint i;
+
+    g_mutex_lock (&pool->mutex);
+
+    for (i = 0; i < pool->workers->len; i++)
+    {
+        guint index = (pool->next + i) % pool->workers->len;
+        DownloadWorker *worker = g_ptr_array_index (pool->workers, index);
+
+        if (!best || worker->n_downloads < best->n_downloads)
+        {
+            best = worker;
+            best_index = index;
+        }
+    }
+
+    best->n_downloads++;
+    pool->next = (best_index + 1) % pool->workers->len;
+
+    g_mutex_unlock (&pool->mutex);
+
+    return best;
+}
+
+/**
+ * download_worker_pool_release:
+ * @pool: a #DownloadWorkerPool
+ * @worker: a #DownloadWorker returned by download_worker_pool_assign()
+ *
+ * Stops counting a completed download against @worker.
+ */
+void
+download_worker_pool_release (DownloadWorkerPool *pool,
+                              DownloadWorker     *worker)
+{
+    g_return_if_fail (pool != NULL);
+    g_return_if_fail (worker != NULL && worker->n_downloads > 0);
+
+    g_mutex_lock (&pool->mutex);
+    worker->n_downloads--;
+    g_mutex_unlock (&pool->mutex);
+}
+
+/**
+ * download_worker_get_context:
+ * @worker: a #DownloadWorker
+ *
+ * Gets the #GMainContext the thread of @worker runs.
+ *
+ * Returns: (transfer none): a #GMainContext
+ */
+GMainContext *
+download_worker_get_context (DownloadWorker *worker)
+{
+    g_return_val_if_fail (worker != NULL, NULL);
+
+    return worker->context;
+}
+
+/**
+ * download_worker_get_manager:
+ * @worker: a #DownloadWorker
+ *
+ * Gets the #DownloadManager, and so the #SoupSession, of @worker.
+ *
+ * Returns: (transfer none): a #DownloadManager
+ */
+DownloadManager *
+download_worker_get_manager (DownloadWorker *worker)
+{
+    g_return_val_if_fail (worker != NULL, NULL);
+
+    return worker->manager;
+}
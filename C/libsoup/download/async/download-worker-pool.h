@@ -0,0 +1,31 @@
+#ifndef DOWNLOAD_WORKER_POOL_H
+#define DOWNLOAD_WORKER_POOL_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _DownloadWorkerPool DownloadWorkerPool;
+typedef struct _DownloadWorker DownloadWorker;
+
+DownloadWorkerPool *
+download_worker_pool_new (guint n_workers,
+                          guint max_connections,
+                          guint max_connections_per_host);
+
+DownloadWorkerPool *
+download_worker_pool_ref (DownloadWorkerPool *pool);
+
+void
+download_worker_pool_unref (DownloadWorkerPool *pool);
+
+guint
+download_worker_pool_get_n_workers (DownloadWorkerPool *pool);
+
+guint
+download_worker_pool_get_n_downloads (DownloadWorkerPool *pool);
+
+G_END_DECLS
+
+#endif /* DOWNLOAD_WORKER_POOL_H */
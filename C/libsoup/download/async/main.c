@@ -1,63 +1,615 @@
 #include "download-async.h"
+#include "download-manager.h"
 
 #include <glib.h>
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#ifdef G_OS_UNIX
+#include <glib-unix.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Downloads the URIs given as arguments and the ones listed in a manifest,
+ * at most --jobs of them at a time, then exits with:
+ *
+ *   0 when every download succeeded or was skipped
+ *   1 when at least one failed
+ *   2 when the command line or the manifest is wrong
+ *   130 when interrupted, downloads in flight are cancelled first
+ *
+ * A manifest, read from a file or from stdin with "-", has one download per
+ * line: "uri [path] [sha256]". Blank lines and lines starting with # are
+ * skipped. A path of "-" or no path at all saves into --output-dir, or
+ * ~/Downloads, under the basename of the URI. A second field of 64
+ * hexadecimal digits is taken as the SHA-256 rather than a path, use
+ * "./name" for a file named like a digest.
+ */
+
+#define EXIT_USAGE       2
+#define EXIT_INTERRUPTED 130
+
+#define DEFAULT_JOBS 4
+
+typedef struct _Entry {
+    gchar *uri;
+    gchar *path;
+    gchar *sha256;
+    guint line;
+
+    guint64 downloaded_bytes;
+    guint64 total_bytes;
+} Entry;
+
+typedef struct _Batch {
+    GPtrArray *entries;
+    guint next;
+    guint n_running;
+    guint n_succeeded;
+    guint n_failed;
+    guint n_skipped;
+
+    DownloadManager *manager;
+    GCancellable *cancellable;
+    GMainLoop *loop;
+    gboolean interrupted;
+
+    gint64 start_time;
+    gboolean tty;
+} Batch;
+
+static gchar *manifest_option = NULL;
+static gint jobs_option = DEFAULT_JOBS;
+static gchar *output_dir_option = NULL;
+static gboolean no_overwrite_option = FALSE;
+static gboolean resume_option = FALSE;
+static gint segments_option = 1;
+static gboolean decompress_option = FALSE;
+static gboolean quiet_option = FALSE;
+static gchar *durability_option = NULL;
+static DownloadDurability durability = DOWNLOAD_DURABILITY_NONE;
+
+static GOptionEntry option_entries[] = {
+    { "manifest", 'i', 0, G_OPTION_ARG_FILENAME, &manifest_option, "Read \"uri [path] [sha256]\" lines from FILE, - for stdin", "FILE" },
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs_option, "Run at most N downloads at a time (default 4)", "N" },
+    { "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir_option, "Save downloads without a path into DIR", "DIR" },
+    { "no-overwrite", 'n', 0, G_OPTION_ARG_NONE, &no_overwrite_option, "Skip downloads whose file exists", NULL },
+    { "resume", 'r', 0, G_OPTION_ARG_NONE, &resume_option, "Keep partial downloads and resume them", NULL },
+    { "segments", 's', 0, G_OPTION_ARG_INT, &segments_option, "Fetch each file as up to N ranges", "N" },
+    { "decompress", 'z', 0, G_OPTION_ARG_NONE, &decompress_option, "Ask for compressed bodies and save .gz/.zst files decompressed", NULL },
+    { "durability", 0, 0, G_OPTION_ARG_STRING, &durability_option, "Flush files before publishing them: none (default), fsync or group", "POLICY" },
+    { "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet_option, "Print failures only", NULL },
+    { NULL }
+};
+
+/**
+ * entry_free:
+ * @user_data: an #Entry
+ *
+ * Frees an #Entry struct.
+ */
 static void
-progress (guint64   downloaded_bytes,
-          guint64   total_bytes,
-          gpointer  user_data)
+entry_free (gpointer user_data)
+{
+    Entry *entry = user_data;
+
+    g_free (entry->uri);
+    g_free (entry->path);
+    g_free (entry->sha256);
+
+    g_slice_free (Entry, entry);
+}
+
+/**
+ * is_sha256:
+ * @string: a manifest field
+ *
+ * Checks whether @string looks like a SHA-256 digest.
+ *
+ * Returns: %TRUE if @string is 64 hexadecimal digits
+ */
+static gboolean
+is_sha256 (const gchar *string)
 {
-    // This could be outputted into a GUI application or file, callback makes
-    // it easy to work with progress
-    g_print ("[ %06.2f%% ] %lu / %lu\n", (gfloat) (((gfloat) downloaded_bytes / (gfloat) total_bytes) * 100), downloaded_bytes, total_bytes);
+    guint i;
+
+    for (i = 0; string[i]; i++)
+    {
+        if (!g_ascii_isxdigit (string[i]))
+            return FALSE;
+    }
+
+    return i == 64;
 }
 
+/**
+ * entry_new:
+ * @uri: the uri to download
+ * @path: (nullable): where to save it, see download_start()
+ * @sha256: (nullable): the expected SHA-256 of the file
+ * @line: the manifest line, 0 for command line arguments
+ *
+ * Creates an #Entry, with the paths of --output-dir applied.
+ *
+ * Returns: (transfer full): a new #Entry
+ */
+static Entry *
+entry_new (const gchar *uri,
+           const gchar *path,
+           const gchar *sha256,
+           guint        line)
+{
+    Entry *entry = g_slice_new0 (Entry);
+
+    entry->uri = g_strdup (uri);
+    entry->sha256 = g_ascii_strdown (sha256 ? sha256 : "", -1);
+    entry->line = line;
+
+    if (*entry->sha256 == '\0')
+        g_clear_pointer (&entry->sha256, g_free);
+
+    if (path && g_strcmp0 (path, "-") != 0)
+        entry->path = g_strdup (path);
+    else if (output_dir_option && g_str_has_suffix (output_dir_option, "/"))
+        entry->path = g_strdup (output_dir_option);
+    else if (output_dir_option)
+        entry->path = g_strconcat (output_dir_option, "/", NULL);
+
+    return entry;
+}
+
+/**
+ * read_manifest:
+ * @name: a file name, or "-" for stdin
+ * @error: return location for a #GError, or %NULL
+ *
+ * Reads the whole manifest.
+ *
+ * Returns: (transfer full) (nullable): the manifest text, or %NULL with
+ *          @error set
+ */
+static gchar *
+read_manifest (const gchar  *name,
+               GError      **error)
+{
+    GString *contents;
+    gchar buffer[4096];
+    gsize length;
+    gchar *text;
+
+    if (g_strcmp0 (name, "-") != 0)
+        return g_file_get_contents (name, &text, NULL, error) ? text : NULL;
+
+    contents = g_string_new (NULL);
+
+    while ((length = fread (buffer, 1, sizeof (buffer), stdin)) > 0)
+        g_string_append_len (contents, buffer, length);
+
+    if (ferror (stdin))
+    {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Could not read stdin");
+        g_string_free (contents, TRUE);
+
+        return NULL;
+    }
+
+    return g_string_free (contents, FALSE);
+}
+
+/**
+ * parse_manifest:
+ * @text: the manifest text
+ * @entries: a #GPtrArray to add an #Entry to per download
+ * @error: return location for a #GError, or %NULL
+ *
+ * Parses the lines of a manifest, see the top of this file.
+ *
+ * Returns: %TRUE if every line made sense, %FALSE with @error set
+ *          otherwise
+ */
+static gboolean
+parse_manifest (const gchar  *text,
+                GPtrArray    *entries,
+                GError      **error)
+{
+    gchar **lines;
+    gboolean ok = TRUE;
+    guint i;
+
+    lines = g_strsplit (text, "\n", -1);
+
+    for (i = 0; ok && lines[i]; i++)
+    {
+        gchar **fields;
+        const gchar *path = NULL;
+        const gchar *sha256 = NULL;
+        guint n_fields;
+
+        g_strstrip (lines[i]);
+
+        if (*lines[i] == '\0' || *lines[i] == '#')
+            continue;
+
+        // Runs of blanks separate fields
+        fields = g_regex_split_simple ("[ \t]+", lines[i], 0, 0);
+        n_fields = g_strv_length (fields);
+
+        if (n_fields == 2 && is_sha256 (fields[1]))
+        {
+            sha256 = fields[1];
+        }
+        else
+        {
+            path = n_fields > 1 ? fields[1] : NULL;
+            sha256 = n_fields > 2 ? fields[2] : NULL;
+        }
+
+        if (n_fields > 3 || (sha256 && !is_sha256 (sha256)))
+        {
+            g_set_error (error,
+                         G_IO_ERROR,
+                         G_IO_ERROR_INVALID_DATA,
+                         "Line %u: expected \"uri [path] [sha256]\"",
+                         i + 1);
+            ok = FALSE;
+        }
+        else
+        {
+            g_ptr_array_add (entries, entry_new (fields[0], path, sha256, i + 1));
+        }
+
+        g_strfreev (fields);
+    }
+
+    g_strfreev (lines);
+
+    return ok;
+}
+
+/**
+ * format_size:
+ * @bytes: a number of bytes
+ *
+ * Formats @bytes for the progress line.
+ *
+ * Returns: (transfer full): a human readable size
+ */
+static gchar *
+format_size (guint64 bytes)
+{
+    return g_format_size_full (bytes, G_FORMAT_SIZE_IEC_UNITS);
+}
+
+/**
+ * batch_print_progress:
+ * @batch: a #Batch
+ * @final: %TRUE for the summary line printed before exiting
+ *
+ * Prints one line about all the downloads of @batch: how many are done,
+ * the bytes received and the average rate. On a terminal the line is
+ * redrawn in place.
+ */
 static void
-callback (gpointer user_data)
+batch_print_progress (Batch    *batch,
+                      gboolean  final)
 {
-    g_print ("Operation finsihed");
+    guint64 downloaded_bytes = 0;
+    guint64 total_bytes = 0;
+    gdouble seconds;
+    gchar *downloaded;
+    gchar *total;
+    gchar *rate;
+    guint i;
+
+    if (quiet_option)
+        return;
+
+    for (i = 0; i < batch->entries->len; i++)
+    {
+        Entry *entry = g_ptr_array_index (batch->entries, i);
+
+        downloaded_bytes += entry->downloaded_bytes;
+        total_bytes += MAX (entry->total_bytes, entry->downloaded_bytes);
+    }
+
+    seconds = MAX ((g_get_monotonic_time () - batch->start_time) / (gdouble) G_USEC_PER_SEC, 0.001);
+
+    downloaded = format_size (downloaded_bytes);
+    total = format_size (total_bytes);
+    rate = format_size ((guint64) (downloaded_bytes / seconds));
+
+    g_printerr ("%s[ %u / %u ] %s / %s, %s/s, %u running, %u failed, %u skipped%s",
+                batch->tty ? "\r\033[K" : "",
+                batch->n_succeeded + batch->n_failed + batch->n_skipped,
+                batch->entries->len,
+                downloaded,
+                total,
+                rate,
+                batch->n_running,
+                batch->n_failed,
+                batch->n_skipped,
+                batch->tty && !final ? "" : "\n");
+
+    g_free (downloaded);
+    g_free (total);
+    g_free (rate);
 }
 
+/**
+ * batch_progress_cb:
+ * @user_data: a #Batch
+ *
+ * Prints the progress line once per second.
+ *
+ * Returns: %G_SOURCE_CONTINUE
+ */
+static gboolean
+batch_progress_cb (gpointer user_data)
+{
+    batch_print_progress (user_data, FALSE);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * entry_progress:
+ * @downloaded_bytes: the bytes an entry received so far
+ * @total_bytes: the length of the entry, 0 if unknown
+ * @user_data: an #Entry
+ *
+ * Keeps the figures of an entry for the progress line.
+ */
+static void
+entry_progress (guint64   downloaded_bytes,
+                guint64   total_bytes,
+                gpointer  user_data)
+{
+    Entry *entry = user_data;
+
+    entry->downloaded_bytes = downloaded_bytes;
+    entry->total_bytes = total_bytes;
+}
+
+typedef struct _Job {
+    Batch *batch;
+    Entry *entry;
+} Job;
+
 static void
-download (gchar *uri,
-          gchar *path)
+batch_start_next (Batch *batch);
+
+/**
+ * job_done_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #Job
+ *
+ * Counts a finished download and starts the next entry, or ends the batch
+ * once nothing runs any more.
+ */
+static void
+job_done_cb (GObject      *object,
+             GAsyncResult *result,
+             gpointer      user_data)
+{
+    Job *job = user_data;
+    Batch *batch = job->batch;
+    Entry *entry = job->entry;
+    GError *error = NULL;
+
+    batch->n_running--;
+
+    if (download_finish (result, &error))
+    {
+        batch->n_succeeded++;
+    }
+    else if (no_overwrite_option && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+    {
+        batch->n_skipped++;
+    }
+    else
+    {
+        batch->n_failed++;
+
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) || !batch->interrupted)
+        {
+            if (batch->tty && !quiet_option)
+                g_printerr ("\r\033[K");
+
+            if (entry->line > 0)
+                g_printerr ("%s (line %u): %s\n", entry->uri, entry->line, error->message);
+            else
+                g_printerr ("%s: %s\n", entry->uri, error->message);
+        }
+    }
+
+    g_clear_error (&error);
+    g_slice_free (Job, job);
+
+    batch_start_next (batch);
+
+    if (batch->n_running == 0)
+        g_main_loop_quit (batch->loop);
+}
+
+/**
+ * batch_start_next:
+ * @batch: a #Batch
+ *
+ * Starts entries until --jobs downloads run or none are left.
+ */
+static void
+batch_start_next (Batch *batch)
+{
+    DownloadOptions options;
+
+    download_options_init (&options);
+    options.manager = batch->manager;
+    options.overwrite = !no_overwrite_option;
+    options.resumable = resume_option;
+    options.durability = durability;
+    options.segments = MAX (segments_option, 1);
+    options.decode = decompress_option ? DOWNLOAD_DECODE_CONTENT | DOWNLOAD_DECODE_RESOURCE : DOWNLOAD_DECODE_NONE;
+    options.p_handler = entry_progress;
+
+    while (!batch->interrupted &&
+           batch->n_running < (guint) jobs_option &&
+           batch->next < batch->entries->len)
+    {
+        Job *job = g_slice_new0 (Job);
+
+        job->batch = batch;
+        job->entry = g_ptr_array_index (batch->entries, batch->next++);
+
+        options.p_user_data = job->entry;
+        options.expected_digest = job->entry->sha256;
+
+        batch->n_running++;
+
+        download_resource_data_unref (download_start (job->entry->uri,
+                                                      job->entry->path,
+                                                      &options,
+                                                      batch->cancellable,
+                                                      job_done_cb,
+                                                      job));
+    }
+}
+
+#ifdef G_OS_UNIX
+/**
+ * batch_interrupt_cb:
+ * @user_data: a #Batch
+ *
+ * Cancels the downloads in flight on SIGINT or SIGTERM and starts no more.
+ * The batch ends once every cancelled download reported back, so resumable
+ * downloads get to save their journal.
+ *
+ * Returns: %G_SOURCE_CONTINUE
+ */
+static gboolean
+batch_interrupt_cb (gpointer user_data)
 {
-    GCancellable *cancellable = g_cancellable_new ();
+    Batch *batch = user_data;
+
+    if (batch->interrupted)
+        return G_SOURCE_CONTINUE;
 
-    download_resource_from_uri_async_full (uri,
-                                           path,
-                                           TRUE,
-                                           cancellable,
-                                           progress,
-                                           NULL,
-                                           callback,
-                                           NULL);
+    batch->interrupted = TRUE;
+    g_cancellable_cancel (batch->cancellable);
+
+    return G_SOURCE_CONTINUE;
 }
+#endif
 
 int
 main (int    argc,
       char **argv)
 {
-    GMainLoop *loop = NULL;
-    gchar *uri;
+    GOptionContext *context;
+    GError *error = NULL;
+    Batch batch = { 0, };
+    gchar *text;
+    guint progress_id = 0;
+    gint status;
+    gint i;
 
-    loop = g_main_loop_new (NULL, FALSE);
-    uri = g_strdup (argv[1]);
+    context = g_option_context_new ("[URI...] - download files");
+    g_option_context_add_main_entries (context, option_entries, NULL);
+    g_option_context_set_description (context,
+                                      "A manifest has one \"uri [path] [sha256]\" line per download.\n"
+                                      "Exit status: 0 all downloads succeeded, 1 some failed,\n"
+                                      "2 usage or manifest error, 130 interrupted.\n");
 
-    // Example URL:
-    //uri = "https://download.fedoraproject.org/pub/fedora/linux/releases/27/Workstation/x86_64/iso/Fedora-Workstation-Live-x86_64-27-1.6.iso";
+    if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+        g_printerr ("%s\n", error->message);
+        return EXIT_USAGE;
+    }
+
+    g_option_context_free (context);
+
+    if (jobs_option < 1)
+    {
+        g_printerr ("--jobs needs at least 1\n");
+        return EXIT_USAGE;
+    }
 
-    if (!uri)
+    if (durability_option == NULL || g_strcmp0 (durability_option, "none") == 0)
+        durability = DOWNLOAD_DURABILITY_NONE;
+    else if (g_strcmp0 (durability_option, "fsync") == 0)
+        durability = DOWNLOAD_DURABILITY_FSYNC;
+    else if (g_strcmp0 (durability_option, "group") == 0)
+        durability = DOWNLOAD_DURABILITY_GROUP;
+    else
     {
-        g_print ("%s needs a uri passed as the first argument, kill with CTRL-C.\n", argv[0]);
-        return 0;
+        g_printerr ("--durability must be none, fsync or group\n");
+        return EXIT_USAGE;
     }
 
-    download (uri, NULL);
+    batch.entries = g_ptr_array_new_with_free_func (entry_free);
 
-	g_main_loop_run (loop);
-    g_main_loop_unref (loop);
+    for (i = 1; i < argc; i++)
+        g_ptr_array_add (batch.entries, entry_new (argv[i], NULL, NULL, 0));
 
-    return 0;
-}
+    if (manifest_option)
+    {
+        text = read_manifest (manifest_option, &error);
 
+        if (!text || !parse_manifest (text, batch.entries, &error))
+        {
+            g_printerr ("%s: %s\n", manifest_option, error->message);
+            return EXIT_USAGE;
+        }
+
+        g_free (text);
+    }
+
+    if (batch.entries->len == 0)
+    {
+        g_printerr ("%s needs URIs as arguments or a --manifest, see --help\n", argv[0]);
+        return EXIT_USAGE;
+    }
+
+    // The manager admits exactly the downloads the batch runs, so a batch of
+    // one host is not held back by the per host limit
+    batch.manager = download_manager_new (jobs_option, jobs_option);
+    batch.cancellable = g_cancellable_new ();
+    batch.loop = g_main_loop_new (NULL, FALSE);
+    batch.start_time = g_get_monotonic_time ();
+
+#ifdef G_OS_UNIX
+    batch.tty = isatty (fileno (stderr));
+
+    g_unix_signal_add (SIGINT, batch_interrupt_cb, &batch);
+    g_unix_signal_add (SIGTERM, batch_interrupt_cb, &batch);
+#endif
+
+    if (!quiet_option)
+        progress_id = g_timeout_add_seconds (1, batch_progress_cb, &batch);
+
+    batch_start_next (&batch);
+    g_main_loop_run (batch.loop);
+
+    if (progress_id)
+        g_source_remove (progress_id);
+
+    batch_print_progress (&batch, TRUE);
+
+    if (batch.interrupted)
+        status = EXIT_INTERRUPTED;
+    else if (batch.n_failed > 0)
+        status = EXIT_FAILURE;
+    else
+        status = EXIT_SUCCESS;
+
+    g_main_loop_unref (batch.loop);
+    g_object_unref (batch.cancellable);
+    download_manager_unref (batch.manager);
+    g_ptr_array_unref (batch.entries);
+
+    return status;
+}
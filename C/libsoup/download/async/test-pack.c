@@ -0,0 +1,368 @@
+#define G_LOG_DOMAIN "download-test"
+
+#include "download-pack.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Tests of what download_pack_open() recovers from a pack a crash left
+ * behind: bytes appended without a record, a torn last record and records
+ * pointing at bytes that never reached the disk.
+ */
+
+// Size of the magic and of a record of a one letter key in the index
+#define TEST_PACK_INDEX_HEADER_SIZE 8
+#define TEST_PACK_INDEX_RECORD_SIZE (4 + 8 + 8 + 4 + 1)
+
+typedef struct _TestPack {
+    gchar *directory;
+    gchar *path;
+    gchar *index_path;
+} TestPack;
+
+/**
+ * test_pack_setup:
+ * @fixture: a #TestPack
+ * @user_data: %NULL
+ *
+ * Makes a directory for the pack of a test.
+ */
+static void
+test_pack_setup (TestPack      *fixture,
+                 gconstpointer  user_data)
+{
+    GError *error = NULL;
+
+    fixture->directory = g_dir_make_tmp ("download-pack-XXXXXX", &error);
+    g_assert_no_error (error);
+
+    fixture->path = g_build_filename (fixture->directory, "objects.pack", NULL);
+    fixture->index_path = g_strconcat (fixture->path, ".idx", NULL);
+}
+
+/**
+ * test_pack_teardown:
+ * @fixture: a #TestPack
+ * @user_data: %NULL
+ *
+ * Removes the pack of a test and its directory.
+ */
+static void
+test_pack_teardown (TestPack      *fixture,
+                    gconstpointer  user_data)
+{
+    g_unlink (fixture->index_path);
+    g_unlink (fixture->path);
+    g_rmdir (fixture->directory);
+
+    g_free (fixture->index_path);
+    g_free (fixture->path);
+    g_free (fixture->directory);
+}
+
+/**
+ * test_pack_append_cb:
+ * @object: %NULL
+ * @result: a #GAsyncResult
+ * @user_data: a #GAsyncResult pointer to set
+ *
+ * Keeps the result of an append for test_pack_append().
+ */
+static void
+test_pack_append_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+    GAsyncResult **result_out = user_data;
+
+    *result_out = g_object_ref (result);
+}
+
+/**
+ * test_pack_append:
+ * @pack: a #DownloadPack
+ * @key: the key of the object
+ * @contents: the object
+ *
+ * Appends @contents to @pack and waits until it is recorded.
+ */
+static void
+test_pack_append (DownloadPack *pack,
+                  const gchar  *key,
+                  const gchar  *contents)
+{
+    GAsyncResult *result = NULL;
+    GBytes *bytes = g_bytes_new_static (contents, strlen (contents));
+    GError *error = NULL;
+
+    download_pack_append_async (pack, key, bytes, NULL, test_pack_append_cb, &result);
+
+    while (!result)
+        g_main_context_iteration (NULL, TRUE);
+
+    g_assert_true (download_pack_append_finish (result, &error));
+    g_assert_no_error (error);
+
+    g_object_unref (result);
+    g_bytes_unref (bytes);
+}
+
+/**
+ * test_pack_assert_object:
+ * @pack: a #DownloadPack
+ * @key: the key of an object
+ * @contents: what the object must hold
+ *
+ * Checks that @pack reads @contents back under @key.
+ */
+static void
+test_pack_assert_object (DownloadPack *pack,
+                         const gchar  *key,
+                         const gchar  *contents)
+{
+    GError *error = NULL;
+    GBytes *bytes;
+    gsize length;
+    const gchar *data;
+
+    bytes = download_pack_get (pack, key, &error);
+    g_assert_no_error (error);
+
+    data = g_bytes_get_data (bytes, &length);
+    g_assert_cmpmem (data, length, contents, strlen (contents));
+
+    g_bytes_unref (bytes);
+}
+
+/**
+ * test_pack_get_size:
+ * @path: a file
+ *
+ * Returns: the size of @path
+ */
+static goffset
+test_pack_get_size (const gchar *path)
+{
+    GStatBuf st;
+
+    g_assert_cmpint (g_stat (path, &st), ==, 0);
+
+    return st.st_size;
+}
+
+/**
+ * test_pack_write_at:
+ * @path: a file
+ * @offset: where to write, or -1 to append
+ * @contents: what to write
+ *
+ * Writes @contents into @path the way a crash may leave it.
+ */
+static void
+test_pack_write_at (const gchar *path,
+                    goffset      offset,
+                    const gchar *contents)
+{
+    gint fd = g_open (path, O_WRONLY | (offset < 0 ? O_APPEND : 0), 0);
+    gsize length = strlen (contents);
+
+    g_assert_cmpint (fd, >=, 0);
+
+    if (offset < 0)
+        g_assert_cmpint (write (fd, contents, length), ==, length);
+    else
+        g_assert_cmpint (pwrite (fd, contents, length, offset), ==, length);
+
+    close (fd);
+}
+
+/**
+ * test_pack_create:
+ * @fixture: a #TestPack
+ *
+ * Creates a pack holding "a" then "b" and closes it.
+ */
+static void
+test_pack_create (TestPack *fixture)
+{
+    GError *error = NULL;
+    DownloadPack *pack;
+
+    pack = download_pack_open (fixture->path, &error);
+    g_assert_no_error (error);
+
+    test_pack_append (pack, "a", "first object");
+    test_pack_append (pack, "b", "second object");
+
+    download_pack_unref (pack);
+}
+
+/**
+ * test_pack_reopen:
+ * @fixture: a #TestPack
+ * @n_objects: how many objects the pack must hold once opened
+ *
+ * Opens the pack of @fixture again.
+ *
+ * Returns: (transfer full): the #DownloadPack
+ */
+static DownloadPack *
+test_pack_reopen (TestPack *fixture,
+                  guint     n_objects)
+{
+    GError *error = NULL;
+    DownloadPack *pack;
+
+    pack = download_pack_open (fixture->path, &error);
+    g_assert_no_error (error);
+    g_assert_cmpuint (download_pack_get_n_objects (pack), ==, n_objects);
+
+    return pack;
+}
+
+/**
+ * test_pack_intact:
+ * @fixture: a #TestPack
+ * @user_data: %NULL
+ *
+ * A pack closed after its appends completed keeps all of them.
+ */
+static void
+test_pack_intact (TestPack      *fixture,
+                  gconstpointer  user_data)
+{
+    DownloadPack *pack;
+
+    test_pack_create (fixture);
+
+    pack = test_pack_reopen (fixture, 2);
+    test_pack_assert_object (pack, "a", "first object");
+    test_pack_assert_object (pack, "b", "second object");
+    download_pack_unref (pack);
+
+    g_assert_cmpint (test_pack_get_size (fixture->path), ==, strlen ("first object") + strlen ("second object"));
+    g_assert_cmpint (test_pack_get_size (fixture->index_path), ==, TEST_PACK_INDEX_HEADER_SIZE + 2 * TEST_PACK_INDEX_RECORD_SIZE);
+}
+
+/**
+ * test_pack_unrecorded_bytes:
+ * @fixture: a #TestPack
+ * @user_data: %NULL
+ *
+ * Bytes of an append whose record never made it are cut off the pack, and
+ * the next append goes where they were.
+ */
+static void
+test_pack_unrecorded_bytes (TestPack      *fixture,
+                            gconstpointer  user_data)
+{
+    DownloadPack *pack;
+
+    test_pack_create (fixture);
+    test_pack_write_at (fixture->path, -1, "lost object");
+
+    pack = test_pack_reopen (fixture, 2);
+    g_assert_cmpint (test_pack_get_size (fixture->path), ==, strlen ("first object") + strlen ("second object"));
+
+    test_pack_append (pack, "c", "third object");
+    download_pack_unref (pack);
+
+    pack = test_pack_reopen (fixture, 3);
+    test_pack_assert_object (pack, "c", "third object");
+    download_pack_unref (pack);
+}
+
+/**
+ * test_pack_torn_record:
+ * @fixture: a #TestPack
+ * @user_data: %NULL
+ *
+ * A record only partly written is cut off the index.
+ */
+static void
+test_pack_torn_record (TestPack      *fixture,
+                       gconstpointer  user_data)
+{
+    DownloadPack *pack;
+
+    test_pack_create (fixture);
+    test_pack_write_at (fixture->index_path, -1, "\x01\x01\x01");
+
+    pack = test_pack_reopen (fixture, 2);
+    test_pack_assert_object (pack, "b", "second object");
+    download_pack_unref (pack);
+
+    g_assert_cmpint (test_pack_get_size (fixture->index_path), ==, TEST_PACK_INDEX_HEADER_SIZE + 2 * TEST_PACK_INDEX_RECORD_SIZE);
+}
+
+/**
+ * test_pack_missing_bytes:
+ * @fixture: a #TestPack
+ * @user_data: %NULL
+ *
+ * A record whose bytes are not all in the pack is cut off the index, and
+ * the bytes of its object that are there are cut off the pack.
+ */
+static void
+test_pack_missing_bytes (TestPack      *fixture,
+                         gconstpointer  user_data)
+{
+    DownloadPack *pack;
+
+    test_pack_create (fixture);
+    g_assert_cmpint (truncate (fixture->path, strlen ("first object") + 3), ==, 0);
+
+    pack = test_pack_reopen (fixture, 1);
+    test_pack_assert_object (pack, "a", "first object");
+    g_assert_false (download_pack_lookup (pack, "b", NULL, NULL));
+    download_pack_unref (pack);
+
+    g_assert_cmpint (test_pack_get_size (fixture->path), ==, strlen ("first object"));
+    g_assert_cmpint (test_pack_get_size (fixture->index_path), ==, TEST_PACK_INDEX_HEADER_SIZE + TEST_PACK_INDEX_RECORD_SIZE);
+}
+
+/**
+ * test_pack_stale_bytes:
+ * @fixture: a #TestPack
+ * @user_data: %NULL
+ *
+ * A record whose range holds other bytes than the object it was written
+ * for, as when the record reached the disk and the object did not, is cut
+ * off the index along with the records after it.
+ */
+static void
+test_pack_stale_bytes (TestPack      *fixture,
+                       gconstpointer  user_data)
+{
+    DownloadPack *pack;
+
+    test_pack_create (fixture);
+    test_pack_write_at (fixture->path, 0, "XXXXX");
+
+    pack = test_pack_reopen (fixture, 0);
+    download_pack_unref (pack);
+
+    g_assert_cmpint (test_pack_get_size (fixture->path), ==, 0);
+    g_assert_cmpint (test_pack_get_size (fixture->index_path), ==, TEST_PACK_INDEX_HEADER_SIZE);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add ("/pack/intact", TestPack, NULL, test_pack_setup, test_pack_intact, test_pack_teardown);
+    g_test_add ("/pack/unrecorded-bytes", TestPack, NULL, test_pack_setup, test_pack_unrecorded_bytes, test_pack_teardown);
+    g_test_add ("/pack/torn-record", TestPack, NULL, test_pack_setup, test_pack_torn_record, test_pack_teardown);
+    g_test_add ("/pack/missing-bytes", TestPack, NULL, test_pack_setup, test_pack_missing_bytes, test_pack_teardown);
+    g_test_add ("/pack/stale-bytes", TestPack, NULL, test_pack_setup, test_pack_stale_bytes, test_pack_teardown);
+
+    return g_test_run ();
+}